@@ -24,24 +24,23 @@ typedef struct _arp_header {
     uint8_t  tip[4]; // Target IP address
 } arp_header;
 
+// Parsed ARP message, addresses point into the frame
 typedef struct {
-    eth_header ether;
-
     uint16_t hardware_type;
     uint16_t protocol_type;
     uint8_t  hardware_size;
     uint8_t  protocol_size;
     uint16_t operation;
 
-    char sender_mac[ETH_ADDR_STRLEN];
-    char sender_ip[INET_ADDRSTRLEN];
-    char target_mac[ETH_ADDR_STRLEN];
-    char target_ip[INET_ADDRSTRLEN];
+    const uint8_t *sender_mac;  // 6 bytes
+    const uint8_t *sender_ip;   // 4 bytes
+    const uint8_t *target_mac;
+    const uint8_t *target_ip;
 } arp_packet;
 
 /*** PROTOTYPES ***/
-void arp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-int parse_arp_packet(const unsigned char *frame, size_t frame_len, arp_packet *out);
-void print_arp_packet(const unsigned char *packet, uint32_t wire_len, const arp_packet *p);
+int parse_arp_packet(const unsigned char *frame, size_t frame_len, const eth_header *ether, arp_packet *out);
+void print_arp_packet(outbuf *ob, const packet_view *v, const arp_packet *p);
+void summarize_arp_packet(outbuf *ob, const packet_view *v, const arp_packet *p);
 
 #endif /* ARP_H */
@@ -0,0 +1,43 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "netshark.h"
+
+/*** MACROS ***/
+#define CAPTURE_SNAPLEN         BUFSIZ  // Max bytes kept per frame
+#define CAPTURE_TIMEOUT_MS      1000    // Read timeout, bounds the shutdown latency
+#define CAPTURE_BURST_MIN       1
+#define CAPTURE_BURST_MAX       1024
+#define CAPTURE_BURST_DEFAULT   64
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// One frame pulled from the capture backend
+typedef struct {
+    struct pcap_pkthdr hdr;
+    const unsigned char *data;
+} capture_slot;
+
+// A burst of frames pulled in a single backend call.
+// When the backend does not keep its buffer alive after the call
+// returns (libpcap), frames are copied into `arena`, one
+// CAPTURE_SNAPLEN stride per slot.
+typedef struct {
+    capture_slot *slots;
+    int count;
+    int size;
+    int copy;
+    unsigned char *arena;
+} capture_batch;
+
+/*** PROTOTYPES ***/
+int capture_batch_init(capture_batch *b, int size, int copy);
+void capture_batch_free(capture_batch *b);
+void capture_batch_collect(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *bytes);
+void capture_batch_flush(capture_batch *b, pcap_handler handler, unsigned char *user);
+
+void capture_install_signals(NetShark *n);
+int capture_stopped(void);
+int capture_run(NetShark *n);
+
+#endif /* CAPTURE_H */
@@ -7,9 +7,8 @@
 #define DHCP_CLIENT_PORT 68
 
 /*** DHCP Packet Structure (Based on RFC 2131) ***/
+// Fixed fields are decoded, the variable ones point into the payload
 typedef struct {
-    udp_packet udp;               // Encapsulated UDP packet (contains IP, Ethernet info)
-
     uint8_t op;                   // Message op code: 1 = BOOTREQUEST, 2 = BOOTREPLY
     uint8_t htype;                // Hardware address type: 1 = Ethernet
     uint8_t hlen;                 // Hardware address length: 6 for MAC
@@ -24,19 +23,20 @@ typedef struct {
     uint32_t siaddr;              // IP address of next server to use in bootstrap
     uint32_t giaddr;              // Gateway IP address (used by relay agents)
 
-    uint8_t chaddr[16];           // Client hardware address (first 6 bytes are MAC, rest are padding)
-    char sname[64];               // Optional server host name (null-terminated string)
-    char file[128];               // Boot file name (null-terminated string)
+    const uint8_t *chaddr;        // Client hardware address (16 bytes, first 6 are the MAC)
+    const uint8_t *sname;         // Optional server host name (64 bytes, NUL padded)
+    const uint8_t *file;          // Boot file name (128 bytes, NUL padded)
 
-    uint8_t options[312];        // Optional parameters field (DHCP options in TLV format)
+    const uint8_t *options;       // Optional parameters field (DHCP options in TLV format)
+    uint16_t options_len;
 
     uint16_t total_len;          // Total parsed length of the DHCP message (computed field, not from the wire)
 } dhcp_packet;
 
 
 /*** Prototypes ***/
-void dhcp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
 int parse_dhcp_packet(const unsigned char *data, size_t len, dhcp_packet *out);
-void print_dhcp_packet(const unsigned char *packet, uint32_t wire_len, const dhcp_packet *p);
+void print_dhcp_packet(outbuf *ob, const packet_view *v, const dhcp_packet *p);
+void summarize_dhcp_packet(outbuf *ob, const packet_view *v, const dhcp_packet *p);
 
 #endif
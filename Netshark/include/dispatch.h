@@ -0,0 +1,116 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "netshark.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "tcp.h"
+#include "udp.h"
+#include "record.h"
+
+/*** MACROS ***/
+#define DISPATCH_FILTER_MAX 1024    // Longest BPF expression built from -f
+
+/*** STRUCTURE DEFINITIONS ***/
+// Dissectors selectable with -f, one bit each in the routing tables
+typedef enum {
+    PROTO_ARP = 0,
+    PROTO_ICMP,
+    PROTO_TCP,
+    PROTO_UDP,
+    PROTO_FTP,
+    PROTO_HTTP,
+    PROTO_DHCP,
+    PROTO_DNS,
+    PROTO_MDNS,
+    PROTO_TLS,
+    PROTO_COUNT
+}               Proto;
+
+// A frame decoded up to its transport layer.
+// The dispatcher fills it once per packet and hands it to every dissector
+// interested in the packet, so none of them parses L2-L4 again. It only
+// holds binary fields and pointers into the frame: nothing is formatted
+// until a dissector actually prints. `tcp`/`udp` are only valid when
+// ip.protocol says so.
+struct packet_view {
+    const struct pcap_pkthdr *hdr;
+    const unsigned char *frame;
+    uint32_t caplen;
+
+    eth_header ether;
+    ip_header ip;               // Valid when ether.ethertype is IPv4
+    tcp_packet tcp;
+    udp_packet udp;
+
+    uint32_t l3_off;            // Offset of the header after Ethernet (+ VLAN tag)
+    uint32_t payload_off;       // Offset of the transport payload
+    uint32_t payload_len;       // Transport payload captured (bounded by caplen)
+
+    flow *flow;                 // IPv4 conversation, NULL if not tracked
+    uint8_t flow_side;          // Side of flow->key the packet comes from
+};
+
+typedef void (*dissector_fn)(Worker *w, const packet_view *v);
+
+// Routing tables: for each ethertype, IP protocol and TCP/UDP port, the
+// set of selected dissectors (1 << Proto) keyed on it. A packet runs every
+// dissector whose bit is set at any of its layers.
+typedef struct Dispatcher {
+    uint16_t selected;
+    uint16_t streamed;          // Selected dissectors reading TCP streams
+    uint16_t ethertype[65536];
+    uint16_t ipproto[256];
+    uint16_t tcp_port[65536];
+    uint16_t udp_port[65536];
+}               Dispatcher;
+
+/*** PROTOTYPES ***/
+// /src/dispatch.c
+Dispatcher *dispatch_new(const char *list, char *filter, size_t filter_len, char *errbuf);
+void dispatch_packet(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *frame);
+const record_schema *dispatch_schema(int proto);
+
+// /src/handlers/*_handler.c
+void arp_handler(Worker *w, const packet_view *v);
+void icmp_handler(Worker *w, const packet_view *v);
+void tcp_handler(Worker *w, const packet_view *v);
+void udp_handler(Worker *w, const packet_view *v);
+void ftp_handler(Worker *w, const packet_view *v);
+void http_handler(Worker *w, const packet_view *v);
+void dhcp_handler(Worker *w, const packet_view *v);
+void dns_handler(Worker *w, const packet_view *v);
+void mdns_handler(Worker *w, const packet_view *v);
+void tls_handler(Worker *w, const packet_view *v);
+
+// Reassembled TCP streams (see stream.h), the handlers above then only
+// see segments of flows that couldn't be tracked
+size_t ftp_stream(Worker *w, const packet_view *v, tcp_stream *s, int side,
+                  const unsigned char *data, size_t len, unsigned flags);
+size_t http_stream(Worker *w, const packet_view *v, tcp_stream *s, int side,
+                   const unsigned char *data, size_t len, unsigned flags);
+size_t tls_stream(Worker *w, const packet_view *v, tcp_stream *s, int side,
+                  const unsigned char *data, size_t len, unsigned flags);
+
+// Fields each dissector exports with --format, section id = Proto + 1
+extern const record_schema arp_schema;
+extern const record_schema icmp_schema;
+extern const record_schema tcp_schema;
+extern const record_schema udp_schema;
+extern const record_schema ftp_schema;
+extern const record_schema http_schema;
+extern const record_schema dhcp_schema;
+extern const record_schema dns_schema;
+extern const record_schema mdns_schema;
+extern const record_schema tls_schema;
+// Flow reports (--flows), section id PROTO_COUNT + 1
+extern const record_schema flow_schema;
+// Latency reports (--latency), section id PROTO_COUNT + 2
+extern const record_schema latency_schema;
+// Heavy hitter reports (--top), section id PROTO_COUNT + 3
+extern const record_schema topk_schema;
+// Certificate reports (--certs), section ids PROTO_COUNT + 4 and + 5
+extern const record_schema cert_schema;
+extern const record_schema issuer_schema;
+
+#endif /* DISPATCH_H */
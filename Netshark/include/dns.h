@@ -5,10 +5,61 @@
 
 #define DNS_MAX_NAME_LEN 256
 #define DNS_MAX_PACKET_SIZE 512
+#define DNS_HEADER_LEN  12
+#define DNS_RR_MAX      64      // Records located per message, past it only walked
 
+// Record types
+#define DNS_TYPE_A      1
+#define DNS_TYPE_NS     2
+#define DNS_TYPE_CNAME  5
+#define DNS_TYPE_SOA    6
+#define DNS_TYPE_PTR    12
+#define DNS_TYPE_HINFO  13
+#define DNS_TYPE_MX     15
+#define DNS_TYPE_TXT    16
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_SRV    33
+#define DNS_TYPE_NAPTR  35
+#define DNS_TYPE_DNAME  39
+#define DNS_TYPE_OPT    41
+#define DNS_TYPE_DS     43
+#define DNS_TYPE_RRSIG  46
+#define DNS_TYPE_NSEC   47
+#define DNS_TYPE_DNSKEY 48
+#define DNS_TYPE_SVCB   64
+#define DNS_TYPE_HTTPS  65
+#define DNS_TYPE_ANY    255
+#define DNS_TYPE_CAA    257
+
+#define DNS_FLAG_QR     0x8000
+#define DNS_OPCODE(f)   (((f) >> 11) & 0xf)
+#define DNS_FLAG_TC     0x0200
+#define DNS_RCODE_NXDOMAIN 3
+
+typedef enum {
+    DNS_QUESTION = 0,
+    DNS_ANSWER,
+    DNS_AUTHORITY,
+    DNS_ADDITIONAL,
+} dns_section;
+
+// One question or resource record, located in the message. Names are
+// offsets into `msg`, decoded when printed.
 typedef struct {
-    udp_packet udp;
+    uint16_t name;              // Owner name
+    uint16_t type;
+    uint16_t class;             // OPT: the sender's UDP payload size
+    uint16_t rdlength;
+    uint32_t ttl;               // OPT: extended rcode, version and flags
+    uint16_t rdata;             // Offset of the data, 0 in questions
+    uint8_t section;            // dns_section
+} dns_rr;
 
+// A DNS or mDNS message. Every section is walked; the first DNS_RR_MAX
+// records are kept in `rr`, in message order. Every name was checked when
+// parsing, so printing them can't fail.
+typedef struct {
+    const unsigned char *msg;   // DNS message inside the frame
     uint16_t id;
     uint16_t flags;
     uint16_t qdcount;
@@ -16,15 +67,46 @@ typedef struct {
     uint16_t nscount;
     uint16_t arcount;
 
-    char qname[DNS_MAX_NAME_LEN];
+    uint16_t qname_off;         // First question, 0 when there is none
     uint16_t qtype;
     uint16_t qclass;
 
     uint16_t total_len;
+    uint16_t rcode;             // With the EDNS0 extended bits
+    uint8_t edns;               // An OPT record is present
+    uint8_t edns_version;
+    uint8_t dnssec_ok;          // EDNS0 DO bit
+    uint8_t malformed;          // Walking stopped at a broken record
+    uint16_t udp_size;          // EDNS0 payload size
+    uint16_t nrr;               // Records in `rr`
+    uint16_t opt;               // Index of the OPT record in `rr`
+    dns_rr rr[DNS_RR_MAX];
 } dns_packet;
 
+// Walks the labels of a name, following compression pointers
+typedef struct {
+    const unsigned char *msg;
+    size_t len;
+    size_t pos;
+    size_t limit;               // Pointers must go below it: they can't loop
+    size_t total;               // Length of the name so far, 255 at most
+    size_t end;                 // Just past the name's bytes in place, once walked
+} dns_name_iter;
+
+// /src/parsers/dns_parser.c
 int parse_dns_packet(const unsigned char *data, size_t len, dns_packet *out);
-void print_dns_packet(const unsigned char *packet, uint32_t wire_len, const dns_packet *dns);
-void dns_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
+void dns_name_iter_init(dns_name_iter *it, const unsigned char *msg, size_t len, size_t off);
+int dns_name_next(dns_name_iter *it, span *label);
+size_t dns_name_text(const unsigned char *msg, size_t len, size_t off, char *buf, size_t size);
+uint32_t dns_name_hash(const unsigned char *msg, size_t len, size_t off);
+
+// /src/handlers/dns_handler.c
+void print_dns_packet(outbuf *ob, const packet_view *v, const dns_packet *dns);
+void summarize_dns_packet(outbuf *ob, const packet_view *v, const dns_packet *dns);
+void print_dns_name(outbuf *ob, const dns_packet *dns, size_t off);
+void print_dns_sections(outbuf *ob, const dns_packet *dns, int mdns);
+const char *dns_type_str(uint16_t type);
+const char *dns_rcode_str(uint16_t rcode);
+size_t dns_answers_text(const void *pkt, char *buf);
 
 #endif // DNS_H
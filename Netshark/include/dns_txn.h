@@ -0,0 +1,70 @@
+#ifndef DNS_TXN_H
+#define DNS_TXN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "latency.h"
+
+/*** MACROS ***/
+#define DNS_TXN_MAX         65536       // Queries kept per worker, power of two
+#define DNS_TXN_TIMEOUT     5           // Seconds before a query counts as unanswered
+#define DNS_TXN_RCODES      24          // Answers counted per rcode, up to BADCOOKIE
+#define DNS_TXN_NONE        UINT32_MAX
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// What a response must repeat to answer a query
+typedef struct {
+    uint32_t client;            // Network byte order
+    uint32_t server;
+    uint16_t port;              // Client's port
+    uint16_t id;                // Transaction ID
+    uint32_t qname;             // dns_name_hash() of the question
+}               dns_txn_key;
+
+// One query, from the time it was seen
+typedef struct {
+    dns_txn_key key;
+    uint32_t hash;
+    uint8_t pending;            // Not answered yet
+    uint64_t sent_us;
+}               dns_txn;
+
+// Queries of one worker awaiting their response (with --latency).
+// Queries are kept in a ring in the order they were seen, so the oldest
+// is always next to time out; an open addressed index finds them by key.
+// Answered queries leave the index at once and the ring once every query
+// before them is gone. When the ring is full the oldest query is dropped.
+typedef struct {
+    dns_txn *ring;              // DNS_TXN_MAX queries
+    uint32_t head;              // Oldest query, in sequence numbers
+    uint32_t tail;              // Next one
+    uint32_t *index;            // 2 * DNS_TXN_MAX slots: ring positions
+    latency_table *latency;     // Where response times go
+
+    unsigned long long queries;
+    unsigned long long retransmits; // Repeated queries, timed from the first
+    unsigned long long answered;
+    unsigned long long rcode[DNS_TXN_RCODES];
+    unsigned long long timeouts;
+    unsigned long long unmatched;   // Responses to no query seen
+    unsigned long long dropped;     // Queries not kept: the ring was full
+}               dns_txn_table;
+
+/*** PROTOTYPES ***/
+// /src/dns_txn.c
+int dns_txn_init(dns_txn_table *t, latency_table *latency);
+void dns_txn_free(dns_txn_table *t);
+void dns_txn_query(dns_txn_table *t, const dns_txn_key *k, uint64_t now);
+void dns_txn_response(dns_txn_table *t, const dns_txn_key *k, int rcode, uint64_t now);
+void dns_txn_expire(dns_txn_table *t, uint64_t sec);
+
+// Times out the queries left unanswered, cheap when none is due
+static inline void dns_txn_advance(dns_txn_table *t, uint64_t sec)
+{
+    if (t->head != t->tail
+        && t->ring[t->head & (DNS_TXN_MAX - 1)].sent_us + DNS_TXN_TIMEOUT * 1000000ULL <= sec * 1000000)
+        dns_txn_expire(t, sec);
+}
+
+#endif /* DNS_TXN_H */
@@ -30,10 +30,10 @@ typedef struct _vlan_tag {
     uint16_t tci;                /* PCP(3) | DEI(1) | VID(12)        */
 } vlan_tag;
 
-/* ---- human‑readable result ------------------------------------------- */
+/* ---- decoded view: addresses point into the frame --------------------- */
 typedef struct {
-    char     dst_mac[ETH_ADDR_STRLEN];
-    char     src_mac[ETH_ADDR_STRLEN];
+    const uint8_t *dst;          /* 6 bytes, format with mac_to_str()  */
+    const uint8_t *src;
 
     uint16_t ethertype;          /* host byte order                  */
 
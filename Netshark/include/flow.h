@@ -0,0 +1,119 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "output.h"
+#include "stream.h"
+
+struct packet_view;
+
+/*** MACROS ***/
+#define FLOW_MAX_DEFAULT        (1 << 18)   // Flows tracked per worker (--flow-max)
+#define FLOW_IDLE_DEFAULT       60          // Seconds without a packet before a flow ends
+#define FLOW_ACTIVE_DEFAULT     300         // Seconds between two reports of a long flow
+#define FLOW_CLOSED_TIMEOUT     2           // Seconds a flow stays after RST or FIN both ways
+#define FLOW_BUCKET_SLOTS       7           // Flows per 64-byte bucket
+#define FLOW_WHEEL_SLOTS        1024        // One-second timer slots, power of two
+#define FLOW_NONE               UINT32_MAX
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// Why a flow is reported
+typedef enum {
+    FLOW_END_IDLE = 0,      // No packet for the idle timeout
+    FLOW_END_ACTIVE,        // Still going after the active timeout: counters restart
+    FLOW_END_CLOSED,        // RST, or FIN from both sides
+    FLOW_END_CAPTURE,       // Still open when the capture stopped
+}               flow_end;
+
+// IPv4 5-tuple, the lower (address, port) side first so that both
+// directions of a conversation give the same key
+typedef struct {
+    uint32_t addr[2];           // Network byte order
+    uint16_t port[2];           // 0 without ports (ICMP, later fragments)
+    uint8_t proto;
+    uint8_t pad[3];
+}               flow_key;
+
+// One conversation. Counters are kept per side of the key; `client` says
+// which side sent the first packet.
+typedef struct flow {
+    flow_key key;
+    uint32_t hash;
+    uint32_t timer_next;        // Timing wheel slot list, or free list
+    uint32_t timer_prev;
+    uint16_t timer_slot;
+
+    uint8_t client;
+    uint8_t closed;
+    uint8_t tcp_flags[2];       // Every flag seen from each side
+
+    uint64_t first_us;          // Capture time of the first and last packet
+    uint64_t last_us;           //   since the last report
+    uint64_t packets[2];
+    uint64_t bytes[2];          // On the wire
+
+    tcp_stream *stream;         // Reassembly, for TCP flows a dissector reads as a stream
+}               flow;
+
+// One cache line: the hashes of up to 7 flows and their index in the flow
+// array. A lookup compares the 7 hashes at once and only touches a flow
+// whose hash matches.
+typedef struct {
+    uint32_t hash[FLOW_BUCKET_SLOTS];
+    uint32_t index[FLOW_BUCKET_SLOTS];
+    uint8_t used;               // One bit per slot
+    uint8_t pad;
+    uint16_t overflow;          // Flows stored past this bucket while it was full
+    uint32_t pad2;
+} __attribute__((aligned(64))) flow_bucket;
+
+// Flow table of one capture worker.
+// Workers share the traffic by flow hash, so each table sees both
+// directions of its flows and is never locked. Open addressing over
+// buckets, probing to the next bucket when one is full. Flows live in a
+// preallocated array; entries are handed out lazily so untouched memory
+// stays unmapped.
+typedef struct {
+    flow_bucket *buckets;
+    uint32_t bucket_mask;
+    flow *flows;
+    uint32_t max;
+    uint32_t hwm;               // Entries handed out at least once
+    uint32_t free_list;         // Chained through timer_next
+    uint32_t count;
+
+    // Timing wheel, in capture time. A flow sits in the slot of the second
+    // it may expire at; moving it on every packet would cost too much, so
+    // when the slot comes around its deadline is checked again and it is
+    // moved further if it got packets since.
+    uint32_t wheel[FLOW_WHEEL_SLOTS];
+    uint64_t tick;              // Last second handled, 0 before the first packet
+    uint32_t idle;              // Timeouts (s)
+    uint32_t active;
+
+    outbuf *out;                // Where ended flows are printed, NULL = silent
+    stream_pool *streams;       // Where the flows' reassembly state comes from
+
+    unsigned long long created;
+    unsigned long long ended;
+    unsigned long long full;    // Packets not tracked, the table was full
+}               flow_table;
+
+/*** PROTOTYPES ***/
+// /src/flow.c
+int flow_table_init(flow_table *t, uint32_t max, uint32_t idle, uint32_t active);
+void flow_table_free(flow_table *t);
+flow *flow_update(flow_table *t, const struct packet_view *v, uint8_t *side);
+void flow_expire(flow_table *t, uint64_t now);
+void flow_flush(flow_table *t);
+
+// Runs the timing wheel up to `sec`, cheap when the second didn't change
+static inline void flow_advance(flow_table *t, uint64_t sec)
+{
+    if (sec > t->tick)
+        flow_expire(t, sec);
+}
+
+#endif /* FLOW_H */
@@ -45,20 +45,19 @@
 
 /*** STRUCTURE ***/
 
+// First line of an FTP control message, the spans point into the payload
 typedef struct {
-    tcp_packet tcp;
-    char raw[1024];       // Raw FTP payload
-    char command[8];      // For client commands: "USER", "PASS", etc.
-    char arguments[1016]; // Everything after the command
+    span command;         // For client commands: "USER", "PASS", etc.
+    span arguments;       // Everything after the command
     int is_response;      // 1 = server response, 0 = client command
     int response_code;    // If response: numeric code like 220, 331, etc.
-    char message[1016];   // Response message
+    span message;         // Response message
 } ftp_packet;
 
 
 /*** PROTOTYPES ***/
-void ftp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
 void parse_ftp_packet(const unsigned char *data, size_t len, ftp_packet *pkt);
-void print_ftp_packet(const unsigned char *frame, uint32_t wire_len, const ftp_packet *pkt);
+void print_ftp_packet(outbuf *ob, const packet_view *v, const ftp_packet *pkt);
+void summarize_ftp_packet(outbuf *ob, const packet_view *v, const ftp_packet *pkt);
 
 #endif /* FTP_H */
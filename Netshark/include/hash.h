@@ -0,0 +1,38 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*** MACROS ***/
+#define MD5_DIGEST_LEN      16
+#define SHA256_DIGEST_LEN   32
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// Incremental MD5 (RFC 1321): any number of updates, then final
+typedef struct {
+    uint32_t state[4];
+    uint64_t bytes;             // Hashed so far
+    unsigned char block[64];    // Start of the next block
+}               md5_ctx;
+
+// Incremental SHA-256 (FIPS 180-4)
+typedef struct {
+    uint32_t state[8];
+    uint64_t bytes;
+    unsigned char block[64];
+}               sha256_ctx;
+
+/*** PROTOTYPES ***/
+// /src/hash.c
+void md5_init(md5_ctx *c);
+void md5_update(md5_ctx *c, const void *data, size_t len);
+void md5_final(md5_ctx *c, unsigned char digest[MD5_DIGEST_LEN]);
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const void *data, size_t len);
+void sha256_final(sha256_ctx *c, unsigned char digest[SHA256_DIGEST_LEN]);
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LEN]);
+char *hex_string(const unsigned char *data, size_t len, char *out);
+
+#endif /* HASH_H */
@@ -12,6 +12,7 @@
 #define HTTP_METHOD_OPTIONS "OPTIONS"
 #define HTTP_METHOD_TRACE   "TRACE"
 #define HTTP_METHOD_CONNECT "CONNECT"
+#define HTTP_METHOD_PATCH   "PATCH"
 
 #define HTTP_VERSION_1_0    "HTTP/1.0"
 #define HTTP_VERSION_1_1    "HTTP/1.1"
@@ -20,28 +21,104 @@
 #define HTTP_PORT       80
 #define HTTP_PORT_ALT   8080
 
+#define HTTP_HEADERS_MAX    32      // Header fields kept per message
+#define HTTP_LINE_MAX       4096    // Longest chunk size or trailer line
+#define HTTP_PIPELINE_MAX   8       // Requests timed while awaiting a response
+#define HTTP_HOST_MAX       30      // Bytes of a request's Host kept for its response
+
 /*** STRUCTURE DEFINITIONS ***/
 typedef struct {
-    tcp_packet tcp;
+    span name;
+    span value;                 // Without the surrounding blanks
+}               http_header;
 
+// HTTP message head, the spans point into the payload
+typedef struct {
     int is_request;
     int is_response;
-    char method[16];
-    char path[256];
-    char version[16];
+    span method;
+    span path;
+    span version;
     int status_code;
-    char status_message[256];
-    char headers[1024];
-    char body[2048];
+    span status_message;
+    span headers;
+    span body;
+    http_header fields[HTTP_HEADERS_MAX];
+    uint8_t nfields;
+    uint8_t has_length;         // Content-Length was given
+    uint8_t chunked;            // Transfer-Encoding: chunked
+    uint8_t keep_alive;         // The connection stays open after the message
+    uint64_t content_length;
 
     // New fields for HTTP length tracking
-    uint16_t header_len;  // Length of HTTP headers
-    uint16_t data_len;    // Length of HTTP body
+    uint32_t header_len;  // Length of HTTP headers
+    uint32_t data_len;    // Length of HTTP body
 } http_packet;
 
+// Where an http_parser stands in its direction of the connection
+typedef enum {
+    HTTP_STATE_HEAD = 0,        // Before or inside a message head
+    HTTP_STATE_BODY,            // Content-Length body, `remaining` bytes left
+    HTTP_STATE_CHUNK_SIZE,      // Chunk size line
+    HTTP_STATE_CHUNK_DATA,      // Chunk data and its CRLF, `remaining` bytes left
+    HTTP_STATE_TRAILER,         // Trailer fields, up to an empty line
+    HTTP_STATE_DONE,            // Message complete, HTTP_EV_END not given yet
+    HTTP_STATE_CLOSE,           // The body ends with the connection
+    HTTP_STATE_LOST,            // Not at a message: looking for the next one
+} http_state;
+
+// What the bytes consumed by http_parse() were
+typedef enum {
+    HTTP_EV_NONE = 0,           // Framing or skipped bytes; nothing when 0 were consumed
+    HTTP_EV_HEAD,               // A message head, parsed into `msg`
+    HTTP_EV_BODY,               // Body bytes
+    HTTP_EV_END,                // The message is complete (no bytes)
+} http_event;
+
+// One direction of an HTTP connection, resumed on every call
+typedef struct {
+    uint8_t state;              // http_state
+    uint8_t response;           // The current message is a response
+    uint32_t scanned;           // Bytes of an incomplete head known not to end it
+    uint64_t remaining;
+}               http_parser;
+
+// A request awaiting its response
+typedef struct {
+    uint64_t sent_us;           // Capture time of its last byte
+    uint8_t head;               // HEAD: the response has no body
+    uint8_t host_len;
+    char host[HTTP_HOST_MAX];
+}               http_request;
+
+// State of a reassembled connection, from the stream pool. Responses come
+// in the order of the requests, so the oldest queued request is the one
+// the next response answers.
+typedef struct {
+    http_parser dir[2];         // Indexed by stream side
+    uint64_t start_us[2];       // Capture time of the current message's first byte
+    http_request queue[HTTP_PIPELINE_MAX];
+    uint8_t first;              // Oldest request in `queue`
+    uint8_t pending;            // Requests in `queue`
+    uint8_t untracked;          // Requests past a full queue, not timed
+    uint8_t open;               // The newest queued request isn't complete yet
+    uint8_t timing;             // `answered` and `ttfb_us` are the current response's
+    int status;
+    uint64_t ttfb_us;
+    http_request answered;
+}               http_conn;
+
 /*** PROTOTYPES ***/
-void http_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
+// /src/parsers/http_parser.c
 int parse_http_packet(const unsigned char *packet, size_t len, http_packet *out);
-void print_http_packet(const unsigned char *packet, uint32_t wire_len, const http_packet *p);
+int http_message_start(const unsigned char *data, size_t len);
+size_t http_parse(http_parser *ps, const unsigned char *data, size_t len, int fin, int head_request,
+                  http_packet *msg, http_event *ev);
+void http_parser_lost(http_parser *ps);
+span http_header_value(const http_packet *p, const char *name);
+
+// /src/handlers/http_handler.c
+void print_http_packet(outbuf *ob, const packet_view *v, const http_packet *p);
+void summarize_http_packet(outbuf *ob, const packet_view *v, const http_packet *p);
 
 #endif /* HTTP_H */
@@ -17,23 +17,21 @@
 #define ICMP_TIMESTAMP_REPLY       14
 
 /*** STRUCTURE DEFINITIONS ***/
+// Parsed ICMP message, the lower layers are in the packet_view
 typedef struct {
-    eth_header ether;
-    ip_header ip;
-
     uint8_t type;
     uint8_t code;
     uint16_t checksum;
     uint16_t identifier;
     uint16_t sequence;
 
-    uint8_t payload[1024]; // Up to you to truncate/limit this
+    const uint8_t *payload; // Points into the frame
     uint16_t payload_len;
 } icmp_packet;
 
 /*** PROTOTYPES ***/
-void icmp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
 int parse_icmp_packet(const unsigned char *packet, size_t len, icmp_packet *out);
-void print_icmp_packet(const unsigned char *packet, uint32_t wire_len, const icmp_packet *icmp);
+void print_icmp_packet(outbuf *ob, const packet_view *v, const icmp_packet *icmp);
+void summarize_icmp_packet(outbuf *ob, const packet_view *v, const icmp_packet *icmp);
 
 #endif /* ICMP_H */
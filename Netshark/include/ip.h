@@ -50,9 +50,8 @@ typedef struct _ip_header {
     unsigned short checksum;    // Header Checksum
                                 //   - Error-checking for the IP header only (not data)
 
-                                //   - The intended recipient
-    char src[INET_ADDRSTRLEN];
-    char dst[INET_ADDRSTRLEN];
+    struct in_addr src;         // Source and destination, as on the wire:
+    struct in_addr dst;         //   format them with ip_to_str() when printing
 } ip_header;
 
 int parse_ip_header(const unsigned char *, size_t, ip_header *);
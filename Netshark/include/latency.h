@@ -0,0 +1,91 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "output.h"
+
+/*** MACROS ***/
+#define LATENCY_SUB_BITS    5           // 32 buckets per power of two: within 3%
+#define LATENCY_SUB         (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS    36          // Up to 2^36 us (19 hours), longer is clamped
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+#define LATENCY_METRICS     2           // Histograms per key at most
+#define LATENCY_NAME_MAX    32          // Bytes of a key's name kept
+#define LATENCY_KEYS        1024        // Key slots per worker, power of two
+#define LATENCY_TIMEOUT     (-1)        // Code of the key counting requests never answered
+#define LATENCY_NONE        UINT64_MAX  // No sample for this metric
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// What is timed, each with its own histograms per key
+typedef enum {
+    LATENCY_HTTP = 0,       // Per Host and status: time to first byte, total
+    LATENCY_DNS,            // Per resolver and rcode: round trip
+    LATENCY_TLS,            // Per server name and version: ServerHello, first Application Data
+    LATENCY_KINDS
+}               latency_kind;
+
+// Histogram of microseconds in the manner of HdrHistogram: LATENCY_SUB
+// linear buckets per power of two, so a value is known to within
+// 1/LATENCY_SUB of itself whatever its magnitude, in a fixed 4 KiB.
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t bucket[LATENCY_BUCKETS];
+}               latency_hist;
+
+// Samples of one (kind, name, code) key
+typedef struct {
+    uint32_t hash;              // 0 = free slot
+    uint8_t kind;
+    uint8_t name_len;
+    int code;
+    char name[LATENCY_NAME_MAX];
+    latency_hist *hist;         // LATENCY_METRICS histograms
+    uint64_t timeouts;          // Requests given up, under LATENCY_TIMEOUT
+}               latency_entry;
+
+// Latency histograms of one worker.
+// Samples go into the histograms of their key; every `interval` seconds of
+// capture time each key's percentiles are printed and the table starts
+// over, so each report covers one interval.
+typedef struct {
+    latency_entry *entries;     // LATENCY_KEYS slots, open addressing
+    uint32_t count;
+    uint32_t interval;          // Seconds between reports, 0 = not kept
+    uint64_t next;              // Second of the next report
+    uint64_t last;              // Second of the last sample
+
+    latency_hist **spare;       // Histograms of past intervals, for reuse
+    uint32_t nspare;
+
+    outbuf *out;                // Where the reports are printed
+
+    unsigned long long samples;
+    unsigned long long timeouts;
+    unsigned long long dropped; // Samples and timeouts not kept: too many keys
+}               latency_table;
+
+/*** PROTOTYPES ***/
+// /src/latency.c
+int latency_table_init(latency_table *t, uint32_t interval, outbuf *out);
+void latency_table_free(latency_table *t);
+void latency_add(latency_table *t, latency_kind kind, const unsigned char *name, size_t len,
+                 int code, uint64_t sec, const uint64_t *us);
+void latency_timeout(latency_table *t, latency_kind kind, const unsigned char *name, size_t len,
+                     uint64_t sec);
+void latency_report(latency_table *t, uint64_t sec);
+void latency_flush(latency_table *t);
+uint64_t latency_quantile(const latency_hist *h, double q);
+
+// Prints the histograms once their interval is over, cheap otherwise
+static inline void latency_advance(latency_table *t, uint64_t sec)
+{
+    if (t->interval && sec >= t->next)
+        latency_report(t, sec);
+}
+
+#endif /* LATENCY_H */
@@ -1,20 +1,14 @@
 #ifndef MDNS_H
 #define MDNS_H
 
-#include "udp.h"
+#include "dns.h"
 
 #define MDNS_MAX_NAME_LEN 256
 
-typedef struct {
-    udp_packet udp;
-    uint16_t id, flags, qdcount, ancount, nscount, arcount;
-    char qname[MDNS_MAX_NAME_LEN];
-    uint16_t qtype, qclass;
-    uint16_t total_len;
-} mdns_packet;
+// mDNS messages have the DNS wire format (RFC 6762) and go through the
+// same decoder, parse_dns_packet()
+typedef dns_packet mdns_packet;
 
-int parse_mdns_packet(const unsigned char *data, size_t len, mdns_packet *out);
-void print_mdns_packet(const unsigned char *packet, uint32_t wire_len, const mdns_packet *mdns);
-void mdns_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-void print_dns_answers(const unsigned char *data, size_t len, size_t offset, uint16_t ancount);
-#endif // MDNS_H
\ No newline at end of file
+void print_mdns_packet(outbuf *ob, const packet_view *v, const mdns_packet *mdns);
+void summarize_mdns_packet(outbuf *ob, const packet_view *v, const mdns_packet *mdns);
+#endif // MDNS_H
@@ -7,21 +7,103 @@
 #include <stdlib.h>
 #include <time.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include "netpcap.h"
+#include "output.h"
+#include "writer.h"
+#include "flow.h"
+#include "latency.h"
+#include "dns_txn.h"
+#include "topk.h"
+#include "tls_fingerprint.h"
+#include "x509.h"
+#include "tls_session.h"
 
 
 extern int DEBUG_MODE;
 
+#define MAX_WORKERS 64
+
 
 /***********************************|
 |             STRUCT                |
 |__________________________________*/
 
+// Where packets are read from
+typedef enum {
+    BACKEND_PCAP = 0,   // libpcap
+    BACKEND_RING,       // libnetpcap: AF_PACKET + TPACKET_V3 mmap'd ring, zero-copy
+    BACKEND_XDP,        // libnetpcap: AF_XDP socket on one RX queue
+    BACKEND_FILE,       // libnetpcap: mmap'd pcap/pcapng file (-r)
+}               Backend;
+
 // Arguments given when launching the program 
 typedef struct _Args {
     char *dev;
     char *filter_exp;
+    char *read_file;    // Capture file to read instead of an interface
+    int burst;          // Packets pulled from the capture backend per call
+    Backend backend;
+    netpcap_ring_opts ring_opts;
+    netpcap_xdp_opts xdp_opts;
+    writer_opts write_opts;     // -w: save the packets to pcapng
+    int workers;        // Capture threads joined into one PACKET_FANOUT group
+    output_policy out_policy;   // When stdout can't keep up (--output-policy)
+    unsigned int out_sample;    // sample policy: print 1 packet in n
+    output_raw raw;             // Bytes dumped in hex (--raw)
+    int quiet;                  // -q: one line per packet
+    output_format format;       // --format
+    int flows;                  // --flows: print each flow when it ends
+    uint32_t flow_max;          // Flows tracked per worker
+    uint32_t flow_idle;         // Flow timeouts (s)
+    uint32_t flow_active;
+    int reassembly;             // TCP dissectors read reassembled streams (--no-reassembly)
+    uint32_t stream_buffer;     // Bytes held per direction of a stream
+    size_t stream_memory;       // Bytes held for all the streams
+    uint32_t latency;           // Seconds between latency reports, 0 = none (--latency)
+    uint32_t top;               // Seconds between heavy hitter reports, 0 = none (--top)
+    uint32_t certs;             // Seconds between certificate reports, 0 = none (--certs)
+    size_t raw_max;             // --raw-max, 0 = whole frame
 }               Args;
 
+struct NetShark;
+struct Dispatcher;
+
+// A frame decoded by the dispatcher (see dispatch.h)
+typedef struct packet_view packet_view;
+
+// Bytes inside a captured frame, not NUL-terminated: print with "%.*s"
+typedef struct {
+    const unsigned char *ptr;
+    uint32_t len;
+}               span;
+
+// One capture thread.
+// Each worker owns its capture socket, its dissector state and its output
+// buffer: nothing on the packet path is shared between workers. It is the
+// `user` argument every packet handler receives.
+typedef struct _Worker {
+    int id;
+    int cpu;                    // CPU the thread is pinned to, -1 if not pinned
+    pthread_t thread;
+    struct NetShark *app;
+
+    netpcap_t *sock;            // libnetpcap handle (every backend but BACKEND_PCAP)
+    outbuf out;                 // Text produced by the dissectors, see output.h
+    writer_ring *wring;         // Queue to the pcapng writer, NULL when not saving
+    flow_table flows;           // Conversations seen by this worker, see flow.h
+    stream_pool streams;        // Memory of their TCP reassembly, see stream.h
+    latency_table latency;      // Response times of their requests, see latency.h
+    dns_txn_table dns;          // DNS queries awaiting a response, see dns_txn.h
+    topk_table top;             // Heaviest DNS names, clients and TLS fingerprints, see topk.h
+    tls_fp_cache fingerprints;  // TLS fingerprint digests computed, see tls_fingerprint.h
+    x509_cache certs;           // Certificates parsed, see x509.h
+    tls_session_cache sessions; // TLS sessions issued and resumed, see tls_session.h
+
+    unsigned long long packets;
+    unsigned long long bytes;
+}               Worker;
+
 // The full context of the application
 typedef struct  NetShark {
     // A linked list of all devices from our system
@@ -36,24 +118,40 @@ typedef struct  NetShark {
     // The actual handler function that will be triggered
     // each time a packet is captured
     pcap_t *handle;
-    void *handler;
+    pcap_handler handler;
     struct bpf_program fp;
     bpf_u_int32 net;
-}               NetShark;
 
-typedef struct {
-    void (*tcp)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*udp)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*arp)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*ftp)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*http)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*icmp)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*dhcp)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*dns)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*mdns)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-    void (*tls)(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-} HandlerPacket;
+    // Number of packets handed to the dissectors per capture call
+    int burst;
+
+    // With the libnetpcap backends packets come from the workers' sockets,
+    // `handle` is then a dead libpcap handle only used to compile the filter
+    // expression
+    Backend backend;
+    netpcap_ring_opts ring_opts;
+    netpcap_xdp_opts xdp_opts;
+
+    // Capture threads (always at least one)
+    int nworkers;
+    Worker *workers;
+
+    // Thread saving the packets to disk (-w), NULL when not saving
+    pcap_writer *writer;
 
+    // Thread writing the dissectors' text to stdout
+    output_thread *output;
+    // -q: dissectors print a one-line summary instead of their full block
+    int quiet;
+    // --format: records instead of text, stdout then only carries them
+    output_format format;
+
+    // Routes each packet to the dissectors selected with -f
+    struct Dispatcher *dispatch;
+
+    // Bytes the workers' stream pools hold, bounded by --stream-memory
+    size_t stream_used;
+}               NetShark;
 
 
 
@@ -64,10 +162,14 @@ typedef struct {
 
 // /src/init.c
 void init(NetShark *n, Args args);
+void cleanup(NetShark *n);
 
 // /src/utils.c
-void dump_hex_single_line(const uint8_t *buf, size_t len);
-void mac_to_str(const uint8_t mac[6], char *dst, size_t dstframe_len);
+void print_raw_bytes(outbuf *ob, const char *label, const packet_view *v);
+void print_summary_head(outbuf *ob, const packet_view *v, const char *proto);
+void print_printable(outbuf *ob, const void *data, size_t len);
+char *mac_to_str(const uint8_t mac[6], char *dst, size_t dstframe_len);
+char *ip_to_str(const void *addr, char *dst, size_t dst_len);
 
 
 #endif /* NETSHARK_H */
\ No newline at end of file
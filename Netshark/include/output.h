@@ -0,0 +1,225 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+/*** MACROS ***/
+#define OUTPUT_CHUNK_SIZE       (256 * 1024)    // Bytes of text per chunk
+#define OUTPUT_CHUNKS           16              // Chunks per worker, power of two
+#define OUTPUT_IOV_MAX          64              // Chunks handed to each writev(2)
+#define OUTPUT_IDLE_US          1000            // Output thread sleep when every queue is empty
+#define OUTPUT_WAIT_US          50              // Worker sleep waiting for a chunk (block policy)
+#define OUTPUT_FLUSH_MS         100             // Max time text waits in a worker's chunk
+#define OUTPUT_SAMPLE_DEFAULT   10              // sample policy: print 1 packet in n
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// What a worker does when the output thread is behind and every chunk of
+// its queue is waiting to be written (--output-policy)
+typedef enum {
+    OUTPUT_BLOCK = 0,   // Wait for the terminal: the capture stalls
+    OUTPUT_DROP,        // Throw the packet's text away, keep capturing
+    OUTPUT_SAMPLE,      // Past half a queue, only print 1 packet in `sample`
+}               output_policy;
+
+// Which bytes of the frame handlers dump in hex (--raw)
+typedef enum {
+    OUTPUT_RAW_ALL = 0, // The whole captured frame
+    OUTPUT_RAW_PAYLOAD, // Only what follows the transport header
+    OUTPUT_RAW_NONE,    // No hex dump at all
+}               output_raw;
+
+// What the dissectors write (--format)
+typedef enum {
+    OUTPUT_TEXT = 0,    // Human readable blocks, or lines with -q
+    OUTPUT_JSON,        // One JSON array of packet objects
+    OUTPUT_NDJSON,      // One JSON object per line
+    OUTPUT_BIN,         // Length-prefixed binary records, see record.h
+}               output_format;
+
+// Single-producer single-consumer queue of text chunks between one capture
+// worker and the output thread. Chunks are allocated once; the worker fills
+// the one at `head` and publishes it, the output thread writes published
+// chunks and hands them back by moving `tail`.
+typedef struct {
+    char *chunks[OUTPUT_CHUNKS];
+    size_t lens[OUTPUT_CHUNKS];
+
+    // Producer (capture worker)
+    uint64_t head __attribute__((aligned(64)));
+
+    // Consumer (output thread)
+    uint64_t tail __attribute__((aligned(64)));
+} output_queue;
+
+// Output buffer owned by one capture worker.
+// Dissectors append their text to the worker's current chunk. The text of
+// a packet is never split between two chunks: when one fills up, the
+// partial packet moves to the next chunk and the full one is published.
+// ob_begin()/ob_end() bracket each packet so a packet's text is either
+// printed whole or not at all.
+typedef struct {
+    char *buf;                  // Current chunk, NULL until the first write
+    size_t len;
+    size_t cap;                 // == len when writes must take the slow path
+    size_t mark;                // Where the current packet's text starts
+    int muted;                  // The current packet's text is discarded
+    unsigned long long since;   // When the current chunk got its first byte (ms)
+
+    output_queue *q;
+    output_policy policy;
+    unsigned int sample;
+    unsigned int sample_seq;
+    output_raw raw;
+    size_t raw_max;             // Bytes dumped at most, 0 = no limit
+    output_format format;
+    unsigned int sections;      // Dissectors in the current record (see record.h)
+    uint32_t section_ids;       // Bit per schema id already in it
+    size_t record_off;          // Where the current record starts, from `mark`
+    const struct packet_view *view;     // Packet of the current record
+    time_t ts_sec;              // Second whose "HH:MM:SS" is in ts_hms
+    char ts_hms[8];
+
+    unsigned long long printed;     // Packets whose text was queued
+    unsigned long long dropped;     // Packets whose text was thrown away
+    unsigned long long sampled;     // Packets skipped by the sample policy
+    unsigned long long stalls;      // Times the worker waited for a chunk
+} outbuf;
+
+// Thread writing every worker's text to `fd`.
+// Published chunks from all queues are gathered into one writev(2), so
+// workers never make a system call to print.
+typedef struct {
+    pthread_t thread;
+    volatile int stop;
+
+    output_queue *queues;           // One per capture worker
+    int nqueues;
+    int fd;
+    int failed;                     // A write failed: text is discarded
+    size_t skip;                    // Bytes left out at the start of the stream
+
+    unsigned long long writes;      // writev(2) calls
+    unsigned long long bytes;       // Bytes written
+} output_thread;
+
+/*** PROTOTYPES ***/
+int output_init(output_thread *o, int fd, int nqueues);
+void output_free(output_thread *o);
+int output_start(output_thread *o);
+void output_stop(output_thread *o);
+
+void outbuf_init(outbuf *ob, output_queue *q, output_policy policy, unsigned int sample);
+void outbuf_flush(outbuf *ob, int idle);
+void ob_begin(outbuf *ob);
+void ob_end(outbuf *ob);
+
+char *ob_make_room(outbuf *ob, size_t need);
+void ob_puts(outbuf *ob, const char *s);     // appends '\n' like puts(3)
+void ob_printf(outbuf *ob, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Hand-rolled formatters, no format string to parse
+void ob_u64(outbuf *ob, unsigned long long v);                  // Decimal
+void ob_hex(outbuf *ob, unsigned long long v, int digits);      // Lowercase, zero padded
+void ob_ip4(outbuf *ob, const void *addr);                      // Dotted quad
+void ob_mac(outbuf *ob, const uint8_t mac[6]);                  // XX:XX:XX:XX:XX:XX
+void ob_timestamp(outbuf *ob, const struct timeval *ts);        // HH:MM:SS.uuuuuu, local time
+void ob_seconds(outbuf *ob, unsigned long long us);             // Microseconds as s.uuuuuu
+void ob_hexdump(outbuf *ob, const uint8_t *buf, size_t len, int upper);  // SSE2/AVX2, no spaces
+void ob_json_str(outbuf *ob, const void *s, size_t len);       // Quoted and escaped, SSE2/AVX2
+
+// Room for `need` bytes at the end of the buffer, NULL when the packet's
+// text is being discarded
+static inline char *ob_room(outbuf *ob, size_t need)
+{
+    if (ob->cap - ob->len >= need)
+        return ob->buf + ob->len;
+    return ob_make_room(ob, need);
+}
+
+static inline void ob_write(outbuf *ob, const void *data, size_t len)
+{
+    char *p = ob_room(ob, len);
+
+    if (p)
+    {
+        memcpy(p, data, len);
+        ob->len += len;
+    }
+}
+
+static inline void ob_putc(outbuf *ob, char c)
+{
+    char *p = ob_room(ob, 1);
+
+    if (p)
+    {
+        *p = c;
+        ob->len++;
+    }
+}
+
+// Nothing was written for the current packet yet
+static inline int ob_packet_empty(const outbuf *ob)
+{
+    return ob->len == ob->mark;
+}
+
+// Inline so strlen() of a literal is folded
+static inline void ob_str(outbuf *ob, const char *s)
+{
+    ob_write(ob, s, strlen(s));
+}
+
+// One "label value" line, the label carrying its own " : "
+static inline void ob_field_str(outbuf *ob, const char *label, const char *s)
+{
+    ob_str(ob, label);
+    ob_str(ob, s);
+    ob_putc(ob, '\n');
+}
+
+static inline void ob_field_u(outbuf *ob, const char *label, unsigned long long v)
+{
+    ob_str(ob, label);
+    ob_u64(ob, v);
+    ob_putc(ob, '\n');
+}
+
+static inline void ob_field_bytes(outbuf *ob, const char *label, unsigned long long v)
+{
+    ob_str(ob, label);
+    ob_u64(ob, v);
+    ob_str(ob, " bytes\n");
+}
+
+// "0x" and `digits` hex digits
+static inline void ob_field_hex(outbuf *ob, const char *label, unsigned long long v, int digits)
+{
+    ob_str(ob, label);
+    ob_str(ob, "0x");
+    ob_hex(ob, v, digits);
+    ob_putc(ob, '\n');
+}
+
+static inline void ob_field_ip4(outbuf *ob, const char *label, const void *addr)
+{
+    ob_str(ob, label);
+    ob_ip4(ob, addr);
+    ob_putc(ob, '\n');
+}
+
+static inline void ob_field_mac(outbuf *ob, const char *label, const uint8_t mac[6])
+{
+    ob_str(ob, label);
+    ob_mac(ob, mac);
+    ob_putc(ob, '\n');
+}
+
+#endif /* OUTPUT_H */
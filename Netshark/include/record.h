@@ -0,0 +1,121 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "netshark.h"
+
+/*
+ * Structured output (--format json|ndjson|bin).
+ *
+ * Every parsed packet struct has one table of field descriptors: name,
+ * type, offset and size of each member worth exporting. The JSON and
+ * binary writers walk that table over the struct, so adding a field to a
+ * dissector's output is one line in its table.
+ *
+ * Binary layout, all integers in host byte order (check `byte_order`):
+ *
+ *   file    record_file_header, then blocks one after the other
+ *   block   u32 length (whole block, a multiple of 8) | u16 kind | u16 count
+ *           | body | zero padding
+ *   schema  kind RECORD_SCHEMA, count = fields. Body: u16 schema id,
+ *           u8 name length, name, then per field: u8 type, u8 size
+ *           (0 when length-prefixed), u8 name length, name
+ *   packet  kind RECORD_PACKET, count = sections. Body: one section per
+ *           schema, the packet schema (id 0) first: u16 schema id,
+ *           u16 values length, the values in table order. Flow reports
+ *           are packet blocks with the flow section alone, latency
+ *           and top reports with their own section alone.
+ *
+ *   values  FIELD_UINT: `size` bytes, FIELD_INT: 4, FIELD_BOOL: 1,
+ *           FIELD_IP4/IP4_PTR: 4 (network order), FIELD_MAC_PTR: 6,
+ *           FIELD_TS: u64 microseconds since the epoch,
+ *           FIELD_SPAN/STR/TEXT: u16 length then the bytes
+ *
+ * A packet carrying several messages for one dissector (a reassembled
+ * TCP stream) gives one record per message.
+ *
+ * Blocks start on 8 byte boundaries, so a mmap'd file is walked by adding
+ * lengths. Fields left out of JSON by their condition are still present
+ * (zeroed or empty) in binary: a section has one layout per schema.
+ */
+
+/*** MACROS ***/
+#define RECORD_MAGIC        "NSHKREC"       // 8 bytes with the NUL
+#define RECORD_VERSION      1
+#define RECORD_BYTE_ORDER   0x1a2b3c4d
+#define RECORD_SCHEMA       1               // Block kinds
+#define RECORD_PACKET       2
+#define RECORD_TEXT_MAX     512             // Buffer handed to FIELD_TEXT getters
+
+#define FIELD_MEMBER_SIZE(st, m)    sizeof(((st *)0)->m)
+
+// A member exported under its own name
+#define FIELD(st, m, type) \
+    { #m, type, offsetof(st, m), FIELD_MEMBER_SIZE(st, m), 0, 0, NULL }
+// Left out of JSON while the `flag` member is 0
+#define FIELD_IF(st, m, type, flag) \
+    { #m, type, offsetof(st, m), FIELD_MEMBER_SIZE(st, m), \
+      offsetof(st, flag), FIELD_MEMBER_SIZE(st, flag), NULL }
+// A value computed from the struct by `fn`
+#define FIELD_FN(name, fn) \
+    { name, FIELD_TEXT, 0, 0, 0, 0, fn }
+#define FIELD_FN_IF(name, fn, st, flag) \
+    { name, FIELD_TEXT, 0, 0, offsetof(st, flag), FIELD_MEMBER_SIZE(st, flag), fn }
+
+#define RECORD_SCHEMA_DEF(var, id, name, fields) \
+    const record_schema var = { id, name, fields, sizeof(fields) / sizeof(fields[0]) }
+
+/*** STRUCTURE DEFINITIONS ***/
+typedef enum {
+    FIELD_UINT = 1,     // Unsigned integer of 1, 2, 4 or 8 bytes
+    FIELD_INT,          // int
+    FIELD_BOOL,         // Any integer, true when not 0
+    FIELD_IP4,          // 4 bytes in network order (struct in_addr, uint32_t)
+    FIELD_IP4_PTR,      // Pointer to 4 bytes in the frame
+    FIELD_MAC_PTR,      // Pointer to 6 bytes in the frame
+    FIELD_TS,           // struct timeval
+    FIELD_SPAN,         // span, left out of JSON when ptr is NULL
+    FIELD_STR,          // const char *, left out of JSON when NULL
+    FIELD_TEXT,         // Written by a getter
+}               field_type;
+
+// Writes the field's value into buf (RECORD_TEXT_MAX bytes), returns its length
+typedef size_t (*record_text_fn)(const void *pkt, char *buf);
+
+typedef struct {
+    const char *name;
+    field_type type;
+    uint16_t off;               // Offset of the member in the struct
+    uint16_t size;              // Size of the member
+    uint16_t when_off;          // Member that must be non zero for JSON
+    uint16_t when_size;         // 0 = always written
+    record_text_fn text;        // FIELD_TEXT
+}               field_desc;
+
+// The fields of one packet struct
+typedef struct {
+    uint16_t id;                // Section id in binary records
+    const char *name;           // Key of the section in JSON
+    const field_desc *fields;
+    int nfields;
+}               record_schema;
+
+// Start of a binary output file
+typedef struct {
+    char magic[8];              // RECORD_MAGIC
+    uint32_t byte_order;        // RECORD_BYTE_ORDER as written by this host
+    uint16_t version;
+    uint16_t nschemas;          // Schema blocks following the header
+}               record_file_header;
+
+/*** PROTOTYPES ***/
+// /src/record.c
+int record_header(int fd, output_format format);
+int record_trailer(int fd, output_format format);
+void record_begin(outbuf *ob, const packet_view *v);
+void record_add(outbuf *ob, const record_schema *schema, const void *pkt);
+void record_end(outbuf *ob);
+void record_object(outbuf *ob, const record_schema *schema, const void *obj);
+
+#endif /* RECORD_H */
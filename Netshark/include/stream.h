@@ -0,0 +1,97 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct _Worker;
+struct packet_view;
+
+/*** MACROS ***/
+#define STREAM_BUFFER_DEFAULT   (64 << 10)  // Bytes held per direction (--stream-buffer)
+#define STREAM_MEMORY_DEFAULT   (256 << 20) // Bytes held by all the workers (--stream-memory)
+#define STREAM_CLASS_MIN        7           // Smallest pool block: 128 bytes
+#define STREAM_CLASSES          18          // Largest: 16 MiB
+#define STREAM_BUFFER_MAX       (1u << (STREAM_CLASS_MIN + STREAM_CLASSES - 1))
+#define STREAM_POOL_CACHE       (1 << 20)   // Free bytes a worker keeps per class
+
+// Flags handed to the stream callbacks
+#define STREAM_GAP      0x01    // Bytes were lost right before `data`
+#define STREAM_FIN      0x02    // The sender closed: nothing will follow `data` (maybe empty)
+#define STREAM_END      0x04    // The flow is gone: free `state`. v and data are NULL
+
+/*** STRUCTURE DEFINITIONS ***/
+struct tcp_stream;
+
+// Hands `len` in-order bytes of one direction to a dissector, which
+// returns how many it consumed. Bytes not consumed (an incomplete message)
+// are kept and given again, followed by the next ones, on the next call.
+typedef size_t (*stream_fn)(struct _Worker *w, const struct packet_view *v, struct tcp_stream *s,
+                            int side, const unsigned char *data, size_t len, unsigned flags);
+
+// Bytes received ahead of a hole, copied out of their frame
+typedef struct stream_seg {
+    struct stream_seg *next;
+    uint32_t seq;
+    uint32_t len;
+    uint8_t cls;                // Pool class of the block
+    unsigned char data[];
+}               stream_seg;
+
+// One direction of a TCP connection
+typedef struct {
+    uint32_t next_seq;          // Next byte to hand to the dissector
+    uint32_t skip;              // Bytes the dissector passes over (message bodies)
+    uint8_t started;            // next_seq is known (SYN or first segment seen)
+    uint8_t gap;                // Bytes lost since the last delivery
+    uint8_t fin;                // FIN seen at `fin_seq`
+    uint8_t pend_cls;
+    uint32_t fin_seq;
+    uint32_t user;              // Free for the dissector (parser state)
+    unsigned char *pend;        // Delivered but not consumed yet
+    uint32_t pend_len;
+    uint32_t ooo_bytes;         // Held in `ooo`
+    stream_seg *ooo;            // Ahead of next_seq, sorted, never overlapping
+}               stream_dir;
+
+// Reassembly state of a flow, from the pool of its worker
+typedef struct tcp_stream {
+    stream_dir dir[2];          // Indexed by side of the flow key
+    stream_fn fn;               // Dissector the bytes go to
+    void *state;                // The dissector's own, see stream_state()
+    uint8_t cls;
+    uint8_t state_cls;
+}               tcp_stream;
+
+// Per-worker allocator for streams and their buffers.
+// Blocks come in power-of-two classes and go back to a per-class free
+// list, so steady traffic never reaches malloc. Every block the pool
+// holds counts against one limit shared by all the workers.
+typedef struct {
+    void *free[STREAM_CLASSES];
+    uint32_t cached[STREAM_CLASSES];
+    size_t *used;               // Bytes allocated by all the pools
+    size_t limit;
+    uint32_t dir_max;           // Bytes held per direction
+    struct _Worker *worker;     // Handed to the callbacks
+
+    unsigned long long streams;
+    unsigned long long bytes;       // Handed to dissectors
+    unsigned long long ooo;         // Segments stored ahead of a hole
+    unsigned long long overlaps;    // Segments carrying bytes already received
+    unsigned long long lost;        // Bytes given up (capture loss or limits)
+    unsigned long long refused;     // Allocations over the global limit
+}               stream_pool;
+
+/*** PROTOTYPES ***/
+// /src/stream.c
+void stream_pool_init(stream_pool *p, struct _Worker *w, size_t *used, size_t limit, uint32_t dir_max);
+void stream_pool_free(stream_pool *p);
+tcp_stream *stream_attach(stream_pool *p, tcp_stream **slot, stream_fn fn);
+void *stream_state(stream_pool *p, tcp_stream *s, size_t size);
+void *stream_buffer_get(stream_pool *p, size_t size, uint8_t *cls);
+void stream_buffer_put(stream_pool *p, void *b, uint8_t cls);
+void stream_segment(stream_pool *p, tcp_stream *s, const struct packet_view *v);
+void stream_close(stream_pool *p, tcp_stream *s);
+
+#endif /* STREAM_H */
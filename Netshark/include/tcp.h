@@ -27,10 +27,8 @@ typedef struct _tcp_header {
     uint16_t urp;
 } tcp_header;
 
-// Parsed TCP Packet Struct
+// Parsed TCP header, the lower layers are in the packet_view
 typedef struct {
-    eth_header ether;               // Ethernet header
-    ip_header ip;                   // IP header (raw)
     uint16_t src_port;              // TCP source port
     uint16_t dst_port;              // TCP dest port
     uint32_t seq_num;               // Sequence number
@@ -41,13 +39,12 @@ typedef struct {
     uint16_t checksum;              // TCP checksum
     uint16_t urg_ptr;               // Urgent pointer
     uint16_t data_len;              // TCP payload length
-    char flags_str[32];             // TCP flag string
 } tcp_packet;
 
 /*** PROTOTYPES ***/
-void tcp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-int parse_tcp_header(const unsigned char *frame, size_t frame_len, tcp_packet *out);
-void get_tcp_flags(unsigned char flags, char *str);
-void print_tcp_packet(const unsigned char *packet, uint32_t wire_len, const tcp_packet *p);
+int parse_tcp_header(const unsigned char *frame, size_t frame_len, const ip_header *ip, tcp_packet *out);
+char *get_tcp_flags(unsigned char flags, char *str);
+void print_tcp_packet(outbuf *ob, const packet_view *v);
+void summarize_tcp_packet(outbuf *ob, const packet_view *v);
 
 #endif /* TCP_H */
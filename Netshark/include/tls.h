@@ -17,6 +17,7 @@
 #define TLS_HANDSHAKE_HELLO_REQUEST       0
 #define TLS_HANDSHAKE_CLIENT_HELLO        1
 #define TLS_HANDSHAKE_SERVER_HELLO        2
+#define TLS_HANDSHAKE_NEW_SESSION_TICKET  4
 #define TLS_HANDSHAKE_CERTIFICATE         11
 #define TLS_HANDSHAKE_SERVER_KEY_EXCHANGE 12
 #define TLS_HANDSHAKE_CERTIFICATE_REQUEST 13
@@ -32,6 +33,14 @@
 #define TLS_VERSION_1_3  0x0304
 #define SSL_VERSION_3_0  0x0300
 
+#define TLS_RECORD_HEADER_LEN     5
+#define TLS_HANDSHAKE_HEADER_LEN  4
+#define TLS_HANDSHAKE_MAX   (64 << 10)  // Largest handshake message reassembled, per direction
+
+// stream_dir.user of a TLS stream
+#define TLS_STREAM_SYNC     0   // At a record boundary
+#define TLS_STREAM_LOST     1   // Lost the record boundaries, ignore the rest
+
 // Common TLS ports
 #define TLS_PORT_HTTPS   443
 #define TLS_PORT_SMTPS   465
@@ -39,7 +48,7 @@
 #define TLS_PORT_POP3S   995
 
 /*** STRUCTURE DEFINITIONS ***/
-typedef struct _tls_record_header {
+typedef struct __attribute__((packed)) _tls_record_header {
     uint8_t  type;
     uint16_t version;
     uint16_t length;
@@ -66,8 +75,6 @@ typedef struct _tls_server_hello {
 
 // Parsed TLS Packet Structure
 typedef struct {
-    tcp_packet tcp;                 // TCP packet info
-    
     // TLS Record Layer
     uint8_t  record_type;           // TLS record type
     uint16_t tls_version;           // TLS version
@@ -78,15 +85,11 @@ typedef struct {
     uint32_t handshake_length;      // Handshake message length
     uint16_t handshake_version;     // Version in handshake
     
-    // Parsed string representations
-    char record_type_str[32];       // Record type string
-    char handshake_type_str[32];    // Handshake type string
-    char version_str[16];           // Version string
-    char server_name[256];          // SNI server name (if present)
+    span server_name;               // SNI server name (if present), in the frame
     
     // For ECDHE key exchange
     uint8_t pubkey_len;
-    unsigned char pubkey[256];  // adjust as needed
+    const unsigned char *pubkey;    // Points into the frame
     uint16_t named_curve;
     uint8_t has_pubkey;
 
@@ -94,22 +97,65 @@ typedef struct {
     uint8_t is_encrypted;           // Is payload encrypted
     uint8_t has_sni;                // Has Server Name Indication
     uint8_t is_handshake;           // Is handshake message
+    uint8_t reassembled;            // The message came in several records
+    uint8_t truncated;              // Only the start of the message was dissected
+    uint8_t has_client_fp;          // ja3 and ja4 set
+    uint8_t has_server_fp;          // ja3s and ja4s set
+
+    // Fingerprints of the hellos, in the connection's tls_fingerprint
+    span ja3;
+    span ja4;
+    span ja3s;
+    span ja4s;
+
+    // Leaf of a Certificate message, in the worker's x509_cache
+    uint8_t cert_count;             // Certificates of the message
+    uint8_t has_cert;               // The leaf was parsed, cert_* set
+    const char *cert_subject;
+    const char *cert_issuer;
+    const char *cert_cn;
+    const char *cert_san;
+    const char *cert_key;
+    const char *cert_sha256;
+    struct timeval cert_not_before;
+    struct timeval cert_not_after;
     
     uint16_t payload_len;           // TLS payload length
 } tls_packet;
 
+// Handshake messages of one direction, which may span several records.
+// A message is dissected in place when one record holds all of it;
+// otherwise its bytes are gathered in a pool buffer until complete.
+typedef struct {
+    unsigned char *buf;             // From the stream pool, NULL when nothing is pending
+    uint32_t len;                   // Bytes of the message gathered
+    uint32_t need;                  // Its full size, header included, 0 before the header
+    uint32_t discard;               // Bytes left of a message too large to gather
+    unsigned char head[TLS_HANDSHAKE_HEADER_LEN];
+    uint8_t cls;
+    uint8_t encrypted;              // ChangeCipherSpec sent: handshake records are opaque
+}               tls_handshake_dir;
+
+// TLS state of a reassembled connection, see stream_state()
+typedef struct {
+    tls_handshake_dir dir[2];       // Indexed by side of the flow key
+    tls_fingerprint fp;
+    tls_timing timing;
+    uint8_t tracked;                // Kept across packets: the handshake is timed
+}               tls_conn;
+
 /*** PROTOTYPES ***/
-void tls_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
 int parse_tls_record(const unsigned char *data, size_t data_len, tls_packet *out);
 int parse_tls_handshake(const unsigned char *data, size_t data_len, tls_packet *out);
 int parse_client_hello(const unsigned char *data, size_t data_len, tls_packet *out);
 int parse_server_hello(const unsigned char *data, size_t data_len, tls_packet *out);
-int extract_sni(const unsigned char *data, size_t data_len, char *sni_out, size_t sni_max);
-void get_tls_record_type_str(uint8_t type, char *str);
-void get_tls_handshake_type_str(uint8_t type, char *str);
-void get_tls_version_str(uint16_t version, char *str);
+int extract_sni(const unsigned char *data, size_t data_len, span *sni);
+char *get_tls_record_type_str(uint8_t type, char *str);
+char *get_tls_handshake_type_str(uint8_t type, char *str);
+char *get_tls_version_str(uint16_t version, char *str);
 int is_tls_port(uint16_t port);
 int is_likely_tls(const unsigned char *data, size_t len);
-void print_tls_packet(const unsigned char *packet, uint32_t wire_len, const tls_packet *p);
+void print_tls_packet(outbuf *ob, const packet_view *v, const tls_packet *p);
+void summarize_tls_packet(outbuf *ob, const packet_view *v, const tls_packet *p);
 
 #endif /* TLS_H */
\ No newline at end of file
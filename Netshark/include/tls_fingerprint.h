@@ -0,0 +1,84 @@
+#ifndef TLS_FINGERPRINT_H
+#define TLS_FINGERPRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*** MACROS ***/
+#define TLS_JA3_LEN       32        // MD5 in hex
+#define TLS_JA4_LEN       36        // "t13d1516h2_8daaf6152771_e5627efa2ab1"
+#define TLS_JA4S_LEN      25        // "t130200_1301_234ea6891581"
+#define TLS_FP_LIST_MAX   512       // Values of a hello list fingerprinted, past it ignored
+#define TLS_FP_CACHE      1024      // Digests remembered per worker, power of two
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// One list of a hello. `count` goes on past TLS_FP_LIST_MAX, `n` doesn't.
+typedef struct {
+    uint16_t v[TLS_FP_LIST_MAX];
+    size_t n;
+    size_t count;
+}               tls_fp_list;
+
+// What one walk over a ClientHello or ServerHello collects: the values
+// its fingerprints are made of, and what it says about resuming a session
+typedef struct {
+    uint16_t version;               // Of the hello
+    uint16_t supported;             // Best of supported_versions, 0 without
+    tls_fp_list ciphers;
+    tls_fp_list exts;               // Types, in the order sent
+    tls_fp_list groups;
+    tls_fp_list formats;
+    tls_fp_list sigalgs;
+    size_t alpn;                    // Offset of the ALPN body, 0 without
+    size_t end;                     // Of the extensions
+    const unsigned char *session_id; // NULL when empty
+    uint8_t session_id_len;
+    const unsigned char *ticket;    // session_ticket of a ClientHello, NULL without
+    uint16_t ticket_len;
+    uint8_t sni;
+    uint8_t psk;                    // pre_shared_key extension
+    uint8_t retry;                  // ServerHello that is a HelloRetryRequest
+}               tls_hello_fields;
+
+// Fingerprints of the hellos of one connection, kept from the first
+// ClientHello and ServerHello: a ClientHello sent again after a
+// HelloRetryRequest doesn't change them
+typedef struct {
+    char ja3[TLS_JA3_LEN + 1];
+    char ja4[TLS_JA4_LEN + 1];
+    char ja3s[TLS_JA3_LEN + 1];
+    char ja4s[TLS_JA4S_LEN + 1];
+    uint8_t client;                 // ja3 and ja4 computed
+    uint8_t server;                 // ja3s and ja4s computed
+}               tls_fingerprint;
+
+// A digest, under a 64-bit hash of the values it hashes
+typedef struct {
+    uint64_t key;                   // 0 = free
+    char hex[TLS_JA3_LEN];
+}               tls_fp_memo;
+
+// Digests of the fingerprints one worker computed.
+// Clients of the same software send the same lists, so the MD5 and
+// SHA-256 of a list are looked up by a cheap hash of its values first,
+// in a direct mapped table, and only computed the first time it shows up.
+typedef struct {
+    tls_fp_memo *memo;              // TLS_FP_CACHE entries
+
+    unsigned long long hellos;      // Fingerprinted
+    unsigned long long digests;     // Computed
+    unsigned long long hits;        // Found in memo
+}               tls_fp_cache;
+
+/*** PROTOTYPES ***/
+// /src/parsers/tls_fingerprint.c
+int tls_fp_cache_init(tls_fp_cache *c);
+void tls_fp_cache_free(tls_fp_cache *c);
+int tls_hello_walk(const unsigned char *hello, size_t len, int client, tls_hello_fields *h);
+void tls_client_fingerprint(tls_fp_cache *c, const unsigned char *hello, tls_hello_fields *h,
+                            tls_fingerprint *fp);
+void tls_server_fingerprint(tls_fp_cache *c, const unsigned char *hello, tls_hello_fields *h,
+                            tls_fingerprint *fp);
+
+#endif /* TLS_FINGERPRINT_H */
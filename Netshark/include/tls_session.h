@@ -0,0 +1,53 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "latency.h"
+
+/*** MACROS ***/
+#define TLS_SESSION_CACHE   4096        // Session IDs and tickets remembered per worker, power of two
+#define TLS_RESUMED_CODE    100         // Added to the version in latency codes of resumed handshakes
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// Handshake of one reassembled connection, timed from its first
+// ClientHello: to the ServerHello, then to the first Application Data
+// record of the client, once the handshake is over from its side
+typedef struct {
+    uint64_t hello_us;              // ClientHello seen, 0 before
+    uint64_t session_id;            // Key of the client's session ID, 0 = none
+    uint64_t offered;               // Key of the session the client offered, 0 = none
+    char name[LATENCY_NAME_MAX];    // SNI, else the server's address
+    uint8_t name_len;
+    uint8_t client;                 // Side that sent the ClientHello
+    uint8_t attempt;                // The client tried to resume
+    uint8_t done;                   // Application Data timed
+    int code;                       // Latency key code once the ServerHello came, 0 before
+}               tls_timing;
+
+// Sessions servers handed out, as seen by one worker.
+// Session IDs of full handshakes and TLS 1.2 tickets go into a direct
+// mapped table under a hash of the server's address and their bytes, so
+// an offer to resume can be told apart from a session issued before the
+// capture or on a connection of another worker. TLS 1.3 tickets are
+// encrypted: those resumptions are counted, never found.
+typedef struct {
+    uint64_t *keys;                 // TLS_SESSION_CACHE slots, 0 = free
+
+    unsigned long long handshakes;  // ServerHellos answering a ClientHello seen
+    unsigned long long attempts;    // ClientHellos offering a session
+    unsigned long long resumed;     // Handshakes that resumed one
+    unsigned long long known;       // Offers of a session seen issued
+    unsigned long long issued;      // Session IDs and tickets cached
+}               tls_session_cache;
+
+/*** PROTOTYPES ***/
+// /src/tls_session.c
+int tls_session_cache_init(tls_session_cache *c);
+void tls_session_cache_free(tls_session_cache *c);
+uint64_t tls_session_key(const unsigned char *server, const unsigned char *id, size_t len);
+void tls_session_issue(tls_session_cache *c, uint64_t key);
+int tls_session_known(const tls_session_cache *c, uint64_t key);
+
+#endif /* TLS_SESSION_H */
@@ -0,0 +1,84 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "output.h"
+
+/*** MACROS ***/
+#define TOPK_DEPTH          4           // Count-Min rows
+#define TOPK_WIDTH          8192        // Counters per row, power of two: error within N/3000
+#define TOPK_TRACKED        64          // Heavy hitter candidates kept per list
+#define TOPK_REPORT         10          // Printed per list and interval
+#define TOPK_KEY_MAX        256         // Bytes of a key: a DNS name in text
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// What is counted, each in its own list
+typedef enum {
+    TOPK_DNS_QNAME = 0,     // Names queried
+    TOPK_DNS_CLIENT,        // Addresses sending queries
+    TOPK_DNS_NXDOMAIN,      // Names answered NXDOMAIN
+    TOPK_TLS_JA3,           // Fingerprints of clients, once per connection
+    TOPK_TLS_JA4,
+    TOPK_TLS_JA3S,          // Fingerprints of servers
+    TOPK_TLS_JA4S,
+    TOPK_LISTS
+}               topk_list_id;
+
+// One candidate. `count` is the sketch's estimate, never under the true
+// count; `seen` what was counted since it was tracked, never over.
+typedef struct {
+    uint64_t hash;
+    uint64_t count;
+    uint64_t seen;
+    uint16_t len;
+    uint16_t heap;              // Position in the heap
+    char *key;                  // Its slot in the list's name arena
+}               topk_entry;
+
+// Heavy hitters of one list.
+// A Count-Min sketch estimates how often every key was seen in fixed
+// memory. The keys with the highest estimates are the Space-Saving
+// candidates: a min-heap on the estimate, with the lowest one replaced
+// when a key outgrows it. Their keys are copied into a fixed arena once
+// admitted, so memory doesn't depend on how many distinct keys go by.
+typedef struct {
+    uint32_t sketch[TOPK_DEPTH][TOPK_WIDTH];
+    topk_entry entries[TOPK_TRACKED];
+    uint8_t heap[TOPK_TRACKED];             // Entries, lowest count first
+    uint8_t index[2 * TOPK_TRACKED];        // Entries by hash, open addressing, 0 = free
+    uint32_t count;                         // Entries in use
+    uint64_t total;                         // Keys added this interval
+    char names[TOPK_TRACKED][TOPK_KEY_MAX];
+}               topk_list;
+
+// Top lists of one worker (--top).
+// Every `interval` seconds of capture time each list prints its heaviest
+// keys and starts over.
+typedef struct {
+    topk_list *lists;           // TOPK_LISTS lists, NULL when not kept
+    uint32_t interval;          // Seconds between reports, 0 = not kept
+    uint64_t next;              // Second of the next report
+    uint64_t last;              // Second of the last key added
+    outbuf *out;
+
+    unsigned long long keys;
+}               topk_table;
+
+/*** PROTOTYPES ***/
+// /src/topk.c
+int topk_table_init(topk_table *t, uint32_t interval, outbuf *out);
+void topk_table_free(topk_table *t);
+void topk_add(topk_table *t, topk_list_id list, const void *key, size_t len, uint64_t sec);
+void topk_report(topk_table *t, uint64_t sec);
+void topk_flush(topk_table *t);
+
+// Prints the lists once their interval is over, cheap otherwise
+static inline void topk_advance(topk_table *t, uint64_t sec)
+{
+    if (t->interval && sec >= t->next)
+        topk_report(t, sec);
+}
+
+#endif /* TOPK_H */
@@ -13,20 +13,19 @@ typedef struct _udp_header {
     uint16_t uh_sum;
 } udp_header;
 
+// Parsed UDP header, the lower layers are in the packet_view
 typedef struct {
-    eth_header ether;
-    ip_header ip;
     uint16_t src_port;
     uint16_t dst_port;
     uint16_t length;
     uint16_t checksum;
     uint16_t data_len;
-    char service_str[64];
+    const char *service;        // Well-known service on either port
 } udp_packet;
 
 /*** PROTOTYPES ***/
-void udp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet);
-int parse_udp_header(const unsigned char *frame, size_t frame_len, udp_packet *out);
-void print_udp_packet(const unsigned char *packet, uint32_t wire_len, const udp_packet *p);
+int parse_udp_header(const unsigned char *frame, size_t frame_len, const ip_header *ip, udp_packet *out);
+void print_udp_packet(outbuf *ob, const packet_view *v);
+void summarize_udp_packet(outbuf *ob, const packet_view *v);
 
 #endif /* UDP_H */
@@ -0,0 +1,87 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <pcap.h>
+
+/*** MACROS ***/
+#define WRITER_RING_REFS    (1U << 16)          // Packets queued per worker, power of two
+#define WRITER_RING_BYTES   (32U << 20)         // Frame bytes queued per worker
+#define WRITER_BUF_SIZE     (1U << 20)          // Bytes handed to each write(2)
+#define WRITER_BUF_ALIGN    4096
+#define WRITER_IDLE_US      1000                // Writer sleep when every ring is empty
+#define WRITER_FLUSH_MS     1000                // Max time a partial buffer waits
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// -w/-C/-G/-W
+typedef struct {
+    const char *path;                   // NULL: nothing is saved
+    unsigned long long rotate_bytes;    // 0 = no size rotation
+    unsigned int rotate_secs;           // 0 = no time rotation
+    int max_files;                      // 0 = no limit
+} writer_opts;
+
+// A queued packet: its header and where its bytes sit in the data arena
+typedef struct {
+    struct pcap_pkthdr hdr;
+    uint64_t off;                   // Position in the arena, never wraps
+} writer_ref;
+
+// Single-producer single-consumer queue between one capture worker and the
+// writer thread. The worker copies the frame into `data` and publishes a
+// reference to it; the writer copies it out and releases the space. The
+// two sides only share the head/tail counters, each on its own cache line.
+typedef struct {
+    writer_ref *refs;
+    unsigned char *data;
+
+    // Producer (capture worker)
+    uint64_t ref_head __attribute__((aligned(64)));
+    uint64_t data_head;
+    unsigned long long drops;       // Packets not queued because the ring was full
+
+    // Consumer (writer thread)
+    uint64_t ref_tail __attribute__((aligned(64)));
+    uint64_t data_tail;
+} writer_ring;
+
+// pcapng writer thread.
+// Packets are coalesced into an aligned WRITER_BUF_SIZE buffer which goes
+// to disk in one write(2). With rotation, files are named <path>.<n> and at
+// most `max_files` are kept, the oldest being overwritten.
+typedef struct {
+    pthread_t thread;
+    volatile int stop;
+
+    writer_ring *rings;             // One per capture worker
+    int nrings;
+
+    writer_opts opts;
+    int linktype;
+
+    int fd;
+    int file_index;
+    unsigned long long file_bytes;
+    time_t file_start;
+    time_t now;                     // Wall clock, refreshed once per writer loop
+    int failed;                     // A write failed: stop saving
+
+    unsigned char *buf;
+    size_t buf_len;
+    unsigned long long flush_ms;    // Last time the buffer went to disk
+
+    unsigned long long packets;     // Packets written
+    unsigned long long files;       // Files opened
+} pcap_writer;
+
+/*** PROTOTYPES ***/
+int writer_init(pcap_writer *w, const writer_opts *opts, int linktype, int nrings);
+void writer_free(pcap_writer *w);
+int writer_start(pcap_writer *w);
+void writer_stop(pcap_writer *w);
+int writer_push(writer_ring *r, const struct pcap_pkthdr *hdr, const unsigned char *data);
+
+#endif /* WRITER_H */
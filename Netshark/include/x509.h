@@ -0,0 +1,89 @@
+#ifndef X509_H
+#define X509_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "output.h"
+
+/*** MACROS ***/
+#define X509_NAME_MAX       256         // Bytes of a subject or issuer in text
+#define X509_CN_MAX         68          // Bytes of a common name: 64 at most, RFC 5280
+#define X509_SAN_MAX        512         // Bytes of the alternative names in text
+#define X509_KEY_MAX        16          // "rsa-2048", "ec-p256", "ed25519"
+#define X509_DATE_LEN       10          // "2026-11-02"
+#define X509_CACHE_SETS     128         // Of X509_CACHE_WAYS certificates each, power of two
+#define X509_CACHE_WAYS     4
+#define X509_CHAIN_MAX      8           // Certificates of a Certificate message looked at
+
+/*** STRUCTURE DEFINITIONS ***/
+
+// What a certificate says, in text. Names are written as their RDNs are
+// encoded ("C=US, O=Let's Encrypt, CN=R3"), cut to fit their buffers.
+typedef struct {
+    char subject[X509_NAME_MAX];
+    char issuer[X509_NAME_MAX];
+    char cn[X509_CN_MAX];           // Last common name of the subject
+    char san[X509_SAN_MAX];         // DNS names, addresses, e-mails and URIs, space separated
+    char key[X509_KEY_MAX];         // Public key algorithm and size
+    uint32_t nsan;                  // Alternative names, those cut from `san` too
+    time_t not_before;
+    time_t not_after;
+    uint8_t self_signed;            // Issued by its subject
+}               x509_cert;
+
+// A certificate parsed once, then found again by its DER bytes
+typedef struct {
+    uint64_t hash;                  // Of the DER, 0 = free
+    unsigned char *der;             // Copy, compared on lookup
+    uint32_t der_len;
+    uint32_t issuer_hash;
+    uint64_t used;                  // Lookup stamp of the last use, for eviction
+    char sha256[65];                // Fingerprint in hex
+    x509_cert cert;
+
+    unsigned long long seen;        // This interval
+}               x509_entry;
+
+// Certificates of one worker.
+// An edge sees the same few hundred certificates over and over: each is
+// parsed the first time, then found in a set associative table by a hash
+// of its bytes and confirmed by comparing them, which costs far less than
+// hashing it with SHA-256 again. The least recently used certificate of
+// a set makes room for a new one. Every `interval` seconds of capture
+// time (--certs) the certificates seen are printed by expiry, then their
+// issuers.
+typedef struct {
+    x509_entry *entries;            // X509_CACHE_SETS * X509_CACHE_WAYS
+    uint64_t stamp;
+    uint32_t interval;              // Seconds between reports, 0 = none
+    uint64_t next;                  // Second of the next report
+    uint64_t last;                  // Second of the last certificate seen
+    outbuf *out;
+
+    unsigned long long certs;       // Looked up
+    unsigned long long parsed;      // Not in the cache
+    unsigned long long invalid;     // Not a certificate
+    unsigned long long evicted;
+}               x509_cache;
+
+/*** PROTOTYPES ***/
+// /src/parsers/x509_parser.c
+int x509_parse(const unsigned char *der, size_t len, x509_cert *out);
+size_t x509_date(time_t t, char *buf);
+
+// /src/x509_cache.c
+int x509_cache_init(x509_cache *c, uint32_t interval, outbuf *out);
+void x509_cache_free(x509_cache *c);
+const x509_entry *x509_lookup(x509_cache *c, const unsigned char *der, size_t len, uint64_t sec);
+void x509_report(x509_cache *c, uint64_t sec);
+void x509_flush(x509_cache *c);
+
+// Prints the certificates once their interval is over, cheap otherwise
+static inline void x509_advance(x509_cache *c, uint64_t sec)
+{
+    if (c->interval && sec >= c->next)
+        x509_report(c, sec);
+}
+
+#endif /* X509_H */
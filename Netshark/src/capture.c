@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include "record.h"
+#include "dns.h"
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+
+/*
+ * Capture driver.
+ *
+ * Instead of entering libpcap once per packet, the driver asks the backend
+ * for up to `burst` frames per call, then hands the whole burst to the
+ * dissector stage. SIGINT/SIGTERM only raise a flag (and break the backend
+ * out of its blocking read), so the main loop returns and the cleanup code
+ * in main() gets to run.
+ *
+ * Three backends are available: libpcap, and libnetpcap's TPACKET_V3 ring
+ * and AF_XDP socket, whose bursts point straight into the memory shared
+ * with the kernel.
+ *
+ * With the ring backend the capture can be spread over several workers,
+ * one thread per ring, all members of the same PACKET_FANOUT group. The
+ * signals are then blocked in the workers and handled by the main thread,
+ * which breaks every ring out of its poll().
+ */
+
+static volatile sig_atomic_t stop_requested = 0;
+static pcap_t *active_handle = NULL;
+static Worker *active_workers = NULL;
+static int active_nworkers = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+    if (active_workers)
+    {
+        for (int i = 0; i < active_nworkers; i++)
+            netpcap_breakloop(active_workers[i].sock);
+    }
+    else if (active_handle)
+        pcap_breakloop(active_handle);
+}
+
+void capture_install_signals(NetShark *n)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    // No SA_RESTART: a blocking read must come back with EINTR
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    active_handle = n->handle;
+    if (n->backend != BACKEND_PCAP)
+    {
+        active_workers = n->workers;
+        active_nworkers = n->nworkers;
+    }
+}
+
+int capture_stopped(void)
+{
+    return stop_requested;
+}
+
+int capture_batch_init(capture_batch *b, int size, int copy)
+{
+    memset(b, 0, sizeof(*b));
+    b->size = size;
+    b->copy = copy;
+
+    b->slots = calloc(size, sizeof(capture_slot));
+    if (!b->slots)
+        return -1;
+
+    if (copy) {
+        b->arena = malloc((size_t)size * CAPTURE_SNAPLEN);
+        if (!b->arena) {
+            free(b->slots);
+            b->slots = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void capture_batch_free(capture_batch *b)
+{
+    free(b->slots);
+    free(b->arena);
+    b->slots = NULL;
+    b->arena = NULL;
+}
+
+// pcap_handler used as the backend callback: only records the frame
+void capture_batch_collect(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *bytes)
+{
+    capture_batch *b = (capture_batch *)user;
+
+    if (b->count >= b->size)
+        return;
+
+    capture_slot *slot = &b->slots[b->count];
+    slot->hdr = *hdr;
+
+    if (b->copy) {
+        unsigned char *dst = b->arena + (size_t)b->count * CAPTURE_SNAPLEN;
+        if (slot->hdr.caplen > CAPTURE_SNAPLEN)
+            slot->hdr.caplen = CAPTURE_SNAPLEN;
+        memcpy(dst, bytes, slot->hdr.caplen);
+        slot->data = dst;
+    } else {
+        slot->data = bytes;
+    }
+    b->count++;
+}
+
+// Dissector stage: run the packet handler over the whole burst
+void capture_batch_flush(capture_batch *b, pcap_handler handler, unsigned char *user)
+{
+    for (int i = 0; i < b->count; i++)
+        handler(user, &b->slots[i].hdr, b->slots[i].data);
+    b->count = 0;
+}
+
+// Pull up to one burst from the selected backend
+static int capture_dispatch(Worker *w, capture_batch *b)
+{
+    if (w->app->backend != BACKEND_PCAP)
+        return netpcap_dispatch(w->sock, b->size, capture_batch_collect, (unsigned char *)b);
+    return pcap_dispatch(w->app->handle, b->size, capture_batch_collect, (unsigned char *)b);
+}
+
+static void print_output_stats(NetShark *n)
+{
+    unsigned long long printed = 0, dropped = 0, sampled = 0, stalls = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        printed += n->workers[i].out.printed;
+        dropped += n->workers[i].out.dropped;
+        sampled += n->workers[i].out.sampled;
+        stalls += n->workers[i].out.stalls;
+    }
+
+    printf("%llu packets printed (%llu bytes in %llu writes)", printed,
+           n->output->bytes, n->output->writes);
+    if (dropped)
+        printf(", %llu not printed (output queue full)", dropped);
+    if (sampled)
+        printf(", %llu skipped by sampling", sampled);
+    if (stalls)
+        printf(", capture waited for the output %llu times", stalls);
+    printf("\n");
+}
+
+static void print_flow_stats(NetShark *n)
+{
+    unsigned long long created = 0, full = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        created += n->workers[i].flows.created;
+        full += n->workers[i].flows.full;
+    }
+    printf("%llu flows", created);
+    if (full)
+        printf(", %llu packets not tracked (flow table full)", full);
+    printf("\n");
+}
+
+static void print_stream_stats(NetShark *n)
+{
+    unsigned long long streams = 0, bytes = 0, ooo = 0, overlaps = 0, lost = 0, refused = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        const stream_pool *p = &n->workers[i].streams;
+
+        streams += p->streams;
+        bytes += p->bytes;
+        ooo += p->ooo;
+        overlaps += p->overlaps;
+        lost += p->lost;
+        refused += p->refused;
+    }
+    if (streams == 0)
+        return;
+    printf("%llu TCP streams reassembled (%llu bytes), %llu segments out of order, %llu overlapping\n",
+           streams, bytes, ooo, overlaps);
+    if (lost || refused)
+        printf("%llu stream bytes lost, %llu buffers refused (stream memory limit)\n", lost, refused);
+}
+
+static void print_latency_stats(NetShark *n)
+{
+    unsigned long long samples = 0, timeouts = 0, dropped = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        samples += n->workers[i].latency.samples;
+        timeouts += n->workers[i].latency.timeouts;
+        dropped += n->workers[i].latency.dropped;
+    }
+    if (n->nworkers == 0 || n->workers[0].latency.interval == 0)
+        return;
+    printf("%llu latency samples", samples);
+    if (timeouts)
+        printf(", %llu timeouts", timeouts);
+    if (dropped)
+        printf(", %llu not kept (too many hosts and statuses)", dropped);
+    printf("\n");
+}
+
+// TLS hellos fingerprinted, and how many of their digests were memoized
+static void print_tls_stats(NetShark *n)
+{
+    unsigned long long hellos = 0, digests = 0, hits = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        hellos += n->workers[i].fingerprints.hellos;
+        digests += n->workers[i].fingerprints.digests;
+        hits += n->workers[i].fingerprints.hits;
+    }
+    if (hellos == 0)
+        return;
+    printf("%llu TLS hellos fingerprinted, %llu digests computed, %llu found in cache\n",
+           hellos, digests, hits);
+}
+
+// TLS handshakes of reassembled connections, and how many resumed a session
+static void print_tls_session_stats(NetShark *n)
+{
+    unsigned long long handshakes = 0, attempts = 0, resumed = 0, known = 0, issued = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        handshakes += n->workers[i].sessions.handshakes;
+        attempts += n->workers[i].sessions.attempts;
+        resumed += n->workers[i].sessions.resumed;
+        known += n->workers[i].sessions.known;
+        issued += n->workers[i].sessions.issued;
+    }
+    if (handshakes == 0 && attempts == 0)
+        return;
+    printf("%llu TLS handshakes, %llu resumption attempts, %llu resumed", handshakes, attempts, resumed);
+    if (attempts)
+        printf(" (%.1f%%)", 100.0 * resumed / attempts);
+    printf(", %llu sessions issued, %llu offered again\n", issued, known);
+}
+
+// Certificates of TLS handshakes, and how many of them the cache spared parsing
+static void print_cert_stats(NetShark *n)
+{
+    unsigned long long certs = 0, parsed = 0, invalid = 0, evicted = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        certs += n->workers[i].certs.certs;
+        parsed += n->workers[i].certs.parsed;
+        invalid += n->workers[i].certs.invalid;
+        evicted += n->workers[i].certs.evicted;
+    }
+    if (certs == 0)
+        return;
+    printf("%llu certificates seen, %llu parsed, %llu found in cache", certs, parsed, certs - parsed - invalid);
+    if (invalid)
+        printf(", %llu invalid", invalid);
+    if (evicted)
+        printf(", %llu evicted", evicted);
+    printf("\n");
+}
+
+// DNS transactions, with --latency
+static void print_dns_stats(NetShark *n)
+{
+    unsigned long long queries = 0, retransmits = 0, answered = 0, timeouts = 0;
+    unsigned long long unmatched = 0, dropped = 0, waiting;
+    unsigned long long rcode[DNS_TXN_RCODES] = { 0 };
+    const char *sep = " (";
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        const dns_txn_table *t = &n->workers[i].dns;
+
+        queries += t->queries;
+        retransmits += t->retransmits;
+        answered += t->answered;
+        timeouts += t->timeouts;
+        unmatched += t->unmatched;
+        dropped += t->dropped;
+        for (int r = 0; r < DNS_TXN_RCODES; r++)
+            rcode[r] += t->rcode[r];
+    }
+    if (queries == 0 && unmatched == 0)
+        return;
+    waiting = queries - retransmits - answered - timeouts - dropped;
+    printf("%llu DNS queries, %llu answered", queries, answered);
+    for (int r = 0; r < DNS_TXN_RCODES; r++)
+    {
+        const char *name = dns_rcode_str(r);
+
+        if (rcode[r] == 0)
+            continue;
+        if (name)
+            printf("%s%llu %s", sep, rcode[r], name);
+        else
+            printf("%s%llu rcode %d", sep, rcode[r], r);
+        sep = ", ";
+    }
+    if (sep[0] == ',')
+        printf(")");
+    printf(", %llu timed out", timeouts);
+    if (waiting)
+        printf(", %llu still waiting", waiting);
+    if (retransmits)
+        printf(", %llu retransmitted", retransmits);
+    if (unmatched)
+        printf(", %llu unmatched responses", unmatched);
+    if (dropped)
+        printf(", %llu not kept (too many pending)", dropped);
+    printf("\n");
+}
+
+static void print_capture_stats(NetShark *n, double elapsed)
+{
+    unsigned long long packets = 0, bytes = 0;
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        packets += n->workers[i].packets;
+        bytes += n->workers[i].bytes;
+    }
+
+    printf("\n%llu packets processed\n", packets);
+    if (n->backend == BACKEND_FILE)
+    {
+        struct netpcap_stat st;
+        if (netpcap_stats(n->workers[0].sock, &st) == 0)
+            printf("%u packets read from file in %.3f s\n", st.ps_recv, elapsed);
+        if (elapsed > 0)
+            printf("%.0f packets/s, %.0f bytes/s\n", packets / elapsed, bytes / elapsed);
+    }
+    else if (n->backend != BACKEND_PCAP)
+    {
+        unsigned long long recv = 0, drop = 0;
+
+        for (int i = 0; i < n->nworkers; i++)
+        {
+            struct netpcap_stat st;
+            if (netpcap_stats(n->workers[i].sock, &st) == 0)
+            {
+                recv += st.ps_recv;
+                drop += st.ps_drop;
+            }
+        }
+        printf("%llu packets received by filter\n", recv);
+        printf("%llu packets dropped by kernel\n", drop);
+
+        if (n->nworkers > 1)
+        {
+            for (int i = 0; i < n->nworkers; i++)
+                printf("  worker %d (cpu %d): %llu packets, %llu bytes\n", n->workers[i].id,
+                       n->workers[i].cpu, n->workers[i].packets, n->workers[i].bytes);
+        }
+    }
+    else
+    {
+        struct pcap_stat st;
+        if (pcap_stats(n->handle, &st) == 0)
+        {
+            printf("%u packets received by filter\n", st.ps_recv);
+            printf("%u packets dropped by kernel\n", st.ps_drop);
+        }
+    }
+
+    print_flow_stats(n);
+    print_stream_stats(n);
+    print_latency_stats(n);
+    print_dns_stats(n);
+    print_tls_stats(n);
+    print_tls_session_stats(n);
+    print_cert_stats(n);
+    print_output_stats(n);
+
+    if (n->writer)
+    {
+        unsigned long long drops = 0;
+
+        for (int i = 0; i < n->writer->nrings; i++)
+            drops += n->writer->rings[i].drops;
+        printf("%llu packets saved to %llu file(s), %llu not saved (writer queue full)\n",
+               n->writer->packets, n->writer->files, drops);
+    }
+}
+
+// Capture loop of one worker, returns 0 or -1 on a backend error
+static int capture_worker_loop(Worker *w)
+{
+    NetShark *n = w->app;
+    capture_batch batch;
+    int status = 0;
+
+    // libpcap recycles its buffer on the next read: copy the burst out.
+    // The ring keeps the burst's blocks until the next dispatch call.
+    if (capture_batch_init(&batch, n->burst, n->backend == BACKEND_PCAP) == -1)
+    {
+        fprintf(stderr, "Couldn't allocate a capture burst of %d packets\n", n->burst);
+        return -1;
+    }
+
+    while (!stop_requested)
+    {
+        int rc = capture_dispatch(w, &batch);
+        int idle = batch.count < batch.size;
+
+        w->packets += batch.count;
+        for (int i = 0; i < batch.count; i++)
+        {
+            w->bytes += batch.slots[i].hdr.len;
+            if (w->wring)
+                writer_push(w->wring, &batch.slots[i].hdr, batch.slots[i].data);
+        }
+        capture_batch_flush(&batch, n->handler, (unsigned char *)w);
+        // Live, flows must time out even when no packet comes
+        if (idle && n->backend != BACKEND_FILE)
+        {
+            flow_advance(&w->flows, time(NULL));
+            latency_advance(&w->latency, time(NULL));
+            dns_txn_advance(&w->dns, time(NULL));
+            topk_advance(&w->top, time(NULL));
+            x509_advance(&w->certs, time(NULL));
+        }
+        // A full burst means more is coming: let the chunk fill up
+        outbuf_flush(&w->out, idle);
+
+        if (rc == PCAP_ERROR_BREAK || rc == NETPCAP_ERROR_BREAK)
+            break;
+        // End of the capture file
+        if (rc == 0 && n->backend == BACKEND_FILE)
+            break;
+        if (rc < 0)
+        {
+            fprintf(stderr, "Capture error (worker %d): %s\n", w->id,
+                    n->backend != BACKEND_PCAP ? netpcap_geterr(w->sock) : pcap_geterr(n->handle));
+            status = -1;
+            break;
+        }
+    }
+
+    flow_flush(&w->flows);
+    latency_flush(&w->latency);
+    topk_flush(&w->top);
+    x509_flush(&w->certs);
+    outbuf_flush(&w->out, 1);
+    capture_batch_free(&batch);
+    return status;
+}
+
+static void *capture_worker_main(void *arg)
+{
+    Worker *w = (Worker *)arg;
+
+    if (w->cpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "Worker %d: couldn't pin to cpu %d\n", w->id, w->cpu);
+    }
+
+    return capture_worker_loop(w) == 0 ? NULL : (void *)-1;
+}
+
+// Run one thread per worker, the calling thread only waits for signals
+static int capture_run_workers(NetShark *n)
+{
+    sigset_t set, old;
+    int status = 0;
+    int started = 0;
+
+    // Threads inherit the mask: only the main thread takes SIGINT/SIGTERM
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for (; started < n->nworkers; started++)
+    {
+        Worker *w = &n->workers[started];
+        if (pthread_create(&w->thread, NULL, capture_worker_main, w) != 0)
+        {
+            fprintf(stderr, "Couldn't start worker %d\n", w->id);
+            status = -1;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (status == -1)
+        on_signal(0);
+
+    for (int i = 0; i < started; i++)
+    {
+        void *rc;
+        pthread_join(n->workers[i].thread, &rc);
+        if (rc != NULL)
+        {
+            status = -1;
+            // One worker failing stops the whole capture
+            on_signal(0);
+        }
+    }
+    return status;
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int capture_run(NetShark *n)
+{
+    struct timespec start;
+    int status;
+
+    // Anything printed so far goes out before the output thread's writes
+    fflush(stdout);
+    capture_install_signals(n);
+    if (record_header(n->output->fd, n->format) == -1)
+    {
+        perror("Couldn't write the output header");
+        return -1;
+    }
+    if (output_start(n->output) == -1)
+        return -1;
+    if (n->writer && writer_start(n->writer) == -1)
+    {
+        output_stop(n->output);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (n->nworkers > 1)
+        status = capture_run_workers(n);
+    else
+        status = capture_worker_loop(&n->workers[0]);
+
+    double elapsed = elapsed_since(&start);
+
+    active_handle = NULL;
+    active_workers = NULL;
+    active_nworkers = 0;
+    // Waits for everything queued to reach the disk
+    if (n->writer)
+        writer_stop(n->writer);
+    // Same for the text still queued
+    output_stop(n->output);
+    if (!n->output->failed)
+        record_trailer(n->output->fd, n->format);
+    print_capture_stats(n, elapsed);
+    return status;
+}
@@ -0,0 +1,272 @@
+#include "dispatch.h"
+
+/*
+ * Single-pass dispatcher.
+ *
+ * -f takes a comma separated list of dissectors ("dns,tls,http"). Each
+ * of them is keyed on an ethertype, an IP protocol or a set of TCP/UDP
+ * ports; at startup the keys are spread over flat tables indexed by those
+ * values. Per packet, Ethernet, IPv4 and TCP/UDP are decoded once, and one
+ * table lookup per layer (two for the ports) gives the set of dissectors to
+ * run, in Proto order. The BPF filter is the union of the dissectors'
+ * expressions, so the backend only delivers packets someone wants.
+ *
+ * Dissectors with a stream function get TCP flows through the reassembly
+ * of stream.c instead: they see in-order bytes, after the dissectors of
+ * the segment itself (before them with -q).
+ */
+
+typedef enum {
+    KEY_ETHERTYPE,
+    KEY_IPPROTO,
+    KEY_TCP_PORT,
+    KEY_UDP_PORT,
+}               KeyType;
+
+typedef struct {
+    const char *name;
+    KeyType key;
+    uint16_t values[4];         // 0 ends the list
+    dissector_fn fn;
+    stream_fn stream;           // Reads reassembled TCP streams, NULL = segments only
+    const record_schema *schema;
+}               Dissector;
+
+static const Dissector dissectors[PROTO_COUNT] = {
+    [PROTO_ARP]  = { "arp",  KEY_ETHERTYPE, { ETHERTYPE_ARP },       arp_handler,  NULL,        &arp_schema },
+    [PROTO_ICMP] = { "icmp", KEY_IPPROTO,   { IPPROTO_ICMP },        icmp_handler, NULL,        &icmp_schema },
+    [PROTO_TCP]  = { "tcp",  KEY_IPPROTO,   { IPPROTO_TCP },         tcp_handler,  NULL,        &tcp_schema },
+    [PROTO_UDP]  = { "udp",  KEY_IPPROTO,   { IPPROTO_UDP },         udp_handler,  NULL,        &udp_schema },
+    [PROTO_FTP]  = { "ftp",  KEY_TCP_PORT,  { 21 },                  ftp_handler,  ftp_stream,  &ftp_schema },
+    [PROTO_HTTP] = { "http", KEY_TCP_PORT,  { 80, 8080 },            http_handler, http_stream, &http_schema },
+    [PROTO_DHCP] = { "dhcp", KEY_UDP_PORT,  { 67, 68 },              dhcp_handler, NULL,        &dhcp_schema },
+    [PROTO_DNS]  = { "dns",  KEY_UDP_PORT,  { 53 },                  dns_handler,  NULL,        &dns_schema },
+    [PROTO_MDNS] = { "mdns", KEY_UDP_PORT,  { 5353 },                mdns_handler, NULL,        &mdns_schema },
+    [PROTO_TLS]  = { "tls",  KEY_TCP_PORT,  { 443, 465, 993, 995 },  tls_handler,  tls_stream,  &tls_schema },
+};
+
+static int find_dissector(const char *name, size_t len)
+{
+    // "ssl" has always been accepted for tls
+    if (len == 3 && !strncmp(name, "ssl", 3))
+        return PROTO_TLS;
+    for (int i = 0; i < PROTO_COUNT; i++)
+    {
+        if (strlen(dissectors[i].name) == len && !strncmp(name, dissectors[i].name, len))
+            return i;
+    }
+    return -1;
+}
+
+// Appends the BPF expression matching dissector `p` to `filter`
+static int append_filter(const Dissector *p, char *filter, size_t filter_len)
+{
+    size_t used = strlen(filter);
+
+    for (int i = 0; i < 4 && p->values[i]; i++)
+    {
+        const char *sep = used ? " or " : "";
+        int len;
+
+        if (p->key == KEY_TCP_PORT)
+            len = snprintf(filter + used, filter_len - used, "%stcp port %u", sep, p->values[i]);
+        else if (p->key == KEY_UDP_PORT)
+            len = snprintf(filter + used, filter_len - used, "%sudp port %u", sep, p->values[i]);
+        else
+            len = snprintf(filter + used, filter_len - used, "%s%s", sep, p->name);
+        if (len < 0 || (size_t)len >= filter_len - used)
+            return -1;
+        used += len;
+    }
+    return 0;
+}
+
+// Parses the -f list into routing tables and the matching BPF expression.
+// Returns NULL and fills errbuf on an unknown name.
+Dispatcher *dispatch_new(const char *list, char *filter, size_t filter_len, char *errbuf)
+{
+    Dispatcher *t = calloc(1, sizeof(*t));
+    const char *s = list;
+
+    if (!t)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Out of memory");
+        return NULL;
+    }
+    filter[0] = '\0';
+    while (1)
+    {
+        size_t len = strcspn(s, ",");
+        int id = find_dissector(s, len);
+
+        if (id < 0)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "Unsupported filter: %.*s", (int)len, s);
+            free(t);
+            return NULL;
+        }
+        if (!(t->selected & (1u << id)))
+        {
+            const Dissector *p = &dissectors[id];
+
+            t->selected |= 1u << id;
+            if (p->stream)
+                t->streamed |= 1u << id;
+            for (int i = 0; i < 4 && p->values[i]; i++)
+            {
+                if (p->key == KEY_ETHERTYPE)
+                    t->ethertype[p->values[i]] |= 1u << id;
+                else if (p->key == KEY_IPPROTO)
+                    t->ipproto[p->values[i]] |= 1u << id;
+                else if (p->key == KEY_TCP_PORT)
+                    t->tcp_port[p->values[i]] |= 1u << id;
+                else
+                    t->udp_port[p->values[i]] |= 1u << id;
+            }
+            if (append_filter(p, filter, filter_len) == -1)
+            {
+                snprintf(errbuf, PCAP_ERRBUF_SIZE, "Filter list too long: %s", list);
+                free(t);
+                return NULL;
+            }
+        }
+        if (s[len] == '\0')
+            break;
+        s += len + 1;
+    }
+    return t;
+}
+
+// Fields exported by dissector `proto`
+const record_schema *dispatch_schema(int proto)
+{
+    return dissectors[proto].schema;
+}
+
+// Bounds the transport payload by what was actually captured
+static void set_payload(packet_view *v, uint32_t off, uint32_t declared)
+{
+    v->payload_off = off;
+    if (off >= v->caplen)
+        v->payload_len = 0;
+    else
+        v->payload_len = declared < v->caplen - off ? declared : v->caplen - off;
+}
+
+// pcap_handler run over every packet: `user` is the Worker
+void dispatch_packet(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *frame)
+{
+    Worker *w = (Worker *)user;
+    const Dispatcher *t = w->app->dispatch;
+    packet_view v;
+    uint32_t run;
+    uint32_t streamed = 0;
+    int len;
+
+    v.hdr = hdr;
+    v.frame = frame;
+    v.caplen = hdr->caplen;
+    v.flow = NULL;
+    latency_advance(&w->latency, hdr->ts.tv_sec);
+    dns_txn_advance(&w->dns, hdr->ts.tv_sec);
+    topk_advance(&w->top, hdr->ts.tv_sec);
+    x509_advance(&w->certs, hdr->ts.tv_sec);
+
+    len = parse_ethernet_header(frame, v.caplen, &v.ether);
+    if (len < 0)
+        return;
+    v.l3_off = len;
+    set_payload(&v, len, v.caplen);
+    run = t->ethertype[v.ether.ethertype];
+
+    if (v.ether.ethertype == ETHERTYPE_IPV4)
+    {
+        len = parse_ip_header(frame + v.l3_off, v.caplen - v.l3_off, &v.ip);
+        if (len < 20 || v.ip.version != 4)
+            return;
+        uint32_t l4_off = v.l3_off + len;
+        uint32_t l4_len = v.ip.total_len > len ? v.ip.total_len - len : 0;
+
+        run |= t->ipproto[v.ip.protocol];
+        set_payload(&v, l4_off, l4_len);
+
+        // Ports only mean something in the first fragment
+        if ((v.ip.frag_off & 0x1fff) == 0 && l4_off < v.caplen)
+        {
+            if (v.ip.protocol == IPPROTO_TCP)
+            {
+                len = parse_tcp_header(frame + l4_off, v.caplen - l4_off, &v.ip, &v.tcp);
+                if (len < 0)
+                    return;
+                run |= t->tcp_port[v.tcp.src_port] | t->tcp_port[v.tcp.dst_port];
+                set_payload(&v, l4_off + len, v.tcp.data_len);
+            }
+            else if (v.ip.protocol == IPPROTO_UDP)
+            {
+                len = parse_udp_header(frame + l4_off, v.caplen - l4_off, &v.ip, &v.udp);
+                if (len < 0)
+                    return;
+                run |= t->udp_port[v.udp.src_port] | t->udp_port[v.udp.dst_port];
+                set_payload(&v, l4_off + len, v.udp.data_len);
+            }
+        }
+        else
+            run &= ~((1u << PROTO_TCP) | (1u << PROTO_UDP));
+
+        v.flow = flow_update(&w->flows, &v, &v.flow_side);
+
+        // The TCP application dissectors read the flow's stream instead
+        // of the segment, the most specific one when several want it
+        streamed = run & t->streamed;
+        if (streamed && v.flow
+            && stream_attach(&w->streams, &v.flow->stream, dissectors[31 - __builtin_clz(streamed)].stream))
+            run &= ~streamed;
+        else
+            streamed = 0;
+    }
+
+    // The text of all the dissectors is printed or dropped as a whole
+    ob_begin(&w->out);
+    if (w->out.format != OUTPUT_TEXT)
+    {
+        // One record per packet, a section per dissector
+        record_begin(&w->out, &v);
+        while (run)
+        {
+            int id = __builtin_ctz(run);
+
+            dissectors[id].fn(w, &v);
+            run &= run - 1;
+        }
+        if (streamed)
+            stream_segment(&w->streams, v.flow->stream, &v);
+        record_end(&w->out);
+    }
+    else if (w->app->quiet)
+    {
+        // One line per packet: the most specific dissector with something
+        // to say about it writes it
+        if (streamed)
+            stream_segment(&w->streams, v.flow->stream, &v);
+        while (run && ob_packet_empty(&w->out))
+        {
+            int id = 31 - __builtin_clz(run);
+
+            dissectors[id].fn(w, &v);
+            run &= ~(1u << id);
+        }
+    }
+    else
+    {
+        while (run)
+        {
+            int id = __builtin_ctz(run);
+
+            dissectors[id].fn(w, &v);
+            run &= run - 1;
+        }
+        if (streamed)
+            stream_segment(&w->streams, v.flow->stream, &v);
+    }
+    ob_end(&w->out);
+}
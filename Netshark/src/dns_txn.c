@@ -0,0 +1,212 @@
+#include "dns_txn.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * DNS transactions of one worker (--latency).
+ *
+ * dns_handler hands every query and response to port 53 here. A response
+ * answers the query with the same client address and port, server, ID and
+ * question name; its round trip goes into the latency histograms of the
+ * resolver under its rcode. Queries still waiting after DNS_TXN_TIMEOUT
+ * seconds of capture time are counted as timeouts of the resolver.
+ */
+
+#define INDEX_SLOTS     (2 * DNS_TXN_MAX)
+#define RING_MASK       (DNS_TXN_MAX - 1)
+
+int dns_txn_init(dns_txn_table *t, latency_table *latency)
+{
+    memset(t, 0, sizeof(*t));
+    t->latency = latency;
+    t->ring = malloc(DNS_TXN_MAX * sizeof(dns_txn));
+    t->index = malloc(INDEX_SLOTS * sizeof(uint32_t));
+    if (!t->ring || !t->index)
+    {
+        dns_txn_free(t);
+        return -1;
+    }
+    memset(t->index, 0xff, INDEX_SLOTS * sizeof(uint32_t));
+    return 0;
+}
+
+void dns_txn_free(dns_txn_table *t)
+{
+    free(t->ring);
+    free(t->index);
+    t->ring = NULL;
+    t->index = NULL;
+}
+
+/*** Index ***/
+
+static uint32_t key_hash(const dns_txn_key *k)
+{
+    uint64_t a = (uint64_t)k->client << 32 | k->server;
+    uint64_t b = (uint64_t)k->qname << 32 | (uint32_t)k->port << 16 | k->id;
+    uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ (b + 0x632be59bd9b4e019ULL) * 0xc2b2ae3d27d4eb4fULL;
+
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+static int key_equal(const dns_txn_key *a, const dns_txn_key *b)
+{
+    return a->client == b->client && a->server == b->server && a->port == b->port
+        && a->id == b->id && a->qname == b->qname;
+}
+
+// Slot of the pending query with key `k`, DNS_TXN_NONE when there is none
+static uint32_t index_find(const dns_txn_table *t, const dns_txn_key *k, uint32_t hash)
+{
+    for (uint32_t i = hash & (INDEX_SLOTS - 1);; i = (i + 1) & (INDEX_SLOTS - 1))
+    {
+        const dns_txn *e;
+
+        if (t->index[i] == DNS_TXN_NONE)
+            return DNS_TXN_NONE;
+        e = &t->ring[t->index[i]];
+        if (e->hash == hash && key_equal(&e->key, k))
+            return i;
+    }
+}
+
+// Slot pointing at ring position `pos`, which must be in the index
+static uint32_t index_slot(const dns_txn_table *t, uint32_t pos)
+{
+    uint32_t i = t->ring[pos].hash & (INDEX_SLOTS - 1);
+
+    while (t->index[i] != pos)
+        i = (i + 1) & (INDEX_SLOTS - 1);
+    return i;
+}
+
+// Empties slot `i`, moving back the entries after it that probed past it
+// so that every lookup still finds them
+static void index_remove(dns_txn_table *t, uint32_t i)
+{
+    uint32_t j = i;
+
+    for (;;)
+    {
+        uint32_t home;
+
+        j = (j + 1) & (INDEX_SLOTS - 1);
+        if (t->index[j] == DNS_TXN_NONE)
+            break;
+        home = t->ring[t->index[j]].hash & (INDEX_SLOTS - 1);
+        // Leave it when its home is in (i, j], cyclically
+        if (((j - home) & (INDEX_SLOTS - 1)) < ((j - i) & (INDEX_SLOTS - 1)))
+            continue;
+        t->index[i] = t->index[j];
+        i = j;
+    }
+    t->index[i] = DNS_TXN_NONE;
+}
+
+/*** Transactions ***/
+
+// Answered queries at the front of the ring can go
+static void ring_trim(dns_txn_table *t)
+{
+    while (t->head != t->tail && !t->ring[t->head & RING_MASK].pending)
+        t->head++;
+}
+
+static size_t resolver_name(const dns_txn *e, char *name)
+{
+    inet_ntop(AF_INET, &e->key.server, name, INET_ADDRSTRLEN);
+    return strlen(name);
+}
+
+static void resolver_add(dns_txn_table *t, const dns_txn *e, int code, uint64_t now)
+{
+    char name[INET_ADDRSTRLEN];
+    uint64_t us = now > e->sent_us ? now - e->sent_us : 0;
+    size_t len = resolver_name(e, name);
+
+    latency_add(t->latency, LATENCY_DNS, (const unsigned char *)name, len, code, now / 1000000, &us);
+}
+
+void dns_txn_query(dns_txn_table *t, const dns_txn_key *k, uint64_t now)
+{
+    uint32_t hash = key_hash(k);
+    uint32_t i;
+    dns_txn *e;
+
+    t->queries++;
+    if (index_find(t, k, hash) != DNS_TXN_NONE)
+    {
+        t->retransmits++;
+        return;
+    }
+    if (t->tail - t->head == DNS_TXN_MAX)
+    {
+        e = &t->ring[t->head & RING_MASK];
+        if (e->pending)
+        {
+            index_remove(t, index_slot(t, t->head & RING_MASK));
+            t->dropped++;
+        }
+        t->head++;
+        ring_trim(t);
+    }
+    e = &t->ring[t->tail & RING_MASK];
+    e->key = *k;
+    e->hash = hash;
+    e->pending = 1;
+    e->sent_us = now;
+    for (i = hash & (INDEX_SLOTS - 1); t->index[i] != DNS_TXN_NONE; i = (i + 1) & (INDEX_SLOTS - 1))
+        ;
+    t->index[i] = t->tail & RING_MASK;
+    t->tail++;
+}
+
+void dns_txn_response(dns_txn_table *t, const dns_txn_key *k, int rcode, uint64_t now)
+{
+    uint32_t i = index_find(t, k, key_hash(k));
+    dns_txn *e;
+
+    if (i == DNS_TXN_NONE)
+    {
+        t->unmatched++;
+        return;
+    }
+    e = &t->ring[t->index[i]];
+    e->pending = 0;
+    index_remove(t, i);
+    t->answered++;
+    if (rcode < DNS_TXN_RCODES)
+        t->rcode[rcode]++;
+    resolver_add(t, e, rcode, now);
+    ring_trim(t);
+}
+
+// Queries seen DNS_TXN_TIMEOUT seconds or more before the start of second
+// `sec` won't be answered any more
+void dns_txn_expire(dns_txn_table *t, uint64_t sec)
+{
+    while (t->head != t->tail)
+    {
+        uint32_t pos = t->head & RING_MASK;
+        dns_txn *e = &t->ring[pos];
+
+        if (e->pending)
+        {
+            char name[INET_ADDRSTRLEN];
+            size_t len;
+
+            if (e->sent_us + DNS_TXN_TIMEOUT * 1000000ULL > sec * 1000000)
+                break;
+            index_remove(t, index_slot(t, pos));
+            e->pending = 0;
+            t->timeouts++;
+            len = resolver_name(e, name);
+            latency_timeout(t->latency, LATENCY_DNS, (const unsigned char *)name, len, sec);
+        }
+        t->head++;
+    }
+}
@@ -0,0 +1,567 @@
+#include "flow.h"
+#include "dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+/*
+ * Per-worker flow table.
+ *
+ * The dispatcher hands every IPv4 packet to flow_update(), which finds or
+ * creates its flow and updates the counters. The timing wheel runs on
+ * capture time, one slot per second: flows are reported (with --flows)
+ * and released when idle, reported and restarted when active for too long,
+ * and released soon after a TCP close.
+ */
+
+#define FLOW_BUCKET_FULL    ((1u << FLOW_BUCKET_SLOTS) - 1)
+
+// Flow report exported with --format, see record.h
+typedef struct {
+    struct timeval first;
+    struct timeval last;
+    uint8_t proto;
+    struct in_addr client;
+    struct in_addr server;
+    uint16_t client_port;
+    uint16_t server_port;
+    uint64_t client_packets;
+    uint64_t server_packets;
+    uint64_t client_bytes;
+    uint64_t server_bytes;
+    uint8_t client_flags;
+    uint8_t server_flags;
+    const char *end;
+}               flow_report;
+
+static const field_desc flow_fields[] = {
+    FIELD(flow_report, first, FIELD_TS),
+    FIELD(flow_report, last, FIELD_TS),
+    FIELD(flow_report, proto, FIELD_UINT),
+    FIELD(flow_report, client, FIELD_IP4),
+    FIELD(flow_report, server, FIELD_IP4),
+    FIELD(flow_report, client_port, FIELD_UINT),
+    FIELD(flow_report, server_port, FIELD_UINT),
+    FIELD(flow_report, client_packets, FIELD_UINT),
+    FIELD(flow_report, server_packets, FIELD_UINT),
+    FIELD(flow_report, client_bytes, FIELD_UINT),
+    FIELD(flow_report, server_bytes, FIELD_UINT),
+    FIELD(flow_report, client_flags, FIELD_UINT),
+    FIELD(flow_report, server_flags, FIELD_UINT),
+    FIELD(flow_report, end, FIELD_STR),
+};
+
+RECORD_SCHEMA_DEF(flow_schema, PROTO_COUNT + 1, "flow", flow_fields);
+
+static const char *flow_end_str[] = {
+    [FLOW_END_IDLE]    = "idle",
+    [FLOW_END_ACTIVE]  = "active",
+    [FLOW_END_CLOSED]  = "closed",
+    [FLOW_END_CAPTURE] = "end",
+};
+
+/*** Hashing ***/
+
+// Mixes the canonical key. Both directions have the same key, hence the
+// same hash: the table is symmetric without hashing twice.
+static uint32_t flow_hash(const flow_key *k)
+{
+    uint64_t a = (uint64_t)k->addr[0] << 32 | k->addr[1];
+    uint64_t b = (uint64_t)k->port[0] << 32 | (uint64_t)k->port[1] << 16 | k->proto;
+    uint64_t h = a * 0x9e3779b97f4a7c15ULL ^ (b + 0x632be59bd9b4e019ULL) * 0xc2b2ae3d27d4eb4fULL;
+
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+// Fills the key of the packet, returns the side of the key the packet
+// was sent from
+static uint8_t flow_key_of(const packet_view *v, flow_key *k)
+{
+    uint32_t src = v->ip.src.s_addr, dst = v->ip.dst.s_addr;
+    uint16_t sport = 0, dport = 0;
+
+    // Ports only in first fragments, like the dispatcher
+    if ((v->ip.frag_off & 0x1fff) == 0)
+    {
+        if (v->ip.protocol == IPPROTO_TCP)
+        {
+            sport = v->tcp.src_port;
+            dport = v->tcp.dst_port;
+        }
+        else if (v->ip.protocol == IPPROTO_UDP)
+        {
+            sport = v->udp.src_port;
+            dport = v->udp.dst_port;
+        }
+    }
+
+    uint8_t side = ntohl(src) > ntohl(dst) || (src == dst && sport > dport);
+
+    k->addr[side] = src;
+    k->addr[!side] = dst;
+    k->port[side] = sport;
+    k->port[!side] = dport;
+    k->proto = v->ip.protocol;
+    memset(k->pad, 0, sizeof(k->pad));
+    return side;
+}
+
+// Slots of bucket `b` whose hash is `hash`, one bit each
+static unsigned int bucket_match(const flow_bucket *b, uint32_t hash)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // The 8th lane is index[0]: masked out by `used`
+    __m128i h = _mm_set1_epi32(hash);
+    __m128i lo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)b->hash), h);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(b->hash + 4)), h);
+    unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(lo))
+                      | _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4;
+
+    return mask & b->used;
+#else
+    unsigned int mask = 0;
+
+    for (int i = 0; i < FLOW_BUCKET_SLOTS; i++)
+        mask |= (unsigned int)(b->hash[i] == hash) << i;
+    return mask & b->used;
+#endif
+}
+
+/*** Table ***/
+
+int flow_table_init(flow_table *t, uint32_t max, uint32_t idle, uint32_t active)
+{
+    uint32_t nbuckets = 1;
+
+    memset(t, 0, sizeof(*t));
+    // At most ~70% of the slots used when the table is full
+    while (nbuckets * 5 < max)
+        nbuckets <<= 1;
+    if (posix_memalign((void **)&t->buckets, 64, (size_t)nbuckets * sizeof(flow_bucket)) != 0)
+    {
+        t->buckets = NULL;
+        return -1;
+    }
+    memset(t->buckets, 0, (size_t)nbuckets * sizeof(flow_bucket));
+    t->flows = calloc(max, sizeof(flow));
+    if (!t->flows)
+    {
+        free(t->buckets);
+        t->buckets = NULL;
+        return -1;
+    }
+    t->bucket_mask = nbuckets - 1;
+    t->max = max;
+    t->free_list = FLOW_NONE;
+    t->idle = idle;
+    t->active = active;
+    for (int i = 0; i < FLOW_WHEEL_SLOTS; i++)
+        t->wheel[i] = FLOW_NONE;
+    return 0;
+}
+
+void flow_table_free(flow_table *t)
+{
+    free(t->buckets);
+    free(t->flows);
+    memset(t, 0, sizeof(*t));
+}
+
+static flow *flow_find(flow_table *t, const flow_key *k, uint32_t hash)
+{
+    uint32_t b = hash & t->bucket_mask;
+
+    for (uint32_t probes = 0; probes <= t->bucket_mask; probes++)
+    {
+        const flow_bucket *bucket = &t->buckets[b];
+        unsigned int match = bucket_match(bucket, hash);
+
+        while (match)
+        {
+            flow *f = &t->flows[bucket->index[__builtin_ctz(match)]];
+
+            if (memcmp(&f->key, k, sizeof(*k)) == 0)
+                return f;
+            match &= match - 1;
+        }
+        // Nothing was ever pushed past this bucket
+        if (bucket->overflow == 0)
+            return NULL;
+        b = (b + 1) & t->bucket_mask;
+    }
+    return NULL;
+}
+
+// Stores flow `idx` in the first bucket with a free slot
+static void bucket_insert(flow_table *t, uint32_t idx, uint32_t hash)
+{
+    uint32_t b = hash & t->bucket_mask;
+
+    // The table holds fewer flows than slots: a free one exists
+    while (t->buckets[b].used == FLOW_BUCKET_FULL)
+    {
+        t->buckets[b].overflow++;
+        b = (b + 1) & t->bucket_mask;
+    }
+
+    flow_bucket *bucket = &t->buckets[b];
+    int slot = __builtin_ctz(~bucket->used);
+
+    bucket->hash[slot] = hash;
+    bucket->index[slot] = idx;
+    bucket->used |= 1u << slot;
+}
+
+static void bucket_remove(flow_table *t, uint32_t idx, uint32_t hash)
+{
+    uint32_t b = hash & t->bucket_mask;
+
+    for (;;)
+    {
+        flow_bucket *bucket = &t->buckets[b];
+        unsigned int match = bucket_match(bucket, hash);
+
+        while (match)
+        {
+            int slot = __builtin_ctz(match);
+
+            if (bucket->index[slot] == idx)
+            {
+                bucket->used &= ~(1u << slot);
+                return;
+            }
+            match &= match - 1;
+        }
+        // Passed over while full when the flow was inserted
+        bucket->overflow--;
+        b = (b + 1) & t->bucket_mask;
+    }
+}
+
+/*** Timing wheel ***/
+
+static void timer_link(flow_table *t, flow *f, uint64_t sec)
+{
+    uint32_t idx = f - t->flows;
+    uint32_t *head = &t->wheel[sec & (FLOW_WHEEL_SLOTS - 1)];
+
+    f->timer_slot = sec & (FLOW_WHEEL_SLOTS - 1);
+    f->timer_prev = FLOW_NONE;
+    f->timer_next = *head;
+    if (*head != FLOW_NONE)
+        t->flows[*head].timer_prev = idx;
+    *head = idx;
+}
+
+static void timer_unlink(flow_table *t, flow *f)
+{
+    if (f->timer_prev != FLOW_NONE)
+        t->flows[f->timer_prev].timer_next = f->timer_next;
+    else
+        t->wheel[f->timer_slot] = f->timer_next;
+    if (f->timer_next != FLOW_NONE)
+        t->flows[f->timer_next].timer_prev = f->timer_prev;
+}
+
+// Second at which the flow ends or must be reported
+static uint64_t flow_deadline(const flow_table *t, const flow *f)
+{
+    uint64_t last = f->last_us / 1000000;
+    uint64_t active = f->first_us / 1000000 + t->active;
+
+    if (f->closed)
+        return last + FLOW_CLOSED_TIMEOUT;
+    // Nothing since the last active report: only the idle timeout is left
+    if ((f->packets[0] | f->packets[1]) == 0)
+        return last + t->idle;
+    return last + t->idle < active ? last + t->idle : active;
+}
+
+/*** Reports ***/
+
+static void flow_print_flags(outbuf *ob, uint8_t flags)
+{
+    // tcpdump's letters, '.' for ACK
+    static const char letters[] = "FSRP.U";
+    int any = 0;
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (flags & (1u << i))
+        {
+            ob_putc(ob, letters[i]);
+            any = 1;
+        }
+    }
+    if (!any)
+        ob_putc(ob, '-');
+}
+
+// "12:00:00.000000 FLOW TCP 10.0.0.1:50000 > 10.0.0.2:80 pkts 5/4 bytes
+// 400/3000 dur 0.120000 flags SP./S.F closed", the client first
+static void flow_print(flow_table *t, const flow *f, flow_end why)
+{
+    outbuf *ob = t->out;
+    uint8_t c = f->client, s = !f->client;
+    struct timeval last = { f->last_us / 1000000, f->last_us % 1000000 };
+
+    ob_timestamp(ob, &last);
+    ob_str(ob, " FLOW ");
+    if (f->key.proto == IPPROTO_TCP)
+        ob_str(ob, "TCP ");
+    else if (f->key.proto == IPPROTO_UDP)
+        ob_str(ob, "UDP ");
+    else if (f->key.proto == IPPROTO_ICMP)
+        ob_str(ob, "ICMP ");
+    else
+    {
+        ob_str(ob, "proto ");
+        ob_u64(ob, f->key.proto);
+        ob_putc(ob, ' ');
+    }
+    ob_ip4(ob, &f->key.addr[c]);
+    if (f->key.port[c] || f->key.port[s])
+    {
+        ob_putc(ob, ':');
+        ob_u64(ob, f->key.port[c]);
+    }
+    ob_str(ob, " > ");
+    ob_ip4(ob, &f->key.addr[s]);
+    if (f->key.port[c] || f->key.port[s])
+    {
+        ob_putc(ob, ':');
+        ob_u64(ob, f->key.port[s]);
+    }
+    ob_str(ob, " pkts ");
+    ob_u64(ob, f->packets[c]);
+    ob_putc(ob, '/');
+    ob_u64(ob, f->packets[s]);
+    ob_str(ob, " bytes ");
+    ob_u64(ob, f->bytes[c]);
+    ob_putc(ob, '/');
+    ob_u64(ob, f->bytes[s]);
+    ob_str(ob, " dur ");
+    ob_seconds(ob, f->last_us - f->first_us);
+    if (f->key.proto == IPPROTO_TCP)
+    {
+        ob_str(ob, " flags ");
+        flow_print_flags(ob, f->tcp_flags[c]);
+        ob_putc(ob, '/');
+        flow_print_flags(ob, f->tcp_flags[s]);
+    }
+    ob_putc(ob, ' ');
+    ob_str(ob, flow_end_str[why]);
+    ob_putc(ob, '\n');
+}
+
+static void flow_report_out(flow_table *t, const flow *f, flow_end why)
+{
+    outbuf *ob = t->out;
+
+    if (ob == NULL || f->packets[0] + f->packets[1] == 0)
+        return;
+
+    ob_begin(ob);
+    if (ob->format == OUTPUT_TEXT)
+        flow_print(t, f, why);
+    else
+    {
+        uint8_t c = f->client, s = !f->client;
+        flow_report r;
+
+        r.first.tv_sec = f->first_us / 1000000;
+        r.first.tv_usec = f->first_us % 1000000;
+        r.last.tv_sec = f->last_us / 1000000;
+        r.last.tv_usec = f->last_us % 1000000;
+        r.proto = f->key.proto;
+        r.client.s_addr = f->key.addr[c];
+        r.server.s_addr = f->key.addr[s];
+        r.client_port = f->key.port[c];
+        r.server_port = f->key.port[s];
+        r.client_packets = f->packets[c];
+        r.server_packets = f->packets[s];
+        r.client_bytes = f->bytes[c];
+        r.server_bytes = f->bytes[s];
+        r.client_flags = f->tcp_flags[c];
+        r.server_flags = f->tcp_flags[s];
+        r.end = flow_end_str[why];
+        record_object(ob, &flow_schema, &r);
+    }
+    ob_end(ob);
+}
+
+// Reports the flow and takes it out of the table
+static void flow_release(flow_table *t, flow *f, flow_end why)
+{
+    uint32_t idx = f - t->flows;
+
+    flow_report_out(t, f, why);
+    if (f->stream)
+        stream_close(t->streams, f->stream);
+    bucket_remove(t, idx, f->hash);
+    f->timer_next = t->free_list;
+    t->free_list = idx;
+    t->count--;
+    t->ended++;
+}
+
+/*** Packets ***/
+
+static flow *flow_create(flow_table *t, const flow_key *k, uint32_t hash)
+{
+    uint32_t idx;
+
+    if (t->free_list != FLOW_NONE)
+    {
+        idx = t->free_list;
+        t->free_list = t->flows[idx].timer_next;
+    }
+    else if (t->hwm < t->max)
+        idx = t->hwm++;
+    else
+        return NULL;
+
+    flow *f = &t->flows[idx];
+
+    memset(f, 0, sizeof(*f));
+    f->key = *k;
+    f->hash = hash;
+    bucket_insert(t, idx, hash);
+    t->count++;
+    t->created++;
+    return f;
+}
+
+// Accounts the packet to its flow, created on its first packet. Returns
+// NULL when the table is full. `side` is the side of the key the packet
+// comes from.
+flow *flow_update(flow_table *t, const packet_view *v, uint8_t *side)
+{
+    flow_key k;
+    uint8_t s = flow_key_of(v, &k);
+    uint32_t hash = flow_hash(&k);
+    uint64_t now = (uint64_t)v->hdr->ts.tv_sec * 1000000 + v->hdr->ts.tv_usec;
+    uint8_t tcp_flags = 0;
+    int fresh = 0;
+    int start;
+    flow *f;
+
+    flow_advance(t, v->hdr->ts.tv_sec);
+    if (k.proto == IPPROTO_TCP && (k.port[0] | k.port[1]))
+        tcp_flags = v->tcp.flags;
+
+    f = flow_find(t, &k, hash);
+    // A new connection reusing the ports of a closed one
+    if (f && f->closed && (tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN)
+    {
+        timer_unlink(t, f);
+        flow_release(t, f, FLOW_END_CLOSED);
+        f = NULL;
+    }
+    if (f == NULL)
+    {
+        f = flow_create(t, &k, hash);
+        if (f == NULL)
+        {
+            t->full++;
+            return NULL;
+        }
+        f->client = s;
+        fresh = 1;
+    }
+
+    // First packet of the flow, or after an active report: opens the
+    // interval the active timeout counts from
+    start = (f->packets[0] | f->packets[1]) == 0;
+    if (start)
+        f->first_us = now;
+    f->last_us = now;
+    f->packets[s]++;
+    f->bytes[s] += v->hdr->len;
+    if (tcp_flags)
+    {
+        f->tcp_flags[s] |= tcp_flags;
+        if (!f->closed && ((tcp_flags & TH_RST) || (f->tcp_flags[0] & f->tcp_flags[1] & TH_FIN)))
+            f->closed = start = 1;
+    }
+    // The wheel only pushes deadlines back, so an earlier one means moving
+    if (start)
+    {
+        if (!fresh)
+            timer_unlink(t, f);
+        timer_link(t, f, flow_deadline(t, f));
+    }
+    *side = s;
+    return f;
+}
+
+// Handles the wheel's slots up to second `now`: flows past their deadline
+// are reported, the others wait in the slot of their new deadline
+void flow_expire(flow_table *t, uint64_t now)
+{
+    if (t->tick == 0)
+    {
+        t->tick = now;
+        return;
+    }
+
+    uint64_t steps = now - t->tick;
+
+    // After a long gap every slot is due once
+    if (steps > FLOW_WHEEL_SLOTS)
+        steps = FLOW_WHEEL_SLOTS;
+    for (uint64_t i = 1; i <= steps; i++)
+    {
+        uint32_t *head = &t->wheel[(t->tick + i) & (FLOW_WHEEL_SLOTS - 1)];
+        uint32_t idx = *head;
+
+        // Flows put back in this slot go on a new list
+        *head = FLOW_NONE;
+        while (idx != FLOW_NONE)
+        {
+            flow *f = &t->flows[idx];
+            uint64_t deadline = flow_deadline(t, f);
+
+            idx = f->timer_next;
+            if (deadline > now)
+                timer_link(t, f, deadline);
+            else if (f->closed)
+                flow_release(t, f, FLOW_END_CLOSED);
+            else if (f->last_us / 1000000 + t->idle <= now)
+                flow_release(t, f, FLOW_END_IDLE);
+            else
+            {
+                // Active timeout: report what was counted so far, go on
+                flow_report_out(t, f, FLOW_END_ACTIVE);
+                memset(f->packets, 0, sizeof(f->packets));
+                memset(f->bytes, 0, sizeof(f->bytes));
+                deadline = flow_deadline(t, f);
+                timer_link(t, f, deadline > now ? deadline : now + 1);
+            }
+        }
+    }
+    t->tick = now;
+}
+
+// End of the capture: reports every flow still open
+void flow_flush(flow_table *t)
+{
+    for (int i = 0; i < FLOW_WHEEL_SLOTS; i++)
+    {
+        uint32_t idx = t->wheel[i];
+
+        t->wheel[i] = FLOW_NONE;
+        while (idx != FLOW_NONE)
+        {
+            flow *f = &t->flows[idx];
+
+            idx = f->timer_next;
+            flow_release(t, f, FLOW_END_CAPTURE);
+        }
+    }
+}
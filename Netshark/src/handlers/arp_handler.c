@@ -1,44 +1,79 @@
 #include "arp.h"
+#include "dispatch.h"
 
-void print_arp_packet(const unsigned char *packet, uint32_t wire_len, const arp_packet *p) {
-    puts("\n=== ARP Packet ===");
+void print_arp_packet(outbuf *ob, const packet_view *v, const arp_packet *p) {
+    ob_puts(ob, "\n=== ARP Packet ===");
 
-    printf("Src MAC          : %s\n", p->ether.src_mac);
-    printf("Dst MAC          : %s\n", p->ether.dst_mac);
-    printf("EtherType        : 0x%04x\n", p->ether.ethertype);
-    puts("");
+    ob_field_mac(ob, "Src MAC          : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC          : ", v->ether.dst);
+    ob_field_hex(ob, "EtherType        : ", v->ether.ethertype, 4);
+    ob_puts(ob, "");
 
-    printf("Hardware Type    : %s (%u)\n",
+    ob_printf(ob, "Hardware Type    : %s (%u)\n",
            p->hardware_type == ARP_HARDWARE_TYPE_ETHERNET ? "Ethernet" : "Other",
            p->hardware_type);
-    printf("Protocol Type    : 0x%04x\n", p->protocol_type);
-    printf("HW Addr Length   : %u bytes\n", p->hardware_size);
-    printf("Proto Addr Length: %u bytes\n", p->protocol_size);
-    printf("Operation        : %s (%u)\n",
+    ob_field_hex(ob, "Protocol Type    : ", p->protocol_type, 4);
+    ob_field_bytes(ob, "HW Addr Length   : ", p->hardware_size);
+    ob_field_bytes(ob, "Proto Addr Length: ", p->protocol_size);
+    ob_printf(ob, "Operation        : %s (%u)\n",
            p->operation == ARP_REQUEST ? "Request" :
            p->operation == ARP_REPLY   ? "Reply"   : "Unknown",
            p->operation);
-    printf("Sender MAC       : %s\n", p->sender_mac);
-    printf("Sender IP        : %s\n", p->sender_ip);
-    printf("Target MAC       : %s\n", p->target_mac);
-    printf("Target IP        : %s\n", p->target_ip);
-    puts("");
+    ob_field_mac(ob, "Sender MAC       : ", p->sender_mac);
+    ob_field_ip4(ob, "Sender IP        : ", p->sender_ip);
+    ob_field_mac(ob, "Target MAC       : ", p->target_mac);
+    ob_field_ip4(ob, "Target IP        : ", p->target_ip);
+    ob_puts(ob, "");
 
-    printf("Total on wire    : %u bytes\n", wire_len);
-    printf("Raw Bytes        : ");
-    dump_hex_single_line(packet, wire_len);
+    ob_field_bytes(ob, "Total on wire    : ", v->caplen);
+    print_raw_bytes(ob, "Raw Bytes        : ", v);
 
-    puts("\n===========================\n");
+    ob_puts(ob, "\n===========================\n");
 }
 
-void arp_handler(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *frame) {
-    (void)user;
-    arp_packet pkt;
-    uint32_t framelen = hdr->len;
+// -q: "ARP who-has 10.0.0.2 tell 10.0.0.1" or "ARP 10.0.0.2 is-at MAC"
+void summarize_arp_packet(outbuf *ob, const packet_view *v, const arp_packet *p) {
+    print_summary_head(ob, v, "ARP");
+    if (p->operation == ARP_REQUEST) {
+        ob_str(ob, "who-has ");
+        ob_ip4(ob, p->target_ip);
+        ob_str(ob, " tell ");
+        ob_ip4(ob, p->sender_ip);
+    } else if (p->operation == ARP_REPLY) {
+        ob_ip4(ob, p->sender_ip);
+        ob_str(ob, " is-at ");
+        ob_mac(ob, p->sender_mac);
+    } else {
+        ob_str(ob, "op ");
+        ob_u64(ob, p->operation);
+    }
+    ob_putc(ob, '\n');
+}
+
+static const field_desc arp_fields[] = {
+    FIELD(arp_packet, hardware_type, FIELD_UINT),
+    FIELD(arp_packet, protocol_type, FIELD_UINT),
+    FIELD(arp_packet, hardware_size, FIELD_UINT),
+    FIELD(arp_packet, protocol_size, FIELD_UINT),
+    FIELD(arp_packet, operation, FIELD_UINT),
+    FIELD(arp_packet, sender_mac, FIELD_MAC_PTR),
+    FIELD(arp_packet, sender_ip, FIELD_IP4_PTR),
+    FIELD(arp_packet, target_mac, FIELD_MAC_PTR),
+    FIELD(arp_packet, target_ip, FIELD_IP4_PTR),
+};
 
-    int offset = parse_ethernet_header(frame, framelen, &pkt.ether);
+RECORD_SCHEMA_DEF(arp_schema, PROTO_ARP + 1, "arp", arp_fields);
+
+void arp_handler(Worker *w, const packet_view *v) {
+    arp_packet pkt;
 
-    if (parse_arp_packet(frame + offset, framelen - offset, &pkt) >= 0)
-        print_arp_packet(frame, framelen, &pkt);
+    if (parse_arp_packet(v->frame + v->l3_off, v->caplen - v->l3_off, &v->ether, &pkt) < 0)
+        return;
+    if (w->out.format != OUTPUT_TEXT)
+        record_add(&w->out, &arp_schema, &pkt);
+    else if (w->app->quiet)
+        summarize_arp_packet(&w->out, v, &pkt);
+    else
+        print_arp_packet(&w->out, v, &pkt);
     // silently ignore otherwise
 }
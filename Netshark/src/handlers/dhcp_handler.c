@@ -1,4 +1,5 @@
 #include "dhcp.h"
+#include "dispatch.h"
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -18,77 +19,163 @@ int parse_dhcp_packet(const unsigned char *data, size_t len, dhcp_packet *out) {
     out->siaddr = *(uint32_t *)(data + 20);
     out->giaddr = *(uint32_t *)(data + 24);
 
-    mac_to_str((const uint8_t *)(data + 28), (char *)out->chaddr, sizeof(out->chaddr));
-    memcpy(out->sname, data + 44, 64);
-    memcpy(out->file, data + 108, 128);
-    memcpy(out->options, data + 240, len - 240);
+    out->chaddr = data + 28;
+    out->sname = data + 44;
+    out->file = data + 108;
+    out->options = data + 236;
+    out->options_len = len - 236;
 
     out->total_len = len;
 
     return 0;
 }
 
-void print_dhcp_packet(const unsigned char *packet, uint32_t wire_len, const dhcp_packet *p) {
-    printf("=== DHCP Packet ===");
-    printf("Src MAC        : %s\n", p->udp.ether.src_mac);
-    printf("Dst MAC        : %s\n", p->udp.ether.dst_mac);
-    printf("Ethertype      : 0x%04x\n\n", p->udp.ether.ethertype);
+void print_dhcp_packet(outbuf *ob, const packet_view *v, const dhcp_packet *p) {
+    ob_str(ob, "=== DHCP Packet ===");
+    ob_field_mac(ob, "Src MAC        : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC        : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype      : ", v->ether.ethertype, 4);
+    ob_putc(ob, '\n');
 
-    printf("Source IP      : %s\n", p->udp.ip.src);
-    printf("Destination IP : %s\n\n", p->udp.ip.dst);
+    ob_field_ip4(ob, "Source IP      : ", &v->ip.src);
+    ob_field_ip4(ob, "Destination IP : ", &v->ip.dst);
+    ob_putc(ob, '\n');
 
-    printf("Source Port    : %u\n", p->udp.src_port);
-    printf("Dest Port      : %u\n\n", p->udp.dst_port);
+    ob_field_u(ob, "Source Port    : ", v->udp.src_port);
+    ob_field_u(ob, "Dest Port      : ", v->udp.dst_port);
+    ob_putc(ob, '\n');
 
-    printf("OP Code        : %u (%s)\n", p->op, (p->op == 1 ? "BOOTREQUEST" : "BOOTREPLY"));
-    printf("Transaction ID : 0x%08x\n", p->xid);
-    printf("Client MAC     : %s\n", p->chaddr);
-    printf("Your IP Addr   : %s\n", inet_ntoa(*(struct in_addr *)&p->yiaddr));
-    printf("Server IP Addr : %s\n", inet_ntoa(*(struct in_addr *)&p->siaddr));
-    printf("Gateway IP     : %s\n", inet_ntoa(*(struct in_addr *)&p->giaddr));
+    ob_printf(ob, "OP Code        : %u (%s)\n", p->op, (p->op == 1 ? "BOOTREQUEST" : "BOOTREPLY"));
+    ob_field_hex(ob, "Transaction ID : ", p->xid, 8);
+    ob_field_mac(ob, "Client MAC     : ", p->chaddr);
+    ob_field_ip4(ob, "Your IP Addr   : ", &p->yiaddr);
+    ob_field_ip4(ob, "Server IP Addr : ", &p->siaddr);
+    ob_field_ip4(ob, "Gateway IP     : ", &p->giaddr);
 
     // Show magic cookie and options (simplified)
-    if (memcmp(p->options, "\x63\x82\x53\x63", 4) == 0) {
-        printf("Magic Cookie   : 63 82 53 63 (DHCP)\n");
+    if (p->options_len >= 4 && memcmp(p->options, "\x63\x82\x53\x63", 4) == 0) {
+        ob_str(ob, "Magic Cookie   : 63 82 53 63 (DHCP)\n");
 
-        uint8_t *opt_ptr = (uint8_t *)(p->options + 4);
-        while (*opt_ptr != 0xFF) {
+        const uint8_t *opt_ptr = p->options + 4;
+        const uint8_t *opt_end = p->options + p->options_len;
+        while (opt_ptr < opt_end && *opt_ptr != 0xFF) {
             uint8_t code = *opt_ptr++;
+            if (code == 0)          // Pad
+                continue;
+            if (opt_ptr >= opt_end)
+                break;
             uint8_t len = *opt_ptr++;
-            printf("Option %u (%u bytes)\n", code, len);
+            ob_printf(ob, "Option %u (%u bytes)\n", code, len);
             opt_ptr += len;
         }
     }
 
-    printf("\nRaw Bytes      : ");
-    dump_hex_single_line(packet, wire_len);
-    printf("\n===========================\n");
+    print_raw_bytes(ob, "\nRaw Bytes      : ", v);
+    ob_str(ob, "\n===========================\n");
 }
 
-void dhcp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet) {
-    (void)args;
+// Option 53, 0 when absent
+static uint8_t dhcp_message_type(const dhcp_packet *p) {
+    if (p->options_len < 4 || memcmp(p->options, "\x63\x82\x53\x63", 4) != 0)
+        return 0;
+
+    const uint8_t *opt_ptr = p->options + 4;
+    const uint8_t *opt_end = p->options + p->options_len;
+    while (opt_ptr + 1 < opt_end && *opt_ptr != 0xFF) {
+        uint8_t code = *opt_ptr++;
+        if (code == 0)
+            continue;
+        uint8_t len = *opt_ptr++;
+        if (code == 53 && len >= 1 && opt_ptr < opt_end)
+            return *opt_ptr;
+        opt_ptr += len;
+    }
+    return 0;
+}
 
-    dhcp_packet p;
-    int offset = 0;
+static const char *dhcp_types[] = {
+    NULL, "DISCOVER", "OFFER", "REQUEST", "DECLINE", "ACK", "NAK", "RELEASE", "INFORM"
+};
+
+// -q: "DHCP REQUEST xid 0x3903f326 from MAC", offers and acks add the address
+void summarize_dhcp_packet(outbuf *ob, const packet_view *v, const dhcp_packet *p) {
+    uint8_t type = dhcp_message_type(p);
+
+    print_summary_head(ob, v, "DHCP");
+    if (type > 0 && type <= 8)
+        ob_str(ob, dhcp_types[type]);
+    else
+        ob_str(ob, p->op == 1 ? "BOOTREQUEST" : "BOOTREPLY");
+    ob_str(ob, " xid 0x");
+    ob_hex(ob, p->xid, 8);
+    ob_str(ob, " from ");
+    ob_mac(ob, p->chaddr);
+    if (p->yiaddr) {
+        ob_str(ob, " your ");
+        ob_ip4(ob, &p->yiaddr);
+    }
+    ob_putc(ob, '\n');
+}
+
+// Option 53 by name, empty when absent
+static size_t dhcp_type_text(const void *pkt, char *buf) {
+    uint8_t type = dhcp_message_type(pkt);
 
-    offset += parse_ethernet_header(packet, header->len, &p.udp.ether);
-    offset += parse_ip_header(packet + offset, header->len - offset, &p.udp.ip);
-    offset += parse_udp_header(packet + offset, header->len - offset, &p.udp);
+    if (type == 0)
+        return 0;
+    if (type <= 8)
+        return strlen(strcpy(buf, dhcp_types[type]));
+    return snprintf(buf, RECORD_TEXT_MAX, "%u", type);
+}
 
-    uint16_t sport = p.udp.src_port;
-    uint16_t dport = p.udp.dst_port;
+// sname and file are NUL padded
+static size_t dhcp_sname_text(const void *pkt, char *buf) {
+    const dhcp_packet *p = pkt;
+    size_t len = strnlen((const char *)p->sname, 64);
 
-    if ((sport != DHCP_CLIENT_PORT && sport != DHCP_SERVER_PORT) &&
-        (dport != DHCP_CLIENT_PORT && dport != DHCP_SERVER_PORT)) {
-        fprintf(stderr, "Not a DHCP packet\n");
-        return;
-    }
+    memcpy(buf, p->sname, len);
+    return len;
+}
+
+static size_t dhcp_file_text(const void *pkt, char *buf) {
+    const dhcp_packet *p = pkt;
+    size_t len = strnlen((const char *)p->file, 128);
 
-    const unsigned char *payload = packet + offset;
-    int payload_len = p.udp.data_len;
+    memcpy(buf, p->file, len);
+    return len;
+}
+
+static const field_desc dhcp_fields[] = {
+    FIELD(dhcp_packet, op, FIELD_UINT),
+    FIELD_FN("message_type", dhcp_type_text),
+    FIELD(dhcp_packet, htype, FIELD_UINT),
+    FIELD(dhcp_packet, hlen, FIELD_UINT),
+    FIELD(dhcp_packet, hops, FIELD_UINT),
+    FIELD(dhcp_packet, xid, FIELD_UINT),
+    FIELD(dhcp_packet, secs, FIELD_UINT),
+    FIELD(dhcp_packet, flags, FIELD_UINT),
+    FIELD(dhcp_packet, ciaddr, FIELD_IP4),
+    FIELD(dhcp_packet, yiaddr, FIELD_IP4),
+    FIELD(dhcp_packet, siaddr, FIELD_IP4),
+    FIELD(dhcp_packet, giaddr, FIELD_IP4),
+    FIELD(dhcp_packet, chaddr, FIELD_MAC_PTR),
+    FIELD_FN("sname", dhcp_sname_text),
+    FIELD_FN("file", dhcp_file_text),
+    FIELD(dhcp_packet, options_len, FIELD_UINT),
+};
+
+RECORD_SCHEMA_DEF(dhcp_schema, PROTO_DHCP + 1, "dhcp", dhcp_fields);
+
+void dhcp_handler(Worker *w, const packet_view *v) {
+    dhcp_packet p;
 
-    if (payload_len > 0 && parse_dhcp_packet(payload, payload_len, &p) == 0) {
-        print_dhcp_packet(packet, header->len, &p);
+    if (v->payload_len > 0 && parse_dhcp_packet(v->frame + v->payload_off, v->payload_len, &p) == 0) {
+        if (w->out.format != OUTPUT_TEXT)
+            record_add(&w->out, &dhcp_schema, &p);
+        else if (w->app->quiet)
+            summarize_dhcp_packet(&w->out, v, &p);
+        else
+            print_dhcp_packet(&w->out, v, &p);
     } else {
         fprintf(stderr, "Failed to parse DHCP payload\n");
     }
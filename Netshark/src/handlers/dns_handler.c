@@ -1,104 +1,503 @@
 #include "dns.h"
+#include "dispatch.h"
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
 
-static int parse_qname(const unsigned char *data, size_t len, size_t *offset, char *out) {
-    size_t i = *offset;
-    size_t out_i = 0;
+static inline uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
 
-    while (i < len && data[i] != 0) {
-        uint8_t label_len = data[i++];
-        if (label_len == 0 || label_len + i > len || out_i + label_len + 1 >= DNS_MAX_NAME_LEN)
-            return -1;
+static inline uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
 
-        memcpy(&out[out_i], &data[i], label_len);
-        out_i += label_len;
-        i += label_len;
-        out[out_i++] = '.';
+const char *dns_type_str(uint16_t type) {
+    switch (type) {
+        case DNS_TYPE_A:      return "A";
+        case DNS_TYPE_NS:     return "NS";
+        case DNS_TYPE_CNAME:  return "CNAME";
+        case DNS_TYPE_SOA:    return "SOA";
+        case DNS_TYPE_PTR:    return "PTR";
+        case DNS_TYPE_HINFO:  return "HINFO";
+        case DNS_TYPE_MX:     return "MX";
+        case DNS_TYPE_TXT:    return "TXT";
+        case DNS_TYPE_AAAA:   return "AAAA";
+        case DNS_TYPE_SRV:    return "SRV";
+        case DNS_TYPE_NAPTR:  return "NAPTR";
+        case DNS_TYPE_DNAME:  return "DNAME";
+        case DNS_TYPE_OPT:    return "OPT";
+        case DNS_TYPE_DS:     return "DS";
+        case DNS_TYPE_RRSIG:  return "RRSIG";
+        case DNS_TYPE_NSEC:   return "NSEC";
+        case DNS_TYPE_DNSKEY: return "DNSKEY";
+        case DNS_TYPE_SVCB:   return "SVCB";
+        case DNS_TYPE_HTTPS:  return "HTTPS";
+        case DNS_TYPE_ANY:    return "ANY";
+        case DNS_TYPE_CAA:    return "CAA";
+        default:              return NULL;
     }
+}
 
-    if (i >= len || out_i == 0)
-        return -1;
+// RFC 1035, 2136, 6891, 8945 and 7873 names, NULL for the others
+const char *dns_rcode_str(uint16_t rcode) {
+    static const char *names[] = {
+        "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+        "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", "DSOTYPENI",
+        NULL, NULL, NULL, NULL,
+        "BADVERS", "BADKEY", "BADTIME", "BADMODE", "BADNAME", "BADALG",
+        "BADTRUNC", "BADCOOKIE",
+    };
 
-    out[out_i - 1] = '\0'; // replace last dot
-    *offset = i + 1;
-    return 0;
+    return rcode < sizeof(names) / sizeof(names[0]) ? names[rcode] : NULL;
 }
 
-int parse_dns_packet(const unsigned char *data, size_t len, dns_packet *out) {
-    if (!data || len < 12 || !out) return -1;
+static void print_dns_type(outbuf *ob, uint16_t type) {
+    const char *s = dns_type_str(type);
+
+    if (s) {
+        ob_str(ob, s);
+    } else {
+        ob_str(ob, "TYPE");
+        ob_u64(ob, type);
+    }
+}
 
-    out->id = ntohs(*(uint16_t *)(data));
-    out->flags = ntohs(*(uint16_t *)(data + 2));
-    out->qdcount = ntohs(*(uint16_t *)(data + 4));
-    out->ancount = ntohs(*(uint16_t *)(data + 6));
-    out->nscount = ntohs(*(uint16_t *)(data + 8));
-    out->arcount = ntohs(*(uint16_t *)(data + 10));
+// The name at `off` label by label, "." for the root
+void print_dns_name(outbuf *ob, const dns_packet *dns, size_t off) {
+    dns_name_iter it;
+    span label;
+    int any = 0;
 
-    size_t offset = 12;
-    if (out->qdcount > 0 && parse_qname(data, len, &offset, out->qname) == 0) {
-        if (offset + 4 > len) return -1;
-        out->qtype = ntohs(*(uint16_t *)(data + offset));
-        out->qclass = ntohs(*(uint16_t *)(data + offset + 2));
+    dns_name_iter_init(&it, dns->msg, dns->total_len, off);
+    while (dns_name_next(&it, &label) == 1) {
+        if (any)
+            ob_putc(ob, '.');
+        print_printable(ob, label.ptr, label.len);
+        any = 1;
     }
+    if (!any)
+        ob_putc(ob, '.');
+}
 
-    out->total_len = len;
-    return 0;
+// <character-string>s (TXT, HINFO, CAA value), each quoted
+static void print_dns_strings(outbuf *ob, const unsigned char *p, size_t len) {
+    size_t i = 0;
+
+    while (i < len) {
+        size_t n = p[i] < len - i - 1 ? p[i] : len - i - 1;
+
+        if (i)
+            ob_putc(ob, ' ');
+        ob_putc(ob, '"');
+        print_printable(ob, p + i + 1, n);
+        ob_putc(ob, '"');
+        i += 1 + n;
+    }
 }
 
-void print_dns_packet(const unsigned char *packet, uint32_t wire_len, const dns_packet *dns) {
-    printf("=== DNS Packet ===\n");
-    printf("Src MAC        : %s\n", dns->udp.ether.src_mac);
-    printf("Dst MAC        : %s\n", dns->udp.ether.dst_mac);
-    printf("Ethertype      : 0x%04x\n\n", dns->udp.ether.ethertype);
+// EDNS0 options: "udp 1232 version 0 do COOKIE ECS 192.0.2.0/24"
+static void print_dns_opt(outbuf *ob, const dns_packet *dns, const dns_rr *rr) {
+    const unsigned char *p = dns->msg + rr->rdata;
+    size_t i = 0;
 
-    printf("Source IP      : %s\n", dns->udp.ip.src);
-    printf("Destination IP : %s\n\n", dns->udp.ip.dst);
+    ob_str(ob, "udp ");
+    ob_u64(ob, dns->udp_size);
+    ob_str(ob, " version ");
+    ob_u64(ob, dns->edns_version);
+    if (dns->dnssec_ok)
+        ob_str(ob, " do");
+    while (i + 4 <= rr->rdlength) {
+        uint16_t code = get16(p + i);
+        uint16_t len = get16(p + i + 2);
+        const unsigned char *d = p + i + 4;
 
-    printf("Source Port    : %u\n", dns->udp.src_port);
-    printf("Dest Port      : %u\n\n", dns->udp.dst_port);
+        if (i + 4 + len > rr->rdlength)
+            break;
+        switch (code) {
+        case 8:     // Client subnet (RFC 7871)
+            ob_str(ob, " ECS");
+            if (len >= 4 && get16(d) == 1 && d[2] <= 32) {
+                unsigned char addr[4] = { 0 };
 
-    printf("Transaction ID : 0x%04x\n", dns->id);
-    printf("Flags          : 0x%04x\n", dns->flags);
-    printf("Questions      : %u\n", dns->qdcount);
-    printf("Answers        : %u\n", dns->ancount);
-    printf("Authority RRs  : %u\n", dns->nscount);
-    printf("Additional RRs : %u\n", dns->arcount);
-    if (dns->qdcount > 0) {
-        printf("Query Name     : %s\n", dns->qname);
-        printf("Query Type     : %u\n", dns->qtype);
-        printf("Query Class    : %u\n", dns->qclass);
+                memcpy(addr, d + 4, len - 4 < 4 ? len - 4 : 4);
+                ob_putc(ob, ' ');
+                ob_ip4(ob, addr);
+                ob_putc(ob, '/');
+                ob_u64(ob, d[2]);
+            }
+            break;
+        case 10:    ob_str(ob, " COOKIE"); break;
+        case 11:    ob_str(ob, " KEEPALIVE"); break;
+        case 12:    ob_str(ob, " PADDING"); break;
+        case 15:    // Extended error (RFC 8914): its code
+            ob_str(ob, " EDE");
+            if (len >= 2) {
+                ob_putc(ob, ' ');
+                ob_u64(ob, get16(d));
+            }
+            break;
+        default:
+            ob_str(ob, " OPT");
+            ob_u64(ob, code);
+            break;
+        }
+        i += 4 + len;
     }
+}
+
+// The data of a record in zone file form, unknown types as RFC 3597 hex
+static void print_dns_rdata(outbuf *ob, const dns_packet *dns, const dns_rr *rr) {
+    const unsigned char *p = dns->msg + rr->rdata;
+    size_t len = rr->rdlength;
+    char addr[INET6_ADDRSTRLEN];
+
+    switch (rr->type) {
+    case DNS_TYPE_A:
+        ob_ip4(ob, p);
+        return;
+    case DNS_TYPE_AAAA:
+        inet_ntop(AF_INET6, p, addr, sizeof(addr));
+        ob_str(ob, addr);
+        return;
+    case DNS_TYPE_NS:
+    case DNS_TYPE_CNAME:
+    case DNS_TYPE_PTR:
+    case DNS_TYPE_DNAME:
+    case DNS_TYPE_NSEC:
+        print_dns_name(ob, dns, rr->rdata);
+        return;
+    case DNS_TYPE_MX:
+        ob_u64(ob, get16(p));
+        ob_putc(ob, ' ');
+        print_dns_name(ob, dns, rr->rdata + 2);
+        return;
+    case DNS_TYPE_SRV:
+        ob_u64(ob, get16(p));
+        ob_putc(ob, ' ');
+        ob_u64(ob, get16(p + 2));
+        ob_putc(ob, ' ');
+        ob_u64(ob, get16(p + 4));
+        ob_putc(ob, ' ');
+        print_dns_name(ob, dns, rr->rdata + 6);
+        return;
+    case DNS_TYPE_SVCB:
+    case DNS_TYPE_HTTPS:
+        ob_u64(ob, get16(p));
+        ob_putc(ob, ' ');
+        print_dns_name(ob, dns, rr->rdata + 2);
+        return;
+    case DNS_TYPE_SOA: {
+        dns_name_iter it;
+        span label;
 
-    printf("\nRaw Bytes      : ");
-    dump_hex_single_line(packet, wire_len);
-    printf("\n===========================\n");
+        // The numbers follow the two names
+        dns_name_iter_init(&it, dns->msg, dns->total_len, rr->rdata);
+        while (dns_name_next(&it, &label) == 1)
+            ;
+        print_dns_name(ob, dns, rr->rdata);
+        ob_putc(ob, ' ');
+        print_dns_name(ob, dns, it.end);
+        dns_name_iter_init(&it, dns->msg, dns->total_len, it.end);
+        while (dns_name_next(&it, &label) == 1)
+            ;
+        for (int i = 0; i < 5; i++) {
+            ob_putc(ob, ' ');
+            ob_u64(ob, get32(dns->msg + it.end + i * 4));
+        }
+        return;
+    }
+    case DNS_TYPE_TXT:
+    case DNS_TYPE_HINFO:
+        print_dns_strings(ob, p, len);
+        return;
+    case DNS_TYPE_CAA:
+        if (len >= 2 && 2 + (size_t)p[1] <= len) {
+            ob_u64(ob, p[0]);
+            ob_putc(ob, ' ');
+            print_printable(ob, p + 2, p[1]);
+            ob_str(ob, " \"");
+            print_printable(ob, p + 2 + p[1], len - 2 - p[1]);
+            ob_putc(ob, '"');
+            return;
+        }
+        break;
+    case DNS_TYPE_DS:
+        if (len >= 4) {
+            ob_u64(ob, get16(p));
+            ob_putc(ob, ' ');
+            ob_u64(ob, p[2]);
+            ob_putc(ob, ' ');
+            ob_u64(ob, p[3]);
+            ob_putc(ob, ' ');
+            ob_hexdump(ob, p + 4, len - 4, 1);
+            return;
+        }
+        break;
+    case DNS_TYPE_DNSKEY:
+        if (len >= 4) {
+            ob_u64(ob, get16(p));
+            ob_putc(ob, ' ');
+            ob_u64(ob, p[2]);
+            ob_putc(ob, ' ');
+            ob_u64(ob, p[3]);
+            ob_str(ob, " (");
+            ob_u64(ob, len - 4);
+            ob_str(ob, " byte key)");
+            return;
+        }
+        break;
+    case DNS_TYPE_RRSIG:
+        print_dns_type(ob, get16(p));
+        ob_putc(ob, ' ');
+        ob_u64(ob, p[2]);
+        ob_putc(ob, ' ');
+        ob_u64(ob, p[3]);
+        ob_putc(ob, ' ');
+        ob_u64(ob, get32(p + 4));
+        ob_putc(ob, ' ');
+        print_dns_name(ob, dns, rr->rdata + 18);
+        return;
+    case DNS_TYPE_OPT:
+        print_dns_opt(ob, dns, rr);
+        return;
+    }
+    ob_str(ob, "\\# ");
+    ob_u64(ob, len);
+    if (len) {
+        ob_putc(ob, ' ');
+        ob_hexdump(ob, p, len, 0);
+    }
 }
 
-void dns_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet) {
-    (void)args;
+// Every record located, one line each in zone file form. With `mdns` the
+// top bit of the class is shown apart: unicast response wanted in
+// questions, cache flush in records (RFC 6762).
+void print_dns_sections(outbuf *ob, const dns_packet *dns, int mdns) {
+    static const char *titles[] = { "Questions", "Answers", "Authority", "Additional" };
+    int section = -1;
 
-    dns_packet dns;
-    int offset = 0;
+    for (uint16_t i = 0; i < dns->nrr; i++) {
+        const dns_rr *rr = &dns->rr[i];
+        uint16_t class = mdns ? rr->class & 0x7fff : rr->class;
+
+        if (rr->section != section) {
+            section = rr->section;
+            ob_str(ob, "\n--- ");
+            ob_str(ob, titles[section]);
+            ob_str(ob, " ---\n");
+        }
+        ob_str(ob, "  ");
+        if (rr->type == DNS_TYPE_OPT) {
+            ob_str(ob, "OPT ");
+            print_dns_rdata(ob, dns, rr);
+            ob_putc(ob, '\n');
+            continue;
+        }
+        print_dns_name(ob, dns, rr->name);
+        if (section != DNS_QUESTION) {
+            ob_putc(ob, ' ');
+            ob_u64(ob, rr->ttl);
+        }
+        ob_putc(ob, ' ');
+        if (class == 1) {
+            ob_str(ob, "IN");
+        } else {
+            ob_str(ob, "CLASS");
+            ob_u64(ob, class);
+        }
+        if (mdns && (rr->class & 0x8000))
+            ob_str(ob, section == DNS_QUESTION ? " (QU)" : " (flush)");
+        ob_putc(ob, ' ');
+        print_dns_type(ob, rr->type);
+        if (section != DNS_QUESTION) {
+            ob_putc(ob, ' ');
+            print_dns_rdata(ob, dns, rr);
+        }
+        ob_putc(ob, '\n');
+    }
+    if (dns->nrr < dns->qdcount + dns->ancount + dns->nscount + dns->arcount)
+        ob_str(ob, dns->malformed ? "  [malformed record]\n" : "  [more records]\n");
+}
+
+void print_dns_packet(outbuf *ob, const packet_view *v, const dns_packet *dns) {
+    ob_str(ob, "=== DNS Packet ===\n");
+    ob_field_mac(ob, "Src MAC        : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC        : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype      : ", v->ether.ethertype, 4);
+    ob_putc(ob, '\n');
+
+    ob_field_ip4(ob, "Source IP      : ", &v->ip.src);
+    ob_field_ip4(ob, "Destination IP : ", &v->ip.dst);
+    ob_putc(ob, '\n');
+
+    ob_field_u(ob, "Source Port    : ", v->udp.src_port);
+    ob_field_u(ob, "Dest Port      : ", v->udp.dst_port);
+    ob_putc(ob, '\n');
+
+    ob_field_hex(ob, "Transaction ID : ", dns->id, 4);
+    ob_field_hex(ob, "Flags          : ", dns->flags, 4);
+    ob_field_u(ob, "Rcode          : ", dns->rcode);
+    ob_field_u(ob, "Questions      : ", dns->qdcount);
+    ob_field_u(ob, "Answers        : ", dns->ancount);
+    ob_field_u(ob, "Authority RRs  : ", dns->nscount);
+    ob_field_u(ob, "Additional RRs : ", dns->arcount);
+    print_dns_sections(ob, dns, 0);
+
+    print_raw_bytes(ob, "\nRaw Bytes      : ", v);
+    ob_str(ob, "\n===========================\n");
+}
+
+// -q: "DNS 0x1a2b A? example.com", answers add "rcode 3 an 0"
+void summarize_dns_packet(outbuf *ob, const packet_view *v, const dns_packet *dns) {
+    print_summary_head(ob, v, "DNS");
+    ob_str(ob, "0x");
+    ob_hex(ob, dns->id, 4);
+    ob_putc(ob, ' ');
+    if (dns->qname_off) {
+        print_dns_type(ob, dns->qtype);
+        ob_str(ob, "? ");
+        print_dns_name(ob, dns, dns->qname_off);
+    }
+    if (dns->flags & DNS_FLAG_QR) {
+        ob_str(ob, " rcode ");
+        ob_u64(ob, dns->rcode);
+        ob_str(ob, " an ");
+        ob_u64(ob, dns->ancount);
+    }
+    if (dns->malformed)
+        ob_str(ob, " malformed");
+    ob_putc(ob, '\n');
+}
+
+static size_t dns_qname_text(const void *pkt, char *buf) {
+    const dns_packet *dns = pkt;
+
+    return dns_name_text(dns->msg, dns->total_len, dns->qname_off, buf, RECORD_TEXT_MAX);
+}
+
+// "CNAME www.example.com,A 93.184.216.34": the answers' types and the
+// addresses or names they hold, as far as RECORD_TEXT_MAX goes
+size_t dns_answers_text(const void *pkt, char *buf) {
+    const dns_packet *dns = pkt;
+    size_t n = 0;
 
-    offset += parse_ethernet_header(packet, header->len, &dns.udp.ether);
-    offset += parse_ip_header(packet + offset, header->len - offset, &dns.udp.ip);
-    offset += parse_udp_header(packet + offset, header->len - offset, &dns.udp);
+    for (uint16_t i = 0; i < dns->nrr; i++) {
+        const dns_rr *rr = &dns->rr[i];
+        const char *type = dns_type_str(rr->type);
+        char text[DNS_MAX_NAME_LEN];
+        size_t len = 0;
 
-    uint16_t sport = dns.udp.src_port;
-    uint16_t dport = dns.udp.dst_port;
+        if (rr->section != DNS_ANSWER)
+            continue;
+        if (rr->type == DNS_TYPE_A)
+            inet_ntop(AF_INET, dns->msg + rr->rdata, text, sizeof(text));
+        else if (rr->type == DNS_TYPE_AAAA)
+            inet_ntop(AF_INET6, dns->msg + rr->rdata, text, sizeof(text));
+        else if (rr->type == DNS_TYPE_CNAME || rr->type == DNS_TYPE_PTR || rr->type == DNS_TYPE_NS)
+            len = dns_name_text(dns->msg, dns->total_len, rr->rdata, text, sizeof(text));
+        else if (rr->type == DNS_TYPE_MX)
+            len = dns_name_text(dns->msg, dns->total_len, rr->rdata + 2, text, sizeof(text));
+        else if (rr->type == DNS_TYPE_SRV)
+            len = dns_name_text(dns->msg, dns->total_len, rr->rdata + 6, text, sizeof(text));
+        else
+            text[0] = '\0';
+        if (!len)
+            len = strlen(text);
+        if (n + 16 + len + 2 > RECORD_TEXT_MAX)
+            break;
+        if (n)
+            buf[n++] = ',';
+        if (type)
+            n += snprintf(buf + n, RECORD_TEXT_MAX - n, "%s", type);
+        else
+            n += snprintf(buf + n, RECORD_TEXT_MAX - n, "TYPE%u", rr->type);
+        if (len) {
+            buf[n++] = ' ';
+            memcpy(buf + n, text, len);
+            n += len;
+        }
+    }
+    return n;
+}
+
+static const field_desc dns_fields[] = {
+    FIELD(dns_packet, id, FIELD_UINT),
+    FIELD(dns_packet, flags, FIELD_UINT),
+    FIELD(dns_packet, rcode, FIELD_UINT),
+    FIELD(dns_packet, qdcount, FIELD_UINT),
+    FIELD(dns_packet, ancount, FIELD_UINT),
+    FIELD(dns_packet, nscount, FIELD_UINT),
+    FIELD(dns_packet, arcount, FIELD_UINT),
+    FIELD_FN_IF("qname", dns_qname_text, dns_packet, qname_off),
+    FIELD_IF(dns_packet, qtype, FIELD_UINT, qname_off),
+    FIELD_IF(dns_packet, qclass, FIELD_UINT, qname_off),
+    FIELD_FN_IF("answers", dns_answers_text, dns_packet, ancount),
+    FIELD(dns_packet, edns, FIELD_BOOL),
+    FIELD_IF(dns_packet, udp_size, FIELD_UINT, edns),
+    FIELD_IF(dns_packet, dnssec_ok, FIELD_BOOL, edns),
+    FIELD(dns_packet, malformed, FIELD_BOOL),
+};
+
+RECORD_SCHEMA_DEF(dns_schema, PROTO_DNS + 1, "dns", dns_fields);
 
-    if (sport != 53 && dport != 53) {
-        fprintf(stderr, "Not a DNS packet\n");
+// Standard queries and their responses, by client, server, ID and
+// question, for the resolver latency (--latency)
+static void dns_track(Worker *w, const packet_view *v, const dns_packet *dns) {
+    uint64_t now = (uint64_t)v->hdr->ts.tv_sec * 1000000 + v->hdr->ts.tv_usec;
+    dns_txn_key k;
+
+    if (!dns->qname_off || DNS_OPCODE(dns->flags) != 0)
         return;
+    k.id = dns->id;
+    k.qname = dns_name_hash(dns->msg, dns->total_len, dns->qname_off);
+    if (dns->flags & DNS_FLAG_QR) {
+        k.client = v->ip.dst.s_addr;
+        k.server = v->ip.src.s_addr;
+        k.port = v->udp.dst_port;
+        dns_txn_response(&w->dns, &k, dns->rcode, now);
+    } else {
+        k.client = v->ip.src.s_addr;
+        k.server = v->ip.dst.s_addr;
+        k.port = v->udp.src_port;
+        dns_txn_query(&w->dns, &k, now);
     }
+}
+
+// Names queried, clients querying and names that don't exist, for the
+// heavy hitters (--top)
+static void dns_top(Worker *w, const packet_view *v, const dns_packet *dns) {
+    char name[DNS_MAX_NAME_LEN];
+    size_t len;
+    int response = dns->flags & DNS_FLAG_QR;
 
-    const unsigned char *payload = packet + offset;
-    int payload_len = dns.udp.data_len;
+    if (!dns->qname_off || DNS_OPCODE(dns->flags) != 0)
+        return;
+    if (response && dns->rcode != DNS_RCODE_NXDOMAIN)
+        return;
+    len = dns_name_text(dns->msg, dns->total_len, dns->qname_off, name, sizeof(name));
+    if (response) {
+        topk_add(&w->top, TOPK_DNS_NXDOMAIN, name, len, v->hdr->ts.tv_sec);
+    } else {
+        topk_add(&w->top, TOPK_DNS_QNAME, name, len, v->hdr->ts.tv_sec);
+        topk_add(&w->top, TOPK_DNS_CLIENT, &v->ip.src, 4, v->hdr->ts.tv_sec);
+    }
+}
+
+void dns_handler(Worker *w, const packet_view *v) {
+    dns_packet dns;
 
-    if (parse_dns_packet(payload, payload_len, &dns) == 0) {
-        print_dns_packet(packet, header->len, &dns);
+    if (parse_dns_packet(v->frame + v->payload_off, v->payload_len, &dns) == 0) {
+        if (w->dns.ring)
+            dns_track(w, v, &dns);
+        if (w->top.lists)
+            dns_top(w, v, &dns);
+        if (w->out.format != OUTPUT_TEXT)
+            record_add(&w->out, &dns_schema, &dns);
+        else if (w->app->quiet)
+            summarize_dns_packet(&w->out, v, &dns);
+        else
+            print_dns_packet(&w->out, v, &dns);
     } else {
         fprintf(stderr, "Failed to parse DNS packet.\n");
     }
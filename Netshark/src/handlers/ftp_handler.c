@@ -1,79 +1,144 @@
 #include "ftp.h"
+#include "dispatch.h"
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
 
 void parse_ftp_packet(const unsigned char *data, size_t len, ftp_packet *pkt) {
-    if (!data || !pkt || len == 0) return;
+    memset(pkt, 0, sizeof(*pkt));
+    if (!data || len == 0) return;
 
-    size_t copy_len = len < sizeof(pkt->raw) - 1 ? len : sizeof(pkt->raw) - 1;
-    memcpy(pkt->raw, data, copy_len);
-    pkt->raw[copy_len] = '\0';
+    // Only the first line is decoded
+    size_t end = 0;
+    while (end < len && data[end] != '\r' && data[end] != '\n')
+        end++;
 
-    // Detect if it's a response or command
-    if (isdigit(pkt->raw[0]) && isdigit(pkt->raw[1]) && isdigit(pkt->raw[2]) && pkt->raw[3] == ' ') {
+    // Detect if it's a response or command, "220-" continues a multi-line reply
+    if (end >= 4 && isdigit(data[0]) && isdigit(data[1]) && isdigit(data[2]) && (data[3] == ' ' || data[3] == '-')) {
         pkt->is_response = 1;
-        sscanf(pkt->raw, "%d %[^\r\n]", &pkt->response_code, pkt->message);
+        pkt->response_code = (data[0] - '0') * 100 + (data[1] - '0') * 10 + (data[2] - '0');
+        pkt->message.ptr = data + 4;
+        pkt->message.len = end - 4;
     } else {
+        size_t sp = 0;
+        while (sp < end && data[sp] != ' ')
+            sp++;
         pkt->is_response = 0;
-        sscanf(pkt->raw, "%7s %[^\r\n]", pkt->command, pkt->arguments);
+        pkt->command.ptr = data;
+        pkt->command.len = sp < 7 ? sp : 7;
+        if (sp < end) {
+            pkt->arguments.ptr = data + sp + 1;
+            pkt->arguments.len = end - sp - 1;
+        }
     }
 }
 
 
-void print_ftp_packet(const unsigned char *frame, uint32_t wire_len, const ftp_packet *pkt) {
-    puts("\n=== FTP Packet =============");
-    printf("Src MAC             : %s\n", pkt->tcp.ether.src_mac);
-    printf("Dst MAC             : %s\n", pkt->tcp.ether.dst_mac);
-    printf("Ethertype           : 0x%04x\n", pkt->tcp.ether.ethertype);
-    puts("");
-    printf("Src IP              : %s\n", pkt->tcp.ip.src);
-    printf("Dst IP              : %s\n", pkt->tcp.ip.dst);
-    puts("");
-    printf("Src Port            : %u\n", pkt->tcp.src_port);
-    printf("Dst Port            : %u\n", pkt->tcp.dst_port);
-    printf("Seq Number          : %u\n", pkt->tcp.seq_num);
-    printf("Ack Number          : %u\n", pkt->tcp.ack_num);
-    printf("Flags               : %s\n", pkt->tcp.flags_str);
-    printf("Window Size         : %u\n", pkt->tcp.window);
-    printf("Header Length       : %u bytes\n", pkt->tcp.header_len);
-    printf("Data Length         : %u bytes\n", pkt->tcp.data_len);
-    puts("");
+void print_ftp_packet(outbuf *ob, const packet_view *v, const ftp_packet *pkt) {
+    const tcp_packet *tcp = &v->tcp;
+    char flags[32];
+
+    ob_puts(ob, "\n=== FTP Packet =============");
+    ob_field_mac(ob, "Src MAC             : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC             : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype           : ", v->ether.ethertype, 4);
+    ob_puts(ob, "");
+    ob_field_ip4(ob, "Src IP              : ", &v->ip.src);
+    ob_field_ip4(ob, "Dst IP              : ", &v->ip.dst);
+    ob_puts(ob, "");
+    ob_field_u(ob, "Src Port            : ", tcp->src_port);
+    ob_field_u(ob, "Dst Port            : ", tcp->dst_port);
+    ob_field_u(ob, "Seq Number          : ", tcp->seq_num);
+    ob_field_u(ob, "Ack Number          : ", tcp->ack_num);
+    ob_field_str(ob, "Flags               : ", get_tcp_flags(tcp->flags, flags));
+    ob_field_u(ob, "Window Size         : ", tcp->window);
+    ob_field_bytes(ob, "Header Length       : ", tcp->header_len);
+    ob_field_bytes(ob, "Data Length         : ", tcp->data_len);
+    ob_puts(ob, "");
+    if (pkt->is_response) {
+        ob_printf(ob, "Response Code       : %d\n", pkt->response_code);
+        ob_printf(ob, "Message             : %.*s\n", (int)pkt->message.len, pkt->message.ptr);
+    } else {
+        ob_printf(ob, "Command         : %.*s\n", (int)pkt->command.len, pkt->command.ptr);
+        ob_printf(ob, "Arguments       : %.*s\n", (int)pkt->arguments.len, pkt->arguments.ptr);
+    }
+    ob_puts(ob, "");
+    ob_field_bytes(ob, "Total on wire       : ", v->caplen);
+    print_raw_bytes(ob, "Raw Bytes           : ", v);
+    ob_puts(ob, "\n===========================\n");
+}
+
+
+// -q: "FTP USER anonymous" or "FTP 220 Welcome"
+void summarize_ftp_packet(outbuf *ob, const packet_view *v, const ftp_packet *pkt) {
+    print_summary_head(ob, v, "FTP");
     if (pkt->is_response) {
-        printf("Response Code       : %d\n", pkt->response_code);
-        printf("Message             : %s\n", pkt->message);
+        ob_u64(ob, pkt->response_code);
+        ob_putc(ob, ' ');
+        print_printable(ob, pkt->message.ptr, pkt->message.len);
     } else {
-        printf("Command         : %s\n", pkt->command);
-        printf("Arguments       : %s\n", pkt->arguments);
+        print_printable(ob, pkt->command.ptr, pkt->command.len);
+        if (pkt->arguments.len) {
+            ob_putc(ob, ' ');
+            print_printable(ob, pkt->arguments.ptr, pkt->arguments.len);
+        }
     }
-    puts("");
-    printf("Total on wire       : %u bytes\n", wire_len);
-    printf("Raw Bytes           : "); dump_hex_single_line(frame, wire_len);
-    puts("\n===========================\n");
+    ob_putc(ob, '\n');
 }
 
+static const field_desc ftp_fields[] = {
+    FIELD(ftp_packet, is_response, FIELD_BOOL),
+    FIELD(ftp_packet, command, FIELD_SPAN),
+    FIELD(ftp_packet, arguments, FIELD_SPAN),
+    FIELD_IF(ftp_packet, response_code, FIELD_INT, is_response),
+    FIELD(ftp_packet, message, FIELD_SPAN),
+};
 
-void ftp_handler(
-    unsigned char *user,
-    const struct pcap_pkthdr *hdr,
-    const unsigned char *packet
-) {
-    (void)user;
+RECORD_SCHEMA_DEF(ftp_schema, PROTO_FTP + 1, "ftp", ftp_fields);
+
+static void ftp_output(Worker *w, const packet_view *v, const ftp_packet *pkt) {
+    if (w->out.format != OUTPUT_TEXT)
+        record_add(&w->out, &ftp_schema, pkt);
+    else if (w->app->quiet)
+        summarize_ftp_packet(&w->out, v, pkt);
+    else
+        print_ftp_packet(&w->out, v, pkt);
+}
+
+// Segments of flows without a stream: the first line of the payload
+void ftp_handler(Worker *w, const packet_view *v) {
     ftp_packet pkt;
-    int offset = 0;
 
-    offset += parse_ethernet_header(packet, hdr->len, &pkt.tcp.ether);
-    offset += parse_ip_header(packet + offset, hdr->len - offset, &pkt.tcp.ip);
-    offset += parse_tcp_header(packet + offset, hdr->len - offset, &pkt.tcp);
+    if (v->payload_len > 0) {
+        parse_ftp_packet(v->frame + v->payload_off, v->payload_len, &pkt);
+        ftp_output(w, v, &pkt);
+    }
+}
+
+// One direction of a reassembled control connection: every complete line
+// is a command or a reply line. After a hole the stream is taken to
+// resume at a line start, as segments of this protocol almost always do.
+size_t ftp_stream(Worker *w, const packet_view *v, tcp_stream *s, int side,
+                  const unsigned char *data, size_t len, unsigned flags) {
+    size_t off = 0;
+    ftp_packet pkt;
 
-    // Parse only if port matches FTP control port
-    if (pkt.tcp.src_port != FTP_PORT && pkt.tcp.dst_port != FTP_PORT)
-        return;
+    (void)s;
+    (void)side;
+    if (flags & STREAM_END)
+        return 0;
+    while (off < len) {
+        const unsigned char *nl = memchr(data + off, '\n', len - off);
+        size_t end = nl ? (size_t)(nl + 1 - data) : len;
 
-    const unsigned char *payload = packet + offset;
-    int payload_len = pkt.tcp.data_len;
-    if (payload_len > 0) {
-        parse_ftp_packet(payload, payload_len, &pkt);
-        print_ftp_packet(packet, hdr->len, &pkt);
+        // Wait for the end of the line, unless none will come
+        if (!nl && !(flags & STREAM_FIN))
+            break;
+        if (data[off] != '\r' && data[off] != '\n') {
+            parse_ftp_packet(data + off, end - off, &pkt);
+            ftp_output(w, v, &pkt);
+        }
+        off = end;
     }
+    return off;
 }
@@ -1,136 +1,246 @@
 #include "http.h"
+#include "dispatch.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <arpa/inet.h>
 
-int parse_http_packet(const unsigned char *data, size_t len, http_packet *out) {
-    if (!data || !out || len == 0) return -1;
-
-    const char *start = (const char *)data;
-    const char *end = start + len;
-
-    // Detect if response or request
-    if (strncmp(start, "HTTP/", 5) == 0) {
-        out->is_response = 1;
-        sscanf(start, "%15s %d %[^\r\n]", out->version, &out->status_code, out->status_message);
-    } else {
-        out->is_request = 1;
-        sscanf(start, "%15s %255s %15s", out->method, out->path, out->version);
-    }
-
-    // Locate headers
-    const char *headers_start = strstr(start, "\r\n");
-    if (!headers_start) return 0;
-    headers_start += 2;
-
-    const char *body_start = strstr(headers_start, "\r\n\r\n");
-    if (body_start) {
-        out->header_len = body_start + 4 - start;
-
-        size_t headers_len = body_start - headers_start;
-        if (headers_len < sizeof(out->headers)) {
-            memcpy(out->headers, headers_start, headers_len);
-            out->headers[headers_len] = '\0';
-        }
-
-        body_start += 4;
-        size_t body_len = end - body_start;
-        out->data_len = body_len < sizeof(out->body) ? body_len : sizeof(out->body) - 1;
-        memcpy(out->body, body_start, out->data_len);
-        out->body[out->data_len] = '\0';
-    } else {
-        out->header_len = len;
-    }
-
-    return 0;
-}
-
-
-void print_http_packet(const unsigned char *packet, uint32_t wire_len, const http_packet *p)
+void print_http_packet(outbuf *ob, const packet_view *v, const http_packet *p)
 {
+    const tcp_packet *tcp = &v->tcp;
+    char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], flags[32];
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
+    struct tm tm_info;
     char time_buf[20];
-    strftime(time_buf, sizeof(time_buf), "%H:%M:%S", tm_info);
+    localtime_r(&now, &tm_info);
+    strftime(time_buf, sizeof(time_buf), "%H:%M:%S", &tm_info);
+
+    ip_to_str(&v->ip.src, src, sizeof(src));
+    ip_to_str(&v->ip.dst, dst, sizeof(dst));
 
     if (p->is_response)
-        printf("=== HTTP Response ===\n");
+        ob_str(ob, "=== HTTP Response ===\n");
     else
-        printf("=== HTTP Request ===\n");
-    printf("Src MAC        : %s\n", p->tcp.ether.src_mac);
-    printf("Dst MAC        : %s\n", p->tcp.ether.dst_mac);
-    printf("Ethertype      : 0x%04x\n", p->tcp.ether.ethertype);
-    puts("\n");
-    printf("Source IP      : %s\n", p->tcp.ip.src);
-    printf("Destination IP : %s\n", p->tcp.ip.dst);
-    puts("\n");
-    printf("Source Port     : %u\n", p->tcp.src_port);
-    printf("Destination Port: %u\n", p->tcp.dst_port);
-    printf("Seq Number      : %u\n", p->tcp.seq_num);
-    printf("Ack Number      : %u\n", p->tcp.ack_num);
-    printf("Flags           : %s\n", p->tcp.flags_str);
-    printf("Window Size     : %u\n", p->tcp.window);
-    puts("\n");
-    printf("\n[%s] HTTP %s:%d -> %s:%d\n", time_buf,
-           p->tcp.ip.src, p->tcp.src_port,
-           p->tcp.ip.dst, p->tcp.dst_port);
-    printf("Header Length   : %u bytes\n", p->header_len);
-    printf("Data Length     : %u bytes\n", p->data_len);
+        ob_str(ob, "=== HTTP Request ===\n");
+    ob_field_mac(ob, "Src MAC        : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC        : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype      : ", v->ether.ethertype, 4);
+    ob_puts(ob, "\n");
+    ob_field_str(ob, "Source IP      : ", src);
+    ob_field_str(ob, "Destination IP : ", dst);
+    ob_puts(ob, "\n");
+    ob_field_u(ob, "Source Port     : ", tcp->src_port);
+    ob_field_u(ob, "Destination Port: ", tcp->dst_port);
+    ob_field_u(ob, "Seq Number      : ", tcp->seq_num);
+    ob_field_u(ob, "Ack Number      : ", tcp->ack_num);
+    ob_field_str(ob, "Flags           : ", get_tcp_flags(tcp->flags, flags));
+    ob_field_u(ob, "Window Size     : ", tcp->window);
+    ob_puts(ob, "\n");
+    ob_printf(ob, "\n[%s] HTTP %s:%d -> %s:%d\n", time_buf,
+           src, tcp->src_port,
+           dst, tcp->dst_port);
+    ob_field_bytes(ob, "Header Length   : ", p->header_len);
+    ob_field_bytes(ob, "Data Length     : ", p->data_len);
     if (p->is_response)
     {
-        printf("Version       : %s\n", p->version);
-        printf("Status Code   : %d\n", p->status_code);
-        printf("Status Msg    : %s\n", p->status_message);
+        ob_printf(ob, "Version       : %.*s\n", (int)p->version.len, p->version.ptr);
+        ob_printf(ob, "Status Code   : %d\n", p->status_code);
+        ob_printf(ob, "Status Msg    : %.*s\n", (int)p->status_message.len, p->status_message.ptr);
     }
     else if (p->is_request)
     {
-        printf("Method        : %s\n", p->method);
-        printf("Path          : %s\n", p->path);
-        printf("Version       : %s\n", p->version);
+        ob_printf(ob, "Method        : %.*s\n", (int)p->method.len, p->method.ptr);
+        ob_printf(ob, "Path          : %.*s\n", (int)p->path.len, p->path.ptr);
+        ob_printf(ob, "Version       : %.*s\n", (int)p->version.len, p->version.ptr);
     }
 
-    if (*p->headers)
+    if (p->headers.len)
     {
-        printf("\nHeaders:\n%s\n", p->headers);
+        ob_printf(ob, "\nHeaders:\n%.*s\n", (int)p->headers.len, p->headers.ptr);
     }
 
-    if (*p->body)
+    if (p->body.len)
     {
-        printf("\nBody:\n%s\n", p->body);
+        ob_printf(ob, "\nBody:\n%.*s\n", (int)p->body.len, p->body.ptr);
     }
 
-    printf("Total on wire   : %u bytes\n", wire_len);
-    printf("Raw Bytes       : ");
-    dump_hex_single_line(packet, wire_len);
-    printf("\n===========================\n");
+    ob_field_bytes(ob, "Total on wire   : ", v->caplen);
+    print_raw_bytes(ob, "Raw Bytes       : ", v);
+    ob_str(ob, "\n===========================\n");
+}
+
+// -q: "HTTP GET /index.html HTTP/1.1", "HTTP 200 OK", or the length of
+// a segment in the middle of a message
+void summarize_http_packet(outbuf *ob, const packet_view *v, const http_packet *p) {
+    print_summary_head(ob, v, "HTTP");
+    if (p->is_request) {
+        print_printable(ob, p->method.ptr, p->method.len);
+        ob_putc(ob, ' ');
+        print_printable(ob, p->path.ptr, p->path.len);
+        ob_putc(ob, ' ');
+        print_printable(ob, p->version.ptr, p->version.len);
+    } else if (p->is_response) {
+        ob_u64(ob, p->status_code);
+        ob_putc(ob, ' ');
+        print_printable(ob, p->status_message.ptr, p->status_message.len);
+    } else {
+        ob_str(ob, "data len ");
+        ob_u64(ob, v->payload_len);
+    }
+    ob_putc(ob, '\n');
 }
 
-void http_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet) {
-    (void)args;
+static const field_desc http_fields[] = {
+    FIELD(http_packet, is_request, FIELD_BOOL),
+    FIELD(http_packet, is_response, FIELD_BOOL),
+    FIELD(http_packet, method, FIELD_SPAN),
+    FIELD(http_packet, path, FIELD_SPAN),
+    FIELD(http_packet, version, FIELD_SPAN),
+    FIELD_IF(http_packet, status_code, FIELD_INT, is_response),
+    FIELD(http_packet, status_message, FIELD_SPAN),
+    FIELD_IF(http_packet, content_length, FIELD_UINT, has_length),
+    FIELD(http_packet, chunked, FIELD_BOOL),
+    FIELD(http_packet, keep_alive, FIELD_BOOL),
+    FIELD(http_packet, header_len, FIELD_UINT),
+    FIELD(http_packet, data_len, FIELD_UINT),
+};
+
+RECORD_SCHEMA_DEF(http_schema, PROTO_HTTP + 1, "http", http_fields);
+
+static void http_output(Worker *w, const packet_view *v, const http_packet *p) {
+    if (w->out.format != OUTPUT_TEXT)
+        record_add(&w->out, &http_schema, p);
+    else if (w->app->quiet)
+        summarize_http_packet(&w->out, v, p);
+    else
+        print_http_packet(&w->out, v, p);
+}
 
+// Segments of flows without a stream: whatever the payload starts with
+void http_handler(Worker *w, const packet_view *v) {
     http_packet p;
-    int offset = 0;
 
+    if (v->payload_len > 0) {
+        parse_http_packet(v->frame + v->payload_off, v->payload_len, &p);
+        http_output(w, v, &p);
+    }
+}
 
-    offset += parse_ethernet_header(packet, header->len, &p.tcp.ether);
-    offset += parse_ip_header(packet + offset, header->len - offset, &p.tcp.ip);
-    offset += parse_tcp_header(packet + offset, header->len - offset, &p.tcp);
-    
-    uint16_t sport = p.tcp.src_port;
-    uint16_t dport = p.tcp.dst_port;
+/*** Request/response pairing ***/
 
-    if (sport != HTTP_PORT && dport != HTTP_PORT && sport != HTTP_PORT_ALT && dport != HTTP_PORT_ALT)
-    {
-        fprintf(stderr, "Error: can't recongnize HTTP port\n");
+// Queues a request for the response that will answer it, unless older
+// ones went untimed: the queue must stay in order
+static void http_request_seen(http_conn *c, const http_packet *p, uint64_t now) {
+    span host = http_header_value(p, "Host");
+    http_request *r;
+
+    if (c->pending == HTTP_PIPELINE_MAX || c->untracked) {
+        c->untracked++;
+        c->open = 0;
         return;
     }
+    r = &c->queue[(c->first + c->pending++) % HTTP_PIPELINE_MAX];
+    r->sent_us = now;
+    r->head = p->method.len == 4 && memcmp(p->method.ptr, HTTP_METHOD_HEAD, 4) == 0;
+    r->host_len = host.len < HTTP_HOST_MAX ? host.len : HTTP_HOST_MAX;
+    if (r->host_len)
+        memcpy(r->host, host.ptr, r->host_len);
+    c->open = 1;
+}
+
+// The last byte of the newest request: what the server waits for
+static void http_request_sent(http_conn *c, uint64_t now) {
+    if (c->open && c->pending)
+        c->queue[(c->first + c->pending - 1) % HTTP_PIPELINE_MAX].sent_us = now;
+    c->open = 0;
+}
+
+// A final response (not 1xx) starts: it answers the oldest request
+static void http_response_seen(http_conn *c, const http_packet *p, uint64_t start) {
+    c->timing = 0;
+    if (c->pending) {
+        c->answered = c->queue[c->first];
+        c->first = (c->first + 1) % HTTP_PIPELINE_MAX;
+        if (--c->pending == 0)
+            c->open = 0;
+        c->status = p->status_code;
+        c->ttfb_us = start > c->answered.sent_us ? start - c->answered.sent_us : 0;
+        c->timing = 1;
+    } else if (c->untracked) {
+        c->untracked--;
+    }
+}
+
+// The response is complete: its times go to the host's histograms
+static void http_response_done(Worker *w, http_conn *c, uint64_t now) {
+    uint64_t us[2];
+
+    if (!c->timing)
+        return;
+    us[0] = c->ttfb_us;
+    us[1] = now > c->answered.sent_us ? now - c->answered.sent_us : 0;
+    latency_add(&w->latency, LATENCY_HTTP, (const unsigned char *)c->answered.host,
+                c->answered.host_len, c->status, now / 1000000, us);
+    c->timing = 0;
+}
 
-    const unsigned char *payload = packet + offset;
-    int payload_len = p.tcp.data_len;
-    if (payload_len > 0) {
-        parse_http_packet(payload, header->len - offset, &p);
-        print_http_packet(packet, header->len, &p);
+// Messages of one direction of a reassembled connection. Each head is
+// printed once complete with the part of its body at hand; bodies are
+// followed by their framing, so keep-alive and pipelined messages are all
+// found. Responses are paired with the requests in order, giving the time
+// to first byte (last byte of the request to first byte of the response)
+// and the total time (to the response's last byte).
+size_t http_stream(Worker *w, const packet_view *v, tcp_stream *s, int side,
+                   const unsigned char *data, size_t len, unsigned flags) {
+    http_conn *c;
+    http_parser *ps;
+    uint64_t now;
+    size_t off = 0;
+
+    if (flags & STREAM_END)
+        return 0;
+    c = stream_state(&w->streams, s, sizeof(*c));
+    if (c == NULL) {
+        // Over the memory limit: the direction goes unparsed
+        s->dir[side].skip = UINT32_MAX;
+        return len;
+    }
+    ps = &c->dir[side];
+    if (flags & STREAM_GAP) {
+        // Requests or responses may be gone: pairing starts over
+        http_parser_lost(ps);
+        c->pending = 0;
+        c->untracked = 0;
+        c->open = 0;
+        c->timing = 0;
     }
-}
\ No newline at end of file
+    now = (uint64_t)v->hdr->ts.tv_sec * 1000000 + v->hdr->ts.tv_usec;
+
+    for (;;) {
+        http_packet p;
+        http_event ev;
+        size_t n;
+
+        if (ps->state == HTTP_STATE_HEAD && ps->scanned == 0 && off < len)
+            c->start_us[side] = now;
+        n = http_parse(ps, data + off, len - off, (flags & STREAM_FIN) != 0,
+                       c->pending && c->queue[c->first].head, &p, &ev);
+        off += n;
+        if (ev == HTTP_EV_HEAD) {
+            if (p.is_request)
+                http_request_seen(c, &p, now);
+            else if (p.status_code / 100 != 1)
+                http_response_seen(c, &p, c->start_us[side]);
+            http_output(w, v, &p);
+        } else if (ev == HTTP_EV_END) {
+            if (ps->response)
+                http_response_done(w, c, now);
+            else
+                http_request_sent(c, now);
+        } else if (ev == HTTP_EV_NONE && n == 0) {
+            break;
+        }
+    }
+    return off;
+}
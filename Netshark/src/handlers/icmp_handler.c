@@ -1,4 +1,5 @@
 #include "icmp.h"
+#include "dispatch.h"
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -73,58 +74,71 @@ int parse_icmp_packet(const unsigned char *data, size_t len, icmp_packet *out) {
     out->identifier = (data[4] << 8) + data[5];
     out->sequence = (data[6] << 8) + data[7];
 
+    out->payload = data + 8;
     out->payload_len = len - 8;
-    if (out->payload_len > sizeof(out->payload))
-        out->payload_len = sizeof(out->payload);
-
-    memcpy(out->payload, data + 8, out->payload_len);
 
     return 0;
 }
 
-void print_icmp_packet(const unsigned char *packet, uint32_t wire_len, const icmp_packet *icmp) {
-    printf("\n=== ICMP Packet ===\n");
-    printf("Src MAC        : %s\n", icmp->ether.src_mac);
-    printf("Dst MAC        : %s\n", icmp->ether.dst_mac);
-    printf("Ethertype      : 0x%04x\n", icmp->ether.ethertype);
-    puts("\n");
-
-    printf("Source IP      : %s\n", icmp->ip.src);
-    printf("Destination IP : %s\n", icmp->ip.dst);
-    puts("\n");
-
-    printf("ICMP Type      : %u (%s)\n", icmp->type, icmp_type_to_str(icmp->type));
-    printf("ICMP Code      : %u (%s)\n", icmp->code, icmp_code_to_str(icmp->type, icmp->code));
-    printf("Checksum       : 0x%04x\n", icmp->checksum);
-    printf("Identifier     : %u\n", icmp->identifier);
-    printf("Sequence       : %u\n", icmp->sequence);
-    printf("Payload Length : %u bytes\n", icmp->payload_len);
-
-    printf("Raw Bytes      : ");
-    dump_hex_single_line(packet, wire_len);
-    printf("\n===========================\n");
+void print_icmp_packet(outbuf *ob, const packet_view *v, const icmp_packet *icmp) {
+    ob_str(ob, "\n=== ICMP Packet ===\n");
+    ob_field_mac(ob, "Src MAC        : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC        : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype      : ", v->ether.ethertype, 4);
+    ob_puts(ob, "\n");
+
+    ob_field_ip4(ob, "Source IP      : ", &v->ip.src);
+    ob_field_ip4(ob, "Destination IP : ", &v->ip.dst);
+    ob_puts(ob, "\n");
+
+    ob_printf(ob, "ICMP Type      : %u (%s)\n", icmp->type, icmp_type_to_str(icmp->type));
+    ob_printf(ob, "ICMP Code      : %u (%s)\n", icmp->code, icmp_code_to_str(icmp->type, icmp->code));
+    ob_field_hex(ob, "Checksum       : ", icmp->checksum, 4);
+    ob_field_u(ob, "Identifier     : ", icmp->identifier);
+    ob_field_u(ob, "Sequence       : ", icmp->sequence);
+    ob_field_bytes(ob, "Payload Length : ", icmp->payload_len);
+
+    print_raw_bytes(ob, "Raw Bytes      : ", v);
+    ob_str(ob, "\n===========================\n");
 }
 
-void icmp_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet) {
-    (void)args;
-
-    icmp_packet icmp;
-    int offset = 0;
+// -q: "ICMP Echo Request id 1 seq 2", or the type and code
+void summarize_icmp_packet(outbuf *ob, const packet_view *v, const icmp_packet *icmp) {
+    print_summary_head(ob, v, "ICMP");
+    ob_str(ob, icmp_type_to_str(icmp->type));
+    if (icmp->type == ICMP_ECHO_REQUEST || icmp->type == ICMP_ECHO_REPLY) {
+        ob_str(ob, " id ");
+        ob_u64(ob, icmp->identifier);
+        ob_str(ob, " seq ");
+        ob_u64(ob, icmp->sequence);
+    } else {
+        ob_str(ob, ", ");
+        ob_str(ob, icmp_code_to_str(icmp->type, icmp->code));
+    }
+    ob_putc(ob, '\n');
+}
 
-    offset += parse_ethernet_header(packet, header->len, &icmp.ether);
-    offset += parse_ip_header(packet + offset, header->len - offset, &icmp.ip);
+static const field_desc icmp_fields[] = {
+    FIELD(icmp_packet, type, FIELD_UINT),
+    FIELD(icmp_packet, code, FIELD_UINT),
+    FIELD(icmp_packet, checksum, FIELD_UINT),
+    FIELD(icmp_packet, identifier, FIELD_UINT),
+    FIELD(icmp_packet, sequence, FIELD_UINT),
+    FIELD(icmp_packet, payload_len, FIELD_UINT),
+};
 
-    // Ensure it's actually ICMP
-    if (icmp.ip.protocol != IPPROTO_ICMP) {
-        fprintf(stderr, "Not an ICMP packet (protocol = %d)\n", icmp.ip.protocol);
-        return;
-    }
+RECORD_SCHEMA_DEF(icmp_schema, PROTO_ICMP + 1, "icmp", icmp_fields);
 
-    const unsigned char *icmp_payload = packet + offset;
-    int icmp_len = header->len - offset;
+void icmp_handler(Worker *w, const packet_view *v) {
+    icmp_packet icmp;
 
-    if (parse_icmp_packet(icmp_payload, icmp_len, &icmp) == 0) {
-        print_icmp_packet(packet, header->len, &icmp);
+    if (parse_icmp_packet(v->frame + v->payload_off, v->payload_len, &icmp) == 0) {
+        if (w->out.format != OUTPUT_TEXT)
+            record_add(&w->out, &icmp_schema, &icmp);
+        else if (w->app->quiet)
+            summarize_icmp_packet(&w->out, v, &icmp);
+        else
+            print_icmp_packet(&w->out, v, &icmp);
     } else {
         fprintf(stderr, "Failed to parse ICMP packet.\n");
     }
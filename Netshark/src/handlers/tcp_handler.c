@@ -1,9 +1,10 @@
 #include "tcp.h"
+#include "dispatch.h"
 #include "ip.h"
 #include <string.h>
 #include <stdio.h>
 
-void get_tcp_flags(unsigned char flags, char *str) {
+char *get_tcp_flags(unsigned char flags, char *str) {
     strcpy(str, "");
     if (flags & TH_FIN)  strcat(str, "FIN ");
     if (flags & TH_SYN)  strcat(str, "SYN ");
@@ -11,14 +12,15 @@ void get_tcp_flags(unsigned char flags, char *str) {
     if (flags & TH_PUSH) strcat(str, "PSH ");
     if (flags & TH_ACK)  strcat(str, "ACK ");
     if (flags & TH_URG)  strcat(str, "URG ");
+    return str;
 }
 
-int parse_tcp_header(const unsigned char *frame, size_t frame_len, tcp_packet *out) {
-    if (!frame || !out)
+int parse_tcp_header(const unsigned char *frame, size_t frame_len, const ip_header *ip, tcp_packet *out) {
+    if (!frame || !ip || !out)
         return -1;
-    if (out->ip.protocol != IPPROTO_TCP)
+    if (ip->protocol != IPPROTO_TCP)
     {
-        fprintf(stderr, "Error not TCP protocol => %d\n", out->ip.protocol);
+        fprintf(stderr, "Error not TCP protocol => %d\n", ip->protocol);
         return -1;
     }
     if (frame_len < sizeof(tcp_header))
@@ -41,52 +43,81 @@ int parse_tcp_header(const unsigned char *frame, size_t frame_len, tcp_packet *o
     out->header_len = tcp_hdr_len;
 
     // Calculate data length from IP total length
-    int total_ip_len = out->ip.total_len;
-    out->data_len = total_ip_len - out->ip.header_len - tcp_hdr_len;
-
-    get_tcp_flags(out->flags, out->flags_str);
+    int total_ip_len = ip->total_len;
+    out->data_len = total_ip_len - ip->header_len - tcp_hdr_len;
 
     // Return total bytes parsed from Ethernet + IP + TCP headers
     return tcp_hdr_len;
 }
 
 
-void print_tcp_packet(const unsigned char *frame, uint32_t wire_len, const tcp_packet *p) {
-    puts("\n=== TCP Packet ============");
-    printf("Src MAC         : %s\n", p->ether.src_mac);
-    printf("Dst MAC         : %s\n", p->ether.dst_mac);
-    printf("Ethertype       : 0x%04x\n", p->ether.ethertype);
-    puts("");
-    printf("Src IP          : %s\n", p->ip.src);
-    printf("Dst IP          : %s\n", p->ip.dst);
-    puts("");
-    printf("Src Port        : %u\n", p->src_port);
-    printf("Dst Port        : %u\n", p->dst_port);
-    printf("Seq Number      : %u\n", p->seq_num);
-    printf("Ack Number      : %u\n", p->ack_num);
-    printf("Flags           : %s\n", p->flags_str);
-    printf("Window Size     : %u\n", p->window);
-    printf("Header Length   : %u bytes\n", p->header_len);
-    printf("Data Length     : %u bytes\n", p->data_len);
-    puts("");
-    printf("Total on wire   : %u bytes\n", wire_len);
-    printf("Raw Bytes       : "); dump_hex_single_line(frame, wire_len);
-    puts("\n===========================\n");
+void print_tcp_packet(outbuf *ob, const packet_view *v) {
+    const tcp_packet *p = &v->tcp;
+    char flags[32];
+
+    ob_puts(ob, "\n=== TCP Packet ============");
+    ob_field_mac(ob, "Src MAC         : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC         : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype       : ", v->ether.ethertype, 4);
+    ob_puts(ob, "");
+    ob_field_ip4(ob, "Src IP          : ", &v->ip.src);
+    ob_field_ip4(ob, "Dst IP          : ", &v->ip.dst);
+    ob_puts(ob, "");
+    ob_field_u(ob, "Src Port        : ", p->src_port);
+    ob_field_u(ob, "Dst Port        : ", p->dst_port);
+    ob_field_u(ob, "Seq Number      : ", p->seq_num);
+    ob_field_u(ob, "Ack Number      : ", p->ack_num);
+    ob_field_str(ob, "Flags           : ", get_tcp_flags(p->flags, flags));
+    ob_field_u(ob, "Window Size     : ", p->window);
+    ob_field_bytes(ob, "Header Length   : ", p->header_len);
+    ob_field_bytes(ob, "Data Length     : ", p->data_len);
+    ob_puts(ob, "");
+    ob_field_bytes(ob, "Total on wire   : ", v->caplen);
+    print_raw_bytes(ob, "Raw Bytes       : ", v);
+    ob_puts(ob, "\n===========================\n");
 }
 
-void tcp_handler(
-    unsigned char            *user,
-    const struct pcap_pkthdr *hdr,
-    const unsigned char      *frame
-) {
-    (void)user;
-    tcp_packet pkt;
+// -q: "TCP [SYN ACK] seq 1 ack 2 win 64240 len 0"
+void summarize_tcp_packet(outbuf *ob, const packet_view *v) {
+    const tcp_packet *p = &v->tcp;
+    char flags[32];
+    size_t len = strlen(get_tcp_flags(p->flags, flags));
+
+    print_summary_head(ob, v, "TCP");
+    ob_putc(ob, '[');
+    ob_write(ob, flags, len ? len - 1 : 0);     // trailing space
+    ob_str(ob, "] seq ");
+    ob_u64(ob, p->seq_num);
+    ob_str(ob, " ack ");
+    ob_u64(ob, p->ack_num);
+    ob_str(ob, " win ");
+    ob_u64(ob, p->window);
+    ob_str(ob, " len ");
+    ob_u64(ob, v->payload_len);
+    ob_putc(ob, '\n');
+}
 
-    int offset = 0;
-    offset += parse_ethernet_header(frame + offset, hdr->len - offset, &pkt.ether);
-    offset += parse_ip_header(frame + offset, hdr->len - offset, &pkt.ip);
-    parse_tcp_header(frame + offset, hdr->len - offset, &pkt);
+static const field_desc tcp_fields[] = {
+    FIELD(tcp_packet, src_port, FIELD_UINT),
+    FIELD(tcp_packet, dst_port, FIELD_UINT),
+    FIELD(tcp_packet, seq_num, FIELD_UINT),
+    FIELD(tcp_packet, ack_num, FIELD_UINT),
+    FIELD(tcp_packet, header_len, FIELD_UINT),
+    FIELD(tcp_packet, flags, FIELD_UINT),
+    FIELD(tcp_packet, window, FIELD_UINT),
+    FIELD(tcp_packet, checksum, FIELD_UINT),
+    FIELD(tcp_packet, urg_ptr, FIELD_UINT),
+    FIELD(tcp_packet, data_len, FIELD_UINT),
+};
 
+RECORD_SCHEMA_DEF(tcp_schema, PROTO_TCP + 1, "tcp", tcp_fields);
 
-    print_tcp_packet(frame, hdr->len, &pkt);
+void tcp_handler(Worker *w, const packet_view *v)
+{
+    if (w->out.format != OUTPUT_TEXT)
+        record_add(&w->out, &tcp_schema, &v->tcp);
+    else if (w->app->quiet)
+        summarize_tcp_packet(&w->out, v);
+    else
+        print_tcp_packet(&w->out, v);
 }
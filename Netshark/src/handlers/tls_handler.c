@@ -1,9 +1,11 @@
 #include "tls.h"
+#include "dispatch.h"
+#include "topk.h"
 #include <string.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 
-void get_tls_record_type_str(uint8_t type, char *str) {
+char *get_tls_record_type_str(uint8_t type, char *str) {
     switch (type) {
         case TLS_TYPE_CHANGE_CIPHER_SPEC:
             strcpy(str, "Change Cipher Spec");
@@ -21,9 +23,10 @@ void get_tls_record_type_str(uint8_t type, char *str) {
             snprintf(str, 32, "Unknown (%u)", type);
             break;
     }
+    return str;
 }
 
-void get_tls_handshake_type_str(uint8_t type, char *str) {
+char *get_tls_handshake_type_str(uint8_t type, char *str) {
     switch (type) {
         case TLS_HANDSHAKE_HELLO_REQUEST:
             strcpy(str, "Hello Request");
@@ -34,6 +37,9 @@ void get_tls_handshake_type_str(uint8_t type, char *str) {
         case TLS_HANDSHAKE_SERVER_HELLO:
             strcpy(str, "Server Hello");
             break;
+        case TLS_HANDSHAKE_NEW_SESSION_TICKET:
+            strcpy(str, "New Session Ticket");
+            break;
         case TLS_HANDSHAKE_CERTIFICATE:
             strcpy(str, "Certificate");
             break;
@@ -59,9 +65,10 @@ void get_tls_handshake_type_str(uint8_t type, char *str) {
             snprintf(str, 32, "Unknown (%u)", type);
             break;
     }
+    return str;
 }
 
-void get_tls_version_str(uint16_t version, char *str) {
+char *get_tls_version_str(uint16_t version, char *str) {
     switch (version) {
         case SSL_VERSION_3_0:
             strcpy(str, "SSL 3.0");
@@ -82,6 +89,7 @@ void get_tls_version_str(uint16_t version, char *str) {
             snprintf(str, 16, "Unknown 0x%04x", version);
             break;
     }
+    return str;
 }
 
 int is_tls_port(uint16_t port) {
@@ -106,11 +114,11 @@ int is_likely_tls(const unsigned char *data, size_t len) {
     return 1;
 }
 
-int extract_sni(const unsigned char *data, size_t data_len, char *sni_out, size_t sni_max) {
+int extract_sni(const unsigned char *data, size_t data_len, span *sni) {
     if (data_len < 43) return 0;  // Minimum ClientHello size
     
-    // Skip version (2) + random (32) + session_id_len (1)
-    size_t pos = 35;
+    // Skip version (2) + random (32)
+    size_t pos = 34;
     
     // Skip session ID
     if (pos >= data_len) return 0;
@@ -153,9 +161,8 @@ int extract_sni(const unsigned char *data, size_t data_len, char *sni_out, size_
                     sni_pos + name_len <= pos + ext_len && 
                     sni_pos + name_len <= data_len) {
                     
-                    size_t copy_len = (name_len < sni_max - 1) ? name_len : sni_max - 1;
-                    memcpy(sni_out, data + sni_pos, copy_len);
-                    sni_out[copy_len] = '\0';
+                    sni->ptr = data + sni_pos;
+                    sni->len = name_len;
                     return 1;
                 }
             }
@@ -174,7 +181,7 @@ int parse_client_hello(const unsigned char *data, size_t data_len, tls_packet *o
     out->handshake_version = ntohs(hello->version);
     
     // Try to extract SNI
-    out->has_sni = extract_sni(data, data_len, out->server_name, sizeof(out->server_name));
+    out->has_sni = extract_sni(data, data_len, &out->server_name);
     
     return 0;
 }
@@ -197,7 +204,7 @@ void parse_client_key_exchange(const unsigned char *data, size_t len, tls_packet
     out->has_pubkey = 1;
     out->pubkey_len = pubkey_len;
     out->named_curve = 0;  // client doesn’t send curve ID
-    memcpy(out->pubkey, data + 1, pubkey_len);
+    out->pubkey = data + 1;
 }
 
 void parse_server_key_exchange(const unsigned char *data, size_t len, tls_packet *out) {
@@ -212,7 +219,7 @@ void parse_server_key_exchange(const unsigned char *data, size_t len, tls_packet
     out->has_pubkey = 1;
     out->named_curve = named_curve;
     out->pubkey_len = pubkey_len;
-    memcpy(out->pubkey, data + 4, pubkey_len);
+    out->pubkey = data + 4;
 }
 
 
@@ -225,11 +232,13 @@ int parse_tls_handshake(const unsigned char *data, size_t data_len, tls_packet *
     out->handshake_length = (hs->length[0] << 16) | (hs->length[1] << 8) | hs->length[2];
     out->is_handshake = 1;
 
-    get_tls_handshake_type_str(out->handshake_type, out->handshake_type_str);
-
     const unsigned char *handshake_data = data + sizeof(tls_handshake_header);
     size_t handshake_data_len = data_len - sizeof(tls_handshake_header);
 
+    // The bytes after it belong to the next message
+    if (handshake_data_len > out->handshake_length)
+        handshake_data_len = out->handshake_length;
+
     switch (out->handshake_type) {
         case TLS_HANDSHAKE_CLIENT_HELLO:
             parse_client_hello(handshake_data, handshake_data_len, out);
@@ -252,22 +261,24 @@ int parse_tls_handshake(const unsigned char *data, size_t data_len, tls_packet *
 
 
 
-int parse_tls_record(const unsigned char *data, size_t data_len, tls_packet *out) {
-    if (!data || !out || data_len < sizeof(tls_record_header))
-        return -1;
-    
+// The record header alone, its body is left to the caller
+static void tls_record_head(const unsigned char *data, tls_packet *out) {
     const tls_record_header *rec = (const tls_record_header *)data;
+
     out->record_type = rec->type;
     out->tls_version = ntohs(rec->version);
     out->record_length = ntohs(rec->length);
     out->payload_len = out->record_length;
-    
+
     // Check if this looks like encrypted data
     out->is_encrypted = (out->record_type == TLS_TYPE_APPLICATION_DATA);
-    
-    get_tls_record_type_str(out->record_type, out->record_type_str);
-    get_tls_version_str(out->tls_version, out->version_str);
-    
+}
+
+int parse_tls_record(const unsigned char *data, size_t data_len, tls_packet *out) {
+    if (!data || !out || data_len < sizeof(tls_record_header))
+        return -1;
+
+    tls_record_head(data, out);
     if (out->record_type == TLS_TYPE_HANDSHAKE && 
         data_len > sizeof(tls_record_header)) {
         const unsigned char *handshake_data = data + sizeof(tls_record_header);
@@ -277,140 +288,682 @@ int parse_tls_record(const unsigned char *data, size_t data_len, tls_packet *out
         // Minimal ChangeCipherSpec message has a payload of 0x01
         out->is_handshake = 1;
         out->handshake_type = TLS_TYPE_CHANGE_CIPHER_SPEC;
-        strcpy(out->handshake_type_str, "Change Cipher Spec");
     }
 
 
     return sizeof(tls_record_header);
 }
 
-void print_tls_packet(const unsigned char *frame, uint32_t wire_len, const tls_packet *p) {
-    puts("\n=== TLS Packet ============");
+void print_tls_packet(outbuf *ob, const packet_view *v, const tls_packet *p) {
+    const tcp_packet *tcp = &v->tcp;
+    char flags[32], str[32];
+
+    ob_puts(ob, "\n=== TLS Packet ============");
     
     // Ethernet Layer
-    printf("Src MAC         : %s\n", p->tcp.ether.src_mac);
-    printf("Dst MAC         : %s\n", p->tcp.ether.dst_mac);
-    printf("Ethertype       : 0x%04x\n", p->tcp.ether.ethertype);
-    puts("");
+    ob_field_mac(ob, "Src MAC         : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC         : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype       : ", v->ether.ethertype, 4);
+    ob_puts(ob, "");
     
     // IP Layer
-    printf("Src IP          : %s\n", p->tcp.ip.src);
-    printf("Dst IP          : %s\n", p->tcp.ip.dst);
-    printf("IP Version      : %u\n", p->tcp.ip.version);
-    printf("IP Header Len   : %u bytes\n", p->tcp.ip.header_len);
-    printf("IP Total Len    : %u bytes\n", p->tcp.ip.total_len);
-    printf("IP ID           : %u\n", p->tcp.ip.id);
-    // printf("IP Flags        : 0x%02x\n", p->tcp.ip.flags);
-    printf("IP Frag Offset  : %u\n", p->tcp.ip.frag_off);
-    printf("IP TTL          : %u\n", p->tcp.ip.ttl);
-    printf("IP Protocol     : %u\n", p->tcp.ip.protocol);
-    printf("IP Checksum     : 0x%04x\n", p->tcp.ip.checksum);
-    puts("");
+    ob_field_ip4(ob, "Src IP          : ", &v->ip.src);
+    ob_field_ip4(ob, "Dst IP          : ", &v->ip.dst);
+    ob_field_u(ob, "IP Version      : ", v->ip.version);
+    ob_field_bytes(ob, "IP Header Len   : ", v->ip.header_len);
+    ob_field_bytes(ob, "IP Total Len    : ", v->ip.total_len);
+    ob_field_u(ob, "IP ID           : ", v->ip.id);
+    // ob_printf(ob, "IP Flags        : 0x%02x\n", v->ip.flags);
+    ob_field_u(ob, "IP Frag Offset  : ", v->ip.frag_off);
+    ob_field_u(ob, "IP TTL          : ", v->ip.ttl);
+    ob_field_u(ob, "IP Protocol     : ", v->ip.protocol);
+    ob_field_hex(ob, "IP Checksum     : ", v->ip.checksum, 4);
+    ob_puts(ob, "");
     
     // TCP Layer
-    printf("Src Port        : %u\n", p->tcp.src_port);
-    printf("Dst Port        : %u\n", p->tcp.dst_port);
-    printf("TCP Seq Number  : %u\n", p->tcp.seq_num);
-    printf("TCP Ack Number  : %u\n", p->tcp.ack_num);
-    printf("TCP Header Len  : %u bytes\n", p->tcp.header_len);
-    printf("TCP Flags       : 0x%02x (%s)\n", p->tcp.flags, p->tcp.flags_str);
-    printf("TCP Window      : %u\n", p->tcp.window);
-    printf("TCP Checksum    : 0x%04x\n", p->tcp.checksum);
-    printf("TCP Urgent Ptr  : %u\n", p->tcp.urg_ptr);
-    printf("TCP Data Len    : %u bytes\n", p->tcp.data_len);
-    puts("");
+    ob_field_u(ob, "Src Port        : ", tcp->src_port);
+    ob_field_u(ob, "Dst Port        : ", tcp->dst_port);
+    ob_field_u(ob, "TCP Seq Number  : ", tcp->seq_num);
+    ob_field_u(ob, "TCP Ack Number  : ", tcp->ack_num);
+    ob_field_bytes(ob, "TCP Header Len  : ", tcp->header_len);
+    ob_printf(ob, "TCP Flags       : 0x%02x (%s)\n", tcp->flags, get_tcp_flags(tcp->flags, flags));
+    ob_field_u(ob, "TCP Window      : ", tcp->window);
+    ob_field_hex(ob, "TCP Checksum    : ", tcp->checksum, 4);
+    ob_field_u(ob, "TCP Urgent Ptr  : ", tcp->urg_ptr);
+    ob_field_bytes(ob, "TCP Data Len    : ", tcp->data_len);
+    ob_puts(ob, "");
     
     // TLS Record Layer
-    printf("TLS Record Type : %u (%s)\n", p->record_type, p->record_type_str);
-    printf("TLS Version     : 0x%04x (%s)\n", p->tls_version, p->version_str);
-    printf("Record Length   : %u bytes\n", p->record_length);
-    printf("Payload Length  : %u bytes\n", p->payload_len);
-    printf("Is Encrypted    : %s\n", p->is_encrypted ? "Yes" : "No");
-    printf("Is Handshake    : %s\n", p->is_handshake ? "Yes" : "No");
-    puts("");
+    ob_printf(ob, "TLS Record Type : %u (%s)\n", p->record_type, get_tls_record_type_str(p->record_type, str));
+    ob_printf(ob, "TLS Version     : 0x%04x (%s)\n", p->tls_version, get_tls_version_str(p->tls_version, str));
+    ob_field_bytes(ob, "Record Length   : ", p->record_length);
+    ob_field_bytes(ob, "Payload Length  : ", p->payload_len);
+    ob_field_str(ob, "Is Encrypted    : ", p->is_encrypted ? "Yes" : "No");
+    ob_field_str(ob, "Is Handshake    : ", p->is_handshake ? "Yes" : "No");
+    if (p->reassembled)
+        ob_field_str(ob, "Reassembled     : ", "Yes, from several records");
+    if (p->truncated)
+        ob_field_str(ob, "Truncated       : ", "Yes");
+    ob_puts(ob, "");
     
     // TLS Handshake Layer (if applicable)
     if (p->is_handshake) {
         if (p->handshake_type != TLS_TYPE_CHANGE_CIPHER_SPEC) {
-            printf("Handshake Length: %u bytes\n", p->handshake_length);
+            ob_field_bytes(ob, "Handshake Length: ", p->handshake_length);
         }
 
         if (p->handshake_version > 0) {
             char hs_version[16];
             get_tls_version_str(p->handshake_version, hs_version);
-            printf("Handshake Ver   : 0x%04x (%s)\n", p->handshake_version, hs_version);
+            ob_printf(ob, "Handshake Ver   : 0x%04x (%s)\n", p->handshake_version, hs_version);
         }
         
-        printf("Has SNI         : %s\n", p->has_sni ? "Yes" : "No");
+        ob_field_str(ob, "Has SNI         : ", p->has_sni ? "Yes" : "No");
         if (p->has_sni) {
-            printf("Server Name     : %s\n", p->server_name);
+            ob_printf(ob, "Server Name     : %.*s\n", (int)p->server_name.len, p->server_name.ptr);
+        }
+        if (p->has_client_fp) {
+            ob_printf(ob, "JA3             : %.*s\n", (int)p->ja3.len, p->ja3.ptr);
+            ob_printf(ob, "JA4             : %.*s\n", (int)p->ja4.len, p->ja4.ptr);
+        }
+        if (p->has_server_fp) {
+            ob_printf(ob, "JA3S            : %.*s\n", (int)p->ja3s.len, p->ja3s.ptr);
+            ob_printf(ob, "JA4S            : %.*s\n", (int)p->ja4s.len, p->ja4s.ptr);
         }
-        puts("");
+        if (p->cert_count)
+            ob_field_u(ob, "Certificates    : ", p->cert_count);
+        if (p->has_cert) {
+            char date[X509_DATE_LEN + 1];
+
+            ob_field_str(ob, "Subject         : ", p->cert_subject);
+            ob_field_str(ob, "Issuer          : ", p->cert_issuer);
+            if (p->cert_san[0])
+                ob_field_str(ob, "Alt Names       : ", p->cert_san);
+            x509_date(p->cert_not_before.tv_sec, date);
+            ob_field_str(ob, "Not Before      : ", date);
+            x509_date(p->cert_not_after.tv_sec, date);
+            ob_field_str(ob, "Not After       : ", date);
+            ob_field_str(ob, "Public Key      : ", p->cert_key);
+            ob_field_str(ob, "SHA-256         : ", p->cert_sha256);
+        }
+        ob_puts(ob, "");
     }
 
     if (p->has_pubkey) {
-        printf("Key Exchange    : Ephemeral Public Key\n");
+        ob_str(ob, "Key Exchange    : Ephemeral Public Key\n");
         if (p->named_curve)
-            printf("Curve           : 0x%04x\n", p->named_curve);
-        printf("Public Key Len  : %u bytes\n", p->pubkey_len);
-        printf("Public Key      : ");
-        for (int i = 0; i < p->pubkey_len; ++i) {
-            printf("%02x", p->pubkey[i]);
-        }
-        puts("\n");
+            ob_field_hex(ob, "Curve           : ", p->named_curve, 4);
+        ob_field_bytes(ob, "Public Key Len  : ", p->pubkey_len);
+        ob_str(ob, "Public Key      : ");
+        ob_hexdump(ob, p->pubkey, p->pubkey_len, 0);
+        ob_puts(ob, "\n");
     }
 
     
     // Summary
-    printf("Total on wire   : %u bytes\n", wire_len);
-    printf("Raw Bytes       : "); dump_hex_single_line(frame, wire_len);
-    puts("\n===========================\n");
+    ob_field_bytes(ob, "Total on wire   : ", v->caplen);
+    print_raw_bytes(ob, "Raw Bytes       : ", v);
+    ob_puts(ob, "\n===========================\n");
+}
+
+
+// -q: "TLS 1.2 Client Hello sni example.com" or "TLS 1.3 Application Data len 517"
+void summarize_tls_packet(outbuf *ob, const packet_view *v, const tls_packet *p)
+{
+    char str[32];
+
+    const char *version = get_tls_version_str(p->tls_version, str);
+
+    print_summary_head(ob, v, "TLS");
+    if (strncmp(version, "TLS ", 4) == 0)
+        version += 4;
+    ob_str(ob, version);
+    ob_putc(ob, ' ');
+    if (p->is_handshake && p->record_type == TLS_TYPE_HANDSHAKE)
+        ob_str(ob, get_tls_handshake_type_str(p->handshake_type, str));
+    else
+        ob_str(ob, get_tls_record_type_str(p->record_type, str));
+    if (p->has_sni) {
+        ob_str(ob, " sni ");
+        print_printable(ob, p->server_name.ptr, p->server_name.len);
+    }
+    if (p->handshake_type == TLS_HANDSHAKE_CLIENT_HELLO && p->has_client_fp) {
+        ob_str(ob, " ja4 ");
+        ob_write(ob, p->ja4.ptr, p->ja4.len);
+        ob_str(ob, " ja3 ");
+        ob_write(ob, p->ja3.ptr, p->ja3.len);
+    } else if (p->handshake_type == TLS_HANDSHAKE_SERVER_HELLO && p->has_server_fp) {
+        ob_str(ob, " ja4s ");
+        ob_write(ob, p->ja4s.ptr, p->ja4s.len);
+        ob_str(ob, " ja3s ");
+        ob_write(ob, p->ja3s.ptr, p->ja3s.len);
+    }
+    if (p->cert_count) {
+        ob_str(ob, " certs ");
+        ob_u64(ob, p->cert_count);
+    }
+    if (p->has_cert) {
+        char date[X509_DATE_LEN + 1];
+
+        ob_str(ob, " cn ");
+        if (p->cert_cn[0])
+            print_printable(ob, p->cert_cn, strlen(p->cert_cn));
+        else
+            ob_putc(ob, '.');
+        ob_str(ob, " expires ");
+        ob_write(ob, date, x509_date(p->cert_not_after.tv_sec, date));
+    }
+    ob_str(ob, " len ");
+    ob_u64(ob, p->record_length);
+    if (p->truncated)
+        ob_str(ob, " truncated");
+    ob_putc(ob, '\n');
+}
+
+static const field_desc tls_fields[] = {
+    FIELD(tls_packet, record_type, FIELD_UINT),
+    FIELD(tls_packet, tls_version, FIELD_UINT),
+    FIELD(tls_packet, record_length, FIELD_UINT),
+    FIELD(tls_packet, is_encrypted, FIELD_BOOL),
+    FIELD(tls_packet, is_handshake, FIELD_BOOL),
+    FIELD_IF(tls_packet, handshake_type, FIELD_UINT, is_handshake),
+    FIELD_IF(tls_packet, handshake_length, FIELD_UINT, is_handshake),
+    FIELD_IF(tls_packet, handshake_version, FIELD_UINT, is_handshake),
+    FIELD_IF(tls_packet, server_name, FIELD_SPAN, has_sni),
+    FIELD_IF(tls_packet, named_curve, FIELD_UINT, has_pubkey),
+    FIELD_IF(tls_packet, pubkey_len, FIELD_UINT, has_pubkey),
+    FIELD(tls_packet, payload_len, FIELD_UINT),
+    FIELD_IF(tls_packet, reassembled, FIELD_BOOL, reassembled),
+    FIELD_IF(tls_packet, truncated, FIELD_BOOL, truncated),
+    FIELD_IF(tls_packet, ja3, FIELD_SPAN, has_client_fp),
+    FIELD_IF(tls_packet, ja4, FIELD_SPAN, has_client_fp),
+    FIELD_IF(tls_packet, ja3s, FIELD_SPAN, has_server_fp),
+    FIELD_IF(tls_packet, ja4s, FIELD_SPAN, has_server_fp),
+    FIELD_IF(tls_packet, cert_count, FIELD_UINT, cert_count),
+    FIELD_IF(tls_packet, cert_subject, FIELD_STR, has_cert),
+    FIELD_IF(tls_packet, cert_issuer, FIELD_STR, has_cert),
+    FIELD_IF(tls_packet, cert_san, FIELD_STR, has_cert),
+    FIELD_IF(tls_packet, cert_key, FIELD_STR, has_cert),
+    FIELD_IF(tls_packet, cert_sha256, FIELD_STR, has_cert),
+    FIELD_IF(tls_packet, cert_not_before, FIELD_TS, has_cert),
+    FIELD_IF(tls_packet, cert_not_after, FIELD_TS, has_cert),
+};
+
+RECORD_SCHEMA_DEF(tls_schema, PROTO_TLS + 1, "tls", tls_fields);
+
+static void tls_output(Worker *w, const packet_view *v, const tls_packet *pkt)
+{
+    if (w->out.format != OUTPUT_TEXT)
+        record_add(&w->out, &tls_schema, pkt);
+    else if (w->app->quiet)
+        summarize_tls_packet(&w->out, v, pkt);
+    else
+        print_tls_packet(&w->out, v, pkt);
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get24(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static void tls_top(Worker *w, const packet_view *v, topk_list_id list, const char *fp, size_t len)
+{
+    if (w->top.lists)
+        topk_add(&w->top, list, fp, len, v->hdr->ts.tv_sec);
+}
+
+// Fingerprints of the connection's first whole ClientHello or ServerHello
+static void tls_fingerprints(Worker *w, const packet_view *v, tls_fingerprint *fp, int client,
+                             const unsigned char *body, tls_hello_fields *h)
+{
+    if (client) {
+        tls_client_fingerprint(&w->fingerprints, body, h, fp);
+        tls_top(w, v, TOPK_TLS_JA3, fp->ja3, TLS_JA3_LEN);
+        tls_top(w, v, TOPK_TLS_JA4, fp->ja4, TLS_JA4_LEN);
+    } else {
+        tls_server_fingerprint(&w->fingerprints, body, h, fp);
+        tls_top(w, v, TOPK_TLS_JA3S, fp->ja3s, TLS_JA3_LEN);
+        tls_top(w, v, TOPK_TLS_JA4S, fp->ja4s, TLS_JA4S_LEN);
+    }
+}
+
+// Every hello carries the fingerprints the connection has so far
+static void tls_fingerprint_fields(tls_packet *pkt, const tls_fingerprint *fp)
+{
+    if (fp->client) {
+        pkt->has_client_fp = 1;
+        pkt->ja3 = (span){ (const unsigned char *)fp->ja3, TLS_JA3_LEN };
+        pkt->ja4 = (span){ (const unsigned char *)fp->ja4, TLS_JA4_LEN };
+    }
+    if (fp->server) {
+        pkt->has_server_fp = 1;
+        pkt->ja3s = (span){ (const unsigned char *)fp->ja3s, TLS_JA3_LEN };
+        pkt->ja4s = (span){ (const unsigned char *)fp->ja4s, TLS_JA4S_LEN };
+    }
+}
+
+// Certificates of a TLS 1.2 Certificate message, looked up in the worker's
+// cache: the CA certificates first, so that the leaf the packet points to
+// is the last entry used. A message cut short gives the certificates that
+// fit. TLS 1.3 sends its certificates encrypted.
+static void tls_certificates(Worker *w, const packet_view *v, tls_packet *pkt,
+                             const unsigned char *body, size_t len)
+{
+    size_t off[X509_CHAIN_MAX], clen[X509_CHAIN_MAX];
+    size_t pos = 3, end, n = 0;
+    const x509_entry *leaf;
+
+    if (len < 3)
+        return;
+    end = 3 + (size_t)get24(body);
+    if (end > len)
+        end = len;
+    while (pos + 3 <= end && n < X509_CHAIN_MAX) {
+        clen[n] = get24(body + pos);
+        if (pos + 3 + clen[n] > end)
+            break;
+        off[n] = pos + 3;
+        pos = off[n] + clen[n];
+        n++;
+    }
+    pkt->cert_count = (uint8_t)n;
+    if (n == 0)
+        return;
+    for (size_t i = n - 1; i > 0; i--)
+        x509_lookup(&w->certs, body + off[i], clen[i], v->hdr->ts.tv_sec);
+    leaf = x509_lookup(&w->certs, body + off[0], clen[0], v->hdr->ts.tv_sec);
+    if (!leaf)
+        return;
+    pkt->has_cert = 1;
+    pkt->cert_subject = leaf->cert.subject;
+    pkt->cert_issuer = leaf->cert.issuer;
+    pkt->cert_cn = leaf->cert.cn;
+    pkt->cert_san = leaf->cert.san;
+    pkt->cert_key = leaf->cert.key;
+    pkt->cert_sha256 = leaf->sha256;
+    pkt->cert_not_before.tv_sec = leaf->cert.not_before < 0 ? 0 : leaf->cert.not_before;
+    pkt->cert_not_after.tv_sec = leaf->cert.not_after < 0 ? 0 : leaf->cert.not_after;
+}
+
+static inline uint64_t packet_us(const packet_view *v)
+{
+    return (uint64_t)v->hdr->ts.tv_sec * 1000000 + v->hdr->ts.tv_usec;
+}
+
+// Latency key code of a version: 10 to 13 for TLS 1.0 to 1.3
+static int tls_version_code(uint16_t version)
+{
+    return version >= TLS_VERSION_1_0 && version <= TLS_VERSION_1_3 ? (version & 0xff) + 9 : 0;
+}
+
+// The ClientHello's server name, or else the server's address
+static void tls_timing_name(tls_timing *t, const packet_view *v, const tls_packet *pkt)
+{
+    if (pkt->has_sni) {
+        t->name_len = pkt->server_name.len < LATENCY_NAME_MAX ? pkt->server_name.len : LATENCY_NAME_MAX;
+        memcpy(t->name, pkt->server_name.ptr, t->name_len);
+    } else {
+        inet_ntop(AF_INET, &v->ip.dst, t->name, sizeof(t->name));
+        t->name_len = strlen(t->name);
+    }
+}
+
+// Session the client offers to resume: a ticket, else a session ID. A
+// TLS 1.3 client sends a random one, so its ID is only an offer when the
+// server issued it.
+static void tls_resume_offer(Worker *w, const packet_view *v, tls_timing *t, const tls_hello_fields *h)
+{
+    tls_session_cache *sc = &w->sessions;
+    const unsigned char *server = (const unsigned char *)&v->ip.dst;
+    uint16_t version = h->supported ? h->supported : h->version;
+
+    if (h->session_id)
+        t->session_id = tls_session_key(server, h->session_id, h->session_id_len);
+    if (h->ticket)
+        t->offered = tls_session_key(server, h->ticket, h->ticket_len);
+    else if (t->session_id && (version < TLS_VERSION_1_3 || tls_session_known(sc, t->session_id)))
+        t->offered = t->session_id;
+    t->attempt = h->psk || t->offered;
+    if (t->attempt)
+        sc->attempts++;
+    if (t->offered && tls_session_known(sc, t->offered))
+        sc->known++;
+}
+
+// The ServerHello answers the first ClientHello: the handshake is timed
+// under the version and whether the session was resumed. TLS 1.2 resumes
+// by echoing the client's session ID, TLS 1.3 with pre_shared_key; the
+// session ID of a full TLS 1.2 handshake is remembered.
+static void tls_resume_answer(Worker *w, const packet_view *v, tls_timing *t, const tls_hello_fields *h)
+{
+    tls_session_cache *sc = &w->sessions;
+    uint16_t version = h->supported ? h->supported : h->version;
+    uint64_t key = 0, now = packet_us(v), us[2];
+    int resumed;
+
+    if (h->session_id)
+        key = tls_session_key((const unsigned char *)&v->ip.src, h->session_id, h->session_id_len);
+    if (version >= TLS_VERSION_1_3)
+        resumed = h->psk;
+    else
+        resumed = key && key == t->session_id;
+    if (key && !resumed && version < TLS_VERSION_1_3)
+        tls_session_issue(sc, key);
+    sc->handshakes++;
+    if (resumed)
+        sc->resumed++;
+
+    t->code = tls_version_code(version) + (resumed ? TLS_RESUMED_CODE : 0);
+    us[0] = now > t->hello_us ? now - t->hello_us : 0;
+    us[1] = LATENCY_NONE;
+    latency_add(&w->latency, LATENCY_TLS, (const unsigned char *)t->name, t->name_len,
+                t->code, v->hdr->ts.tv_sec, us);
+}
+
+// Whether a hello of `side` times the handshake of a reassembled
+// connection: its first ClientHello, then the ServerHello answering it. A
+// ClientHello sent again after a HelloRetryRequest is still timed from
+// the first one.
+static int tls_hello_timed(const tls_conn *c, int side, int client)
+{
+    const tls_timing *t = &c->timing;
+
+    if (!c->tracked)
+        return 0;
+    if (client)
+        return !t->hello_us;
+    return t->hello_us && !t->code && side != t->client;
 }
 
+static void tls_hello_timing(Worker *w, const packet_view *v, tls_conn *c, int side, int client,
+                             const tls_packet *pkt, const tls_hello_fields *h)
+{
+    tls_timing *t = &c->timing;
+
+    if (client) {
+        t->hello_us = packet_us(v);
+        t->client = side;
+        tls_timing_name(t, v, pkt);
+        tls_resume_offer(w, v, t, h);
+    } else if (!h->retry) {
+        tls_resume_answer(w, v, t, h);
+    }
+}
 
-void tls_handler(
-    unsigned char            *user,
-    const struct pcap_pkthdr *hdr,
-    const unsigned char      *frame
-) {
-    (void)user;
+// A ClientHello or ServerHello, walked once for what the connection still
+// needs of it: its fingerprints, its handshake timing and session
+static void tls_hello(Worker *w, const packet_view *v, tls_conn *c, int side, tls_packet *pkt,
+                      const unsigned char *body, size_t len)
+{
+    int client = pkt->handshake_type == TLS_HANDSHAKE_CLIENT_HELLO;
+    int fingerprint = client ? !c->fp.client : !c->fp.server;
+    int timed = tls_hello_timed(c, side, client);
+    tls_hello_fields h;
+
+    if (!pkt->truncated && (fingerprint || timed) && tls_hello_walk(body, len, client, &h) == 0) {
+        // The fingerprints reorder the lists, the timing only reads the rest
+        if (timed)
+            tls_hello_timing(w, v, c, side, client, pkt, &h);
+        if (fingerprint)
+            tls_fingerprints(w, v, &c->fp, client, body, &h);
+    }
+    tls_fingerprint_fields(pkt, &c->fp);
+}
+
+// A TLS 1.2 NewSessionTicket, sent before ChangeCipherSpec: lifetime,
+// then the ticket the client may offer later
+static void tls_session_ticket(Worker *w, const packet_view *v, const tls_conn *c, int side,
+                               const unsigned char *body, size_t len)
+{
+    if (!c->tracked || !c->timing.hello_us || side == c->timing.client || len < 6
+        || get16(body + 4) == 0 || 6 + (size_t)get16(body + 4) > len)
+        return;
+    tls_session_issue(&w->sessions, tls_session_key((const unsigned char *)&v->ip.src,
+                                                    body + 6, get16(body + 4)));
+}
+
+// First Application Data record of the client once the ServerHello came:
+// the handshake is over from its side. With TLS 1.3 that is its Finished,
+// sent with the first request.
+static void tls_timing_data(Worker *w, const packet_view *v, tls_timing *t)
+{
+    uint64_t now = packet_us(v), us[2];
+
+    us[0] = LATENCY_NONE;
+    us[1] = now > t->hello_us ? now - t->hello_us : 0;
+    latency_add(&w->latency, LATENCY_TLS, (const unsigned char *)t->name, t->name_len,
+                t->code, v->hdr->ts.tv_sec, us);
+    t->done = 1;
+}
+
+// One whole handshake message, or its start when `len` falls short
+static void tls_message(Worker *w, const packet_view *v, tls_conn *c, int side, const tls_packet *rec,
+                        const unsigned char *msg, size_t len, int reassembled)
+{
+    const unsigned char *body = msg + TLS_HANDSHAKE_HEADER_LEN;
+    size_t body_len = len > TLS_HANDSHAKE_HEADER_LEN ? len - TLS_HANDSHAKE_HEADER_LEN : 0;
+    tls_packet pkt = *rec;
+
+    parse_tls_handshake(msg, len, &pkt);
+    pkt.reassembled = reassembled;
+    pkt.truncated = len < TLS_HANDSHAKE_HEADER_LEN + (size_t)pkt.handshake_length;
+    switch (pkt.handshake_type) {
+        case TLS_HANDSHAKE_CLIENT_HELLO:
+        case TLS_HANDSHAKE_SERVER_HELLO:
+            tls_hello(w, v, c, side, &pkt, body, body_len);
+            break;
+        case TLS_HANDSHAKE_NEW_SESSION_TICKET:
+            if (!pkt.truncated)
+                tls_session_ticket(w, v, c, side, body, body_len);
+            break;
+        case TLS_HANDSHAKE_CERTIFICATE:
+            if (body_len)
+                tls_certificates(w, v, &pkt, body, body_len);
+            break;
+        default:
+            break;
+    }
+    tls_output(w, v, &pkt);
+}
+
+static void tls_handshake_drop(stream_pool *pool, tls_handshake_dir *hd)
+{
+    if (hd->buf)
+        stream_buffer_put(pool, hd->buf, hd->cls);
+    hd->buf = NULL;
+    hd->len = 0;
+    hd->need = 0;
+    hd->discard = 0;
+}
+
+// The handshake bytes of one record: every message they complete is
+// dissected, in place when the record holds all of it. With a pool the
+// start of a message the record cuts is gathered until the records after
+// it complete it; without one (no stream) it is dissected as it is.
+static void tls_handshake_feed(Worker *w, const packet_view *v, tls_conn *c, int side, stream_pool *pool,
+                               const tls_packet *rec, const unsigned char *data, size_t len)
+{
+    tls_handshake_dir *hd = &c->dir[side];
+    size_t off = 0;
+
+    while (off < len) {
+        size_t left = len - off;
+        size_t n;
+
+        if (hd->discard) {
+            n = hd->discard < left ? hd->discard : left;
+            hd->discard -= n;
+            off += n;
+            continue;
+        }
+        if (hd->len == 0) {
+            if (left >= TLS_HANDSHAKE_HEADER_LEN) {
+                size_t msg_len = TLS_HANDSHAKE_HEADER_LEN + get24(data + off + 1);
+
+                if (msg_len <= left) {
+                    tls_message(w, v, c, side, rec, data + off, msg_len, 0);
+                    off += msg_len;
+                    continue;
+                }
+            }
+            if (pool == NULL) {
+                tls_message(w, v, c, side, rec, data + off, left, 0);
+                return;
+            }
+        }
+        if (hd->len < TLS_HANDSHAKE_HEADER_LEN) {
+            n = TLS_HANDSHAKE_HEADER_LEN - hd->len < left ? TLS_HANDSHAKE_HEADER_LEN - hd->len : left;
+            memcpy(hd->head + hd->len, data + off, n);
+            hd->len += n;
+            off += n;
+            if (hd->len < TLS_HANDSHAKE_HEADER_LEN)
+                return;
+            hd->need = TLS_HANDSHAKE_HEADER_LEN + get24(hd->head + 1);
+            if (hd->need > TLS_HANDSHAKE_MAX
+                || (hd->buf = stream_buffer_get(pool, hd->need, &hd->cls)) == NULL) {
+                // Too large to gather: its header, then its body passed over
+                tls_message(w, v, c, side, rec, hd->head, TLS_HANDSHAKE_HEADER_LEN, 1);
+                n = hd->need - TLS_HANDSHAKE_HEADER_LEN;
+                tls_handshake_drop(pool, hd);
+                hd->discard = n;
+                continue;
+            }
+            memcpy(hd->buf, hd->head, TLS_HANDSHAKE_HEADER_LEN);
+            left = len - off;
+        }
+        n = hd->need - hd->len < left ? hd->need - hd->len : left;
+        memcpy(hd->buf + hd->len, data + off, n);
+        hd->len += n;
+        off += n;
+        if (hd->len == hd->need) {
+            tls_message(w, v, c, side, rec, hd->buf, hd->need, 1);
+            tls_handshake_drop(pool, hd);
+        }
+    }
+}
+
+// One record, `have` bytes of it at hand. Handshake records go message by
+// message, until ChangeCipherSpec makes the sender's ones opaque.
+static void tls_record(Worker *w, const packet_view *v, tls_conn *c, int side, stream_pool *pool,
+                       const unsigned char *rec, size_t have)
+{
+    tls_handshake_dir *hd = &c->dir[side];
+    size_t body = have - TLS_RECORD_HEADER_LEN;
     tls_packet pkt;
+
     memset(&pkt, 0, sizeof(pkt));
-    
-    int offset = 0;
-    
-    // Parse Ethernet header
-    int eth_len = parse_ethernet_header(frame + offset, hdr->len - offset, &pkt.tcp.ether);
-    if (eth_len < 0) return;
-    offset += eth_len;
-    
-    // Parse IP header
-    int ip_len = parse_ip_header(frame + offset, hdr->len - offset, &pkt.tcp.ip);
-    if (ip_len < 0) return;
-    offset += ip_len;
-    
-    // Parse TCP header
-    int tcp_len = parse_tcp_header(frame + offset, hdr->len - offset, &pkt.tcp);
-    if (tcp_len < 0) return;
-    offset += tcp_len;
-    
-    // Check if this might be TLS traffic
-    if (pkt.tcp.data_len == 0) return;  // No TCP payload
-    
-    const unsigned char *tls_data = frame + offset;
-    size_t tls_len = hdr->len - offset;
-    
-    // Basic heuristic: check if it's on a TLS port or looks like TLS
-    if (!is_tls_port(pkt.tcp.src_port) && !is_tls_port(pkt.tcp.dst_port)) {
-        if (!is_likely_tls(tls_data, tls_len)) {
-            return;  // Doesn't look like TLS
+    tls_record_head(rec, &pkt);
+    if (body > pkt.record_length)
+        body = pkt.record_length;
+    if (pkt.record_type == TLS_TYPE_HANDSHAKE && !hd->encrypted && body) {
+        tls_handshake_feed(w, v, c, side, pool, &pkt, rec + TLS_RECORD_HEADER_LEN, body);
+        return;
+    }
+    if (pkt.record_type == TLS_TYPE_APPLICATION_DATA && c->timing.code && !c->timing.done
+        && side == c->timing.client)
+        tls_timing_data(w, v, &c->timing);
+    if (pkt.record_type == TLS_TYPE_HANDSHAKE) {
+        pkt.is_encrypted = hd->encrypted;
+    } else if (pkt.record_type == TLS_TYPE_CHANGE_CIPHER_SPEC) {
+        pkt.is_handshake = 1;
+        pkt.handshake_type = TLS_TYPE_CHANGE_CIPHER_SPEC;
+        hd->encrypted = 1;
+    }
+    tls_output(w, v, &pkt);
+}
+
+// Segments of flows without a stream: every record the payload holds,
+// each handshake message of theirs as far as the segment goes
+void tls_handler(Worker *w, const packet_view *v)
+{
+    const unsigned char *data = v->frame + v->payload_off;
+    size_t len = v->payload_len;
+    tls_conn c;
+    size_t off = 0;
+
+    memset(&c, 0, sizeof(c));
+    while (len - off >= TLS_RECORD_HEADER_LEN) {
+        const unsigned char *rec = data + off;
+        size_t rec_len = TLS_RECORD_HEADER_LEN + ((rec[3] << 8) | rec[4]);
+        size_t have = rec_len < len - off ? rec_len : len - off;
+
+        // The first one is shown whatever it looks like
+        if (off && !is_likely_tls(rec, len - off))
+            break;
+        tls_record(w, v, &c, 0, NULL, rec, have);
+        off += have;
+    }
+}
+
+// One direction of a reassembled connection, record by record. Handshake
+// records are dissected once whole, message by message, messages spanning
+// records gathered in a pool buffer (see tls_handshake_dir); the others
+// only need their header, their body is passed over. Records can't be
+// found again after a hole unless one starts right after it.
+size_t tls_stream(Worker *w, const packet_view *v, tcp_stream *s, int side,
+                  const unsigned char *data, size_t len, unsigned flags)
+{
+    stream_dir *d = &s->dir[side];
+    stream_pool *pool = &w->streams;
+    tls_conn none;
+    tls_conn *c;
+    size_t off = 0;
+
+    if (flags & STREAM_END) {
+        c = s->state;
+        if (c) {
+            tls_handshake_drop(pool, &c->dir[0]);
+            tls_handshake_drop(pool, &c->dir[1]);
         }
+        return 0;
     }
-    
-    // Parse TLS record
-    if (parse_tls_record(tls_data, tls_len, &pkt) < 0) {
-        return;
+    c = stream_state(pool, s, sizeof(*c));
+    if (c == NULL) {
+        // Out of stream memory: messages are dissected record by record
+        memset(&none, 0, sizeof(none));
+        c = &none;
+        pool = NULL;
+    } else {
+        c->tracked = 1;
     }
-    
-    print_tls_packet(frame, hdr->len, &pkt);
-}
\ No newline at end of file
+    if (flags & STREAM_GAP) {
+        d->user = is_likely_tls(data, len) ? TLS_STREAM_SYNC : TLS_STREAM_LOST;
+        if (pool)
+            tls_handshake_drop(pool, &c->dir[side]);
+    }
+    if (d->user == TLS_STREAM_LOST) {
+        d->skip = UINT32_MAX;
+        return len;
+    }
+
+    while (len - off >= TLS_RECORD_HEADER_LEN) {
+        const unsigned char *rec = data + off;
+        size_t rec_len = TLS_RECORD_HEADER_LEN + ((rec[3] << 8) | rec[4]);
+
+        if (!is_likely_tls(rec, len - off)) {
+            d->user = TLS_STREAM_LOST;
+            d->skip = UINT32_MAX;
+            return len;
+        }
+        if (rec[0] == TLS_TYPE_HANDSHAKE) {
+            if (len - off < rec_len)
+                break;
+            tls_record(w, v, c, side, pool, rec, rec_len);
+            off += rec_len;
+        } else {
+            size_t have = rec_len < len - off ? rec_len : len - off;
+
+            tls_record(w, v, c, side, pool, rec, have);
+            off += have;
+            d->skip = rec_len - have;
+            if (d->skip)
+                break;
+        }
+    }
+    return off;
+}
@@ -1,13 +1,14 @@
 #include "udp.h"
+#include "dispatch.h"
 #include <string.h>
 #include <stdio.h>
 
-int parse_udp_header(const unsigned char *frame, size_t frame_len, udp_packet *out) {
-    if (!frame || !out)
+int parse_udp_header(const unsigned char *frame, size_t frame_len, const ip_header *ip, udp_packet *out) {
+    if (!frame || !ip || !out)
         return -1;
 
-    if (out->ip.protocol != IPPROTO_UDP) {
-        fprintf(stderr, "Error: Not a UDP packet => Protocol %d\n", out->ip.protocol);
+    if (ip->protocol != IPPROTO_UDP) {
+        fprintf(stderr, "Error: Not a UDP packet => Protocol %d\n", ip->protocol);
         return -1;
     }
 
@@ -31,8 +32,8 @@ int parse_udp_header(const unsigned char *frame, size_t frame_len, udp_packet *o
     out->data_len = out->length - sizeof(udp_header);
 
     // Optional: Validate UDP length vs IP total length
-    uint16_t ip_total_len = out->ip.total_len;
-    uint8_t  ip_hdr_len   = out->ip.header_len;
+    uint16_t ip_total_len = ip->total_len;
+    uint8_t  ip_hdr_len   = ip->header_len;
     uint16_t udp_payload_len = ip_total_len - ip_hdr_len;
     if (out->length > udp_payload_len) {
         fprintf(stderr, "Warning: UDP length field (%u) exceeds remaining IP payload (%u)\n",
@@ -41,63 +42,79 @@ int parse_udp_header(const unsigned char *frame, size_t frame_len, udp_packet *o
 
     // Detect common UDP services
     if (out->src_port == 53 || out->dst_port == 53)
-        strcpy(out->service_str, "DNS");
+        out->service = "DNS";
     else if (out->src_port == 67 || out->dst_port == 67 || out->src_port == 68 || out->dst_port == 68)
-        strcpy(out->service_str, "DHCP");
+        out->service = "DHCP";
     else if (out->src_port == 123 || out->dst_port == 123)
-        strcpy(out->service_str, "NTP");
+        out->service = "NTP";
     else if (out->src_port == 161 || out->dst_port == 161 || out->src_port == 162 || out->dst_port == 162)
-        strcpy(out->service_str, "SNMP");
+        out->service = "SNMP";
     else if (out->src_port == 69 || out->dst_port == 69)
-        strcpy(out->service_str, "TFTP");
+        out->service = "TFTP";
     else if (out->src_port == 520 || out->dst_port == 520)
-        strcpy(out->service_str, "RIP");
+        out->service = "RIP";
     else
-        strcpy(out->service_str, "Unknown");
+        out->service = "Unknown";
 
     return sizeof(udp_header);
 }
 
-void print_udp_packet(const unsigned char *packet, uint32_t wire_len, const udp_packet *p) {
-    puts("\n=== UDP Packet (Parsed) ===\n");
+void print_udp_packet(outbuf *ob, const packet_view *v) {
+    const udp_packet *p = &v->udp;
+    ob_puts(ob, "\n=== UDP Packet (Parsed) ===\n");
 
-    printf("Src MAC          : %s\n", p->ether.src_mac);
-    printf("Dst MAC          : %s\n", p->ether.dst_mac);
-    printf("Ethertype        : 0x%04x\n", p->ether.ethertype);
-    puts("");
+    ob_field_mac(ob, "Src MAC          : ", v->ether.src);
+    ob_field_mac(ob, "Dst MAC          : ", v->ether.dst);
+    ob_field_hex(ob, "Ethertype        : ", v->ether.ethertype, 4);
+    ob_puts(ob, "");
 
-    printf("Source IP        : %s\n", p->ip.src);
-    printf("Destination IP   : %s\n", p->ip.dst);
-    puts("");
+    ob_field_ip4(ob, "Source IP        : ", &v->ip.src);
+    ob_field_ip4(ob, "Destination IP   : ", &v->ip.dst);
+    ob_puts(ob, "");
 
-    printf("Source Port      : %u\n", p->src_port);
-    printf("Destination Port : %u\n", p->dst_port);
-    printf("Length Field     : %u bytes\n", p->length);
-    printf("Data Length      : %u bytes\n", p->data_len);
-    printf("Checksum         : 0x%04x\n", p->checksum);
-    printf("Service          : %s\n", p->service_str);
-    puts("");
+    ob_field_u(ob, "Source Port      : ", p->src_port);
+    ob_field_u(ob, "Destination Port : ", p->dst_port);
+    ob_field_bytes(ob, "Length Field     : ", p->length);
+    ob_field_bytes(ob, "Data Length      : ", p->data_len);
+    ob_field_hex(ob, "Checksum         : ", p->checksum, 4);
+    ob_field_str(ob, "Service          : ", p->service);
+    ob_puts(ob, "");
 
-    printf("Total on wire    : %u bytes\n", wire_len);
-    printf("Raw Bytes        : ");
-    dump_hex_single_line(packet, wire_len);
+    ob_field_bytes(ob, "Total on wire    : ", v->caplen);
+    print_raw_bytes(ob, "Raw Bytes        : ", v);
 
-    puts("\n===========================\n");
+    ob_puts(ob, "\n===========================\n");
 }
 
-void udp_handler(
-    unsigned char *user,
-    const struct pcap_pkthdr *header,
-    const unsigned char *packet
-) {
-    (void)user;
-
-    udp_packet pkt;
-    int offset = 0;
-
-    offset += parse_ethernet_header(packet + offset, header->len - offset, &pkt.ether);
-    offset += parse_ip_header(packet + offset, header->len - offset, &pkt.ip);
-    if (parse_udp_header(packet + offset, header->len - offset, &pkt) >= 0) {
-        print_udp_packet(packet, header->len, &pkt);
+// -q: "UDP len 42", with the service when it is a known one
+void summarize_udp_packet(outbuf *ob, const packet_view *v) {
+    print_summary_head(ob, v, "UDP");
+    if (strcmp(v->udp.service, "Unknown") != 0) {
+        ob_str(ob, v->udp.service);
+        ob_putc(ob, ' ');
     }
+    ob_str(ob, "len ");
+    ob_u64(ob, v->udp.data_len);
+    ob_putc(ob, '\n');
+}
+
+static const field_desc udp_fields[] = {
+    FIELD(udp_packet, src_port, FIELD_UINT),
+    FIELD(udp_packet, dst_port, FIELD_UINT),
+    FIELD(udp_packet, length, FIELD_UINT),
+    FIELD(udp_packet, checksum, FIELD_UINT),
+    FIELD(udp_packet, data_len, FIELD_UINT),
+    FIELD(udp_packet, service, FIELD_STR),
+};
+
+RECORD_SCHEMA_DEF(udp_schema, PROTO_UDP + 1, "udp", udp_fields);
+
+void udp_handler(Worker *w, const packet_view *v)
+{
+    if (w->out.format != OUTPUT_TEXT)
+        record_add(&w->out, &udp_schema, &v->udp);
+    else if (w->app->quiet)
+        summarize_udp_packet(&w->out, v);
+    else
+        print_udp_packet(&w->out, v);
 }
@@ -0,0 +1,257 @@
+#include "hash.h"
+#include <string.h>
+
+/*
+ * MD5 and SHA-256, for the fingerprints of TLS handshakes and the
+ * certificates they carry. Both hash 64-byte blocks: updates gather bytes
+ * in `block` and compress each one as it fills, so a fingerprint can be
+ * hashed piece by piece as its fields are walked, with nothing allocated.
+ */
+
+static inline uint32_t rol32(uint32_t x, int n)
+{
+    return x << n | x >> (32 - n);
+}
+
+static inline uint32_t ror32(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+/*** MD5 ***/
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+// One MD5 step: `f` mixes b, c and d differently in each of the 4 rounds
+#define MD5_STEP(f, a, b, c, d, m, k, r) \
+    a = b + rol32(a + f(b, c, d) + m + k, r)
+#define MD5_F(b, c, d)  (d ^ (b & (c ^ d)))
+#define MD5_G(b, c, d)  (c ^ (d & (b ^ c)))
+#define MD5_H(b, c, d)  (b ^ c ^ d)
+#define MD5_I(b, c, d)  (c ^ (b | ~d))
+
+static void md5_block(uint32_t state[4], const unsigned char *p)
+{
+    uint32_t m[16];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+    for (int i = 0; i < 16; i++)
+        m[i] = (uint32_t)p[4 * i] | (uint32_t)p[4 * i + 1] << 8
+             | (uint32_t)p[4 * i + 2] << 16 | (uint32_t)p[4 * i + 3] << 24;
+    for (int i = 0; i < 16; i += 4)
+    {
+        MD5_STEP(MD5_F, a, b, c, d, m[i], md5_k[i], 7);
+        MD5_STEP(MD5_F, d, a, b, c, m[i + 1], md5_k[i + 1], 12);
+        MD5_STEP(MD5_F, c, d, a, b, m[i + 2], md5_k[i + 2], 17);
+        MD5_STEP(MD5_F, b, c, d, a, m[i + 3], md5_k[i + 3], 22);
+    }
+    for (int i = 16; i < 32; i += 4)
+    {
+        MD5_STEP(MD5_G, a, b, c, d, m[(5 * i + 1) & 15], md5_k[i], 5);
+        MD5_STEP(MD5_G, d, a, b, c, m[(5 * i + 6) & 15], md5_k[i + 1], 9);
+        MD5_STEP(MD5_G, c, d, a, b, m[(5 * i + 11) & 15], md5_k[i + 2], 14);
+        MD5_STEP(MD5_G, b, c, d, a, m[(5 * i + 16) & 15], md5_k[i + 3], 20);
+    }
+    for (int i = 32; i < 48; i += 4)
+    {
+        MD5_STEP(MD5_H, a, b, c, d, m[(3 * i + 5) & 15], md5_k[i], 4);
+        MD5_STEP(MD5_H, d, a, b, c, m[(3 * i + 8) & 15], md5_k[i + 1], 11);
+        MD5_STEP(MD5_H, c, d, a, b, m[(3 * i + 11) & 15], md5_k[i + 2], 16);
+        MD5_STEP(MD5_H, b, c, d, a, m[(3 * i + 14) & 15], md5_k[i + 3], 23);
+    }
+    for (int i = 48; i < 64; i += 4)
+    {
+        MD5_STEP(MD5_I, a, b, c, d, m[(7 * i) & 15], md5_k[i], 6);
+        MD5_STEP(MD5_I, d, a, b, c, m[(7 * i + 7) & 15], md5_k[i + 1], 10);
+        MD5_STEP(MD5_I, c, d, a, b, m[(7 * i + 14) & 15], md5_k[i + 2], 15);
+        MD5_STEP(MD5_I, b, c, d, a, m[(7 * i + 21) & 15], md5_k[i + 3], 21);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5_init(md5_ctx *c)
+{
+    c->state[0] = 0x67452301;
+    c->state[1] = 0xefcdab89;
+    c->state[2] = 0x98badcfe;
+    c->state[3] = 0x10325476;
+    c->bytes = 0;
+}
+
+void md5_update(md5_ctx *c, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t fill = c->bytes & 63;
+
+    c->bytes += len;
+    if (fill)
+    {
+        size_t n = 64 - fill < len ? 64 - fill : len;
+
+        memcpy(c->block + fill, p, n);
+        p += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        md5_block(c->state, c->block);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        md5_block(c->state, p);
+    memcpy(c->block, p, len);
+}
+
+void md5_final(md5_ctx *c, unsigned char digest[MD5_DIGEST_LEN])
+{
+    static const unsigned char pad[64] = { 0x80 };
+    uint64_t bits = c->bytes * 8;
+    unsigned char tail[8];
+
+    for (int i = 0; i < 8; i++)
+        tail[i] = bits >> (8 * i);
+    md5_update(c, pad, 1 + ((119 - (c->bytes & 63)) & 63));
+    md5_update(c, tail, 8);
+    for (int i = 0; i < 16; i++)
+        digest[i] = c->state[i / 4] >> (8 * (i % 4));
+}
+
+/*** SHA-256 ***/
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// One SHA-256 round, the eight working variables renamed instead of moved
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i) \
+    do { \
+        uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) \
+                    + (g ^ (e & (f ^ g))) + sha256_k[i] + w[i]; \
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) \
+                    + ((a & b) | (c & (a | b))); \
+        d += t1; \
+        h = t1 + t2; \
+    } while (0)
+
+static void sha256_block(uint32_t state[8], const unsigned char *p)
+{
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16
+             | (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for (int i = 0; i < 64; i += 8)
+    {
+        SHA256_ROUND(a, b, c, d, e, f, g, h, i);
+        SHA256_ROUND(h, a, b, c, d, e, f, g, i + 1);
+        SHA256_ROUND(g, h, a, b, c, d, e, f, i + 2);
+        SHA256_ROUND(f, g, h, a, b, c, d, e, i + 3);
+        SHA256_ROUND(e, f, g, h, a, b, c, d, i + 4);
+        SHA256_ROUND(d, e, f, g, h, a, b, c, i + 5);
+        SHA256_ROUND(c, d, e, f, g, h, a, b, i + 6);
+        SHA256_ROUND(b, c, d, e, f, g, h, a, i + 7);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256_init(sha256_ctx *c)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(c->state, iv, sizeof(iv));
+    c->bytes = 0;
+}
+
+void sha256_update(sha256_ctx *c, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t fill = c->bytes & 63;
+
+    c->bytes += len;
+    if (fill)
+    {
+        size_t n = 64 - fill < len ? 64 - fill : len;
+
+        memcpy(c->block + fill, p, n);
+        p += n;
+        len -= n;
+        if (fill + n < 64)
+            return;
+        sha256_block(c->state, c->block);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(c->state, p);
+    memcpy(c->block, p, len);
+}
+
+void sha256_final(sha256_ctx *c, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    static const unsigned char pad[64] = { 0x80 };
+    uint64_t bits = c->bytes * 8;
+    unsigned char tail[8];
+
+    for (int i = 0; i < 8; i++)
+        tail[i] = bits >> (56 - 8 * i);
+    sha256_update(c, pad, 1 + ((119 - (c->bytes & 63)) & 63));
+    sha256_update(c, tail, 8);
+    for (int i = 0; i < 32; i++)
+        digest[i] = c->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    sha256_ctx c;
+
+    sha256_init(&c);
+    sha256_update(&c, data, len);
+    sha256_final(&c, digest);
+}
+
+// Lowercase hex of `len` bytes into `out`, which must hold 2 * len + 1
+char *hex_string(const unsigned char *data, size_t len, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++)
+    {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 15];
+    }
+    out[2 * len] = '\0';
+    return out;
+}
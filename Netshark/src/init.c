@@ -1,4 +1,6 @@
 #include "netshark.h"
+#include "capture.h"
+#include <unistd.h>
 #include "tcp.h"
 #include "arp.h"
 #include "udp.h"
@@ -9,19 +11,7 @@
 #include "dns.h"
 #include "mdns.h"
 #include "tls.h"
-
-static HandlerPacket handlers = {
-    .arp = arp_handler,
-    .icmp = icmp_handler,
-    .tcp = tcp_handler,
-    .udp = udp_handler,
-    .ftp = ftp_handler,
-    .http = http_handler,
-    .dhcp = dhcp_handler,
-    .dns = dns_handler,
-    .mdns = mdns_handler,
-    .tls = tls_handler 
-};
+#include "dispatch.h"
 
 static void init_inet(NetShark *n, Args args)
 {
@@ -66,7 +56,7 @@ static void init_inet(NetShark *n, Args args)
 static void init_pcap_handle(NetShark *n)
 {
     // Open the session in promiscuous mode
-    n->handle = pcap_open_live(n->selected_dev->name, BUFSIZ, 1, 1000, n->errbuf);
+    n->handle = pcap_open_live(n->selected_dev->name, CAPTURE_SNAPLEN, 1, CAPTURE_TIMEOUT_MS, n->errbuf);
     if (n->handle == NULL)
     {
         fprintf(stderr, "Couldn't open device %s: %s\n", n->selected_dev->name, n->errbuf);
@@ -75,148 +65,345 @@ static void init_pcap_handle(NetShark *n)
     }
 }
 
-void init_datalink(NetShark *n)
+/*
+ * One Worker per capture thread, each with its own output queue.
+ * Workers beyond the first only make sense with the ring backend,
+ * where every worker gets its own capture socket.
+ */
+static void init_workers(NetShark *n, Args args)
 {
-    // Get the data link type
-    int datalink = pcap_datalink(n->handle);
-    switch (datalink)
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    n->nworkers = args.workers;
+    n->workers = calloc(n->nworkers, sizeof(Worker));
+    if (n->workers == NULL)
     {
-        case DLT_EN10MB:
-            printf("Data link type: Ethernet\n");
-            break;
-        case DLT_NULL:
-            printf("Data link type: NULL\n");
-            break;
-        default:
-            printf("Unknown data link type: %d\n", datalink);
-            pcap_close(n->handle);
-            pcap_freealldevs(n->alldevs);
-            exit(3);
+        fprintf(stderr, "Couldn't allocate %d workers\n", n->nworkers);
+        pcap_freealldevs(n->alldevs);
+        exit(1);
+    }
+
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        Worker *w = &n->workers[i];
+
+        w->id = i;
+        w->app = n;
+        w->cpu = (n->nworkers > 1 && ncpu > 0) ? i % ncpu : -1;
     }
 }
 
-static void init_filter(NetShark *n, Args args)
+// Workers format their text into chunks preallocated here, the output
+// thread writes them to stdout
+static void init_output(NetShark *n, Args args)
 {
-    char *filter_exp = args.filter_exp;
-    char bpf_filter[256] = {0};
+    int fd = STDOUT_FILENO;
 
-    // Traduction logique vers filtre BPF
-    if (strcmp(args.filter_exp, "http") == 0)
-    {
-        filter_exp = "tcp port 80";
-    }
-    else if (strcmp(args.filter_exp, "ftp") == 0)
-    {
-        filter_exp = "tcp port 21";
-    }
-    else if (strcmp(args.filter_exp, "tcp") == 0)
-    {
-        filter_exp = "tcp";
-    }
-    else if (strcmp(args.filter_exp, "udp") == 0)
+    // Records get stdout to themselves: the banner, the statistics and
+    // the debug messages go to stderr
+    if (args.format != OUTPUT_TEXT)
     {
-        filter_exp = "udp";
-    }
-    else if (strcmp(args.filter_exp, "arp") == 0)
-    {
-        filter_exp = "arp";
+        fd = dup(STDOUT_FILENO);
+        if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+        {
+            perror("Couldn't set up stdout for the records");
+            exit(1);
+        }
     }
-    else if (strcmp(args.filter_exp, "icmp") == 0)
+
+    n->output = malloc(sizeof(output_thread));
+    if (n->output == NULL || output_init(n->output, fd, n->nworkers) == -1)
     {
-        filter_exp = "icmp";
+        fprintf(stderr, "Couldn't allocate the output buffers\n");
+        if (n->output)
+            output_free(n->output);
+        free(n->output);
+        free(n->workers);
+        pcap_freealldevs(n->alldevs);
+        exit(1);
     }
-    else if (strcmp(args.filter_exp, "dhcp") == 0)
+
+    for (int i = 0; i < n->nworkers; i++)
     {
-        filter_exp = "port 67 or port 68";
+        outbuf *ob = &n->workers[i].out;
+
+        outbuf_init(ob, &n->output->queues[i], args.out_policy, args.out_sample);
+        ob->raw = args.raw;
+        ob->raw_max = args.raw_max;
+        ob->format = args.format;
     }
-    else if (strcmp(args.filter_exp, "dns") == 0)
+    // The first record's separator, see record_begin()
+    if (args.format == OUTPUT_JSON)
+        n->output->skip = 1;
+}
+
+// One flow table, stream pool, latency table, DNS transaction table, top
+// lists and TLS fingerprint cache per worker: the fanout hash keeps both
+// directions of a flow on the same worker, so they are never shared
+static void init_flows(NetShark *n, Args args)
+{
+    for (int i = 0; i < n->nworkers; i++)
     {
-        filter_exp = "udp port 53 or tcp port 53";
+        Worker *w = &n->workers[i];
+
+        if (flow_table_init(&w->flows, args.flow_max, args.flow_idle, args.flow_active) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate a flow table of %u flows\n", args.flow_max);
+            exit(1);
+        }
+        if (args.flows)
+            w->flows.out = &w->out;
+        stream_pool_init(&w->streams, w, &n->stream_used, args.stream_memory, args.stream_buffer);
+        w->flows.streams = &w->streams;
+        if (latency_table_init(&w->latency, args.latency, &w->out) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate the latency histograms\n");
+            exit(1);
+        }
+        if (args.latency && dns_txn_init(&w->dns, &w->latency) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate the DNS transaction table\n");
+            exit(1);
+        }
+        if (topk_table_init(&w->top, args.top, &w->out) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate the top lists\n");
+            exit(1);
+        }
+        if (tls_fp_cache_init(&w->fingerprints) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate the TLS fingerprint cache\n");
+            exit(1);
+        }
+        if (x509_cache_init(&w->certs, args.certs, &w->out) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate the certificate cache\n");
+            exit(1);
+        }
+        if (tls_session_cache_init(&w->sessions) == -1)
+        {
+            fprintf(stderr, "Couldn't allocate the TLS session cache\n");
+            exit(1);
+        }
     }
-    else if (strcmp(args.filter_exp, "tls") == 0 || strcmp(args.filter_exp, "ssl") == 0)
+}
+
+static void close_sockets(NetShark *n)
+{
+    for (int i = 0; i < n->nworkers; i++)
     {
-        filter_exp = "tcp port 443 or tcp port 465 or tcp port 993 or tcp port 995";
+        if (n->workers[i].sock)
+            netpcap_close(n->workers[i].sock);
+        n->workers[i].sock = NULL;
     }
-    else if (strcmp(args.filter_exp, "mdns") == 0)
+}
+
+/*
+ * Zero-copy alternative to pcap_open_live: libnetpcap maps a TPACKET_V3
+ * block ring shared with the kernel and hands out pointers into it.
+ * libpcap is still used to compile the filter, through a dead handle.
+ *
+ * With several workers, each one opens its own ring and they all join the
+ * same PACKET_FANOUT group in hash mode: the kernel hashes the flow
+ * symmetrically, so both directions of a connection reach the same worker.
+ */
+static void init_ring_handle(NetShark *n)
+{
+    uint16_t group = (uint16_t)getpid();
+
+    for (int i = 0; i < n->nworkers; i++)
     {
-        filter_exp = "udp port 5353";
-    }
+        Worker *w = &n->workers[i];
 
-    // Copier le filtre traduit
-    strncpy(bpf_filter, filter_exp, sizeof(bpf_filter) - 1);
+        w->sock = netpcap_open_ring(n->selected_dev->name, CAPTURE_SNAPLEN, 1, &n->ring_opts, n->errbuf);
+        if (w->sock == NULL)
+        {
+            fprintf(stderr, "Couldn't open capture ring on %s: %s\n", n->selected_dev->name, n->errbuf);
+            close_sockets(n);
+            pcap_freealldevs(n->alldevs);
+            exit(2);
+        }
 
-    if (DEBUG_MODE)
+        if (n->nworkers > 1 && netpcap_set_fanout(w->sock, group, NETPCAP_FANOUT_HASH) == -1)
+        {
+            fprintf(stderr, "Couldn't join fanout group %u: %s\n", group, netpcap_geterr(w->sock));
+            close_sockets(n);
+            pcap_freealldevs(n->alldevs);
+            exit(2);
+        }
+    }
+
+    n->handle = pcap_open_dead(netpcap_datalink(n->workers[0].sock), CAPTURE_SNAPLEN);
+    if (n->handle == NULL)
     {
-        printf("Filter expression: %s\n", filter_exp);
-        printf("Applying BPF filter: %s\n", bpf_filter);
+        fprintf(stderr, "Couldn't create a filter compiler handle\n");
+        close_sockets(n);
+        pcap_freealldevs(n->alldevs);
+        exit(2);
     }
+}
 
-    // Compiler et appliquer le filtre
-    if (pcap_compile(n->handle, &n->fp, bpf_filter, 0, n->net) == -1)
+/*
+ * AF_XDP: libnetpcap loads an XDP program on the interface that redirects
+ * one RX queue to the socket. The socket can't run a BPF filter, so the
+ * filter compiled through the dead handle is applied in userspace.
+ */
+static void init_xdp_handle(NetShark *n)
+{
+    Worker *w = &n->workers[0];
+
+    w->sock = netpcap_open_xdp(n->selected_dev->name, CAPTURE_SNAPLEN, &n->xdp_opts, n->errbuf);
+    if (w->sock == NULL)
     {
-        fprintf(stderr, "Couldn't parse filter %s: %s\n", bpf_filter, pcap_geterr(n->handle));
-        pcap_close(n->handle);
+        fprintf(stderr, "Couldn't open AF_XDP socket on %s: %s\n", n->selected_dev->name, n->errbuf);
         pcap_freealldevs(n->alldevs);
-        exit(4);
+        exit(2);
     }
 
-    if (pcap_setfilter(n->handle, &n->fp) == -1)
+    n->handle = pcap_open_dead(netpcap_datalink(w->sock), CAPTURE_SNAPLEN);
+    if (n->handle == NULL)
     {
-        fprintf(stderr, "Couldn't install filter %s: %s\n", bpf_filter, pcap_geterr(n->handle));
-        pcap_freecode(&n->fp);
-        pcap_close(n->handle);
+        fprintf(stderr, "Couldn't create a filter compiler handle\n");
+        close_sockets(n);
         pcap_freealldevs(n->alldevs);
-        exit(5);
+        exit(2);
     }
 }
 
-static void init_packet_handler(NetShark *n, Args args)
+/*
+ * Offline mode: libnetpcap maps the whole file and hands out pointers to
+ * its records. There is no kernel filter either, the capture loop runs it.
+ */
+static void init_file_handle(NetShark *n, Args args)
 {
-    if (!strcmp(args.filter_exp, "arp"))
-    {
-        n->handler = handlers.arp;
-    }
-    else if (!strcmp(args.filter_exp, "icmp"))
+    Worker *w = &n->workers[0];
+
+    w->sock = netpcap_open_offline(args.read_file, n->errbuf);
+    if (w->sock == NULL)
     {
-        n->handler = handlers.icmp;
+        fprintf(stderr, "Couldn't open capture file %s\n", n->errbuf);
+        exit(2);
     }
-    else if (!strcmp(args.filter_exp, "tcp"))
+
+    n->handle = pcap_open_dead(netpcap_datalink(w->sock), CAPTURE_SNAPLEN);
+    if (n->handle == NULL)
     {
-        n->handler = handlers.tcp;
+        fprintf(stderr, "Couldn't create a filter compiler handle\n");
+        close_sockets(n);
+        exit(2);
     }
-    else if (!strcmp(args.filter_exp, "udp"))
+}
+
+// -w: the pcapng writer gets one queue per worker
+static void init_writer(NetShark *n, Args args)
+{
+    if (args.write_opts.path == NULL)
+        return;
+
+    n->writer = malloc(sizeof(pcap_writer));
+    if (n->writer == NULL
+        || writer_init(n->writer, &args.write_opts, pcap_datalink(n->handle), n->nworkers) == -1)
     {
-        n->handler = handlers.udp;
+        fprintf(stderr, "Couldn't save packets to %s\n", args.write_opts.path);
+        cleanup(n);
+        exit(6);
     }
-    else if (!strcmp(args.filter_exp, "ftp"))
+
+    for (int i = 0; i < n->nworkers; i++)
+        n->workers[i].wring = &n->writer->rings[i];
+}
+
+void init_datalink(NetShark *n)
+{
+    // Get the data link type
+    int datalink = pcap_datalink(n->handle);
+    switch (datalink)
     {
-        n->handler = handlers.ftp;
+        case DLT_EN10MB:
+            printf("Data link type: Ethernet\n");
+            break;
+        case DLT_NULL:
+            printf("Data link type: NULL\n");
+            break;
+        default:
+            printf("Unknown data link type: %d\n", datalink);
+            pcap_close(n->handle);
+            pcap_freealldevs(n->alldevs);
+            exit(3);
     }
-    else if (!strcmp(args.filter_exp, "http"))
+}
+
+static void init_filter(NetShark *n, Args args)
+{
+    char bpf_filter[DISPATCH_FILTER_MAX];
+
+    // One dissector table for the whole -f list, and the BPF expression
+    // letting through every packet one of them wants
+    n->dispatch = dispatch_new(args.filter_exp, bpf_filter, sizeof(bpf_filter), n->errbuf);
+    if (!n->dispatch)
     {
-        n->handler = handlers.http;
+        fprintf(stderr, "%s\n", n->errbuf);
+        exit(1);
     }
-    else if (!strcmp(args.filter_exp, "dhcp"))
+    if (!args.reassembly)
+        n->dispatch->streamed = 0;
+    n->handler = dispatch_packet;
+
+    if (DEBUG_MODE)
     {
-        n->handler = handlers.http;
+        printf("Filter expression: %s\n", args.filter_exp);
+        printf("Applying BPF filter: %s\n", bpf_filter);
     }
-    else if (!strcmp(args.filter_exp, "dns"))
+
+    // Compiler et appliquer le filtre.
+    // libnetpcap handles get programs from its own compiler, which knows
+    // where the kernel keeps the VLAN tag on AF_PACKET sockets
+    if (n->backend == BACKEND_PCAP)
     {
-        n->handler = handlers.dns;
+        if (pcap_compile(n->handle, &n->fp, bpf_filter, 0, n->net) == -1)
+        {
+            fprintf(stderr, "Couldn't parse filter %s: %s\n", bpf_filter, pcap_geterr(n->handle));
+            pcap_close(n->handle);
+            pcap_freealldevs(n->alldevs);
+            exit(4);
+        }
     }
-    else if (!strcmp(args.filter_exp, "tls") || !strcmp(args.filter_exp, "ssl"))
+    else if (netpcap_compile(n->workers[0].sock, &n->fp, bpf_filter, 1, n->net) == -1)
     {
-        n->handler = handlers.tls;
+        fprintf(stderr, "Couldn't parse filter %s: %s\n", bpf_filter, netpcap_geterr(n->workers[0].sock));
+        pcap_close(n->handle);
+        close_sockets(n);
+        pcap_freealldevs(n->alldevs);
+        exit(4);
     }
 
-    else if (!strcmp(args.filter_exp, "mdns"))
+    if (DEBUG_MODE && n->backend != BACKEND_PCAP)
+        netpcap_bpf_dump(&n->fp);
+
+    // Rings filter in the kernel, AF_XDP sockets and files in libnetpcap
+    if (n->backend != BACKEND_PCAP)
     {
-        n->handler = handlers.mdns;
+        for (int i = 0; i < n->nworkers; i++)
+        {
+            if (netpcap_setfilter(n->workers[i].sock, &n->fp) == -1)
+            {
+                fprintf(stderr, "Couldn't install filter %s: %s\n", bpf_filter,
+                        netpcap_geterr(n->workers[i].sock));
+                netpcap_freecode(&n->fp);
+                pcap_close(n->handle);
+                close_sockets(n);
+                pcap_freealldevs(n->alldevs);
+                exit(5);
+            }
+        }
     }
-    else
+    else if (pcap_setfilter(n->handle, &n->fp) == -1)
     {
-        fprintf(stderr, "Unsupported filter: %s\n", args.filter_exp);
-        exit(1);
+        fprintf(stderr, "Couldn't install filter %s: %s\n", bpf_filter, pcap_geterr(n->handle));
+        pcap_freecode(&n->fp);
+        pcap_close(n->handle);
+        pcap_freealldevs(n->alldevs);
+        exit(5);
     }
 }
 
@@ -229,9 +416,67 @@ void init(NetShark *n, Args args)
     n->fp.bf_len = 0;
     n->net = 0;
     n->selected_dev = NULL; // Initialiser le pointeur de l'interface sélectionnée
+    n->burst = args.burst;
+    n->backend = args.backend;
+    n->ring_opts = args.ring_opts;
+    n->xdp_opts = args.xdp_opts;
+    n->nworkers = 0;
+    n->workers = NULL;
+    n->writer = NULL;
+    n->dispatch = NULL;
+    n->output = NULL;
+    n->quiet = args.quiet;
+    n->format = args.format;
+    n->stream_used = 0;
 
-    init_inet(n, args);
-    init_pcap_handle(n);
-    init_packet_handler(n, args);
+    // No interface needed to read a file
+    if (n->backend != BACKEND_FILE)
+        init_inet(n, args);
+    init_workers(n, args);
+    init_output(n, args);
+    init_flows(n, args);
+    if (n->backend == BACKEND_FILE)
+        init_file_handle(n, args);
+    else if (n->backend == BACKEND_RING)
+        init_ring_handle(n);
+    else if (n->backend == BACKEND_XDP)
+        init_xdp_handle(n);
+    else
+        init_pcap_handle(n);
     init_filter(n, args);
-}
\ No newline at end of file
+    init_writer(n, args);
+}
+
+void cleanup(NetShark *n)
+{
+    if (n->backend == BACKEND_PCAP)
+        pcap_freecode(&n->fp);
+    else
+        netpcap_freecode(&n->fp);
+    pcap_close(n->handle);
+    close_sockets(n);
+    for (int i = 0; i < n->nworkers; i++)
+    {
+        flow_table_free(&n->workers[i].flows);
+        stream_pool_free(&n->workers[i].streams);
+        latency_table_free(&n->workers[i].latency);
+        dns_txn_free(&n->workers[i].dns);
+        topk_table_free(&n->workers[i].top);
+        tls_fp_cache_free(&n->workers[i].fingerprints);
+        x509_cache_free(&n->workers[i].certs);
+        tls_session_cache_free(&n->workers[i].sessions);
+    }
+    free(n->workers);
+    if (n->output)
+    {
+        if (n->output->fd != STDOUT_FILENO)
+            close(n->output->fd);
+        output_free(n->output);
+    }
+    free(n->output);
+    if (n->writer)
+        writer_free(n->writer);
+    free(n->writer);
+    free(n->dispatch);
+    pcap_freealldevs(n->alldevs);
+}
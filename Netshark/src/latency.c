@@ -0,0 +1,391 @@
+#include "latency.h"
+#include "record.h"
+#include "dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-worker latency histograms (--latency).
+ *
+ * Dissectors that pair requests with responses hand each response time to
+ * latency_add() under a key: a name (the HTTP Host, the DNS resolver, the
+ * TLS server name) and a code (the status, the rcode, the TLS version).
+ * A TLS handshake gives its two times apart, LATENCY_NONE standing for
+ * the other. Requests that never got a response are only counted, by
+ * latency_timeout() under the code LATENCY_TIMEOUT: the time they were
+ * waited for says nothing of the server. The dispatcher calls
+ * latency_advance() with the capture time of every packet before the
+ * dissectors and timeouts add to the table; once an interval is over
+ * every key gets one line per histogram with its percentiles, one with
+ * its timeouts, and the table is emptied for the next.
+ */
+
+static const struct {
+    const char *name;
+    int metrics;
+    const char *metric[LATENCY_METRICS];
+} kinds[LATENCY_KINDS] = {
+    [LATENCY_HTTP] = { "http", 2, { "ttfb", "total" } },
+    [LATENCY_DNS]  = { "dns",  1, { "rtt" } },
+    [LATENCY_TLS]  = { "tls",  2, { "hello", "data" } },
+};
+
+// One histogram of one key, exported with --format (see record.h).
+// Times are in microseconds.
+typedef struct {
+    struct timeval time;        // End of the interval
+    const char *kind;
+    span name;
+    int code;
+    const char *metric;
+    uint64_t count;
+    uint64_t timeouts;
+    uint64_t min;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+}               latency_row;
+
+static const field_desc latency_fields[] = {
+    FIELD(latency_row, time, FIELD_TS),
+    FIELD(latency_row, kind, FIELD_STR),
+    FIELD(latency_row, name, FIELD_SPAN),
+    FIELD(latency_row, code, FIELD_INT),
+    FIELD(latency_row, metric, FIELD_STR),
+    FIELD(latency_row, count, FIELD_UINT),
+    FIELD(latency_row, timeouts, FIELD_UINT),
+    FIELD(latency_row, min, FIELD_UINT),
+    FIELD(latency_row, mean, FIELD_UINT),
+    FIELD(latency_row, p50, FIELD_UINT),
+    FIELD(latency_row, p90, FIELD_UINT),
+    FIELD(latency_row, p99, FIELD_UINT),
+    FIELD(latency_row, p999, FIELD_UINT),
+    FIELD(latency_row, max, FIELD_UINT),
+};
+
+RECORD_SCHEMA_DEF(latency_schema, PROTO_COUNT + 2, "latency", latency_fields);
+
+/*** Histograms ***/
+
+// Values below LATENCY_SUB have a bucket each. Above, the bucket is the
+// power of two (the highest bit) then the LATENCY_SUB_BITS bits below it.
+static uint32_t hist_index(uint64_t us)
+{
+    uint32_t shift;
+
+    if (us < LATENCY_SUB)
+        return us;
+    if (us >> LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+    shift = 63 - __builtin_clzll(us) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB + (uint32_t)(us >> shift) - LATENCY_SUB;
+}
+
+// Lowest value of bucket `i`
+static uint64_t hist_value(uint32_t i)
+{
+    uint32_t shift;
+
+    if (i < LATENCY_SUB)
+        return i;
+    shift = i / LATENCY_SUB - 1;
+    return (uint64_t)(LATENCY_SUB + i % LATENCY_SUB) << shift;
+}
+
+static void hist_add(latency_hist *h, uint64_t us)
+{
+    if (h->count == 0 || us < h->min)
+        h->min = us;
+    if (us > h->max)
+        h->max = us;
+    h->count++;
+    h->sum += us;
+    h->bucket[hist_index(us)]++;
+}
+
+// Value under which a share `q` of the samples fall: the highest value of
+// the bucket holding it, so it is never under the true one by more than
+// a bucket's width
+uint64_t latency_quantile(const latency_hist *h, double q)
+{
+    uint64_t rank = (uint64_t)(q * h->count + 0.5);
+    uint64_t seen = 0;
+
+    if (h->count == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += h->bucket[i];
+        if (seen >= rank)
+        {
+            uint64_t top = i + 1 < LATENCY_BUCKETS ? hist_value(i + 1) - 1 : h->max;
+
+            if (top > h->max)
+                top = h->max;
+            return top < h->min ? h->min : top;
+        }
+    }
+    return h->max;
+}
+
+/*** Table ***/
+
+int latency_table_init(latency_table *t, uint32_t interval, outbuf *out)
+{
+    memset(t, 0, sizeof(*t));
+    t->interval = interval;
+    t->out = out;
+    if (interval == 0)
+        return 0;
+    t->entries = calloc(LATENCY_KEYS, sizeof(latency_entry));
+    t->spare = calloc(LATENCY_KEYS, sizeof(latency_hist *));
+    if (!t->entries || !t->spare)
+    {
+        latency_table_free(t);
+        return -1;
+    }
+    return 0;
+}
+
+void latency_table_free(latency_table *t)
+{
+    if (t->entries)
+    {
+        for (uint32_t i = 0; i < LATENCY_KEYS; i++)
+            free(t->entries[i].hist);
+    }
+    for (uint32_t i = 0; i < t->nspare; i++)
+        free(t->spare[i]);
+    free(t->entries);
+    free(t->spare);
+    memset(t, 0, sizeof(*t));
+}
+
+// FNV-1a of the key, never 0
+static uint32_t key_hash(latency_kind kind, const char *name, size_t len, int code)
+{
+    uint32_t h = 2166136261u;
+
+    h = (h ^ kind) * 16777619u;
+    h = (h ^ (uint32_t)code) * 16777619u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h ? h : 1;
+}
+
+static latency_entry *key_find(latency_table *t, latency_kind kind, const char *name, size_t len, int code)
+{
+    uint32_t hash = key_hash(kind, name, len, code);
+    uint32_t i = hash & (LATENCY_KEYS - 1);
+
+    for (;;)
+    {
+        latency_entry *e = &t->entries[i];
+
+        if (e->hash == 0)
+        {
+            // Keep a quarter free so probes stay short
+            if (t->count >= LATENCY_KEYS / 4 * 3)
+                return NULL;
+            if (t->nspare)
+                e->hist = t->spare[--t->nspare];
+            else
+                e->hist = malloc(LATENCY_METRICS * sizeof(latency_hist));
+            if (e->hist == NULL)
+                return NULL;
+            memset(e->hist, 0, LATENCY_METRICS * sizeof(latency_hist));
+            e->hash = hash;
+            e->kind = kind;
+            e->code = code;
+            e->name_len = len;
+            e->timeouts = 0;
+            memcpy(e->name, name, len);
+            t->count++;
+            return e;
+        }
+        if (e->hash == hash && e->kind == kind && e->code == code
+            && e->name_len == len && memcmp(e->name, name, len) == 0)
+            return e;
+        i = (i + 1) & (LATENCY_KEYS - 1);
+    }
+}
+
+// The entry of a key, the name kept lowercased and unprintable bytes as
+// '.'. NULL, counted as dropped, when the table is full.
+static latency_entry *key_entry(latency_table *t, latency_kind kind, const unsigned char *name,
+                                size_t len, int code)
+{
+    char key[LATENCY_NAME_MAX];
+    latency_entry *e;
+
+    if (len > sizeof(key))
+        len = sizeof(key);
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = name[i];
+
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        else if (c <= ' ' || c >= 0x7f)
+            c = '.';
+        key[i] = c;
+    }
+    e = key_find(t, kind, key, len, code);
+    if (e == NULL)
+        t->dropped++;
+    return e;
+}
+
+// Adds one sample per histogram of the kind, `us[i]` going to metric i,
+// none where it is LATENCY_NONE
+void latency_add(latency_table *t, latency_kind kind, const unsigned char *name, size_t len,
+                 int code, uint64_t sec, const uint64_t *us)
+{
+    latency_entry *e;
+
+    if (t->interval == 0)
+        return;
+    e = key_entry(t, kind, name, len, code);
+    if (e == NULL)
+        return;
+    for (int m = 0; m < kinds[kind].metrics; m++)
+    {
+        if (us[m] != LATENCY_NONE)
+            hist_add(&e->hist[m], us[m]);
+    }
+    if (sec > t->last)
+        t->last = sec;
+    t->samples++;
+}
+
+// Counts a request of `name` that was never answered
+void latency_timeout(latency_table *t, latency_kind kind, const unsigned char *name, size_t len,
+                     uint64_t sec)
+{
+    latency_entry *e;
+
+    if (t->interval == 0)
+        return;
+    e = key_entry(t, kind, name, len, LATENCY_TIMEOUT);
+    if (e == NULL)
+        return;
+    e->timeouts++;
+    if (sec > t->last)
+        t->last = sec;
+    t->timeouts++;
+}
+
+/*** Reports ***/
+
+// "12:00:10.000000 LATENCY http example.com 200 ttfb n 42 min 0.000120
+// p50 0.000250 p90 0.000900 p99 0.002000 p99.9 0.002000 max 0.002100",
+// "12:00:10.000000 LATENCY dns 10.0.0.53 timeout rtt timeouts 3"
+static void latency_print(outbuf *ob, const latency_row *r)
+{
+    static const char *labels[] = { " min ", " p50 ", " p90 ", " p99 ", " p99.9 ", " max " };
+    const uint64_t values[] = { r->min, r->p50, r->p90, r->p99, r->p999, r->max };
+
+    ob_timestamp(ob, &r->time);
+    ob_str(ob, " LATENCY ");
+    ob_str(ob, r->kind);
+    ob_putc(ob, ' ');
+    if (r->name.len)
+        ob_write(ob, r->name.ptr, r->name.len);
+    else
+        ob_putc(ob, '-');
+    ob_putc(ob, ' ');
+    if (r->code == LATENCY_TIMEOUT)
+        ob_str(ob, "timeout");
+    else
+        ob_u64(ob, r->code);
+    ob_putc(ob, ' ');
+    ob_str(ob, r->metric);
+    if (r->timeouts)
+    {
+        ob_str(ob, " timeouts ");
+        ob_u64(ob, r->timeouts);
+        ob_putc(ob, '\n');
+        return;
+    }
+    ob_str(ob, " n ");
+    ob_u64(ob, r->count);
+    for (int i = 0; i < 6; i++)
+    {
+        ob_str(ob, labels[i]);
+        ob_seconds(ob, values[i]);
+    }
+    ob_putc(ob, '\n');
+}
+
+// Row of histogram `m` of a key, or of its timeouts, which have none
+static void latency_row_out(latency_table *t, const latency_entry *e, int m, uint64_t sec)
+{
+    const latency_hist *h = &e->hist[m];
+    outbuf *ob = t->out;
+    latency_row r;
+
+    memset(&r, 0, sizeof(r));
+    r.time.tv_sec = sec;
+    r.kind = kinds[e->kind].name;
+    r.name.ptr = (const unsigned char *)e->name;
+    r.name.len = e->name_len;
+    r.code = e->code;
+    r.metric = kinds[e->kind].metric[m];
+    r.count = h->count;
+    r.timeouts = e->timeouts;
+    if (h->count)
+    {
+        r.min = h->min;
+        r.mean = h->sum / h->count;
+        r.p50 = latency_quantile(h, 0.50);
+        r.p90 = latency_quantile(h, 0.90);
+        r.p99 = latency_quantile(h, 0.99);
+        r.p999 = latency_quantile(h, 0.999);
+        r.max = h->max;
+    }
+
+    ob_begin(ob);
+    if (ob->format == OUTPUT_TEXT)
+        latency_print(ob, &r);
+    else
+        record_object(ob, &latency_schema, &r);
+    ob_end(ob);
+}
+
+// Prints the interval that ended at `sec` and starts the next one
+void latency_report(latency_table *t, uint64_t sec)
+{
+    uint64_t end = t->next && t->next <= sec ? t->next : sec;
+
+    for (uint32_t i = 0; i < LATENCY_KEYS && t->count; i++)
+    {
+        latency_entry *e = &t->entries[i];
+
+        if (e->hash == 0)
+            continue;
+        for (int m = 0; m < kinds[e->kind].metrics; m++)
+        {
+            if (e->hist[m].count)
+                latency_row_out(t, e, m, end);
+        }
+        if (e->timeouts)
+            latency_row_out(t, e, 0, end);
+        t->spare[t->nspare++] = e->hist;
+        e->hist = NULL;
+        e->hash = 0;
+        t->count--;
+    }
+    t->next = (sec / t->interval + 1) * t->interval;
+}
+
+// End of the capture: prints what the last interval got so far
+void latency_flush(latency_table *t)
+{
+    if (t->interval && t->count)
+        latency_report(t, t->next > t->last ? t->next : t->last);
+}
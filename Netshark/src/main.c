@@ -7,6 +7,7 @@
 */
 
 #include "netshark.h"
+#include "capture.h"
 
 int DEBUG_MODE = 0;
 
@@ -21,14 +22,81 @@ void parse_env()
 
 void print_usage(char *program_name)
 {
-    printf("Usage: %s -i interface -f \"filter\"\n", program_name);
-    printf("Example: %s -i eth0 -f \"tcp\"\n", program_name);
+    printf("Usage: %s -i interface -f \"filter\" [-b burst] [--backend pcap|ring|xdp]\n", program_name);
+    printf("       %s -r file -f \"filter\" [-b burst]\n", program_name);
+    printf("Example: %s -i eth0 -f \"dns,tls,http\"\n", program_name);
+    printf("  -f list                 comma separated dissectors: arp icmp tcp udp ftp http dhcp dns mdns tls\n");
+    printf("  -q                      one line per packet instead of the full dissection\n");
+    printf("  --format f              text (default), json (one array), ndjson (one object per line)\n");
+    printf("                          or bin (length-prefixed records); messages then go to stderr\n");
+    printf("  -r file                 read a pcap or pcapng file instead of capturing, then report the throughput\n");
+    printf("  -w file                 also save the packets to a pcapng file\n");
+    printf("  -C size                 with -w, start a new file every `size` million bytes\n");
+    printf("  -G seconds              with -w, start a new file every `seconds`\n");
+    printf("  -W count                with -C/-G, keep at most `count` files, overwriting the oldest\n");
+    printf("  -b burst                packets handed to the dissectors per capture call (%d-%d, default %d)\n",
+           CAPTURE_BURST_MIN, CAPTURE_BURST_MAX, CAPTURE_BURST_DEFAULT);
+    printf("  --backend pcap|ring     capture through libpcap (default) or a zero-copy TPACKET_V3 ring\n");
+    printf("  --ring-block-size KiB   ring block size (default %u)\n", NETPCAP_RING_BLOCK_SIZE / 1024);
+    printf("  --ring-blocks n         number of ring blocks (default %u)\n", NETPCAP_RING_BLOCK_COUNT);
+    printf("  --ring-timeout ms       block retire timeout (default %u)\n", NETPCAP_RING_TIMEOUT_MS);
+    printf("  --backend xdp           AF_XDP socket on one RX queue, the queue's traffic no longer reaches the stack\n");
+    printf("  --xdp-queue n           RX queue to capture with --backend xdp (default 0)\n");
+    printf("  --xdp-drv               run the XDP program in the driver (zero-copy when supported)\n");
+    printf("  --workers n             capture threads sharing the traffic by flow (implies --backend ring)\n");
+    printf("  --output-policy p       when stdout can't keep up: block the capture (default with -r),\n");
+    printf("                          drop the packets' text (default live) or sample\n");
+    printf("  --output-sample n       with --output-policy sample, print 1 packet in n when behind (default %d)\n",
+           OUTPUT_SAMPLE_DEFAULT);
+    printf("  --raw all|payload|none  hex dump the whole frame (default), only the payload, or nothing\n");
+    printf("  --raw-max n             hex dump at most n bytes per packet\n");
+    printf("  --flows                 print each IPv4 flow (5-tuple) when it ends: packets, bytes, duration\n");
+    printf("  --flow-max n            flows tracked per worker (default %d)\n", FLOW_MAX_DEFAULT);
+    printf("  --flow-idle s           a flow ends after s seconds without packets (default %d)\n", FLOW_IDLE_DEFAULT);
+    printf("  --flow-active s         a longer flow is reported every s seconds (default %d)\n", FLOW_ACTIVE_DEFAULT);
+    printf("  --no-reassembly         ftp, http and tls dissect each segment alone instead of the TCP stream\n");
+    printf("  --stream-buffer KiB     bytes a TCP stream holds per direction while waiting (default %d)\n",
+           STREAM_BUFFER_DEFAULT >> 10);
+    printf("  --stream-memory MiB     bytes all the TCP streams hold together (default %d)\n",
+           STREAM_MEMORY_DEFAULT >> 20);
+    printf("  --latency s             every s seconds, print HTTP, DNS and TLS handshake time percentiles per host, resolver or server name and status\n");
+    printf("  --top s                 every s seconds, print the most queried DNS names, clients, NXDOMAIN names and TLS fingerprints\n");
+    printf("  --certs s               every s seconds, print the TLS certificates seen by expiry, then their issuers\n");
 }
 
 void parser_args(Args *args, int argc, char **argv)
 {
     args->dev = NULL;
     args->filter_exp = NULL;
+    args->read_file = NULL;
+    memset(&args->write_opts, 0, sizeof(args->write_opts));
+    args->burst = CAPTURE_BURST_DEFAULT;
+    args->backend = BACKEND_PCAP;
+    args->ring_opts.block_size = NETPCAP_RING_BLOCK_SIZE;
+    args->ring_opts.block_count = NETPCAP_RING_BLOCK_COUNT;
+    args->ring_opts.frame_timeout_ms = NETPCAP_RING_TIMEOUT_MS;
+    args->xdp_opts.frame_size = NETPCAP_XDP_FRAME_SIZE;
+    args->xdp_opts.frame_count = NETPCAP_XDP_FRAME_COUNT;
+    args->xdp_opts.queue_id = 0;
+    args->xdp_opts.mode = NETPCAP_XDP_SKB;
+    args->xdp_opts.timeout_ms = NETPCAP_XDP_TIMEOUT_MS;
+    args->workers = 1;
+    args->out_sample = OUTPUT_SAMPLE_DEFAULT;
+    args->raw = OUTPUT_RAW_ALL;
+    args->raw_max = 0;
+    args->quiet = 0;
+    args->format = OUTPUT_TEXT;
+    args->flows = 0;
+    args->flow_max = FLOW_MAX_DEFAULT;
+    args->flow_idle = FLOW_IDLE_DEFAULT;
+    args->flow_active = FLOW_ACTIVE_DEFAULT;
+    args->reassembly = 1;
+    args->stream_buffer = STREAM_BUFFER_DEFAULT;
+    args->stream_memory = STREAM_MEMORY_DEFAULT;
+    args->latency = 0;
+    args->top = 0;
+    args->certs = 0;
+    int out_policy = -1;
 
     for (int i = 1; i < argc; i++)
     {
@@ -55,9 +123,403 @@ void parser_args(Args *args, int argc, char **argv)
                 print_usage(argv[0]);
             }
         }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->burst = atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--backend") == 0)
+        {
+            if (i + 1 < argc && strcmp(argv[i + 1], "ring") == 0)
+            {
+                args->backend = BACKEND_RING;
+                i++;
+            }
+            else if (i + 1 < argc && strcmp(argv[i + 1], "pcap") == 0)
+            {
+                args->backend = BACKEND_PCAP;
+                i++;
+            }
+            else if (i + 1 < argc && strcmp(argv[i + 1], "xdp") == 0)
+            {
+                args->backend = BACKEND_XDP;
+                i++;
+            }
+            else
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--ring-block-size") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->ring_opts.block_size = (unsigned int)atoi(argv[++i]) * 1024;
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--ring-blocks") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->ring_opts.block_count = (unsigned int)atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--ring-timeout") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->ring_opts.frame_timeout_ms = (unsigned int)atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            args->quiet = 1;
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->read_file = argv[++i];
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->write_opts.path = argv[++i];
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-C") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->write_opts.rotate_bytes = strtoull(argv[++i], NULL, 10) * 1000000ULL;
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-G") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->write_opts.rotate_secs = (unsigned int)atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-W") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->write_opts.max_files = atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--xdp-queue") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->xdp_opts.queue_id = (unsigned int)atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--xdp-drv") == 0)
+        {
+            args->xdp_opts.mode = NETPCAP_XDP_DRV;
+        }
+        else if (strcmp(argv[i], "--workers") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->workers = atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--output-policy") == 0)
+        {
+            if (i + 1 < argc && strcmp(argv[i + 1], "block") == 0)
+                out_policy = OUTPUT_BLOCK;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "drop") == 0)
+                out_policy = OUTPUT_DROP;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "sample") == 0)
+                out_policy = OUTPUT_SAMPLE;
+            else
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--raw") == 0)
+        {
+            if (i + 1 < argc && strcmp(argv[i + 1], "all") == 0)
+                args->raw = OUTPUT_RAW_ALL;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "payload") == 0)
+                args->raw = OUTPUT_RAW_PAYLOAD;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "none") == 0)
+                args->raw = OUTPUT_RAW_NONE;
+            else
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--format") == 0)
+        {
+            if (i + 1 < argc && strcmp(argv[i + 1], "text") == 0)
+                args->format = OUTPUT_TEXT;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "json") == 0)
+                args->format = OUTPUT_JSON;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "ndjson") == 0)
+                args->format = OUTPUT_NDJSON;
+            else if (i + 1 < argc && strcmp(argv[i + 1], "bin") == 0)
+                args->format = OUTPUT_BIN;
+            else
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--flows") == 0)
+        {
+            args->flows = 1;
+        }
+        else if (strcmp(argv[i], "--flow-max") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->flow_max = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--flow-idle") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->flow_idle = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--flow-active") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->flow_active = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--no-reassembly") == 0)
+        {
+            args->reassembly = 0;
+        }
+        else if (strcmp(argv[i], "--stream-buffer") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->stream_buffer = strtoul(argv[++i], NULL, 10) << 10;
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--stream-memory") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->stream_memory = (size_t)strtoul(argv[++i], NULL, 10) << 20;
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--latency") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->latency = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--top") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->top = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--certs") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->certs = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--raw-max") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->raw_max = strtoul(argv[++i], NULL, 10);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--output-sample") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                args->out_sample = (unsigned int)atoi(argv[++i]);
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+        }
     }
 
-    if (args->dev == NULL || args->filter_exp == NULL)
+    if (args->burst < CAPTURE_BURST_MIN || args->burst > CAPTURE_BURST_MAX)
+    {
+        fprintf(stderr, "Invalid burst size: must be between %d and %d\n",
+                CAPTURE_BURST_MIN, CAPTURE_BURST_MAX);
+        exit(1);
+    }
+
+    if (args->workers < 1 || args->workers > MAX_WORKERS)
+    {
+        fprintf(stderr, "Invalid worker count: must be between 1 and %d\n", MAX_WORKERS);
+        exit(1);
+    }
+
+    if (args->read_file)
+        args->backend = BACKEND_FILE;
+
+    if (args->quiet && args->format != OUTPUT_TEXT)
+    {
+        fprintf(stderr, "-q can't be used with --format\n");
+        exit(1);
+    }
+
+    if (args->flow_max < 1 || args->flow_max > FLOW_NONE / 2)
+    {
+        fprintf(stderr, "Invalid flow table size: must be between 1 and %u\n", FLOW_NONE / 2);
+        exit(1);
+    }
+    if (args->flow_idle < 1 || args->flow_active < 1)
+    {
+        fprintf(stderr, "Invalid flow timeout: must be at least 1 second\n");
+        exit(1);
+    }
+
+    if (args->stream_buffer < 1024 || args->stream_buffer > STREAM_BUFFER_MAX / 2)
+    {
+        fprintf(stderr, "Invalid stream buffer: must be between 1 and %u KiB\n", STREAM_BUFFER_MAX >> 11);
+        exit(1);
+    }
+    if (args->stream_memory < args->stream_buffer)
+    {
+        fprintf(stderr, "Invalid stream memory: must be at least the stream buffer\n");
+        exit(1);
+    }
+
+    if (args->out_sample < 1)
+    {
+        fprintf(stderr, "Invalid sample rate: must be at least 1\n");
+        exit(1);
+    }
+    // Live, a slow terminal must not make the kernel drop packets. A file
+    // can wait for the terminal.
+    if (out_policy == -1)
+        args->out_policy = args->read_file ? OUTPUT_BLOCK : OUTPUT_DROP;
+    else
+        args->out_policy = out_policy;
+
+    if (args->write_opts.path == NULL
+        && (args->write_opts.rotate_bytes || args->write_opts.rotate_secs || args->write_opts.max_files))
+    {
+        fprintf(stderr, "-C, -G and -W need -w\n");
+        exit(1);
+    }
+    if (args->write_opts.max_files < 0)
+    {
+        fprintf(stderr, "Invalid file count: %d\n", args->write_opts.max_files);
+        exit(1);
+    }
+
+    // Only the ring backend can spread a capture over several sockets
+    if (args->workers > 1 && (args->backend == BACKEND_XDP || args->backend == BACKEND_FILE))
+    {
+        fprintf(stderr, "--workers can't be used with --backend xdp or -r\n");
+        exit(1);
+    }
+    if (args->workers > 1)
+        args->backend = BACKEND_RING;
+
+    if ((args->dev == NULL && args->read_file == NULL) || args->filter_exp == NULL)
     {
         print_usage(argv[0]);
         exit(1);
@@ -74,16 +536,14 @@ int main(int argc, char **argv)
 
     init(&app, args);
 
-    printf("\nStarting packet capture on %s with filter: %s\n", args.dev, args.filter_exp);
-    while (1)
-    {
-        pcap_loop(app.handle, 1, app.handler, NULL);
-    }
+    if (args.read_file)
+        printf("\nReading %s with filter: %s\n", args.read_file, args.filter_exp);
+    else
+        printf("\nStarting packet capture on %s with filter: %s\n", args.dev, args.filter_exp);
+    int status = capture_run(&app);
 
     // Clean up
-    pcap_freecode(&app.fp);
-    pcap_close(app.handle);
-    pcap_freealldevs(app.alldevs);
+    cleanup(&app);
 
-    return 0;
+    return status == 0 ? 0 : 1;
 }
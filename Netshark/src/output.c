@@ -0,0 +1,717 @@
+#include "output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+/*
+ * Output engine.
+ *
+ * Capture workers never write to stdout themselves. Each one formats its
+ * packets' text into preallocated chunks and publishes full chunks (or
+ * partial ones when traffic is light or OUTPUT_FLUSH_MS went by) on its own
+ * queue. The output thread gathers every published chunk of every queue
+ * into a single writev(2).
+ *
+ * When the terminal or pipe can't keep up, the queues fill up and the
+ * worker applies its policy: wait (the old behaviour, the capture stalls and
+ * the kernel drops packets), drop the packet's text, or sample. Whatever
+ * the policy, it is applied to whole packets and counted.
+ */
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*** Producer side ***/
+
+void outbuf_init(outbuf *ob, output_queue *q, output_policy policy, unsigned int sample)
+{
+    memset(ob, 0, sizeof(*ob));
+    ob->q = q;
+    ob->policy = policy;
+    ob->sample = sample ? sample : 1;
+    ob->raw = OUTPUT_RAW_ALL;
+}
+
+// Makes sure `extra` chunks past the head are free, waiting for them with
+// the block policy. Returns -1 when they aren't.
+static int ob_acquire(outbuf *ob, uint64_t extra)
+{
+    output_queue *q = ob->q;
+    int waited = 0;
+
+    while (q->head + extra - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= OUTPUT_CHUNKS)
+    {
+        if (ob->policy != OUTPUT_BLOCK)
+            return -1;
+        if (!waited)
+            ob->stalls++;
+        waited = 1;
+        usleep(OUTPUT_WAIT_US);
+    }
+    return 0;
+}
+
+// Hands the first `len` bytes of the current chunk to the output thread
+static void ob_publish(outbuf *ob, size_t len)
+{
+    output_queue *q = ob->q;
+
+    q->lens[q->head % OUTPUT_CHUNKS] = len;
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    ob->buf = NULL;
+    ob->len = 0;
+    ob->cap = 0;
+    ob->mark = 0;
+}
+
+// Throws away the text of the packet being formatted
+static void ob_drop(outbuf *ob)
+{
+    ob->len = ob->mark;
+    ob->cap = ob->len;
+    ob->muted = 1;
+    ob->dropped++;
+}
+
+char *ob_make_room(outbuf *ob, size_t need)
+{
+    output_queue *q = ob->q;
+
+    if (ob->muted)
+        return NULL;
+
+    if (ob->buf == NULL)
+    {
+        if (ob_acquire(ob, 0) == -1)
+        {
+            ob_drop(ob);
+            return NULL;
+        }
+        ob->buf = q->chunks[q->head % OUTPUT_CHUNKS];
+        ob->len = 0;
+        ob->mark = 0;
+        ob->cap = OUTPUT_CHUNK_SIZE;
+        ob->since = now_ms();
+        if (need <= OUTPUT_CHUNK_SIZE)
+            return ob->buf;
+    }
+
+    // The chunk is full: carry the packet started at `mark` over to the
+    // next one, unless it is the only thing in the chunk already
+    size_t partial = ob->len - ob->mark;
+
+    if (ob->mark == 0 || partial + need > OUTPUT_CHUNK_SIZE || ob_acquire(ob, 1) == -1)
+    {
+        ob_drop(ob);
+        return NULL;
+    }
+
+    char *next = q->chunks[(q->head + 1) % OUTPUT_CHUNKS];
+
+    memcpy(next, ob->buf + ob->mark, partial);
+    ob_publish(ob, ob->mark);
+    ob->buf = next;
+    ob->len = partial;
+    ob->cap = OUTPUT_CHUNK_SIZE;
+    ob->since = now_ms();
+    return ob->buf + ob->len;
+}
+
+// Called between packets. Publishes the current chunk when the capture is
+// idle (the last burst wasn't full) or when its text has waited long enough.
+void outbuf_flush(outbuf *ob, int idle)
+{
+    if (ob->buf == NULL || ob->len == 0)
+        return;
+    if (idle || now_ms() - ob->since >= OUTPUT_FLUSH_MS)
+        ob_publish(ob, ob->len);
+}
+
+void ob_begin(outbuf *ob)
+{
+    ob->mark = ob->len;
+    if (ob->policy != OUTPUT_SAMPLE)
+        return;
+
+    uint64_t backlog = ob->q->head - __atomic_load_n(&ob->q->tail, __ATOMIC_ACQUIRE);
+
+    if (backlog >= OUTPUT_CHUNKS / 2 && ++ob->sample_seq % ob->sample != 0)
+    {
+        ob->cap = ob->len;
+        ob->muted = 1;
+        ob->sampled++;
+    }
+}
+
+void ob_end(outbuf *ob)
+{
+    if (ob->muted)
+    {
+        ob->muted = 0;
+        ob->cap = ob->buf ? OUTPUT_CHUNK_SIZE : 0;
+    }
+    else if (ob->len > ob->mark)
+        ob->printed++;
+    ob->mark = ob->len;
+}
+
+void ob_puts(outbuf *ob, const char *s)
+{
+    ob_str(ob, s);
+    ob_putc(ob, '\n');
+}
+
+void ob_printf(outbuf *ob, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (ob->muted)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(ob->buf ? ob->buf + ob->len : NULL, ob->cap - ob->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    if ((size_t)n >= ob->cap - ob->len)
+    {
+        char *p = ob_make_room(ob, n + 1);
+        if (!p)
+            return;
+        va_start(ap, fmt);
+        vsnprintf(p, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    ob->len += n;
+}
+
+/*** Formatters ***/
+
+static const char digits2[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+// Writes v in decimal ending right before `end`, returns where it starts
+static char *fmt_u64(char *end, unsigned long long v)
+{
+    char *p = end;
+
+    while (v >= 100)
+    {
+        unsigned int r = v % 100;
+        v /= 100;
+        p -= 2;
+        memcpy(p, digits2 + r * 2, 2);
+    }
+    if (v >= 10)
+    {
+        p -= 2;
+        memcpy(p, digits2 + v * 2, 2);
+    }
+    else
+        *--p = '0' + v;
+    return p;
+}
+
+void ob_u64(outbuf *ob, unsigned long long v)
+{
+    char tmp[20];
+    char *start = fmt_u64(tmp + sizeof(tmp), v);
+
+    ob_write(ob, start, tmp + sizeof(tmp) - start);
+}
+
+void ob_hex(outbuf *ob, unsigned long long v, int digits)
+{
+    char tmp[16];
+    char *p = tmp + sizeof(tmp);
+
+    do {
+        *--p = hex_lower[v & 0xf];
+        v >>= 4;
+        digits--;
+    } while (v || (digits > 0 && p > tmp));
+    ob_write(ob, p, tmp + sizeof(tmp) - p);
+}
+
+void ob_ip4(outbuf *ob, const void *addr)
+{
+    const uint8_t *a = addr;
+    char *p = ob_room(ob, 15);
+
+    if (!p)
+        return;
+
+    char *start = p;
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned int b = a[i];
+
+        if (b >= 100)
+        {
+            *p++ = '0' + b / 100;
+            memcpy(p, digits2 + (b % 100) * 2, 2);
+            p += 2;
+        }
+        else if (b >= 10)
+        {
+            memcpy(p, digits2 + b * 2, 2);
+            p += 2;
+        }
+        else
+            *p++ = '0' + b;
+        if (i < 3)
+            *p++ = '.';
+    }
+    ob->len += p - start;
+}
+
+void ob_mac(outbuf *ob, const uint8_t mac[6])
+{
+    char *p = ob_room(ob, 17);
+
+    if (!p)
+        return;
+    for (int i = 0; i < 6; i++)
+    {
+        p[i * 3] = hex_upper[mac[i] >> 4];
+        p[i * 3 + 1] = hex_upper[mac[i] & 0xf];
+        if (i < 5)
+            p[i * 3 + 2] = ':';
+    }
+    ob->len += 17;
+}
+
+void ob_timestamp(outbuf *ob, const struct timeval *ts)
+{
+    char *p = ob_room(ob, 15);
+
+    if (!p)
+        return;
+
+    // localtime_r() only once per second of capture
+    if (ts->tv_sec != ob->ts_sec || ob->ts_hms[2] != ':')
+    {
+        struct tm tm;
+        time_t sec = ts->tv_sec;
+
+        localtime_r(&sec, &tm);
+        memcpy(ob->ts_hms, digits2 + tm.tm_hour * 2, 2);
+        ob->ts_hms[2] = ':';
+        memcpy(ob->ts_hms + 3, digits2 + tm.tm_min * 2, 2);
+        ob->ts_hms[5] = ':';
+        memcpy(ob->ts_hms + 6, digits2 + tm.tm_sec % 60 * 2, 2);
+        ob->ts_sec = ts->tv_sec;
+    }
+
+    unsigned int us = ts->tv_usec % 1000000;
+
+    memcpy(p, ob->ts_hms, 8);
+    p[8] = '.';
+    memcpy(p + 9, digits2 + us / 10000 * 2, 2);
+    memcpy(p + 11, digits2 + us / 100 % 100 * 2, 2);
+    memcpy(p + 13, digits2 + us % 100 * 2, 2);
+    ob->len += 15;
+}
+
+void ob_seconds(outbuf *ob, unsigned long long us)
+{
+    char frac[7];
+    unsigned int v = us % 1000000;
+
+    frac[0] = '.';
+    memcpy(frac + 1, digits2 + v / 10000 * 2, 2);
+    memcpy(frac + 3, digits2 + v / 100 % 100 * 2, 2);
+    memcpy(frac + 5, digits2 + v % 100 * 2, 2);
+    ob_u64(ob, us / 1000000);
+    ob_write(ob, frac, sizeof(frac));
+}
+
+/*** Hex encoder ***/
+
+// Two characters per byte, high nibble first
+static void hex_encode_scalar(char *dst, const uint8_t *src, size_t len, const char *digits)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        dst[i * 2] = digits[src[i] >> 4];
+        dst[i * 2 + 1] = digits[src[i] & 0xf];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 16 bytes in, 32 characters out: split the nibbles, turn each into its
+// ASCII digit with a compare instead of a table, then interleave them.
+// `letter` is what a nibble above 9 gets on top of '0': 7 for 'A'-'F', 39
+// for 'a'-'f'.
+__attribute__((target("sse2")))
+static size_t hex_encode_sse2(char *dst, const uint8_t *src, size_t len, char letter)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i alpha = _mm_set1_epi8(letter);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+        __m128i lo = _mm_and_si128(in, mask);
+
+        hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
+}
+
+// Same on 32 bytes. The unpacks work within each 128-bit lane, the
+// permutes put the two halves of each lane back in order.
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(char *dst, const uint8_t *src, size_t len, char letter)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i alpha = _mm256_set1_epi8(letter);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), mask);
+        __m256i lo = _mm256_and_si256(in, mask);
+
+        hi = _mm256_add_epi8(_mm256_add_epi8(hi, zero), _mm256_and_si256(_mm256_cmpgt_epi8(hi, nine), alpha));
+        lo = _mm256_add_epi8(_mm256_add_epi8(lo, zero), _mm256_and_si256(_mm256_cmpgt_epi8(lo, nine), alpha));
+
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return i;
+}
+
+#endif
+
+// Encodes with the widest instructions the CPU has, the tail in scalar
+static void hex_encode(char *dst, const uint8_t *src, size_t len, int upper)
+{
+    const char *digits = upper ? hex_upper : hex_lower;
+    size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    char letter = upper ? 7 : 39;
+
+    if (__builtin_cpu_supports("avx2"))
+        done = hex_encode_avx2(dst, src, len, letter);
+    if (__builtin_cpu_supports("sse2"))
+        done += hex_encode_sse2(dst + done * 2, src + done, len - done, letter);
+#endif
+    hex_encode_scalar(dst + done * 2, src + done, len - done, digits);
+}
+
+void ob_hexdump(outbuf *ob, const uint8_t *buf, size_t len, int upper)
+{
+    char *p = ob_room(ob, len * 2);
+
+    if (!p)
+        return;
+    hex_encode(p, buf, len, upper);
+    ob->len += len * 2;
+}
+
+/*** JSON strings ***/
+
+// Bytes a JSON string can't hold as they are: '"', '\\', control
+// characters, and everything above 0x7f since frames aren't UTF-8. Those
+// are written \u00XX, i.e. the bytes are read as Latin-1.
+static size_t json_plain_scalar(const uint8_t *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && s[i] >= 0x20 && s[i] < 0x80 && s[i] != '"' && s[i] != '\\')
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Length of the run of plain bytes at the start of `s`, checked 16 at a
+// time. Bytes above 0x7f are negative as signed chars, so the compare with
+// ' ' catches them along with the control characters. Stops at the first
+// special byte or before the last partial block.
+__attribute__((target("sse2")))
+static size_t json_plain_sse2(const uint8_t *s, size_t len)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(in, space),
+                                   _mm_or_si128(_mm_cmpeq_epi8(in, quote), _mm_cmpeq_epi8(in, bslash)));
+        int mask = _mm_movemask_epi8(bad);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t json_plain_avx2(const uint8_t *s, size_t len)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, in),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(in, quote), _mm256_cmpeq_epi8(in, bslash)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(bad);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
+
+#endif
+
+// Length of the run of plain bytes at the start of `s`. Each step picks up
+// where the wider one stopped: when it stopped on a special byte, the next
+// ones stop there at once.
+static size_t json_plain(const uint8_t *s, size_t len)
+{
+    size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        done = json_plain_avx2(s, len);
+    if (__builtin_cpu_supports("sse2"))
+        done += json_plain_sse2(s + done, len - done);
+#endif
+    return done + json_plain_scalar(s + done, len - done);
+}
+
+void ob_json_str(outbuf *ob, const void *s, size_t len)
+{
+    const uint8_t *src = s;
+    char *p = ob_room(ob, len * 6 + 2);     // Every byte as \u00XX at worst
+
+    if (!p)
+        return;
+
+    char *start = p;
+
+    *p++ = '"';
+    while (len > 0)
+    {
+        size_t n = json_plain(src, len);
+
+        memcpy(p, src, n);
+        p += n;
+        src += n;
+        len -= n;
+        if (len == 0)
+            break;
+
+        uint8_t c = *src++;
+
+        len--;
+        *p++ = '\\';
+        switch (c)
+        {
+            case '"':
+            case '\\': *p++ = c; break;
+            case '\n': *p++ = 'n'; break;
+            case '\r': *p++ = 'r'; break;
+            case '\t': *p++ = 't'; break;
+            default:
+                memcpy(p, "u00", 3);
+                p[3] = hex_lower[c >> 4];
+                p[4] = hex_lower[c & 0xf];
+                p += 5;
+        }
+    }
+    *p++ = '"';
+    ob->len += p - start;
+}
+
+/*** Output thread ***/
+
+// Writes the whole iovec array, discarding the text once a write failed
+static void output_writev(output_thread *o, struct iovec *iov, int cnt)
+{
+    o->writes++;
+    while (cnt > 0 && !o->failed)
+    {
+        ssize_t n = writev(o->fd, iov, cnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Reader went away: keep draining so workers never wait
+            o->failed = 1;
+            break;
+        }
+        o->bytes += n;
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Gathers published chunks from every queue into one writev(2), then
+// hands them back. Returns the number of chunks written.
+static int output_drain(output_thread *o)
+{
+    struct iovec iov[OUTPUT_IOV_MAX];
+    uint64_t taken[o->nqueues];
+    int cnt = 0;
+
+    for (int i = 0; i < o->nqueues; i++)
+    {
+        output_queue *q = &o->queues[i];
+        uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        uint64_t t = q->tail;
+
+        for (; t != head && cnt < OUTPUT_IOV_MAX; t++, cnt++)
+        {
+            iov[cnt].iov_base = q->chunks[t % OUTPUT_CHUNKS];
+            iov[cnt].iov_len = q->lens[t % OUTPUT_CHUNKS];
+        }
+        taken[i] = t;
+    }
+
+    if (cnt == 0)
+        return 0;
+    // What the stream must not start with (the JSON array's first
+    // separator), taken off the first bytes ever written
+    for (int i = 0; i < cnt && o->skip; i++)
+    {
+        size_t n = o->skip < iov[i].iov_len ? o->skip : iov[i].iov_len;
+
+        iov[i].iov_base = (char *)iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+        o->skip -= n;
+    }
+    output_writev(o, iov, cnt);
+
+    for (int i = 0; i < o->nqueues; i++)
+        __atomic_store_n(&o->queues[i].tail, taken[i], __ATOMIC_RELEASE);
+    return cnt;
+}
+
+static void *output_main(void *arg)
+{
+    output_thread *o = (output_thread *)arg;
+
+    for (;;)
+    {
+        // Read before draining: once set, the workers have published
+        // their last chunk
+        int stopping = __atomic_load_n(&o->stop, __ATOMIC_ACQUIRE);
+
+        if (output_drain(o))
+            continue;
+        if (stopping)
+            break;
+        usleep(OUTPUT_IDLE_US);
+    }
+    return NULL;
+}
+
+/*** Setup ***/
+
+int output_init(output_thread *o, int fd, int nqueues)
+{
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+
+    o->queues = calloc(nqueues, sizeof(output_queue));
+    if (!o->queues)
+        return -1;
+    o->nqueues = nqueues;
+
+    for (int i = 0; i < nqueues; i++)
+    {
+        for (int c = 0; c < OUTPUT_CHUNKS; c++)
+        {
+            o->queues[i].chunks[c] = malloc(OUTPUT_CHUNK_SIZE);
+            if (!o->queues[i].chunks[c])
+                return -1;
+        }
+    }
+    return 0;
+}
+
+void output_free(output_thread *o)
+{
+    for (int i = 0; i < o->nqueues && o->queues; i++)
+    {
+        for (int c = 0; c < OUTPUT_CHUNKS; c++)
+            free(o->queues[i].chunks[c]);
+    }
+    free(o->queues);
+    memset(o, 0, sizeof(*o));
+}
+
+int output_start(output_thread *o)
+{
+    if (pthread_create(&o->thread, NULL, output_main, o) != 0)
+    {
+        fprintf(stderr, "Couldn't start the output thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void output_stop(output_thread *o)
+{
+    __atomic_store_n(&o->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(o->thread, NULL);
+}
@@ -1,9 +1,9 @@
 #include "arp.h"
 #include "ethernet.h"
 
-int parse_arp_packet(const unsigned char *frame, size_t frame_len, arp_packet *out) {
+int parse_arp_packet(const unsigned char *frame, size_t frame_len, const eth_header *ether, arp_packet *out) {
     // 1. Sanity check
-    if (!frame || !out)
+    if (!frame || !ether || !out)
         return -1;
     // Must contain Ethernet + ARP header
     if (frame_len < sizeof(arp_header)) {
@@ -11,8 +11,8 @@ int parse_arp_packet(const unsigned char *frame, size_t frame_len, arp_packet *o
         return -1;
     }
     // Confirm ARP ethertype
-    if (out->ether.ethertype != ETHERTYPE_ARP) {
-        fprintf(stderr, "Not an ARP frame: 0x%04x\n", ntohs(out->ether.ethertype));
+    if (ether->ethertype != ETHERTYPE_ARP) {
+        fprintf(stderr, "Not an ARP frame: 0x%04x\n", ether->ethertype);
         return -1;
     }
 
@@ -32,10 +32,10 @@ int parse_arp_packet(const unsigned char *frame, size_t frame_len, arp_packet *o
     out->protocol_size = arp->pln;
     out->operation     = ntohs(arp->op);
 
-    mac_to_str(arp->sha, out->sender_mac, sizeof(out->sender_mac)),
-    mac_to_str(arp->tha, out->target_mac, sizeof(out->target_mac)),
-    inet_ntop(AF_INET, arp->sip, out->sender_ip, sizeof(out->sender_ip));
-    inet_ntop(AF_INET, arp->tip, out->target_ip, sizeof(out->target_ip));
+    out->sender_mac    = arp->sha;
+    out->sender_ip     = arp->sip;
+    out->target_mac    = arp->tha;
+    out->target_ip     = arp->tip;
 
     return sizeof(arp_header); // Return number of bytes parsed after Ethernet
 }
\ No newline at end of file
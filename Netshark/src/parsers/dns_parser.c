@@ -0,0 +1,271 @@
+#include "dns.h"
+#include <string.h>
+
+/*
+ * DNS wire format decoder, shared by the dns and mdns dissectors.
+ *
+ * parse_dns_packet() walks the header and every section, checking each
+ * name and locating each record without copying anything: names stay
+ * offsets into the message, decoded label by label by dns_name_next()
+ * when printed. A compression pointer must point below every position the
+ * name visited so far, so a crafted message can't make it loop.
+ */
+
+static inline uint16_t get16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*** Names ***/
+
+void dns_name_iter_init(dns_name_iter *it, const unsigned char *msg, size_t len, size_t off) {
+    it->msg = msg;
+    it->len = len;
+    it->pos = off;
+    it->limit = off;
+    it->total = 0;
+    it->end = 0;
+}
+
+// Sets *label to the next label and returns 1, returns 0 past the last
+// one, -1 when the name is malformed
+int dns_name_next(dns_name_iter *it, span *label) {
+    for (;;) {
+        uint8_t c;
+
+        if (it->pos >= it->len)
+            return -1;
+        c = it->msg[it->pos];
+        if (c == 0) {
+            if (!it->end)
+                it->end = it->pos + 1;
+            return 0;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            size_t ptr;
+
+            if (it->pos + 1 >= it->len)
+                return -1;
+            ptr = (size_t)(c & 0x3f) << 8 | it->msg[it->pos + 1];
+            if (ptr >= it->limit)
+                return -1;
+            if (!it->end)
+                it->end = it->pos + 2;
+            it->pos = it->limit = ptr;
+            continue;
+        }
+        // 0x40 and 0x80 label types are obsolete or unassigned
+        if (c & 0xc0)
+            return -1;
+        if (it->pos + 1 + c > it->len)
+            return -1;
+        it->total += c + 1;
+        if (it->total > 255)
+            return -1;
+        label->ptr = it->msg + it->pos + 1;
+        label->len = c;
+        it->pos += 1 + c;
+        return 1;
+    }
+}
+
+// Checks the whole name at *off and steps over its bytes in place
+static int name_skip(const unsigned char *msg, size_t len, size_t *off) {
+    dns_name_iter it;
+    span label;
+    int r;
+
+    dns_name_iter_init(&it, msg, len, *off);
+    while ((r = dns_name_next(&it, &label)) == 1)
+        ;
+    if (r < 0)
+        return -1;
+    *off = it.end;
+    return 0;
+}
+
+// Dotted text of the name, "." for the root, cut to fit `size` with its
+// NUL. Returns its length, 0 when the name is malformed.
+size_t dns_name_text(const unsigned char *msg, size_t len, size_t off, char *buf, size_t size) {
+    dns_name_iter it;
+    span label;
+    size_t n = 0;
+    int r;
+
+    if (size == 0)
+        return 0;
+    dns_name_iter_init(&it, msg, len, off);
+    while ((r = dns_name_next(&it, &label)) == 1) {
+        size_t take = label.len < size - 1 - n ? label.len : size - 1 - n;
+
+        memcpy(buf + n, label.ptr, take);
+        n += take;
+        if (n + 1 < size)
+            buf[n++] = '.';
+    }
+    if (r < 0) {
+        buf[0] = '\0';
+        return 0;
+    }
+    if (n == 0 && size > 1)
+        buf[n++] = '.';
+    else if (n > 1 && buf[n - 1] == '.')
+        n--;
+    buf[n] = '\0';
+    return n;
+}
+
+// FNV-1a of the labels, case folded: the same name hashes the same however
+// it is compressed or capitalized. 0 when the name is malformed.
+uint32_t dns_name_hash(const unsigned char *msg, size_t len, size_t off) {
+    dns_name_iter it;
+    span label;
+    uint32_t h = 2166136261u;
+    int r;
+
+    dns_name_iter_init(&it, msg, len, off);
+    while ((r = dns_name_next(&it, &label)) == 1) {
+        h = (h ^ label.len) * 16777619u;
+        for (uint32_t i = 0; i < label.len; i++) {
+            uint8_t c = label.ptr[i];
+
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            h = (h ^ c) * 16777619u;
+        }
+    }
+    return r < 0 ? 0 : h;
+}
+
+/*** Records ***/
+
+// The names inside the data of the types that hold some must be whole and
+// end within it; fixed size data must have its size
+static int rdata_check(const unsigned char *msg, size_t len, const dns_rr *rr) {
+    size_t off = rr->rdata;
+    size_t end = off + rr->rdlength;
+
+    switch (rr->type) {
+    case DNS_TYPE_A:
+        return rr->rdlength == 4 ? 0 : -1;
+    case DNS_TYPE_AAAA:
+        return rr->rdlength == 16 ? 0 : -1;
+    case DNS_TYPE_NS:
+    case DNS_TYPE_CNAME:
+    case DNS_TYPE_PTR:
+    case DNS_TYPE_DNAME:
+    case DNS_TYPE_NSEC:
+        break;
+    case DNS_TYPE_MX:
+    case DNS_TYPE_SVCB:
+    case DNS_TYPE_HTTPS:
+        off += 2;
+        break;
+    case DNS_TYPE_SRV:
+        off += 6;
+        break;
+    case DNS_TYPE_RRSIG:
+        off += 18;
+        break;
+    case DNS_TYPE_SOA:
+        if (off >= end || name_skip(msg, len, &off) < 0 || off > end)
+            return -1;
+        if (off >= end || name_skip(msg, len, &off) < 0)
+            return -1;
+        return off + 20 <= end ? 0 : -1;
+    default:
+        return 0;
+    }
+    if (off >= end || name_skip(msg, len, &off) < 0)
+        return -1;
+    return off <= end ? 0 : -1;
+}
+
+// The OPT pseudo-record carries EDNS0: payload size in the class, the
+// rcode's upper bits, version and DO flag in the TTL (RFC 6891)
+static void edns_read(dns_packet *out, const dns_rr *rr) {
+    out->edns = 1;
+    out->udp_size = rr->class;
+    out->rcode |= (rr->ttl >> 24) << 4;
+    out->edns_version = (rr->ttl >> 16) & 0xff;
+    out->dnssec_ok = (rr->ttl >> 15) & 1;
+    out->opt = out->nrr;
+}
+
+int parse_dns_packet(const unsigned char *data, size_t len, dns_packet *out) {
+    if (!data || len < DNS_HEADER_LEN || !out) return -1;
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+
+    out->msg = data;
+    out->id = get16(data);
+    out->flags = get16(data + 2);
+    out->qdcount = get16(data + 4);
+    out->ancount = get16(data + 6);
+    out->nscount = get16(data + 8);
+    out->arcount = get16(data + 10);
+    out->qname_off = 0;
+    out->qtype = 0;
+    out->qclass = 0;
+    out->total_len = len;
+    out->rcode = out->flags & 0x000f;
+    out->edns = 0;
+    out->edns_version = 0;
+    out->dnssec_ok = 0;
+    out->malformed = 0;
+    out->udp_size = 0;
+    out->nrr = 0;
+    out->opt = DNS_RR_MAX;
+
+    const uint16_t counts[4] = { out->qdcount, out->ancount, out->nscount, out->arcount };
+    size_t off = DNS_HEADER_LEN;
+
+    for (int s = DNS_QUESTION; s <= DNS_ADDITIONAL; s++) {
+        for (uint32_t i = 0; i < counts[s]; i++) {
+            dns_rr rr;
+
+            rr.name = off;
+            rr.section = s;
+            if (name_skip(data, len, &off) < 0)
+                goto malformed;
+            if (s == DNS_QUESTION) {
+                if (off + 4 > len)
+                    goto malformed;
+                rr.type = get16(data + off);
+                rr.class = get16(data + off + 2);
+                rr.ttl = 0;
+                rr.rdlength = 0;
+                rr.rdata = 0;
+                off += 4;
+                if (!out->qname_off) {
+                    out->qname_off = rr.name;
+                    out->qtype = rr.type;
+                    out->qclass = rr.class;
+                }
+            } else {
+                if (off + 10 > len)
+                    goto malformed;
+                rr.type = get16(data + off);
+                rr.class = get16(data + off + 2);
+                rr.ttl = get32(data + off + 4);
+                rr.rdlength = get16(data + off + 8);
+                rr.rdata = off + 10;
+                off = rr.rdata + rr.rdlength;
+                if (off > len || rdata_check(data, len, &rr) < 0)
+                    goto malformed;
+                if (rr.type == DNS_TYPE_OPT && !out->edns)
+                    edns_read(out, &rr);
+            }
+            if (out->nrr < DNS_RR_MAX)
+                out->rr[out->nrr++] = rr;
+        }
+    }
+    return 0;
+
+malformed:
+    out->malformed = 1;
+    return 0;
+}
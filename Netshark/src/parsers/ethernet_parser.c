@@ -1,5 +1,6 @@
 #include "netshark.h"
 #include "ethernet.h"
+#include <arpa/inet.h>
 
 /* ---------------------------------------------------------------------- */
 int parse_ethernet_header(
@@ -12,9 +13,9 @@ int parse_ethernet_header(
 
     const ether_info *eh = (const ether_info *)(const void *)frame;
 
-    memset(out, 0, sizeof *out);
-    mac_to_str(eh->dst, out->dst_mac, sizeof out->dst_mac);
-    mac_to_str(eh->src, out->src_mac, sizeof out->src_mac);
+    out->dst      = eh->dst;
+    out->src      = eh->src;
+    out->has_vlan = 0;
 
     /* ---- EtherType or frame_length? ---------------------------------------- */
     uint16_t et = ntohs(eh->type_len);
@@ -23,10 +24,11 @@ int parse_ethernet_header(
 
     /* VLAN tagging check (single tag only) ----------------------------- */
     if (et == ETHERTYPE_VLAN || et == ETHERTYPE_QINQ) {
-        if (frame_len < offset + sizeof(vlan_tag))
+        /* the tag starts with the TPID just read as the EtherType */
+        if (frame_len < offset + 4)
             return -1;            /* truncated tag */
 
-        const vlan_tag *tag = (const vlan_tag *)(const void *)(frame + offset);
+        const vlan_tag *tag = (const vlan_tag *)(const void *)(frame + offset - 2);
 
         out->has_vlan  = 1;
         out->vlan_tpid = et;      /* 0x8100 or 0x88A8                 */
@@ -35,14 +37,12 @@ int parse_ethernet_header(
         out->vlan_pcp  = (uint8_t)((tci >> 13) & 0x07);
         out->vlan_vid  = (uint16_t)(tci & 0x0FFF);
 
-        /* inner EtherType is after the tag */
-        offset += sizeof *tag;
-        if (frame_len < offset + 2) return -1;
-
+        /* inner EtherType is after the TCI */
+        offset += 2;
         et = ntohs(*(const uint16_t *)(const void *)(frame + offset));
         offset += 2;
     }
 
     out->ethertype = et;
-    return (int)ETH_MIN_FRAME;                       /* offset to next layer */
+    return (int)offset;                              /* offset to next layer */
 }
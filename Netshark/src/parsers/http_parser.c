@@ -0,0 +1,441 @@
+#include "http.h"
+#include <string.h>
+#include <strings.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * HTTP/1.x parser.
+ *
+ * Heads are parsed in place: the start line and every header field come
+ * out as spans of the caller's bytes, nothing is copied. http_parse()
+ * follows one direction of a connection across calls: it finds where each
+ * head ends, then walks the body by its framing (Content-Length, chunked,
+ * or up to the close) so the next message of a keep-alive or pipelined
+ * connection is found where it starts. Line ends are looked for 32 or 16
+ * bytes at a time.
+ */
+
+/*** Line ends ***/
+
+static size_t scan_nl_scalar(const unsigned char *s, size_t len) {
+    size_t i = 0;
+
+    while (i < len && s[i] != '\n')
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Offset of the first '\n' in `s`, or of the last partial block
+__attribute__((target("sse2")))
+static size_t scan_nl_sse2(const unsigned char *s, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), nl));
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_nl_avx2(const unsigned char *s, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), nl));
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
+
+#endif
+
+// Offset of the first '\n' in `s`, len when there is none. As in
+// json_plain(), each step picks up where the wider one stopped.
+static size_t scan_nl(const unsigned char *s, size_t len) {
+    size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        done = scan_nl_avx2(s, len);
+    if (__builtin_cpu_supports("sse2"))
+        done += scan_nl_sse2(s + done, len - done);
+#endif
+    return done + scan_nl_scalar(s + done, len - done);
+}
+
+// Length of the head at the start of `s`, up to and with its empty line,
+// 0 while incomplete. The first `from` bytes are known not to end it.
+static size_t head_end(const unsigned char *s, size_t len, size_t from) {
+    size_t i = from;
+
+    while (i < len) {
+        i += scan_nl(s + i, len - i);
+        if (i == len)
+            break;
+        if ((i >= 1 && s[i - 1] == '\n') || (i >= 2 && s[i - 1] == '\r' && s[i - 2] == '\n'))
+            return i + 1;
+        i++;
+    }
+    return 0;
+}
+
+/*** Heads ***/
+
+// Splits the next space separated token of [*pos, end) into `out`
+static void next_token(const unsigned char *data, size_t end, size_t *pos, span *out) {
+    size_t i = *pos;
+    while (i < end && data[i] == ' ')
+        i++;
+    out->ptr = data + i;
+    while (i < end && data[i] != ' ')
+        i++;
+    out->len = data + i - out->ptr;
+    *pos = i;
+}
+
+static int span_is(span s, const char *str) {
+    size_t n = strlen(str);
+    return s.len == n && strncasecmp((const char *)s.ptr, str, n) == 0;
+}
+
+// Whether the comma separated list `s` holds `token`
+static int has_token(span s, const char *token) {
+    size_t i = 0;
+
+    while (i < s.len) {
+        span t;
+
+        while (i < s.len && (s.ptr[i] == ' ' || s.ptr[i] == '\t' || s.ptr[i] == ','))
+            i++;
+        t.ptr = s.ptr + i;
+        while (i < s.len && s.ptr[i] != ',')
+            i++;
+        t.len = s.ptr + i - t.ptr;
+        while (t.len && (t.ptr[t.len - 1] == ' ' || t.ptr[t.len - 1] == '\t'))
+            t.len--;
+        if (span_is(t, token))
+            return 1;
+    }
+    return 0;
+}
+
+// Picks out the fields that decide how the message is framed
+static void http_field(http_packet *out, span name, span value) {
+    if (span_is(name, "Content-Length")) {
+        uint64_t n = 0;
+        uint32_t i = 0;
+
+        for (; i < value.len && value.ptr[i] >= '0' && value.ptr[i] <= '9' && n < (1ULL << 40); i++)
+            n = n * 10 + (value.ptr[i] - '0');
+        if (i && !out->has_length) {
+            out->has_length = 1;
+            out->content_length = n;
+        }
+    } else if (span_is(name, "Transfer-Encoding")) {
+        out->chunked = has_token(value, "chunked");
+    } else if (span_is(name, "Connection")) {
+        if (has_token(value, "close"))
+            out->keep_alive = 0;
+        else if (has_token(value, "keep-alive"))
+            out->keep_alive = 1;
+    }
+}
+
+// Parses the head at the start of [packet, packet + len): a request or
+// status line, then the header fields up to the empty line. Whatever
+// follows the head is the body. A head cut short keeps the fields seen.
+int parse_http_packet(const unsigned char *data, size_t len, http_packet *out) {
+    if (!data || !out || len == 0) return -1;
+
+    memset(out, 0, sizeof(*out));
+
+    size_t eol = scan_nl(data, len);
+    size_t line_end = eol > 0 && data[eol - 1] == '\r' ? eol - 1 : eol;
+    size_t pos = 0;
+
+    // Detect if response or request
+    if (len >= 5 && memcmp(data, "HTTP/", 5) == 0) {
+        out->is_response = 1;
+        next_token(data, line_end, &pos, &out->version);
+        span code;
+        next_token(data, line_end, &pos, &code);
+        for (uint32_t i = 0; i < code.len && i < 3 && code.ptr[i] >= '0' && code.ptr[i] <= '9'; i++)
+            out->status_code = out->status_code * 10 + (code.ptr[i] - '0');
+        while (pos < line_end && data[pos] == ' ')
+            pos++;
+        out->status_message.ptr = data + pos;
+        out->status_message.len = line_end - pos;
+    } else {
+        out->is_request = 1;
+        next_token(data, line_end, &pos, &out->method);
+        next_token(data, line_end, &pos, &out->path);
+        next_token(data, line_end, &pos, &out->version);
+    }
+    // Persistent by default from HTTP/1.1 on
+    out->keep_alive = !span_is(out->version, HTTP_VERSION_1_0);
+
+    // Header fields, one per line
+    const unsigned char *headers_start = data + eol + 1;
+    const unsigned char *headers_end = headers_start;
+
+    out->header_len = len;
+    for (pos = eol + 1; pos < len;) {
+        size_t end = pos + scan_nl(data + pos, len - pos);
+        size_t le = end > pos && data[end - 1] == '\r' ? end - 1 : end;
+
+        if (le == pos && end < len) {
+            out->header_len = end + 1;
+            out->headers.ptr = headers_start;
+            out->headers.len = headers_end - headers_start;
+            out->body.ptr = data + end + 1;
+            out->body.len = len - end - 1;
+            out->data_len = out->body.len;
+            break;
+        }
+        if (data[pos] == ' ' || data[pos] == '\t') {
+            // Folded onto the previous field's value
+            if (out->nfields) {
+                http_header *h = &out->fields[out->nfields - 1];
+                h->value.len = data + le - h->value.ptr;
+            }
+        } else {
+            const unsigned char *colon = memchr(data + pos, ':', le - pos);
+
+            if (colon && out->nfields < HTTP_HEADERS_MAX) {
+                http_header *h = &out->fields[out->nfields++];
+                size_t v = colon + 1 - data;
+
+                h->name.ptr = data + pos;
+                h->name.len = colon - h->name.ptr;
+                while (v < le && (data[v] == ' ' || data[v] == '\t'))
+                    v++;
+                h->value.ptr = data + v;
+                h->value.len = le - v;
+                while (h->value.len && (h->value.ptr[h->value.len - 1] == ' ' ||
+                                        h->value.ptr[h->value.len - 1] == '\t'))
+                    h->value.len--;
+                http_field(out, h->name, h->value);
+            }
+        }
+        headers_end = data + le;
+        pos = end + 1;
+    }
+
+    return 0;
+}
+
+// Value of the first header field called `name`, whatever its case.
+// ptr is NULL when the head has no such field.
+span http_header_value(const http_packet *p, const char *name) {
+    span none = { NULL, 0 };
+
+    for (uint8_t i = 0; i < p->nfields; i++)
+        if (span_is(p->fields[i].name, name))
+            return p->fields[i].value;
+    return none;
+}
+
+// 1 when a message starts at `data` (a status line or a request line with
+// a known method), -1 when `data` is too short to tell, 0 otherwise
+int http_message_start(const unsigned char *data, size_t len) {
+    static const char *starts[] = {
+        "HTTP/1.", HTTP_METHOD_GET " ", HTTP_METHOD_POST " ", HTTP_METHOD_PUT " ",
+        HTTP_METHOD_DELETE " ", HTTP_METHOD_HEAD " ", HTTP_METHOD_OPTIONS " ",
+        HTTP_METHOD_TRACE " ", HTTP_METHOD_CONNECT " ", HTTP_METHOD_PATCH " ",
+    };
+    int partial = 0;
+
+    for (size_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+        size_t n = strlen(starts[i]);
+
+        if (memcmp(data, starts[i], len < n ? len : n) == 0) {
+            if (len >= n)
+                return 1;
+            partial = 1;
+        }
+    }
+    return partial ? -1 : 0;
+}
+
+/*** Connections ***/
+
+// Sets the parser up for the body of the head just parsed (RFC 9112 6.3).
+// `head_request` tells a response to HEAD, which has no body.
+static void http_framing(http_parser *ps, const http_packet *m, int head_request) {
+    if (m->is_response && (head_request || m->status_code == 204 || m->status_code == 304 ||
+                           (m->status_code / 100 == 1 && m->status_code != 101))) {
+        ps->state = HTTP_STATE_DONE;
+    } else if (m->is_response && m->status_code == 101) {
+        // Switched protocols: the rest isn't HTTP
+        ps->state = HTTP_STATE_CLOSE;
+    } else if (m->chunked) {
+        ps->state = HTTP_STATE_CHUNK_SIZE;
+    } else if (m->has_length) {
+        ps->remaining = m->content_length;
+        ps->state = m->content_length ? HTTP_STATE_BODY : HTTP_STATE_DONE;
+    } else {
+        ps->state = m->is_request ? HTTP_STATE_DONE : HTTP_STATE_CLOSE;
+    }
+}
+
+// Bytes were lost: the next message is looked for by its first line
+void http_parser_lost(http_parser *ps) {
+    ps->state = HTTP_STATE_LOST;
+    ps->scanned = 0;
+    ps->remaining = 0;
+}
+
+// Parses what it can of [data, data + len), the bytes of one direction
+// following those consumed by the previous calls. Returns how many it
+// consumed and what they were in *ev. Bytes left over (an incomplete head
+// or chunk line) must be given again with the ones that follow. Called
+// until it gives HTTP_EV_NONE with nothing consumed; `fin` when no bytes
+// will follow these.
+size_t http_parse(http_parser *ps, const unsigned char *data, size_t len, int fin, int head_request,
+                  http_packet *msg, http_event *ev) {
+    size_t n;
+
+    *ev = HTTP_EV_NONE;
+    for (;;) {
+        switch (ps->state) {
+        case HTTP_STATE_HEAD:
+            // Empty lines between messages are tolerated
+            for (n = 0; n < len && (data[n] == '\r' || data[n] == '\n'); n++)
+                ;
+            if (n || len == 0) {
+                ps->scanned = 0;
+                return n;
+            }
+            switch (http_message_start(data, len)) {
+            case 0:
+                http_parser_lost(ps);
+                continue;
+            case -1:
+                return fin ? len : 0;
+            }
+            n = head_end(data, len, ps->scanned);
+            if (n == 0) {
+                ps->scanned = len;
+                if (!fin)
+                    return 0;
+                http_parser_lost(ps);
+                return len;
+            }
+            ps->scanned = 0;
+            parse_http_packet(data, n, msg);
+            ps->response = msg->is_response;
+            http_framing(ps, msg, head_request);
+            msg->body.ptr = data + n;
+            if (ps->state == HTTP_STATE_BODY)
+                msg->body.len = ps->remaining < len - n ? ps->remaining : len - n;
+            else if (ps->state == HTTP_STATE_CLOSE)
+                msg->body.len = len - n;
+            else
+                msg->body.len = 0;
+            if (msg->has_length && ps->state == HTTP_STATE_BODY)
+                msg->data_len = ps->remaining < UINT32_MAX ? ps->remaining : UINT32_MAX;
+            else
+                msg->data_len = msg->body.len;
+            *ev = HTTP_EV_HEAD;
+            return n;
+
+        case HTTP_STATE_BODY:
+        case HTTP_STATE_CHUNK_DATA:
+            if (len == 0)
+                return 0;
+            n = ps->remaining < len ? ps->remaining : len;
+            ps->remaining -= n;
+            if (ps->remaining == 0)
+                ps->state = ps->state == HTTP_STATE_BODY ? HTTP_STATE_DONE : HTTP_STATE_CHUNK_SIZE;
+            *ev = HTTP_EV_BODY;
+            return n;
+
+        case HTTP_STATE_CHUNK_SIZE:
+        case HTTP_STATE_TRAILER:
+            n = scan_nl(data, len);
+            if (n == len) {
+                if (len <= HTTP_LINE_MAX && !fin)
+                    return 0;
+                http_parser_lost(ps);
+                continue;
+            }
+            if (ps->state == HTTP_STATE_TRAILER) {
+                // Up to the empty line
+                if (n == 0 || (n == 1 && data[0] == '\r'))
+                    ps->state = HTTP_STATE_DONE;
+                return n + 1;
+            }
+            {
+                uint64_t size = 0;
+                size_t i = 0;
+
+                for (; i < n && size < (1ULL << 40); i++) {
+                    unsigned char c = data[i] | 0x20;
+
+                    if (data[i] >= '0' && data[i] <= '9')
+                        size = size * 16 + (data[i] - '0');
+                    else if (c >= 'a' && c <= 'f')
+                        size = size * 16 + (c - 'a' + 10);
+                    else
+                        break;
+                }
+                if (i == 0) {
+                    http_parser_lost(ps);
+                    continue;
+                }
+                // The data and the CRLF closing it
+                ps->remaining = size + 2;
+                ps->state = size ? HTTP_STATE_CHUNK_DATA : HTTP_STATE_TRAILER;
+            }
+            return n + 1;
+
+        case HTTP_STATE_DONE:
+            ps->state = HTTP_STATE_HEAD;
+            *ev = HTTP_EV_END;
+            return 0;
+
+        case HTTP_STATE_CLOSE:
+            if (len) {
+                *ev = HTTP_EV_BODY;
+                return len;
+            }
+            if (fin) {
+                http_parser_lost(ps);
+                *ev = HTTP_EV_END;
+            }
+            return 0;
+
+        default:
+            // Lost: skip whole lines up to one starting a message
+            for (n = 0; n < len;) {
+                int start = http_message_start(data + n, len - n);
+                size_t nl;
+
+                if (start == 1)
+                    break;
+                if (start == -1 && !fin)
+                    return n;
+                nl = scan_nl(data + n, len - n);
+                if (n + nl == len)
+                    return len;
+                n += nl + 1;
+            }
+            if (n || len == 0)
+                return n;
+            ps->state = HTTP_STATE_HEAD;
+            continue;
+        }
+    }
+}
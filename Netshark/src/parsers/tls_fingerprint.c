@@ -0,0 +1,492 @@
+#include "tls.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * JA3/JA3S and JA4/JA4S fingerprints of ClientHello and ServerHello.
+ *
+ * One walk over the hello, tls_hello_walk(), collects the values the
+ * fingerprints are made of into small lists: cipher suites and extension
+ * types in the order sent, GREASE left out, and the values of the
+ * extensions they look into (groups, point formats, signature algorithms,
+ * supported versions). The same walk notes what the session cache needs:
+ * the session ID, a ticket, pre_shared_key. Each digest is then looked
+ * up in the worker's memo by a 64-bit hash of its lists; only lists never
+ * seen before go through MD5 or SHA-256, fed their values one by one,
+ * without building the text the fingerprint specifications describe.
+ */
+
+#define EXT_SERVER_NAME         0x0000
+#define EXT_SUPPORTED_GROUPS    0x000a
+#define EXT_EC_POINT_FORMATS    0x000b
+#define EXT_SIGNATURE_ALGS      0x000d
+#define EXT_ALPN                0x0010
+#define EXT_SESSION_TICKET      0x0023
+#define EXT_PRE_SHARED_KEY      0x0029
+#define EXT_SUPPORTED_VERSIONS  0x002b
+
+// Told apart in memo keys: two digests may hash the same lists
+typedef enum {
+    MEMO_JA3 = 1,
+    MEMO_JA3S,
+    MEMO_JA4_CIPHERS,
+    MEMO_JA4_EXTS,
+    MEMO_JA4S_EXTS,
+}               memo_kind;
+
+static const char hexdigits[] = "0123456789abcdef";
+
+// Random of a ServerHello that is a HelloRetryRequest: SHA-256 of "HelloRetryRequest"
+static const unsigned char retry_random[32] = {
+    0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11, 0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+    0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e, 0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c,
+};
+
+int tls_fp_cache_init(tls_fp_cache *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->memo = calloc(TLS_FP_CACHE, sizeof(tls_fp_memo));
+    return c->memo ? 0 : -1;
+}
+
+void tls_fp_cache_free(tls_fp_cache *c)
+{
+    free(c->memo);
+    c->memo = NULL;
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// RFC 8701 reserves 0x0a0a, 0x1a1a, ... 0xfafa: random values in every list
+static inline int is_grease(uint16_t v)
+{
+    return (v & 0x0f0f) == 0x0a0a && (v >> 8) == (v & 0xff);
+}
+
+static inline void list_clear(tls_fp_list *l)
+{
+    l->n = 0;
+    l->count = 0;
+}
+
+static inline void list_add(tls_fp_list *l, uint16_t v)
+{
+    if (l->n < TLS_FP_LIST_MAX)
+        l->v[l->n++] = v;
+    l->count++;
+}
+
+static void list_sort(tls_fp_list *l)
+{
+    for (size_t i = 1; i < l->n; i++)
+    {
+        uint16_t x = l->v[i];
+        size_t j = i;
+
+        for (; j > 0 && l->v[j - 1] > x; j--)
+            l->v[j] = l->v[j - 1];
+        l->v[j] = x;
+    }
+}
+
+/*** Memo ***/
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Sum of a hash of each value with the list it is in, and with its place
+// in it for the lists of `ordered` (a bit per list): every value is mixed
+// apart, and JA4's sorted lists need no sorting to be looked up
+static uint64_t memo_key(memo_kind kind, const tls_fp_list *const *lists, int n, unsigned ordered)
+{
+    uint64_t h = mix64(kind);
+
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t tag = (uint64_t)i << 16;
+
+        for (size_t j = 0; j < lists[i]->n; j++)
+            h += mix64(lists[i]->v[j] | tag | (ordered >> i & 1 ? (uint64_t)(j + 1) << 24 : 0));
+        h += mix64(lists[i]->n | tag | 1ULL << 63);
+    }
+    return h ? h : 1;
+}
+
+// Copies the digest of `key` to `out` when it was computed before
+static int memo_find(tls_fp_cache *c, uint64_t key, char *out, size_t len)
+{
+    tls_fp_memo *m;
+
+    if (c == NULL || c->memo == NULL)
+        return 0;
+    m = &c->memo[key & (TLS_FP_CACHE - 1)];
+    if (m->key != key)
+        return 0;
+    memcpy(out, m->hex, len);
+    c->hits++;
+    return 1;
+}
+
+static void memo_keep(tls_fp_cache *c, uint64_t key, const char *hex, size_t len)
+{
+    tls_fp_memo *m;
+
+    if (c == NULL)
+        return;
+    c->digests++;
+    if (c->memo == NULL)
+        return;
+    m = &c->memo[key & (TLS_FP_CACHE - 1)];
+    m->key = key;
+    memcpy(m->hex, hex, len);
+}
+
+/*** Digests ***/
+
+// JA3 and JA3S: decimal values, dashes within a list, commas between
+static void ja3_digest(tls_fp_cache *c, memo_kind kind, const tls_fp_list *const *lists, int n, char *out)
+{
+    uint64_t key = memo_key(kind, lists, n, ~0u);
+    unsigned char digest[MD5_DIGEST_LEN];
+    md5_ctx m;
+
+    if (memo_find(c, key, out, TLS_JA3_LEN))
+        return;
+    md5_init(&m);
+    for (int i = 0; i < n; i++)
+    {
+        if (i)
+            md5_update(&m, ",", 1);
+        for (size_t j = 0; j < lists[i]->n; j++)
+        {
+            uint16_t v = lists[i]->v[j];
+            char buf[6];
+            size_t k = sizeof(buf);
+
+            do {
+                buf[--k] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            if (j)
+                buf[--k] = '-';
+            md5_update(&m, buf + k, sizeof(buf) - k);
+        }
+    }
+    md5_final(&m, digest);
+    hex_string(digest, sizeof(digest), out);
+    memo_keep(c, key, out, TLS_JA3_LEN);
+}
+
+static void sha256_hex_list(sha256_ctx *s, const tls_fp_list *l)
+{
+    for (size_t i = 0; i < l->n; i++)
+    {
+        uint16_t v = l->v[i];
+        char buf[5] = { ',', hexdigits[v >> 12], hexdigits[(v >> 8) & 15],
+                        hexdigits[(v >> 4) & 15], hexdigits[v & 15] };
+
+        sha256_update(s, buf + (i == 0), sizeof(buf) - (i == 0));
+    }
+}
+
+// JA4's 12 hex digits: SHA-256 of `first` as a comma separated hex list,
+// sorted when `sort` is set, then `second` as it is after an underscore
+// when it has values. Twelve zeros when `first` is empty.
+static void ja4_digest(tls_fp_cache *c, memo_kind kind, tls_fp_list *first, int sort,
+                       const tls_fp_list *second, char *out)
+{
+    const tls_fp_list *lists[2] = { first, second };
+    unsigned char digest[SHA256_DIGEST_LEN];
+    char hex[2 * 6 + 1];
+    uint64_t key;
+    sha256_ctx s;
+
+    if (first->n == 0)
+    {
+        memset(out, '0', 12);
+        return;
+    }
+    key = memo_key(kind, lists, second ? 2 : 1, sort ? 2 : 3);
+    if (memo_find(c, key, out, 12))
+        return;
+    if (sort)
+        list_sort(first);
+    sha256_init(&s);
+    sha256_hex_list(&s, first);
+    if (second && second->n)
+    {
+        sha256_update(&s, "_", 1);
+        sha256_hex_list(&s, second);
+    }
+    sha256_final(&s, digest);
+    memcpy(out, hex_string(digest, 6, hex), 12);
+    memo_keep(c, key, out, 12);
+}
+
+/*** Hellos ***/
+
+// JA4's two characters of a version
+static void ja4_version(uint16_t v, char *out)
+{
+    const char *s;
+
+    switch (v)
+    {
+        case TLS_VERSION_1_3: s = "13"; break;
+        case TLS_VERSION_1_2: s = "12"; break;
+        case TLS_VERSION_1_1: s = "11"; break;
+        case TLS_VERSION_1_0: s = "10"; break;
+        case SSL_VERSION_3_0: s = "s3"; break;
+        case 0x0002:          s = "s2"; break;
+        case 0xfeff:          s = "d1"; break;
+        case 0xfefd:          s = "d2"; break;
+        case 0xfefc:          s = "d3"; break;
+        default:              s = "00"; break;
+    }
+    out[0] = s[0];
+    out[1] = s[1];
+}
+
+static int is_alnum(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// First and last character of the first ALPN protocol, their hex digits
+// when they aren't alphanumeric, "00" without ALPN
+static void ja4_alpn(const unsigned char *p, const tls_hello_fields *h, char *out)
+{
+    size_t off = h->alpn;
+    unsigned char first, last;
+
+    out[0] = out[1] = '0';
+    if (off == 0 || off + 3 > h->end || p[off + 2] == 0 || off + 3 + p[off + 2] > h->end)
+        return;
+    first = p[off + 3];
+    last = p[off + 2 + p[off + 2]];
+    if (is_alnum(first) && is_alnum(last))
+    {
+        out[0] = first;
+        out[1] = last;
+    }
+    else
+    {
+        out[0] = hexdigits[first >> 4];
+        out[1] = hexdigits[last & 15];
+    }
+}
+
+static void two_digits(size_t n, char *out)
+{
+    if (n > 99)
+        n = 99;
+    out[0] = '0' + n / 10;
+    out[1] = '0' + n % 10;
+}
+
+// Values of the u8 or u16 list, length prefixed, an extension holds
+static void ext_values(const unsigned char *p, size_t len, size_t width, tls_fp_list *l)
+{
+    size_t n;
+
+    if (len < width)
+        return;
+    n = width == 2 ? get16(p) : p[0];
+    if (n > len - width)
+        n = len - width;
+    for (p += width; n >= width; p += width, n -= width)
+    {
+        uint16_t v = width == 2 ? get16(p) : p[0];
+
+        if (!is_grease(v))
+            list_add(l, v);
+    }
+}
+
+// The extensions from `pos` to `end`, -1 when they don't fill it exactly
+static int walk_extensions(const unsigned char *p, size_t pos, size_t end, int client,
+                           tls_hello_fields *h)
+{
+    h->end = end;
+    while (pos + 4 <= end)
+    {
+        uint16_t type = get16(p + pos);
+        size_t len = get16(p + pos + 2);
+
+        pos += 4;
+        if (pos + len > end)
+            return -1;
+        if (!is_grease(type))
+            list_add(&h->exts, type);
+        switch (type)
+        {
+            case EXT_SERVER_NAME:       h->sni = 1; break;
+            case EXT_SUPPORTED_GROUPS:  ext_values(p + pos, len, 2, &h->groups); break;
+            case EXT_EC_POINT_FORMATS:  ext_values(p + pos, len, 1, &h->formats); break;
+            case EXT_SIGNATURE_ALGS:    ext_values(p + pos, len, 2, &h->sigalgs); break;
+            case EXT_ALPN:              h->alpn = pos; break;
+            case EXT_PRE_SHARED_KEY:    h->psk = 1; break;
+            case EXT_SESSION_TICKET:
+                if (client && len)
+                {
+                    h->ticket = p + pos;
+                    h->ticket_len = (uint16_t)len;
+                }
+                break;
+            case EXT_SUPPORTED_VERSIONS:
+                // The version chosen in a ServerHello, a list in a ClientHello
+                if (len == 2)
+                {
+                    h->supported = get16(p + pos);
+                }
+                else if (len)
+                {
+                    for (size_t i = pos + 1; i + 2 <= pos + len && i + 2 <= pos + 1 + p[pos]; i += 2)
+                    {
+                        if (!is_grease(get16(p + i)) && get16(p + i) > h->supported)
+                            h->supported = get16(p + i);
+                    }
+                }
+                break;
+        }
+        pos += len;
+    }
+    return pos == end ? 0 : -1;
+}
+
+// Body of a ClientHello (`client`) or ServerHello, without its handshake
+// header. Version, session ID, ciphers (one in a ServerHello), compression
+// and extensions: -1 unless they fill the hello exactly.
+int tls_hello_walk(const unsigned char *p, size_t len, int client, tls_hello_fields *h)
+{
+    size_t pos, end;
+
+    // The lists' values are left as they are, only their counts are reset
+    h->supported = 0;
+    list_clear(&h->ciphers);
+    list_clear(&h->exts);
+    list_clear(&h->groups);
+    list_clear(&h->formats);
+    list_clear(&h->sigalgs);
+    h->alpn = 0;
+    h->session_id = NULL;
+    h->ticket = NULL;
+    h->ticket_len = 0;
+    h->sni = 0;
+    h->psk = 0;
+    h->retry = 0;
+    if (len < 35 || 35 + (size_t)p[34] + 2 > len)
+        return -1;
+    h->version = get16(p);
+    h->session_id_len = p[34];
+    if (h->session_id_len)
+        h->session_id = p + 35;
+    pos = 35 + p[34];
+    if (client)
+    {
+        end = pos + 2 + get16(p + pos);
+        for (pos += 2; pos + 2 <= end && pos + 2 <= len; pos += 2)
+        {
+            if (!is_grease(get16(p + pos)))
+                list_add(&h->ciphers, get16(p + pos));
+        }
+        if (pos != end || pos + 1 > len)
+            return -1;
+        pos += 1 + p[pos];
+    }
+    else
+    {
+        if (pos + 3 > len)
+            return -1;
+        list_add(&h->ciphers, get16(p + pos));
+        pos += 3;
+        h->retry = memcmp(p + 2, retry_random, sizeof(retry_random)) == 0;
+    }
+    // Extensions are optional before TLS 1.2
+    h->end = len;
+    if (pos == len)
+        return 0;
+    if (pos + 2 > len || pos + 2 + get16(p + pos) != len)
+        return -1;
+    return walk_extensions(p, pos + 2, len, client, h);
+}
+
+// ClientHello `p` as walked into `h`, whose lists are reordered:
+// JA3 "771,4865-4866-...,0-23-...,29-23-24,0" and
+// JA4 "t13d1516h2_8daaf6152771_e5627efa2ab1"
+void tls_client_fingerprint(tls_fp_cache *c, const unsigned char *p, tls_hello_fields *h,
+                            tls_fingerprint *fp)
+{
+    tls_fp_list version;
+    const tls_fp_list *ja3[5] = { &version, &h->ciphers, &h->exts, &h->groups, &h->formats };
+    char *j = fp->ja4;
+    size_t kept = 0;
+
+    list_clear(&version);
+    list_add(&version, h->version);
+    ja3_digest(c, MEMO_JA3, ja3, 5, fp->ja3);
+
+    j[0] = 't';
+    ja4_version(h->supported ? h->supported : h->version, j + 1);
+    j[3] = h->sni ? 'd' : 'i';
+    two_digits(h->ciphers.count, j + 4);
+    two_digits(h->exts.count, j + 6);
+    ja4_alpn(p, h, j + 8);
+    j[10] = '_';
+    ja4_digest(c, MEMO_JA4_CIPHERS, &h->ciphers, 1, NULL, j + 11);
+    j[23] = '_';
+    // Without SNI and ALPN, then the signature algorithms as sent
+    for (size_t i = 0; i < h->exts.n; i++)
+    {
+        if (h->exts.v[i] != EXT_SERVER_NAME && h->exts.v[i] != EXT_ALPN)
+            h->exts.v[kept++] = h->exts.v[i];
+    }
+    h->exts.n = kept;
+    ja4_digest(c, MEMO_JA4_EXTS, &h->exts, 1, &h->sigalgs, j + 24);
+    j[TLS_JA4_LEN] = '\0';
+    fp->client = 1;
+    if (c)
+        c->hellos++;
+}
+
+// ServerHello `p` as walked into `h`: JA3S "771,4865,43-51" and
+// JA4S "t130200_1301_234ea6891581"
+void tls_server_fingerprint(tls_fp_cache *c, const unsigned char *p, tls_hello_fields *h,
+                            tls_fingerprint *fp)
+{
+    tls_fp_list version;
+    const tls_fp_list *ja3s[3] = { &version, &h->ciphers, &h->exts };
+    char *j = fp->ja4s;
+    uint16_t cipher;
+
+    list_clear(&version);
+    list_add(&version, h->version);
+    ja3_digest(c, MEMO_JA3S, ja3s, 3, fp->ja3s);
+
+    cipher = h->ciphers.v[0];
+    j[0] = 't';
+    ja4_version(h->supported ? h->supported : h->version, j + 1);
+    two_digits(h->exts.count, j + 3);
+    ja4_alpn(p, h, j + 5);
+    j[7] = '_';
+    for (int i = 0; i < 4; i++)
+        j[8 + i] = hexdigits[(cipher >> (12 - 4 * i)) & 15];
+    j[12] = '_';
+    // In the order sent, SNI and ALPN included
+    ja4_digest(c, MEMO_JA4S_EXTS, &h->exts, 0, NULL, j + 13);
+    j[TLS_JA4S_LEN] = '\0';
+    fp->server = 1;
+    if (c)
+        c->hellos++;
+}
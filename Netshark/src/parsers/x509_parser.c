@@ -0,0 +1,494 @@
+#include "x509.h"
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * X.509 certificates (RFC 5280), walked in DER just far enough to print
+ * them: the subject and issuer names, the validity, the subject public
+ * key's algorithm and size, and the subjectAltName extension. Signatures,
+ * the other extensions and the chain aren't checked: this describes what
+ * goes by, it doesn't validate it.
+ */
+
+#define DER_INTEGER         0x02
+#define DER_BIT_STRING      0x03
+#define DER_OCTET_STRING    0x04
+#define DER_OID             0x06
+#define DER_UTC_TIME        0x17
+#define DER_GENERALIZED     0x18
+#define DER_BMP_STRING      0x1e
+#define DER_SEQUENCE        0x30
+#define DER_SET             0x31
+#define DER_VERSION         0xa0        // [0] EXPLICIT of TBSCertificate
+#define DER_EXTENSIONS      0xa3        // [3] EXPLICIT of TBSCertificate
+
+#define SAN_RFC822          0x81        // GeneralName choices
+#define SAN_DNS             0x82
+#define SAN_URI             0x86
+#define SAN_IP              0x87
+
+// One TLV: its tag and contents
+typedef struct {
+    uint8_t tag;
+    const unsigned char *val;
+    size_t len;
+}               der_tlv;
+
+// Text written into a fixed buffer, cut when full
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+}               text_buf;
+
+// Attribute types of names, by the DER of their OID
+typedef struct {
+    const char *name;
+    unsigned char oid[10];
+    uint8_t len;
+}               oid_name;
+
+static const oid_name attributes[] = {
+    { "CN",           { 0x55, 0x04, 0x03 }, 3 },
+    { "SN",           { 0x55, 0x04, 0x04 }, 3 },
+    { "serialNumber", { 0x55, 0x04, 0x05 }, 3 },
+    { "C",            { 0x55, 0x04, 0x06 }, 3 },
+    { "L",            { 0x55, 0x04, 0x07 }, 3 },
+    { "ST",           { 0x55, 0x04, 0x08 }, 3 },
+    { "street",       { 0x55, 0x04, 0x09 }, 3 },
+    { "O",            { 0x55, 0x04, 0x0a }, 3 },
+    { "OU",           { 0x55, 0x04, 0x0b }, 3 },
+    { "title",        { 0x55, 0x04, 0x0c }, 3 },
+    { "postalCode",   { 0x55, 0x04, 0x11 }, 3 },
+    { "GN",           { 0x55, 0x04, 0x2a }, 3 },
+    { "emailAddress", { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x01 }, 9 },
+    { "DC",           { 0x09, 0x92, 0x26, 0x89, 0x93, 0xf2, 0x2c, 0x64, 0x01, 0x19 }, 10 },
+    { "UID",          { 0x09, 0x92, 0x26, 0x89, 0x93, 0xf2, 0x2c, 0x64, 0x01, 0x01 }, 10 },
+};
+
+static const unsigned char oid_rsa[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01 };
+static const unsigned char oid_rsa_pss[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0a };
+static const unsigned char oid_dsa[] = { 0x2a, 0x86, 0x48, 0xce, 0x38, 0x04, 0x01 };
+static const unsigned char oid_ec[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01 };
+static const unsigned char oid_p256[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+static const unsigned char oid_p384[] = { 0x2b, 0x81, 0x04, 0x00, 0x22 };
+static const unsigned char oid_p521[] = { 0x2b, 0x81, 0x04, 0x00, 0x23 };
+static const unsigned char oid_x25519[] = { 0x2b, 0x65, 0x6e };
+static const unsigned char oid_ed25519[] = { 0x2b, 0x65, 0x70 };
+static const unsigned char oid_ed448[] = { 0x2b, 0x65, 0x71 };
+static const unsigned char oid_san[] = { 0x55, 0x1d, 0x11 };
+
+// Reads the TLV at *pos, at most up to end, and moves past it
+static int der_next(const unsigned char **pos, const unsigned char *end, der_tlv *t)
+{
+    const unsigned char *p = *pos;
+    size_t len;
+
+    if (end - p < 2)
+        return -1;
+    t->tag = *p++;
+    if ((t->tag & 0x1f) == 0x1f)        // High tag numbers: not in certificates
+        return -1;
+    len = *p++;
+    if (len & 0x80)
+    {
+        int n = len & 0x7f;
+
+        if (n == 0 || n > 4 || end - p < n)
+            return -1;
+        for (len = 0; n > 0; n--)
+            len = len << 8 | *p++;
+    }
+    if (len > (size_t)(end - p))
+        return -1;
+    t->val = p;
+    t->len = len;
+    *pos = p + len;
+    return 0;
+}
+
+static inline int oid_is(const der_tlv *t, const unsigned char *oid, size_t len)
+{
+    return t->tag == DER_OID && t->len == len && memcmp(t->val, oid, len) == 0;
+}
+
+static void text_add(text_buf *t, const void *s, size_t n)
+{
+    if (t->len + 1 >= t->size)
+        return;
+    if (n > t->size - 1 - t->len)
+        n = t->size - 1 - t->len;
+    memcpy(t->buf + t->len, s, n);
+    t->len += n;
+    t->buf[t->len] = '\0';
+}
+
+static inline void text_str(text_buf *t, const char *s)
+{
+    text_add(t, s, strlen(s));
+}
+
+// Bytes of a name as printable ASCII: any other byte, a backslash too,
+// as \xNN. An embedded NUL must not cut the name short where it is used
+// as a C string ("www.bank.com\x00.evil.com"), nor a control byte reach
+// the terminal.
+static void text_bytes(text_buf *t, const unsigned char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < n; i++)
+    {
+        char esc[4] = { '\\', 'x', hex[s[i] >> 4], hex[s[i] & 15] };
+
+        if (s[i] >= 0x20 && s[i] < 0x7f && s[i] != '\\')
+            text_add(t, s + i, 1);
+        else
+            text_add(t, esc, sizeof(esc));
+    }
+}
+
+// A string value; BMPString is UTF-16, kept when ASCII
+static void text_string(text_buf *t, const der_tlv *v)
+{
+    size_t i;
+
+    if (v->tag != DER_BMP_STRING)
+    {
+        text_bytes(t, v->val, v->len);
+        return;
+    }
+    for (i = 0; i + 1 < v->len; i += 2)
+    {
+        unsigned char c = v->val[i] == 0 && v->val[i + 1] < 0x80 ? v->val[i + 1] : '?';
+
+        text_bytes(t, &c, 1);
+    }
+}
+
+// An OID never listed, as its dotted numbers
+static void text_oid(text_buf *t, const der_tlv *oid)
+{
+    char num[24];
+    uint64_t v = 0;
+    size_t i;
+    int first = 1;
+
+    for (i = 0; i < oid->len; i++)
+    {
+        if (v >> 56)                    // Too long for us: cut
+            return;
+        v = v << 7 | (oid->val[i] & 0x7f);
+        if (oid->val[i] & 0x80)
+            continue;
+        if (first)
+        {
+            unsigned arc = v < 80 ? (unsigned)(v / 40) : 2;
+
+            snprintf(num, sizeof(num), "%u.%llu", arc, (unsigned long long)(v - arc * 40));
+            first = 0;
+        }
+        else
+        {
+            snprintf(num, sizeof(num), ".%llu", (unsigned long long)v);
+        }
+        text_str(t, num);
+        v = 0;
+    }
+}
+
+// A Name: its RDNs in the order encoded, "C=US, O=Example, CN=example.com".
+// The value of the last common name also goes in cn when asked for.
+static void name_text(const der_tlv *name, char *buf, size_t size, char *cn)
+{
+    text_buf t = { buf, size, 0 };
+    const unsigned char *p = name->val, *end = name->val + name->len;
+    der_tlv rdn, atv, oid, value;
+
+    buf[0] = '\0';
+    while (der_next(&p, end, &rdn) == 0 && rdn.tag == DER_SET)
+    {
+        const unsigned char *q = rdn.val, *qend = rdn.val + rdn.len;
+
+        while (der_next(&q, qend, &atv) == 0 && atv.tag == DER_SEQUENCE)
+        {
+            const unsigned char *a = atv.val, *aend = atv.val + atv.len;
+            size_t i;
+
+            if (der_next(&a, aend, &oid) || oid.tag != DER_OID || der_next(&a, aend, &value))
+                continue;
+            if (t.len)
+                text_add(&t, ", ", 2);
+            for (i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++)
+                if (oid_is(&oid, attributes[i].oid, attributes[i].len))
+                    break;
+            if (i < sizeof(attributes) / sizeof(attributes[0]))
+                text_str(&t, attributes[i].name);
+            else
+                text_oid(&t, &oid);
+            text_add(&t, "=", 1);
+            text_string(&t, &value);
+            if (cn && i == 0)
+            {
+                text_buf c = { cn, X509_CN_MAX, 0 };
+
+                cn[0] = '\0';
+                text_string(&c, &value);
+            }
+        }
+    }
+}
+
+// Days since 1970-01-01 of a date of the proleptic Gregorian calendar
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+    int64_t era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static int digits(const unsigned char *p, size_t n, int *v)
+{
+    size_t i;
+
+    *v = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        *v = *v * 10 + (p[i] - '0');
+    }
+    return 0;
+}
+
+// UTCTime "YYMMDDHHMMSSZ" (years 1950 to 2049) or GeneralizedTime
+// "YYYYMMDDHHMMSSZ", the only forms RFC 5280 allows
+static int der_time(const der_tlv *t, time_t *out)
+{
+    const unsigned char *p = t->val;
+    int y, mo, d, h, mi, s;
+
+    if (t->tag == DER_UTC_TIME && t->len == 13)
+    {
+        if (digits(p, 2, &y))
+            return -1;
+        y += y < 50 ? 2000 : 1900;
+        p += 2;
+    }
+    else if (t->tag == DER_GENERALIZED && t->len == 15)
+    {
+        if (digits(p, 4, &y))
+            return -1;
+        p += 4;
+    }
+    else
+    {
+        return -1;
+    }
+    if (digits(p, 2, &mo) || digits(p + 2, 2, &d) || digits(p + 4, 2, &h)
+        || digits(p + 6, 2, &mi) || digits(p + 8, 2, &s) || p[10] != 'Z')
+        return -1;
+    if (mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || s > 60)
+        return -1;
+    *out = (time_t)(days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s);
+    return 0;
+}
+
+// Bits of an unsigned big-endian INTEGER
+static unsigned integer_bits(const der_tlv *t)
+{
+    const unsigned char *p = t->val;
+    size_t n = t->len;
+    unsigned bits;
+
+    while (n && *p == 0)
+    {
+        p++;
+        n--;
+    }
+    if (n == 0)
+        return 0;
+    for (bits = 8; !(*p & (1u << (bits - 1))); bits--)
+        ;
+    return (unsigned)(n - 1) * 8 + bits;
+}
+
+// Size of the modulus of an RSAPublicKey in the key's BIT STRING
+static unsigned rsa_bits(const der_tlv *key)
+{
+    const unsigned char *p = key->val, *end = key->val + key->len;
+    der_tlv seq, n;
+
+    if (key->tag != DER_BIT_STRING || p == end || *p++ != 0)
+        return 0;
+    if (der_next(&p, end, &seq) || seq.tag != DER_SEQUENCE)
+        return 0;
+    p = seq.val;
+    if (der_next(&p, seq.val + seq.len, &n) || n.tag != DER_INTEGER)
+        return 0;
+    return integer_bits(&n);
+}
+
+// SubjectPublicKeyInfo: "rsa-2048", "ec-p256", "ed25519"...
+static void key_text(const der_tlv *spki, char *buf)
+{
+    const unsigned char *p = spki->val, *end = spki->val + spki->len;
+    der_tlv alg, key, oid, param;
+    const unsigned char *a;
+
+    strcpy(buf, "unknown");
+    if (der_next(&p, end, &alg) || alg.tag != DER_SEQUENCE || der_next(&p, end, &key))
+        return;
+    a = alg.val;
+    if (der_next(&a, alg.val + alg.len, &oid))
+        return;
+    if (der_next(&a, alg.val + alg.len, &param))
+        param.tag = 0;
+    if (oid_is(&oid, oid_rsa, sizeof(oid_rsa)))
+        snprintf(buf, X509_KEY_MAX, "rsa-%u", rsa_bits(&key));
+    else if (oid_is(&oid, oid_rsa_pss, sizeof(oid_rsa_pss)))
+        snprintf(buf, X509_KEY_MAX, "rsa-pss-%u", rsa_bits(&key));
+    else if (oid_is(&oid, oid_ec, sizeof(oid_ec)))
+    {
+        if (oid_is(&param, oid_p256, sizeof(oid_p256)))
+            strcpy(buf, "ec-p256");
+        else if (oid_is(&param, oid_p384, sizeof(oid_p384)))
+            strcpy(buf, "ec-p384");
+        else if (oid_is(&param, oid_p521, sizeof(oid_p521)))
+            strcpy(buf, "ec-p521");
+        else
+            strcpy(buf, "ec");
+    }
+    else if (oid_is(&oid, oid_ed25519, sizeof(oid_ed25519)))
+        strcpy(buf, "ed25519");
+    else if (oid_is(&oid, oid_ed448, sizeof(oid_ed448)))
+        strcpy(buf, "ed448");
+    else if (oid_is(&oid, oid_x25519, sizeof(oid_x25519)))
+        strcpy(buf, "x25519");
+    else if (oid_is(&oid, oid_dsa, sizeof(oid_dsa)))
+        strcpy(buf, "dsa");
+}
+
+// GeneralNames of subjectAltName, in the extension's OCTET STRING
+static void san_text(const der_tlv *value, x509_cert *out)
+{
+    text_buf t = { out->san, sizeof(out->san), strlen(out->san) };
+    const unsigned char *p = value->val, *end = value->val + value->len;
+    der_tlv names, name;
+    char addr[INET6_ADDRSTRLEN];
+
+    if (der_next(&p, end, &names) || names.tag != DER_SEQUENCE)
+        return;
+    p = names.val;
+    end = names.val + names.len;
+    while (der_next(&p, end, &name) == 0)
+    {
+        out->nsan++;
+        if (name.tag == SAN_IP && (name.len == 4 || name.len == 16))
+            inet_ntop(name.len == 4 ? AF_INET : AF_INET6, name.val, addr, sizeof(addr));
+        else if (name.tag != SAN_DNS && name.tag != SAN_RFC822 && name.tag != SAN_URI)
+            continue;                   // Directory and other names: counted only
+        if (t.len)
+            text_add(&t, " ", 1);
+        if (name.tag == SAN_IP)
+            text_str(&t, addr);
+        else
+            text_bytes(&t, name.val, name.len);
+    }
+}
+
+// Extensions: only subjectAltName is looked into
+static void extensions(const der_tlv *exts, x509_cert *out)
+{
+    const unsigned char *p = exts->val, *end = exts->val + exts->len;
+    der_tlv list, ext, t;
+
+    if (der_next(&p, end, &list) || list.tag != DER_SEQUENCE)
+        return;
+    p = list.val;
+    end = list.val + list.len;
+    while (der_next(&p, end, &ext) == 0)
+    {
+        const unsigned char *e = ext.val, *eend = ext.val + ext.len;
+
+        if (ext.tag != DER_SEQUENCE || der_next(&e, eend, &t) || !oid_is(&t, oid_san, sizeof(oid_san)))
+            continue;
+        if (der_next(&e, eend, &t))     // critical, or the value
+            continue;
+        if (t.tag != DER_OCTET_STRING && der_next(&e, eend, &t))
+            continue;
+        if (t.tag == DER_OCTET_STRING)
+            san_text(&t, out);
+    }
+}
+
+// Parses one DER certificate into out. Returns -1 when it isn't one.
+int x509_parse(const unsigned char *der, size_t len, x509_cert *out)
+{
+    const unsigned char *p = der, *end = der + len;
+    der_tlv cert, tbs, t, issuer, validity, subject, spki;
+
+    memset(out, 0, sizeof(*out));
+    if (der_next(&p, end, &cert) || cert.tag != DER_SEQUENCE)
+        return -1;
+    p = cert.val;
+    end = cert.val + cert.len;
+    if (der_next(&p, end, &tbs) || tbs.tag != DER_SEQUENCE)
+        return -1;
+    p = tbs.val;
+    end = tbs.val + tbs.len;
+    if (der_next(&p, end, &t))
+        return -1;
+    if (t.tag == DER_VERSION && der_next(&p, end, &t))
+        return -1;
+    if (t.tag != DER_INTEGER)           // serialNumber
+        return -1;
+    if (der_next(&p, end, &t) || t.tag != DER_SEQUENCE            // signature
+        || der_next(&p, end, &issuer) || issuer.tag != DER_SEQUENCE
+        || der_next(&p, end, &validity) || validity.tag != DER_SEQUENCE
+        || der_next(&p, end, &subject) || subject.tag != DER_SEQUENCE
+        || der_next(&p, end, &spki) || spki.tag != DER_SEQUENCE)
+        return -1;
+
+    name_text(&issuer, out->issuer, sizeof(out->issuer), NULL);
+    name_text(&subject, out->subject, sizeof(out->subject), out->cn);
+    out->self_signed = issuer.len == subject.len && memcmp(issuer.val, subject.val, issuer.len) == 0;
+    key_text(&spki, out->key);
+    {
+        const unsigned char *v = validity.val, *vend = validity.val + validity.len;
+
+        if (der_next(&v, vend, &t) || der_time(&t, &out->not_before)
+            || der_next(&v, vend, &t) || der_time(&t, &out->not_after))
+            return -1;
+    }
+
+    // issuerUniqueID and subjectUniqueID, then the extensions
+    while (der_next(&p, end, &t) == 0)
+        if (t.tag == DER_EXTENSIONS)
+            extensions(&t, out);
+    return 0;
+}
+
+// "YYYY-MM-DD" of a time, UTC, written into buf[X509_DATE_LEN + 1]
+size_t x509_date(time_t t, char *buf)
+{
+    int64_t z = (int64_t)t / 86400 - (t % 86400 < 0) + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    int m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    int64_t y = yoe + era * 400 + (m <= 2);
+
+    if (y < 0 || y > 9999)
+        y = y < 0 ? 0 : 9999;
+    snprintf(buf, X509_DATE_LEN + 1, "%04d-%02d-%02d", (int)y, m, d);
+    return X509_DATE_LEN;
+}
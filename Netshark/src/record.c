@@ -0,0 +1,507 @@
+#include "record.h"
+#include "dispatch.h"
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * JSON and binary writers over the field tables (see record.h).
+ *
+ * Records are built in the worker's output chunk like the text output:
+ * nothing is allocated, and a packet's record is queued, dropped or
+ * sampled as a whole. The binary block length is patched in once the
+ * packet is done; it is kept relative to the packet's start since the
+ * packet moves when it spills over to the next chunk.
+ */
+
+// Fields every record starts with, gathered from the packet_view
+typedef struct {
+    struct timeval ts;
+    uint32_t caplen;
+    uint32_t len;               // On the wire
+    const uint8_t *src_mac;
+    const uint8_t *dst_mac;
+    uint16_t ethertype;
+    int has_vlan;
+    uint16_t vlan;
+    uint8_t has_ip;
+    struct in_addr src;
+    struct in_addr dst;
+    uint8_t ip_proto;
+    uint8_t ttl;
+    uint8_t has_ports;
+    uint16_t sport;
+    uint16_t dport;
+}               record_head;
+
+static const field_desc head_fields[] = {
+    FIELD(record_head, ts, FIELD_TS),
+    FIELD(record_head, caplen, FIELD_UINT),
+    FIELD(record_head, len, FIELD_UINT),
+    FIELD(record_head, src_mac, FIELD_MAC_PTR),
+    FIELD(record_head, dst_mac, FIELD_MAC_PTR),
+    FIELD(record_head, ethertype, FIELD_UINT),
+    FIELD_IF(record_head, vlan, FIELD_UINT, has_vlan),
+    FIELD_IF(record_head, src, FIELD_IP4, has_ip),
+    FIELD_IF(record_head, dst, FIELD_IP4, has_ip),
+    FIELD_IF(record_head, ip_proto, FIELD_UINT, has_ip),
+    FIELD_IF(record_head, ttl, FIELD_UINT, has_ip),
+    FIELD_IF(record_head, sport, FIELD_UINT, has_ports),
+    FIELD_IF(record_head, dport, FIELD_UINT, has_ports),
+};
+
+static RECORD_SCHEMA_DEF(head_schema, 0, "packet", head_fields);
+
+static const uint8_t zeros[8];
+
+static uint64_t load_uint(const uint8_t *p, size_t size)
+{
+    switch (size)
+    {
+        case 1: return *p;
+        case 2: { uint16_t v; memcpy(&v, p, 2); return v; }
+        case 4: { uint32_t v; memcpy(&v, p, 4); return v; }
+        case 8: { uint64_t v; memcpy(&v, p, 8); return v; }
+        default: return 0;
+    }
+}
+
+static const void *load_ptr(const uint8_t *p)
+{
+    const void *ptr;
+
+    memcpy(&ptr, p, sizeof(ptr));
+    return ptr;
+}
+
+// The field's condition holds (or it has none)
+static int field_present(const field_desc *f, const uint8_t *pkt)
+{
+    return f->when_size == 0 || load_uint(pkt + f->when_off, f->when_size) != 0;
+}
+
+// Writes into the record at `off` bytes from the packet's start
+static void patch(outbuf *ob, size_t off, const void *data, size_t len)
+{
+    if (!ob->muted && ob->buf)
+        memcpy(ob->buf + ob->mark + off, data, len);
+}
+
+/*** JSON ***/
+
+// Writes the fields as "name":value pairs, returns how many
+static int json_fields(outbuf *ob, const record_schema *schema, const uint8_t *pkt)
+{
+    int written = 0;
+
+    for (int i = 0; i < schema->nfields; i++)
+    {
+        const field_desc *f = &schema->fields[i];
+        const uint8_t *p = pkt + f->off;
+        char text[RECORD_TEXT_MAX];
+        size_t text_len = 0;
+
+        if (!field_present(f, pkt))
+            continue;
+        if (f->type == FIELD_SPAN && ((const span *)p)->ptr == NULL)
+            continue;
+        if ((f->type == FIELD_STR || f->type == FIELD_IP4_PTR || f->type == FIELD_MAC_PTR)
+            && load_ptr(p) == NULL)
+            continue;
+        if (f->type == FIELD_TEXT)
+            text_len = f->text(pkt, text);
+
+        ob_str(ob, written ? ",\"" : "\"");
+        ob_str(ob, f->name);
+        ob_str(ob, "\":");
+        written++;
+
+        switch (f->type)
+        {
+            case FIELD_UINT:
+                ob_u64(ob, load_uint(p, f->size));
+                break;
+            case FIELD_INT:
+            {
+                int v;
+
+                memcpy(&v, p, sizeof(v));
+                if (v < 0)
+                    ob_putc(ob, '-');
+                ob_u64(ob, v < 0 ? -(unsigned long long)v : (unsigned long long)v);
+                break;
+            }
+            case FIELD_BOOL:
+                ob_str(ob, load_uint(p, f->size) ? "true" : "false");
+                break;
+            case FIELD_IP4:
+            case FIELD_IP4_PTR:
+                ob_putc(ob, '"');
+                ob_ip4(ob, f->type == FIELD_IP4 ? (const void *)p : load_ptr(p));
+                ob_putc(ob, '"');
+                break;
+            case FIELD_MAC_PTR:
+                ob_putc(ob, '"');
+                ob_mac(ob, load_ptr(p));
+                ob_putc(ob, '"');
+                break;
+            case FIELD_TS:
+            {
+                const struct timeval *ts = (const struct timeval *)p;
+
+                ob_seconds(ob, (unsigned long long)ts->tv_sec * 1000000 + ts->tv_usec);
+                break;
+            }
+            case FIELD_SPAN:
+                ob_json_str(ob, ((const span *)p)->ptr, ((const span *)p)->len);
+                break;
+            case FIELD_STR:
+            {
+                const char *s = load_ptr(p);
+
+                ob_json_str(ob, s, strlen(s));
+                break;
+            }
+            case FIELD_TEXT:
+                ob_json_str(ob, text, text_len);
+                break;
+        }
+    }
+    return written;
+}
+
+/*** Binary ***/
+
+static void bin_u16(outbuf *ob, uint16_t v)
+{
+    ob_write(ob, &v, sizeof(v));
+}
+
+// u16 length then the bytes
+static void bin_bytes(outbuf *ob, const void *data, size_t len)
+{
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+    bin_u16(ob, len);
+    if (len)
+        ob_write(ob, data, len);
+}
+
+// Bytes a field takes in a binary record, 0 when it is length-prefixed
+static size_t bin_size(const field_desc *f)
+{
+    switch (f->type)
+    {
+        case FIELD_UINT:
+        case FIELD_INT:
+        case FIELD_IP4:     return f->size;
+        case FIELD_BOOL:    return 1;
+        case FIELD_IP4_PTR: return 4;
+        case FIELD_MAC_PTR: return 6;
+        case FIELD_TS:      return 8;
+        default:            return 0;
+    }
+}
+
+// Section header then every field's value, conditions or not
+static void bin_section(outbuf *ob, const record_schema *schema, const uint8_t *pkt)
+{
+    size_t start = ob->len - ob->mark;
+
+    bin_u16(ob, schema->id);
+    bin_u16(ob, 0);
+    for (int i = 0; i < schema->nfields; i++)
+    {
+        const field_desc *f = &schema->fields[i];
+        const uint8_t *p = pkt + f->off;
+
+        switch (f->type)
+        {
+            case FIELD_UINT:
+            case FIELD_INT:
+            case FIELD_IP4:
+                ob_write(ob, p, f->size);
+                break;
+            case FIELD_BOOL:
+                ob_putc(ob, load_uint(p, f->size) != 0);
+                break;
+            case FIELD_IP4_PTR:
+            case FIELD_MAC_PTR:
+            {
+                const void *ptr = load_ptr(p);
+
+                ob_write(ob, ptr ? ptr : zeros, bin_size(f));
+                break;
+            }
+            case FIELD_TS:
+            {
+                const struct timeval *ts = (const struct timeval *)p;
+                uint64_t us = (uint64_t)ts->tv_sec * 1000000 + ts->tv_usec;
+
+                ob_write(ob, &us, sizeof(us));
+                break;
+            }
+            case FIELD_SPAN:
+                bin_bytes(ob, ((const span *)p)->ptr, ((const span *)p)->len);
+                break;
+            case FIELD_STR:
+            {
+                const char *s = load_ptr(p);
+
+                bin_bytes(ob, s, s ? strlen(s) : 0);
+                break;
+            }
+            case FIELD_TEXT:
+            {
+                char text[RECORD_TEXT_MAX];
+
+                bin_bytes(ob, text, field_present(f, pkt) ? f->text(pkt, text) : 0);
+                break;
+            }
+        }
+    }
+
+    size_t len = ob->len - ob->mark - start - 4;
+    uint16_t len16 = len > UINT16_MAX ? UINT16_MAX : len;
+
+    patch(ob, start + 2, &len16, sizeof(len16));
+}
+
+// Block header, body and padding, the length and count patched last
+static void bin_block_end(outbuf *ob, uint16_t count)
+{
+    size_t len = ob->len - ob->mark - ob->record_off;
+    uint32_t len32;
+
+    if (len % 8)
+        ob_write(ob, zeros, 8 - len % 8);
+    len32 = ob->len - ob->mark - ob->record_off;
+    patch(ob, ob->record_off, &len32, sizeof(len32));
+    patch(ob, ob->record_off + 6, &count, sizeof(count));
+}
+
+/*** Per packet ***/
+
+// Opens the packet's record with the fields every packet has. Called
+// between ob_begin() and ob_end().
+void record_begin(outbuf *ob, const packet_view *v)
+{
+    record_head h;
+
+    memset(&h, 0, sizeof(h));
+    h.ts = v->hdr->ts;
+    h.caplen = v->caplen;
+    h.len = v->hdr->len;
+    h.src_mac = v->ether.src;
+    h.dst_mac = v->ether.dst;
+    h.ethertype = v->ether.ethertype;
+    h.has_vlan = v->ether.has_vlan;
+    if (h.has_vlan)
+        h.vlan = v->ether.vlan_vid;
+    if (v->ether.ethertype == ETHERTYPE_IPV4)
+    {
+        h.has_ip = 1;
+        h.src = v->ip.src;
+        h.dst = v->ip.dst;
+        h.ip_proto = v->ip.protocol;
+        h.ttl = v->ip.ttl;
+        // The dispatcher only decodes TCP/UDP in first fragments
+        if ((v->ip.frag_off & 0x1fff) == 0)
+        {
+            if (v->ip.protocol == IPPROTO_TCP)
+            {
+                h.has_ports = 1;
+                h.sport = v->tcp.src_port;
+                h.dport = v->tcp.dst_port;
+            }
+            else if (v->ip.protocol == IPPROTO_UDP)
+            {
+                h.has_ports = 1;
+                h.sport = v->udp.src_port;
+                h.dport = v->udp.dst_port;
+            }
+        }
+    }
+
+    ob->sections = 0;
+    ob->section_ids = 1u << head_schema.id;
+    ob->record_off = ob->len - ob->mark;
+    ob->view = v;
+    if (ob->format == OUTPUT_BIN)
+    {
+        uint32_t len = 0;
+        uint16_t kind = RECORD_PACKET;
+
+        ob_write(ob, &len, sizeof(len));
+        bin_u16(ob, kind);
+        bin_u16(ob, 0);
+        bin_section(ob, &head_schema, (const uint8_t *)&h);
+        return;
+    }
+    // The separator in front of the array's first record is skipped by
+    // the output thread
+    ob_str(ob, ob->format == OUTPUT_JSON ? ",{" : "{");
+    json_fields(ob, &head_schema, (const uint8_t *)&h);
+}
+
+// Adds a dissector's struct to the packet's record
+void record_add(outbuf *ob, const record_schema *schema, const void *pkt)
+{
+    // Several messages of one dissector in a packet (reassembled streams):
+    // each one gets a record of its own
+    if (ob->section_ids & (1u << schema->id))
+    {
+        record_end(ob);
+        record_begin(ob, ob->view);
+    }
+    ob->section_ids |= 1u << schema->id;
+    ob->sections++;
+    if (ob->format == OUTPUT_BIN)
+    {
+        bin_section(ob, schema, pkt);
+        return;
+    }
+    ob_str(ob, ",\"");
+    ob_str(ob, schema->name);
+    ob_str(ob, "\":{");
+    json_fields(ob, schema, pkt);
+    ob_putc(ob, '}');
+}
+
+// Closes the record, or takes it back when no dissector added anything
+// (like the text output, which prints nothing then)
+void record_end(outbuf *ob)
+{
+    if (ob->sections == 0)
+    {
+        ob->len = ob->mark + ob->record_off;
+        return;
+    }
+    if (ob->format == OUTPUT_BIN)
+        bin_block_end(ob, ob->sections + 1);
+    else
+        ob_str(ob, "}\n");
+}
+
+// A record of its own, not tied to a packet (flow, latency and top reports):
+// the schema's fields alone. Called between ob_begin() and ob_end().
+void record_object(outbuf *ob, const record_schema *schema, const void *obj)
+{
+    ob->record_off = ob->len - ob->mark;
+    if (ob->format == OUTPUT_BIN)
+    {
+        uint32_t len = 0;
+
+        ob_write(ob, &len, sizeof(len));
+        bin_u16(ob, RECORD_PACKET);
+        bin_u16(ob, 0);
+        bin_section(ob, schema, obj);
+        bin_block_end(ob, 1);
+        return;
+    }
+    ob_str(ob, ob->format == OUTPUT_JSON ? ",{\"" : "{\"");
+    ob_str(ob, schema->name);
+    ob_str(ob, "\":{");
+    json_fields(ob, schema, obj);
+    ob_str(ob, "}}\n");
+}
+
+/*** Stream start and end ***/
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One schema block into buf, returns its length or 0 when it doesn't fit
+static size_t schema_block(const record_schema *s, unsigned char *buf, size_t size)
+{
+    size_t len = 8;
+    uint16_t kind = RECORD_SCHEMA;
+    uint16_t count = s->nfields;
+    size_t name_len = strlen(s->name);
+
+    if (len + 3 + name_len > size)
+        return 0;
+    memcpy(buf + len, &s->id, 2);
+    buf[len + 2] = name_len;
+    memcpy(buf + len + 3, s->name, name_len);
+    len += 3 + name_len;
+    for (int i = 0; i < s->nfields; i++)
+    {
+        const field_desc *f = &s->fields[i];
+
+        name_len = strlen(f->name);
+        if (len + 3 + name_len + 8 > size)
+            return 0;
+        buf[len] = f->type;
+        buf[len + 1] = bin_size(f);
+        buf[len + 2] = name_len;
+        memcpy(buf + len + 3, f->name, name_len);
+        len += 3 + name_len;
+    }
+    while (len % 8)
+        buf[len++] = 0;
+
+    uint32_t len32 = len;
+
+    memcpy(buf, &len32, 4);
+    memcpy(buf + 4, &kind, 2);
+    memcpy(buf + 6, &count, 2);
+    return len;
+}
+
+// Written to `fd` before the output thread starts: the JSON array's
+// opening bracket, or the binary header and the schema of every dissector
+int record_header(int fd, output_format format)
+{
+    if (format == OUTPUT_JSON)
+        return write_all(fd, "[\n", 2);
+    if (format != OUTPUT_BIN)
+        return 0;
+
+    record_file_header h;
+    unsigned char block[4096];
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+    h.byte_order = RECORD_BYTE_ORDER;
+    h.version = RECORD_VERSION;
+    h.nschemas = PROTO_COUNT + 6;
+    if (write_all(fd, &h, sizeof(h)) == -1)
+        return -1;
+
+    // Reports that aren't packets come after the dissectors
+    const record_schema *reports[] = { &flow_schema, &latency_schema, &topk_schema, &cert_schema, &issuer_schema };
+
+    for (int i = -1; i < PROTO_COUNT + 5; i++)
+    {
+        const record_schema *s = i < 0 ? &head_schema : i < PROTO_COUNT ? dispatch_schema(i) : reports[i - PROTO_COUNT];
+        size_t len = schema_block(s, block, sizeof(block));
+
+        if (len == 0 || write_all(fd, block, len) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Written once the output thread is done
+int record_trailer(int fd, output_format format)
+{
+    if (format == OUTPUT_JSON)
+        return write_all(fd, "]\n", 2);
+    return 0;
+}
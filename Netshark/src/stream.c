@@ -0,0 +1,507 @@
+#include "stream.h"
+#include "dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * TCP stream reassembly.
+ *
+ * Application dissectors over TCP (ftp, http, tls) get each direction of
+ * a connection as one in-order byte stream instead of segments. Bytes
+ * arriving in order are handed straight from the frame; only what has to
+ * wait is copied: segments received ahead of a hole, and the end of a
+ * message the dissector can't use yet. Overlapping bytes keep the copy
+ * received first.
+ *
+ * A hole is given up, and the dissector told with STREAM_GAP, when the
+ * peer acknowledges bytes the capture never saw, or when waiting for it
+ * would take more than the per-direction or global memory limit.
+ */
+
+#define SEQ_LT(a, b)    ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)   ((int32_t)((a) - (b)) <= 0)
+#define SEQ_WINDOW      (1u << 30)  // Larger jumps are not trusted
+
+/*** Pool ***/
+
+static int pool_class(size_t size)
+{
+    int cls;
+
+    if (size <= (1u << STREAM_CLASS_MIN))
+        return 0;
+    cls = 64 - __builtin_clzll(size - 1) - STREAM_CLASS_MIN;
+    return cls < STREAM_CLASSES ? cls : -1;
+}
+
+static void *pool_alloc(stream_pool *p, size_t size, uint8_t *cls_out)
+{
+    int cls = pool_class(size);
+    size_t bsize;
+    void *b;
+
+    if (cls < 0)
+        return NULL;
+    b = p->free[cls];
+    if (b)
+    {
+        p->free[cls] = *(void **)b;
+        p->cached[cls]--;
+        *cls_out = cls;
+        return b;
+    }
+    bsize = (size_t)1 << (STREAM_CLASS_MIN + cls);
+    if (__atomic_add_fetch(p->used, bsize, __ATOMIC_RELAXED) > p->limit || !(b = malloc(bsize)))
+    {
+        __atomic_sub_fetch(p->used, bsize, __ATOMIC_RELAXED);
+        p->refused++;
+        return NULL;
+    }
+    *cls_out = cls;
+    return b;
+}
+
+static void pool_put(stream_pool *p, void *b, uint8_t cls)
+{
+    size_t bsize = (size_t)1 << (STREAM_CLASS_MIN + cls);
+
+    // Keep up to STREAM_POOL_CACHE bytes per class, the rest goes back to
+    // the other workers
+    if ((p->cached[cls] + 1) * bsize <= STREAM_POOL_CACHE)
+    {
+        *(void **)b = p->free[cls];
+        p->free[cls] = b;
+        p->cached[cls]++;
+        return;
+    }
+    free(b);
+    __atomic_sub_fetch(p->used, bsize, __ATOMIC_RELAXED);
+}
+
+void stream_pool_init(stream_pool *p, struct _Worker *w, size_t *used, size_t limit, uint32_t dir_max)
+{
+    memset(p, 0, sizeof(*p));
+    p->worker = w;
+    p->used = used;
+    p->limit = limit;
+    p->dir_max = dir_max;
+}
+
+void stream_pool_free(stream_pool *p)
+{
+    for (int cls = 0; cls < STREAM_CLASSES; cls++)
+    {
+        while (p->free[cls])
+        {
+            void *b = p->free[cls];
+
+            p->free[cls] = *(void **)b;
+            free(b);
+            __atomic_sub_fetch(p->used, (size_t)1 << (STREAM_CLASS_MIN + cls), __ATOMIC_RELAXED);
+        }
+        p->cached[cls] = 0;
+    }
+}
+
+/*** Delivery ***/
+
+static void pend_drop(stream_pool *p, stream_dir *d)
+{
+    if (d->pend)
+        pool_put(p, d->pend, d->pend_cls);
+    d->pend = NULL;
+    d->pend_len = 0;
+}
+
+// Makes room for `len` more bytes after the pending ones
+static int pend_reserve(stream_pool *p, stream_dir *d, size_t len)
+{
+    size_t need = d->pend_len + len;
+    unsigned char *b;
+    uint8_t cls;
+
+    if (need + d->ooo_bytes > p->dir_max)
+        return -1;
+    if (d->pend && need <= (size_t)1 << (STREAM_CLASS_MIN + d->pend_cls))
+        return 0;
+    b = pool_alloc(p, need, &cls);
+    if (b == NULL)
+        return -1;
+    if (d->pend)
+    {
+        memcpy(b, d->pend, d->pend_len);
+        pool_put(p, d->pend, d->pend_cls);
+    }
+    d->pend = b;
+    d->pend_cls = cls;
+    return 0;
+}
+
+// `n` bytes of the direction will never be seen. The dissector only
+// hears of it when it wasn't passing over them anyway.
+static void lose(stream_pool *p, stream_dir *d, uint32_t n)
+{
+    p->lost += n;
+    if (d->skip >= n)
+    {
+        d->skip -= n;
+        return;
+    }
+    d->skip = 0;
+    p->lost += d->pend_len;
+    pend_drop(p, d);
+    d->gap = 1;
+}
+
+// Runs the dissector over `data` as long as it consumes bytes
+static size_t feed(stream_pool *p, tcp_stream *s, const packet_view *v, int side,
+                   const unsigned char *data, size_t len, unsigned flags)
+{
+    stream_dir *d = &s->dir[side];
+    size_t done = 0;
+
+    while (done < len)
+    {
+        size_t n;
+
+        if (d->skip)
+        {
+            n = d->skip < len - done ? d->skip : len - done;
+            d->skip -= n;
+            done += n;
+            continue;
+        }
+        n = s->fn(p->worker, v, s, side, data + done, len - done, flags | (d->gap ? STREAM_GAP : 0));
+        if (n == 0)
+            break;
+        d->gap = 0;
+        done += n < len - done ? n : len - done;
+    }
+    return done;
+}
+
+// Hands in-order bytes to the dissector and keeps what it leaves
+static void deliver(stream_pool *p, tcp_stream *s, const packet_view *v, int side,
+                    const unsigned char *data, size_t len)
+{
+    stream_dir *d = &s->dir[side];
+    size_t done;
+
+    p->bytes += len;
+    if (d->pend_len)
+    {
+        if (pend_reserve(p, d, len) == 0)
+        {
+            memcpy(d->pend + d->pend_len, data, len);
+            d->pend_len += len;
+            done = feed(p, s, v, side, d->pend, d->pend_len, 0);
+            if (done == d->pend_len)
+                pend_drop(p, d);
+            else if (done)
+            {
+                memmove(d->pend, d->pend + done, d->pend_len - done);
+                d->pend_len -= done;
+            }
+            return;
+        }
+        // No whole message within the limits: give it up, and let the
+        // dissector find the next one in the new bytes
+        p->lost += d->pend_len;
+        pend_drop(p, d);
+        d->gap = 1;
+    }
+
+    // Straight from the frame
+    done = feed(p, s, v, side, data, len, 0);
+    if (done == len)
+        return;
+    if (pend_reserve(p, d, len - done) == -1)
+    {
+        p->lost += len - done;
+        d->gap = 1;
+        return;
+    }
+    memcpy(d->pend, data + done, len - done);
+    d->pend_len = len - done;
+}
+
+// Bytes [seq, seq + len) arrived, the first `cap` of them captured, with
+// seq <= next_seq
+static void in_order(stream_pool *p, tcp_stream *s, const packet_view *v, int side,
+                     uint32_t seq, const unsigned char *data, uint32_t cap, uint32_t len)
+{
+    stream_dir *d = &s->dir[side];
+    uint32_t old = d->next_seq - seq;
+
+    if (old >= len)
+    {
+        p->overlaps++;
+        return;
+    }
+    if (old)
+        p->overlaps++;
+    if (old < cap)
+        deliver(p, s, v, side, data + old, cap - old);
+    d->next_seq = seq + len;
+    // Cut by the snap length
+    if (cap < len)
+        lose(p, d, len - (old > cap ? old : cap));
+}
+
+// Hands the stored segments the hole no longer separates
+static void drain(stream_pool *p, tcp_stream *s, const packet_view *v, int side)
+{
+    stream_dir *d = &s->dir[side];
+    stream_seg *g;
+
+    while ((g = d->ooo) && SEQ_LEQ(g->seq, d->next_seq))
+    {
+        d->ooo = g->next;
+        d->ooo_bytes -= g->len;
+        in_order(p, s, v, side, g->seq, g->data, g->len, g->len);
+        pool_put(p, g, g->cls);
+    }
+}
+
+// Copies the bytes of a segment ahead of next_seq that aren't stored yet
+static int store(stream_pool *p, stream_dir *d, uint32_t seq, const unsigned char *data, uint32_t len)
+{
+    stream_seg **pp = &d->ooo;
+    uint32_t start = seq, end = seq + len;
+    int overlap = 0;
+
+    if (d->ooo_bytes + d->pend_len + len > p->dir_max)
+        return -1;
+    p->ooo++;
+    while (SEQ_LT(seq, end))
+    {
+        stream_seg *g = *pp;
+
+        if (g && SEQ_LEQ(g->seq + g->len, seq))
+        {
+            pp = &g->next;
+            continue;
+        }
+        // Bytes already stored win
+        if (g && SEQ_LEQ(g->seq, seq))
+        {
+            overlap = 1;
+            seq = SEQ_LT(g->seq + g->len, end) ? g->seq + g->len : end;
+            pp = &g->next;
+            continue;
+        }
+
+        uint32_t piece_end = g && SEQ_LT(g->seq, end) ? g->seq : end;
+        uint32_t n = piece_end - seq;
+        stream_seg *ns;
+        uint8_t cls;
+
+        ns = pool_alloc(p, sizeof(*ns) + n, &cls);
+        if (ns == NULL)
+            return -1;
+        ns->seq = seq;
+        ns->len = n;
+        ns->cls = cls;
+        memcpy(ns->data, data + (seq - start), n);
+        ns->next = g;
+        *pp = ns;
+        pp = &ns->next;
+        d->ooo_bytes += n;
+        seq = piece_end;
+    }
+    p->overlaps += overlap;
+    return 0;
+}
+
+// Gives up the bytes missing in front of `to`
+static void skip_to(stream_pool *p, tcp_stream *s, const packet_view *v, int side, uint32_t to)
+{
+    stream_dir *d = &s->dir[side];
+
+    lose(p, d, to - d->next_seq);
+    d->next_seq = to;
+    drain(p, s, v, side);
+}
+
+// The sender closed and everything before its FIN was handed over: the
+// dissector gets a last look at what it left
+static void finish(stream_pool *p, tcp_stream *s, const packet_view *v, int side)
+{
+    stream_dir *d = &s->dir[side];
+
+    if (d->fin != 1 || d->next_seq != d->fin_seq)
+        return;
+    d->fin = 2;
+    if (d->pend_len)
+    {
+        feed(p, s, v, side, d->pend, d->pend_len, STREAM_FIN);
+        pend_drop(p, d);
+    }
+    else
+    {
+        static const unsigned char none[1];
+
+        // A body running up to the close ends here
+        s->fn(p->worker, v, s, side, none, 0, STREAM_FIN | (d->gap ? STREAM_GAP : 0));
+    }
+}
+
+/*** Segments ***/
+
+// Gives the flow its reassembly state, handing its bytes to `fn`.
+// Returns NULL over the memory limit.
+tcp_stream *stream_attach(stream_pool *p, tcp_stream **slot, stream_fn fn)
+{
+    tcp_stream *s = *slot;
+    uint8_t cls;
+
+    if (s)
+        return s;
+    s = pool_alloc(p, sizeof(*s), &cls);
+    if (s == NULL)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    s->fn = fn;
+    s->cls = cls;
+    p->streams++;
+    *slot = s;
+    return s;
+}
+
+// The dissector's state for the stream: `size` zeroed bytes from the
+// pool on the first call, the same block after. NULL over the memory
+// limit. Freed after the STREAM_END call.
+void *stream_state(stream_pool *p, tcp_stream *s, size_t size)
+{
+    uint8_t cls;
+
+    if (s->state)
+        return s->state;
+    s->state = pool_alloc(p, size, &cls);
+    if (s->state == NULL)
+        return NULL;
+    memset(s->state, 0, size);
+    s->state_cls = cls;
+    return s->state;
+}
+
+// A buffer of at least `size` bytes for the dissector's own use, counted
+// against the same limit. Give it back with stream_buffer_put() by
+// STREAM_END at the latest.
+void *stream_buffer_get(stream_pool *p, size_t size, uint8_t *cls)
+{
+    return pool_alloc(p, size, cls);
+}
+
+void stream_buffer_put(stream_pool *p, void *b, uint8_t cls)
+{
+    pool_put(p, b, cls);
+}
+
+// Accounts one TCP segment of the stream's flow
+void stream_segment(stream_pool *p, tcp_stream *s, const packet_view *v)
+{
+    int side = v->flow_side;
+    stream_dir *d = &s->dir[side];
+    stream_dir *peer = &s->dir[!side];
+    uint32_t seq = v->tcp.seq_num;
+    uint32_t len = v->tcp.data_len;
+    uint32_t cap = v->payload_len < len ? v->payload_len : len;
+    const unsigned char *data = v->frame + v->payload_off;
+    uint8_t flags = v->tcp.flags;
+
+    // Bytes the peer acknowledges but the capture never saw are lost: the
+    // hole in front of them won't be filled. What follows it is handed over
+    // with the next packet in that direction, so that the dissector always
+    // sees it with a packet of its own direction.
+    if ((flags & TH_ACK) && peer->started)
+    {
+        uint32_t ack = v->tcp.ack_num;
+
+        // The FIN takes a sequence number but no byte
+        if (peer->fin && SEQ_LT(peer->fin_seq, ack))
+            ack = peer->fin_seq;
+        if (SEQ_LT(peer->next_seq, ack) && ack - peer->next_seq < SEQ_WINDOW)
+        {
+            if (peer->ooo && SEQ_LT(peer->ooo->seq, ack))
+                ack = peer->ooo->seq;
+            lose(p, peer, ack - peer->next_seq);
+            peer->next_seq = ack;
+        }
+    }
+
+    if (flags & (TH_SYN | TH_RST))
+    {
+        // Data starts after the SYN
+        if ((flags & TH_SYN) && !d->started)
+        {
+            d->next_seq = seq + 1;
+            d->started = 1;
+        }
+        return;
+    }
+    if (!d->started)
+    {
+        if (len == 0)
+            return;
+        // Joined in the middle of the connection
+        d->next_seq = seq;
+        d->started = 1;
+        d->gap = 1;
+    }
+    if ((flags & TH_FIN) && !d->fin)
+    {
+        d->fin = 1;
+        d->fin_seq = seq + len;
+    }
+    drain(p, s, v, side);
+
+    if (len)
+    {
+        if (SEQ_LEQ(seq, d->next_seq))
+        {
+            in_order(p, s, v, side, seq, data, cap, len);
+            drain(p, s, v, side);
+        }
+        else if (seq - d->next_seq < SEQ_WINDOW)
+        {
+            // Ahead of a hole: the capture part is stored, the rest (cut
+            // by the snap length) is a hole of its own
+            if (store(p, d, seq, data, cap) == -1)
+            {
+                // Over the limits: the hole is given up instead
+                skip_to(p, s, v, side, d->ooo && SEQ_LT(d->ooo->seq, seq) ? d->ooo->seq : seq);
+                if (SEQ_LEQ(seq, d->next_seq))
+                {
+                    in_order(p, s, v, side, seq, data, cap, len);
+                    drain(p, s, v, side);
+                }
+                else if (store(p, d, seq, data, cap) == -1)
+                    p->lost += len;
+            }
+        }
+    }
+    finish(p, s, v, side);
+}
+
+// Frees the flow's reassembly state, the dissector's first
+void stream_close(stream_pool *p, tcp_stream *s)
+{
+    s->fn(p->worker, NULL, s, 0, NULL, 0, STREAM_END);
+    for (int side = 0; side < 2; side++)
+    {
+        stream_dir *d = &s->dir[side];
+
+        while (d->ooo)
+        {
+            stream_seg *g = d->ooo;
+
+            d->ooo = g->next;
+            pool_put(p, g, g->cls);
+        }
+        pend_drop(p, d);
+    }
+    if (s->state)
+        pool_put(p, s->state, s->state_cls);
+    pool_put(p, s, s->cls);
+}
@@ -0,0 +1,53 @@
+#include "tls_session.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sessions a worker saw issued, to tell resumptions apart (--latency).
+ *
+ * A TLS 1.2 client resumes by sending the session ID or the ticket
+ * (RFC 5077) of an earlier connection; the server accepts by echoing the
+ * session ID. A TLS 1.3 client offers a pre_shared_key, which the server
+ * accepts with its own. TLS 1.3 clients also send a random session ID
+ * for middleboxes (RFC 8446, D.4): it's an offer only when it was issued.
+ * tls_hello_walk() finds them in the hellos; the TLS dissector keys them
+ * here.
+ */
+
+int tls_session_cache_init(tls_session_cache *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->keys = calloc(TLS_SESSION_CACHE, sizeof(uint64_t));
+    return c->keys ? 0 : -1;
+}
+
+void tls_session_cache_free(tls_session_cache *c)
+{
+    free(c->keys);
+    c->keys = NULL;
+}
+
+// FNV-1a over the server's IPv4 address and the session ID or ticket:
+// the same ID from another server is another session
+uint64_t tls_session_key(const unsigned char *server, const unsigned char *id, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (int i = 0; i < 4; i++)
+        h = (h ^ server[i]) * 1099511628211ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ id[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+// Remembers a session, in place of the one in its slot
+void tls_session_issue(tls_session_cache *c, uint64_t key)
+{
+    c->keys[key & (TLS_SESSION_CACHE - 1)] = key;
+    c->issued++;
+}
+
+int tls_session_known(const tls_session_cache *c, uint64_t key)
+{
+    return c->keys[key & (TLS_SESSION_CACHE - 1)] == key;
+}
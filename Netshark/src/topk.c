@@ -0,0 +1,382 @@
+#include "topk.h"
+#include "record.h"
+#include "dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * Per-worker heavy hitters (--top).
+ *
+ * Dissectors hand keys to topk_add(): DNS names queried or answered
+ * NXDOMAIN, addresses of the clients querying, JA3/JA4 fingerprints of
+ * TLS clients and servers. Each list counts them in a Count-Min sketch
+ * with conservative update and keeps the TOPK_TRACKED keys with the
+ * highest estimates. The dispatcher calls topk_advance() with the capture
+ * time of every packet; once an interval is over every list prints its
+ * TOPK_REPORT heaviest keys and starts over.
+ */
+
+#define INDEX_SLOTS     (2 * TOPK_TRACKED)
+
+static const struct {
+    const char *kind;
+    const char *name;
+    int ip4;                    // Keys are IPv4 addresses, else lowercased text
+} lists[TOPK_LISTS] = {
+    [TOPK_DNS_QNAME]    = { "dns", "qname",    0 },
+    [TOPK_DNS_CLIENT]   = { "dns", "client",   1 },
+    [TOPK_DNS_NXDOMAIN] = { "dns", "nxdomain", 0 },
+    [TOPK_TLS_JA3]      = { "tls", "ja3",      0 },
+    [TOPK_TLS_JA4]      = { "tls", "ja4",      0 },
+    [TOPK_TLS_JA3S]     = { "tls", "ja3s",     0 },
+    [TOPK_TLS_JA4S]     = { "tls", "ja4s",     0 },
+};
+
+// One heavy hitter, exported with --format (see record.h)
+typedef struct {
+    struct timeval time;        // End of the interval
+    const char *kind;
+    const char *list;
+    int rank;
+    span key;
+    uint64_t count;             // Estimated, never under the true count
+    uint64_t min;               // Counted since tracked, never over
+    uint64_t total;             // Keys the list got in the interval
+}               topk_row;
+
+static const field_desc topk_fields[] = {
+    FIELD(topk_row, time, FIELD_TS),
+    FIELD(topk_row, kind, FIELD_STR),
+    FIELD(topk_row, list, FIELD_STR),
+    FIELD(topk_row, rank, FIELD_INT),
+    FIELD(topk_row, key, FIELD_SPAN),
+    FIELD(topk_row, count, FIELD_UINT),
+    FIELD(topk_row, min, FIELD_UINT),
+    FIELD(topk_row, total, FIELD_UINT),
+};
+
+RECORD_SCHEMA_DEF(topk_schema, PROTO_COUNT + 3, "top", topk_fields);
+
+int topk_table_init(topk_table *t, uint32_t interval, outbuf *out)
+{
+    memset(t, 0, sizeof(*t));
+    t->interval = interval;
+    t->out = out;
+    if (interval == 0)
+        return 0;
+    t->lists = calloc(TOPK_LISTS, sizeof(topk_list));
+    if (!t->lists)
+        return -1;
+    for (int l = 0; l < TOPK_LISTS; l++)
+    {
+        for (int i = 0; i < TOPK_TRACKED; i++)
+            t->lists[l].entries[i].key = t->lists[l].names[i];
+    }
+    return 0;
+}
+
+void topk_table_free(topk_table *t)
+{
+    free(t->lists);
+    memset(t, 0, sizeof(*t));
+}
+
+/*** Sketch ***/
+
+// FNV-1a, 64 bits: two independent halves for the sketch's rows
+static uint64_t key_hash(const char *key, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)key[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Counts the key once and returns its estimate. Only the counters at the
+// lowest value grow (conservative update): the others already count more
+// than this key, which keeps the estimate much closer for the same memory.
+static uint64_t sketch_add(topk_list *l, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t *c[TOPK_DEPTH];
+    uint32_t min = UINT32_MAX;
+
+    for (int r = 0; r < TOPK_DEPTH; r++)
+    {
+        c[r] = &l->sketch[r][(h1 + r * h2) & (TOPK_WIDTH - 1)];
+        if (*c[r] < min)
+            min = *c[r];
+    }
+    if (min == UINT32_MAX)
+        return min;
+    for (int r = 0; r < TOPK_DEPTH; r++)
+    {
+        if (*c[r] == min)
+            *c[r] = min + 1;
+    }
+    return (uint64_t)min + 1;
+}
+
+/*** Candidates ***/
+
+static void heap_swap(topk_list *l, uint32_t a, uint32_t b)
+{
+    uint8_t e = l->heap[a];
+
+    l->heap[a] = l->heap[b];
+    l->heap[b] = e;
+    l->entries[l->heap[a]].heap = a;
+    l->entries[l->heap[b]].heap = b;
+}
+
+static void heap_up(topk_list *l, uint32_t i)
+{
+    while (i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+
+        if (l->entries[l->heap[parent]].count <= l->entries[l->heap[i]].count)
+            break;
+        heap_swap(l, parent, i);
+        i = parent;
+    }
+}
+
+// An entry's count only grows: it moves towards the leaves
+static void heap_down(topk_list *l, uint32_t i)
+{
+    for (;;)
+    {
+        uint32_t low = i;
+        uint32_t child = 2 * i + 1;
+
+        if (child < l->count && l->entries[l->heap[child]].count < l->entries[l->heap[low]].count)
+            low = child;
+        if (child + 1 < l->count && l->entries[l->heap[child + 1]].count < l->entries[l->heap[low]].count)
+            low = child + 1;
+        if (low == i)
+            break;
+        heap_swap(l, low, i);
+        i = low;
+    }
+}
+
+// Index slot of the key, or the free slot where it would go
+static uint32_t index_find(const topk_list *l, uint64_t hash, const char *key, size_t len)
+{
+    uint32_t i = hash & (INDEX_SLOTS - 1);
+
+    for (;; i = (i + 1) & (INDEX_SLOTS - 1))
+    {
+        const topk_entry *e;
+
+        if (l->index[i] == 0)
+            return i;
+        e = &l->entries[l->index[i] - 1];
+        if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0)
+            return i;
+    }
+}
+
+// Empties slot `i`, moving back the entries after it that probed past it
+static void index_remove(topk_list *l, uint32_t i)
+{
+    uint32_t j = i;
+
+    for (;;)
+    {
+        uint32_t home;
+
+        j = (j + 1) & (INDEX_SLOTS - 1);
+        if (l->index[j] == 0)
+            break;
+        home = l->entries[l->index[j] - 1].hash & (INDEX_SLOTS - 1);
+        if (((j - home) & (INDEX_SLOTS - 1)) < ((j - i) & (INDEX_SLOTS - 1)))
+            continue;
+        l->index[i] = l->index[j];
+        i = j;
+    }
+    l->index[i] = 0;
+}
+
+static void entry_set(topk_list *l, uint32_t slot, uint32_t n, uint64_t hash,
+                      const char *key, size_t len, uint64_t count)
+{
+    topk_entry *e = &l->entries[n];
+
+    e->hash = hash;
+    e->count = count;
+    e->seen = 1;
+    e->len = len;
+    memcpy(e->key, key, len);
+    l->index[slot] = n + 1;
+}
+
+static void list_add(topk_list *l, const char *key, size_t len)
+{
+    uint64_t hash = key_hash(key, len);
+    uint64_t count = sketch_add(l, hash);
+    uint32_t slot = index_find(l, hash, key, len);
+    topk_entry *e;
+
+    l->total++;
+    if (l->index[slot])
+    {
+        e = &l->entries[l->index[slot] - 1];
+        e->count = count;
+        e->seen++;
+        heap_down(l, e->heap);
+    }
+    else if (l->count < TOPK_TRACKED)
+    {
+        entry_set(l, slot, l->count, hash, key, len, count);
+        l->heap[l->count] = l->count;
+        l->entries[l->count].heap = l->count;
+        l->count++;
+        heap_up(l, l->count - 1);
+    }
+    else if (count > l->entries[l->heap[0]].count)
+    {
+        // Space-Saving: the key replaces the lowest candidate
+        uint32_t n = l->heap[0];
+
+        e = &l->entries[n];
+        index_remove(l, index_find(l, e->hash, e->key, e->len));
+        slot = index_find(l, hash, key, len);
+        entry_set(l, slot, n, hash, key, len, count);
+        heap_down(l, 0);
+    }
+}
+
+// Counts one key of a list. Text keys are lowercased, cut to TOPK_KEY_MAX.
+void topk_add(topk_table *t, topk_list_id list, const void *key, size_t len, uint64_t sec)
+{
+    char buf[TOPK_KEY_MAX];
+    const char *k = key;
+
+    if (t->interval == 0)
+        return;
+    if (len > sizeof(buf))
+        len = sizeof(buf);
+    if (!lists[list].ip4)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            char c = k[i];
+
+            buf[i] = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+        }
+        k = buf;
+    }
+    list_add(&t->lists[list], k, len);
+    if (sec > t->last)
+        t->last = sec;
+    t->keys++;
+}
+
+/*** Reports ***/
+
+// "12:00:10.000000 TOP dns qname 1 example.com n 1234 min 1200 of 50000"
+static void topk_print(outbuf *ob, const topk_row *r)
+{
+    ob_timestamp(ob, &r->time);
+    ob_str(ob, " TOP ");
+    ob_str(ob, r->kind);
+    ob_putc(ob, ' ');
+    ob_str(ob, r->list);
+    ob_putc(ob, ' ');
+    ob_u64(ob, r->rank);
+    ob_putc(ob, ' ');
+    if (r->key.len)
+        print_printable(ob, (const char *)r->key.ptr, r->key.len);
+    else
+        ob_putc(ob, '.');
+    ob_str(ob, " n ");
+    ob_u64(ob, r->count);
+    ob_str(ob, " min ");
+    ob_u64(ob, r->min);
+    ob_str(ob, " of ");
+    ob_u64(ob, r->total);
+    ob_putc(ob, '\n');
+}
+
+static void list_report(topk_table *t, int id, uint64_t sec)
+{
+    topk_list *l = &t->lists[id];
+    uint8_t order[TOPK_TRACKED];
+    outbuf *ob = t->out;
+    uint32_t n = l->count;
+
+    // Heaviest first
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t j = i;
+
+        while (j > 0 && l->entries[order[j - 1]].count < l->entries[i].count)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    for (uint32_t i = 0; i < n && i < TOPK_REPORT; i++)
+    {
+        const topk_entry *e = &l->entries[order[i]];
+        char addr[INET_ADDRSTRLEN];
+        topk_row r;
+
+        r.time.tv_sec = sec;
+        r.time.tv_usec = 0;
+        r.kind = lists[id].kind;
+        r.list = lists[id].name;
+        r.rank = i + 1;
+        if (lists[id].ip4 && e->len == 4)
+        {
+            inet_ntop(AF_INET, e->key, addr, sizeof(addr));
+            r.key.ptr = (const unsigned char *)addr;
+            r.key.len = strlen(addr);
+        }
+        else
+        {
+            r.key.ptr = (const unsigned char *)e->key;
+            r.key.len = e->len;
+        }
+        r.count = e->count;
+        r.min = e->seen;
+        r.total = l->total;
+
+        ob_begin(ob);
+        if (ob->format == OUTPUT_TEXT)
+            topk_print(ob, &r);
+        else
+            record_object(ob, &topk_schema, &r);
+        ob_end(ob);
+    }
+    memset(l->sketch, 0, sizeof(l->sketch));
+    memset(l->index, 0, sizeof(l->index));
+    l->count = 0;
+    l->total = 0;
+}
+
+// Prints the interval that ended at `sec` and starts the next one
+void topk_report(topk_table *t, uint64_t sec)
+{
+    uint64_t end = t->next && t->next <= sec ? t->next : sec;
+
+    for (int l = 0; l < TOPK_LISTS; l++)
+    {
+        if (t->lists[l].count)
+            list_report(t, l, end);
+    }
+    t->next = (sec / t->interval + 1) * t->interval;
+}
+
+// End of the capture: prints what the last interval got so far
+void topk_flush(topk_table *t)
+{
+    if (t->interval && t->last)
+        topk_report(t, t->next > t->last ? t->next : t->last);
+}
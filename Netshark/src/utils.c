@@ -1,14 +1,98 @@
 #include "netshark.h"
+#include "dispatch.h"
+#include <arpa/inet.h>
 
-void dump_hex_single_line(const uint8_t *buf, size_t len)
+/* helper: `label` and the frame in hex on one line, as --raw/--raw-max say.
+   Prints nothing at all with --raw none. */
+void print_raw_bytes(outbuf *ob, const char *label, const packet_view *v)
 {
-    for (size_t i = 0; i < len; ++i)
-        printf("%02X", buf[i]);         /* two‑digit hex, no spaces */
+    const uint8_t *buf = v->frame;
+    size_t len = v->caplen;
+
+    if (ob->raw == OUTPUT_RAW_NONE)
+        return;
+    if (ob->raw == OUTPUT_RAW_PAYLOAD)
+    {
+        buf += v->payload_off;
+        len = v->payload_len;
+    }
+
+    ob_str(ob, label);
+    if (ob->raw_max && len > ob->raw_max)
+    {
+        ob_hexdump(ob, buf, ob->raw_max, 1);
+        ob_str(ob, "...");
+    }
+    else
+        ob_hexdump(ob, buf, len, 1);
+}
+
+/* helper: start of a -q line, "time proto src > dst ", with the ports
+   when the packet has them and MAC addresses when it isn't IPv4 */
+void print_summary_head(outbuf *ob, const packet_view *v, const char *proto)
+{
+    int ports = 0;
+
+    ob_timestamp(ob, &v->hdr->ts);
+    ob_putc(ob, ' ');
+    ob_str(ob, proto);
+    ob_putc(ob, ' ');
+
+    if (v->ether.ethertype != ETHERTYPE_IPV4)
+    {
+        ob_mac(ob, v->ether.src);
+        ob_str(ob, " > ");
+        ob_mac(ob, v->ether.dst);
+        ob_putc(ob, ' ');
+        return;
+    }
+
+    // The dispatcher only decodes TCP/UDP in first fragments
+    if ((v->ip.frag_off & 0x1fff) == 0)
+        ports = v->ip.protocol == IPPROTO_TCP ? 1 : v->ip.protocol == IPPROTO_UDP ? 2 : 0;
+
+    ob_ip4(ob, &v->ip.src);
+    if (ports)
+    {
+        ob_putc(ob, ':');
+        ob_u64(ob, ports == 1 ? v->tcp.src_port : v->udp.src_port);
+    }
+    ob_str(ob, " > ");
+    ob_ip4(ob, &v->ip.dst);
+    if (ports)
+    {
+        ob_putc(ob, ':');
+        ob_u64(ob, ports == 1 ? v->tcp.dst_port : v->udp.dst_port);
+    }
+    ob_putc(ob, ' ');
+}
+
+/* helper: bytes from the wire, anything but printable ASCII shown as '.'
+   so a -q line stays one line */
+void print_printable(outbuf *ob, const void *data, size_t len)
+{
+    const unsigned char *s = data;
+    char *p = ob_room(ob, len);
+
+    if (!p)
+        return;
+    for (size_t i = 0; i < len; i++)
+        p[i] = (s[i] >= 0x20 && s[i] < 0x7f) ? s[i] : '.';
+    ob->len += len;
 }
 
-/* helper: format MAC as colon‑separated string */
-void mac_to_str(const uint8_t mac[6], char *dst, size_t dstframe_len)
+/* helper: format MAC as colon‑separated string, returns dst */
+char *mac_to_str(const uint8_t mac[6], char *dst, size_t dstframe_len)
 {
     snprintf(dst, dstframe_len, "%02X:%02X:%02X:%02X:%02X:%02X",
              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return dst;
+}
+
+/* helper: format the 4 bytes at addr as a dotted IPv4 address, returns dst */
+char *ip_to_str(const void *addr, char *dst, size_t dst_len)
+{
+    if (!inet_ntop(AF_INET, addr, dst, dst_len) && dst_len > 0)
+        dst[0] = '\0';
+    return dst;
 }
@@ -0,0 +1,310 @@
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * pcapng writer.
+ *
+ * Capture workers never touch the disk: writer_push() copies the frame
+ * into the worker's ring and returns, dropping the packet (and counting
+ * it) when the ring is full. A dedicated thread drains every ring into a
+ * large aligned buffer and writes it out in one go, opening a new file
+ * when the size or time limit is reached.
+ *
+ * see: https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-02.html
+ */
+
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_EPB_OVERHEAD     32          // Block header, fixed fields and trailing length
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/*** Producer side ***/
+
+int writer_push(writer_ring *r, const struct pcap_pkthdr *hdr, const unsigned char *data)
+{
+    uint32_t len = hdr->caplen;
+    uint64_t start = r->data_head;
+    size_t pos = start % WRITER_RING_BYTES;
+
+    if (r->ref_head - __atomic_load_n(&r->ref_tail, __ATOMIC_ACQUIRE) >= WRITER_RING_REFS)
+    {
+        r->drops++;
+        return -1;
+    }
+
+    // A frame never straddles the end of the arena
+    if (pos + len > WRITER_RING_BYTES)
+        start += WRITER_RING_BYTES - pos;
+    if (start + len - __atomic_load_n(&r->data_tail, __ATOMIC_ACQUIRE) > WRITER_RING_BYTES)
+    {
+        r->drops++;
+        return -1;
+    }
+
+    memcpy(r->data + start % WRITER_RING_BYTES, data, len);
+
+    writer_ref *ref = &r->refs[r->ref_head & (WRITER_RING_REFS - 1)];
+    ref->hdr = *hdr;
+    ref->off = start;
+    r->data_head = start + len;
+
+    __atomic_store_n(&r->ref_head, r->ref_head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*** Writer thread ***/
+
+static void writer_flush(pcap_writer *w)
+{
+    size_t off = 0;
+
+    w->flush_ms = now_ms();
+    while (off < w->buf_len && !w->failed)
+    {
+        ssize_t n = write(w->fd, w->buf + off, w->buf_len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Writing capture file: %s, saving stopped\n", strerror(errno));
+            w->failed = 1;
+            break;
+        }
+        off += n;
+    }
+    w->buf_len = 0;
+}
+
+// Section header and the single interface every packet refers to
+static void writer_header(pcap_writer *w)
+{
+    unsigned char *p = w->buf + w->buf_len;
+    int64_t section_len = -1;
+
+    put32(p, PCAPNG_SHB);
+    put32(p + 4, 28);
+    put32(p + 8, PCAPNG_BYTE_ORDER_MAGIC);
+    put32(p + 12, 1);                       // Version 1.0
+    memcpy(p + 16, &section_len, sizeof(section_len));
+    put32(p + 24, 28);
+
+    put32(p + 28, PCAPNG_IDB);
+    put32(p + 32, 20);
+    put32(p + 36, (uint32_t)w->linktype);   // Link type, reserved
+    put32(p + 40, 0);                       // No snaplen
+    put32(p + 44, 20);
+
+    w->buf_len += 48;
+    w->file_bytes += 48;
+}
+
+static int writer_open_file(pcap_writer *w)
+{
+    char name[4096];
+
+    if (w->opts.rotate_bytes || w->opts.rotate_secs)
+        snprintf(name, sizeof(name), "%s.%d", w->opts.path, w->file_index);
+    else
+        snprintf(name, sizeof(name), "%s", w->opts.path);
+
+    w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd == -1)
+    {
+        fprintf(stderr, "Couldn't create %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    w->file_bytes = 0;
+    w->file_start = time(NULL);
+    w->files++;
+    writer_header(w);
+    return 0;
+}
+
+static void writer_rotate(pcap_writer *w)
+{
+    writer_flush(w);
+    close(w->fd);
+    w->fd = -1;
+
+    w->file_index++;
+    if (w->opts.max_files > 0)
+        w->file_index %= w->opts.max_files;
+
+    if (writer_open_file(w) == -1)
+        w->failed = 1;
+}
+
+static void writer_append(pcap_writer *w, const struct pcap_pkthdr *hdr, const unsigned char *data)
+{
+    uint32_t caplen = hdr->caplen;
+    uint32_t pad = (4 - caplen % 4) % 4;
+    uint32_t total = PCAPNG_EPB_OVERHEAD + caplen + pad;
+    uint64_t ts = (uint64_t)hdr->ts.tv_sec * 1000000 + hdr->ts.tv_usec;
+
+    if (w->failed)
+        return;
+
+    // Only rotate a file that already holds packets
+    if (w->file_bytes > 48
+        && ((w->opts.rotate_bytes && w->file_bytes + total > w->opts.rotate_bytes)
+            || (w->opts.rotate_secs && w->now - w->file_start >= (time_t)w->opts.rotate_secs)))
+    {
+        writer_rotate(w);
+        if (w->failed)
+            return;
+    }
+
+    if (w->buf_len + total > WRITER_BUF_SIZE)
+        writer_flush(w);
+
+    unsigned char *p = w->buf + w->buf_len;
+    put32(p, PCAPNG_EPB);
+    put32(p + 4, total);
+    put32(p + 8, 0);                        // Interface id
+    put32(p + 12, (uint32_t)(ts >> 32));
+    put32(p + 16, (uint32_t)ts);
+    put32(p + 20, caplen);
+    put32(p + 24, hdr->len);
+    memcpy(p + 28, data, caplen);
+    memset(p + 28 + caplen, 0, pad);
+    put32(p + total - 4, total);
+
+    w->buf_len += total;
+    w->file_bytes += total;
+    w->packets++;
+}
+
+// Move every queued packet of one ring into the write buffer
+static int writer_drain(pcap_writer *w, writer_ring *r)
+{
+    uint64_t head = __atomic_load_n(&r->ref_head, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (r->ref_tail != head)
+    {
+        writer_ref *ref = &r->refs[r->ref_tail & (WRITER_RING_REFS - 1)];
+
+        writer_append(w, &ref->hdr, r->data + ref->off % WRITER_RING_BYTES);
+
+        __atomic_store_n(&r->data_tail, ref->off + ref->hdr.caplen, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->ref_tail, r->ref_tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    return n;
+}
+
+static void *writer_main(void *arg)
+{
+    pcap_writer *w = (pcap_writer *)arg;
+
+    for (;;)
+    {
+        // Read before draining: once set, the workers have stopped pushing
+        int stopping = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+        int moved = 0;
+
+        w->now = time(NULL);
+        for (int i = 0; i < w->nrings; i++)
+            moved += writer_drain(w, &w->rings[i]);
+
+        if (moved)
+            continue;
+        if (stopping)
+            break;
+
+        if (w->buf_len > 0 && now_ms() - w->flush_ms >= WRITER_FLUSH_MS)
+            writer_flush(w);
+        usleep(WRITER_IDLE_US);
+    }
+
+    writer_flush(w);
+    return NULL;
+}
+
+/*** Setup ***/
+
+int writer_init(pcap_writer *w, const writer_opts *opts, int linktype, int nrings)
+{
+    memset(w, 0, sizeof(*w));
+    w->opts = *opts;
+    w->linktype = linktype;
+    w->fd = -1;
+
+    w->rings = calloc(nrings, sizeof(writer_ring));
+    if (!w->rings)
+        return -1;
+    w->nrings = nrings;
+
+    for (int i = 0; i < nrings; i++)
+    {
+        w->rings[i].refs = malloc(WRITER_RING_REFS * sizeof(writer_ref));
+        w->rings[i].data = malloc(WRITER_RING_BYTES);
+        if (!w->rings[i].refs || !w->rings[i].data)
+        {
+            fprintf(stderr, "Couldn't allocate the capture file queue\n");
+            return -1;
+        }
+    }
+
+    if (posix_memalign((void **)&w->buf, WRITER_BUF_ALIGN, WRITER_BUF_SIZE) != 0)
+    {
+        w->buf = NULL;
+        fprintf(stderr, "Couldn't allocate the capture file buffer\n");
+        return -1;
+    }
+
+    return writer_open_file(w);
+}
+
+void writer_free(pcap_writer *w)
+{
+    for (int i = 0; i < w->nrings && w->rings; i++)
+    {
+        free(w->rings[i].refs);
+        free(w->rings[i].data);
+    }
+    free(w->rings);
+    free(w->buf);
+    if (w->fd != -1)
+        close(w->fd);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+int writer_start(pcap_writer *w)
+{
+    w->flush_ms = now_ms();
+    if (pthread_create(&w->thread, NULL, writer_main, w) != 0)
+    {
+        fprintf(stderr, "Couldn't start the capture file writer\n");
+        return -1;
+    }
+    return 0;
+}
+
+void writer_stop(pcap_writer *w)
+{
+    __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(w->thread, NULL);
+}
@@ -0,0 +1,353 @@
+#include "x509.h"
+#include "hash.h"
+#include "record.h"
+#include "dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Per-worker certificate cache, and the certificate reports (--certs).
+ *
+ * The TLS dissector hands every certificate of a Certificate message to
+ * x509_lookup(). A certificate met before is found by a 64-bit hash of its
+ * DER and a comparison with the copy kept; only a new one is parsed and
+ * hashed with SHA-256 for its fingerprint. The reports read the cache
+ * alone: every interval, the certificates seen are printed by expiry,
+ * soonest first, then each issuer with the number of them it signed.
+ */
+
+#define CACHE_ENTRIES   (X509_CACHE_SETS * X509_CACHE_WAYS)
+
+// One certificate of an interval, exported with --format (see record.h)
+typedef struct {
+    struct timeval time;        // End of the interval
+    struct timeval not_before;
+    struct timeval not_after;
+    int days;                   // Left until not_after, negative once expired
+    uint64_t count;             // Seen in the interval
+    const char *key;
+    const char *sha256;
+    const char *subject;
+    const char *issuer;
+    const char *san;
+    uint8_t self_signed;
+}               cert_row;
+
+// One issuer of an interval
+typedef struct {
+    struct timeval time;
+    const char *issuer;
+    uint64_t certs;             // Different certificates it signed
+    uint64_t count;             // Times they were seen
+}               issuer_row;
+
+static const field_desc cert_fields[] = {
+    FIELD(cert_row, time, FIELD_TS),
+    FIELD(cert_row, not_before, FIELD_TS),
+    FIELD(cert_row, not_after, FIELD_TS),
+    FIELD(cert_row, days, FIELD_INT),
+    FIELD(cert_row, count, FIELD_UINT),
+    FIELD(cert_row, key, FIELD_STR),
+    FIELD(cert_row, sha256, FIELD_STR),
+    FIELD(cert_row, subject, FIELD_STR),
+    FIELD(cert_row, issuer, FIELD_STR),
+    FIELD(cert_row, san, FIELD_STR),
+    FIELD(cert_row, self_signed, FIELD_BOOL),
+};
+
+static const field_desc issuer_fields[] = {
+    FIELD(issuer_row, time, FIELD_TS),
+    FIELD(issuer_row, issuer, FIELD_STR),
+    FIELD(issuer_row, certs, FIELD_UINT),
+    FIELD(issuer_row, count, FIELD_UINT),
+};
+
+RECORD_SCHEMA_DEF(cert_schema, PROTO_COUNT + 4, "cert", cert_fields);
+RECORD_SCHEMA_DEF(issuer_schema, PROTO_COUNT + 5, "issuer", issuer_fields);
+
+int x509_cache_init(x509_cache *c, uint32_t interval, outbuf *out)
+{
+    memset(c, 0, sizeof(*c));
+    c->interval = interval;
+    c->out = out;
+    c->entries = calloc(CACHE_ENTRIES, sizeof(x509_entry));
+    return c->entries ? 0 : -1;
+}
+
+void x509_cache_free(x509_cache *c)
+{
+    if (c->entries)
+    {
+        for (int i = 0; i < CACHE_ENTRIES; i++)
+            free(c->entries[i].der);
+    }
+    free(c->entries);
+    memset(c, 0, sizeof(*c));
+}
+
+/*** Lookup ***/
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Four independent lanes of 8 bytes: about a byte per cycle, a small part
+// of what SHA-256 costs. Collisions only cost a comparison.
+static uint64_t der_hash(const unsigned char *p, size_t len)
+{
+    uint64_t h[4] = { len, 0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL };
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        for (int l = 0; l < 4; l++)
+        {
+            uint64_t v;
+
+            memcpy(&v, p + i + 8 * l, 8);
+            h[l] = (h[l] ^ v) * 0x9e3779b97f4a7c15ULL;
+            h[l] ^= h[l] >> 29;
+        }
+    }
+    for (; i < len; i++)
+        h[0] = (h[0] ^ p[i]) * 0x100000001b3ULL;
+    h[0] = mix64(h[0] ^ mix64(h[1]) ^ mix64(h[2] + 1) ^ mix64(h[3] + 2));
+    return h[0] ? h[0] : 1;
+}
+
+// FNV-1a, to group certificates by issuer in the reports
+static uint32_t text_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h;
+}
+
+// The certificate in DER, from the cache or parsed into it. The entry
+// stays valid until the next lookup. NULL when it isn't a certificate,
+// or when there is no memory to keep it.
+const x509_entry *x509_lookup(x509_cache *c, const unsigned char *der, size_t len, uint64_t sec)
+{
+    uint64_t hash = der_hash(der, len);
+    x509_entry *set = &c->entries[(hash & (X509_CACHE_SETS - 1)) * X509_CACHE_WAYS];
+    x509_entry *e = NULL;
+    unsigned char digest[SHA256_DIGEST_LEN];
+    x509_cert cert;
+
+    c->certs++;
+    if (sec > c->last)
+        c->last = sec;
+    for (int i = 0; i < X509_CACHE_WAYS; i++)
+    {
+        if (set[i].hash == hash && set[i].der_len == len && memcmp(set[i].der, der, len) == 0)
+        {
+            set[i].used = ++c->stamp;
+            set[i].seen++;
+            return &set[i];
+        }
+    }
+
+    if (len > UINT32_MAX || x509_parse(der, len, &cert) == -1)
+    {
+        c->invalid++;
+        return NULL;
+    }
+    c->parsed++;
+
+    // A free way, else the least recently used one
+    for (int i = 0; i < X509_CACHE_WAYS; i++)
+    {
+        if (!e || set[i].used < e->used)
+            e = &set[i];
+        if (!set[i].hash)
+            break;
+    }
+    if (e->hash)
+        c->evicted++;
+    free(e->der);
+    memset(e, 0, sizeof(*e));
+    e->der = malloc(len);
+    if (!e->der)
+        return NULL;
+    memcpy(e->der, der, len);
+    e->der_len = len;
+    e->hash = hash;
+    e->cert = cert;
+    e->issuer_hash = text_hash(cert.issuer);
+    sha256(der, len, digest);
+    hex_string(digest, sizeof(digest), e->sha256);
+    e->used = ++c->stamp;
+    e->seen = 1;
+    return e;
+}
+
+/*** Reports ***/
+
+static void print_date(outbuf *ob, time_t t)
+{
+    char date[X509_DATE_LEN + 1];
+
+    ob_write(ob, date, x509_date(t, date));
+}
+
+// "12:00:10.000000 CERT 2026-11-02 days 15 n 1234 ec-p256 3fa2c1d0e9b8a7f6 subject CN=example.com issuer C=US, O=Let's Encrypt, CN=R3"
+static void cert_print(outbuf *ob, const cert_row *r)
+{
+    ob_timestamp(ob, &r->time);
+    ob_str(ob, " CERT ");
+    print_date(ob, r->not_after.tv_sec);
+    ob_str(ob, " days ");
+    if (r->days < 0)
+        ob_putc(ob, '-');
+    ob_u64(ob, r->days < 0 ? -(unsigned long long)r->days : (unsigned long long)r->days);
+    ob_str(ob, " n ");
+    ob_u64(ob, r->count);
+    ob_putc(ob, ' ');
+    ob_str(ob, r->key);
+    ob_putc(ob, ' ');
+    ob_write(ob, r->sha256, 16);
+    ob_str(ob, " subject ");
+    print_printable(ob, r->subject, strlen(r->subject));
+    ob_str(ob, " issuer ");
+    if (r->self_signed)
+        ob_str(ob, "self");
+    else
+        print_printable(ob, r->issuer, strlen(r->issuer));
+    ob_putc(ob, '\n');
+}
+
+// "12:00:10.000000 ISSUER C=US, O=Let's Encrypt, CN=R3 certs 12 n 4500"
+static void issuer_print(outbuf *ob, const issuer_row *r)
+{
+    ob_timestamp(ob, &r->time);
+    ob_str(ob, " ISSUER ");
+    print_printable(ob, r->issuer, strlen(r->issuer));
+    ob_str(ob, " certs ");
+    ob_u64(ob, r->certs);
+    ob_str(ob, " n ");
+    ob_u64(ob, r->count);
+    ob_putc(ob, '\n');
+}
+
+static int days_left(time_t not_after, uint64_t sec)
+{
+    int64_t left = (int64_t)not_after - (int64_t)sec;
+
+    return (int)(left >= 0 ? left / 86400 : -((-left + 86399) / 86400));
+}
+
+// Times before 1970 can't be exported: as 0
+static inline time_t unsigned_time(time_t t)
+{
+    return t < 0 ? 0 : t;
+}
+
+// Prints the interval that ended at `sec` and starts the next one
+void x509_report(x509_cache *c, uint64_t sec)
+{
+    uint64_t end = c->next && c->next <= sec ? c->next : sec;
+    x509_entry *order[CACHE_ENTRIES];
+    outbuf *ob = c->out;
+    int n = 0;
+
+    // Seen this interval, expiring soonest first
+    for (int i = 0; i < CACHE_ENTRIES; i++)
+    {
+        x509_entry *e = &c->entries[i];
+        int j = n;
+
+        if (!e->hash || !e->seen)
+            continue;
+        while (j > 0 && order[j - 1]->cert.not_after > e->cert.not_after)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = e;
+        n++;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        const x509_entry *e = order[i];
+        cert_row r;
+
+        memset(&r, 0, sizeof(r));
+        r.time.tv_sec = end;
+        r.not_before.tv_sec = unsigned_time(e->cert.not_before);
+        r.not_after.tv_sec = unsigned_time(e->cert.not_after);
+        r.days = days_left(e->cert.not_after, end);
+        r.count = e->seen;
+        r.key = e->cert.key;
+        r.sha256 = e->sha256;
+        r.subject = e->cert.subject;
+        r.issuer = e->cert.issuer;
+        r.san = e->cert.san;
+        r.self_signed = e->cert.self_signed;
+
+        ob_begin(ob);
+        if (ob->format == OUTPUT_TEXT)
+            cert_print(ob, &r);
+        else
+            record_object(ob, &cert_schema, &r);
+        ob_end(ob);
+    }
+
+    // Issuers, in the order of their first certificate above
+    for (int i = 0; i < n; i++)
+    {
+        const x509_entry *e = order[i];
+        issuer_row r;
+        int first = 1;
+
+        if (e->cert.self_signed)
+            continue;
+        for (int j = 0; j < i && first; j++)
+        {
+            if (order[j]->issuer_hash == e->issuer_hash && !order[j]->cert.self_signed
+                && strcmp(order[j]->cert.issuer, e->cert.issuer) == 0)
+                first = 0;
+        }
+        if (!first)
+            continue;
+
+        memset(&r, 0, sizeof(r));
+        r.time.tv_sec = end;
+        r.issuer = e->cert.issuer;
+        for (int j = i; j < n; j++)
+        {
+            if (order[j]->issuer_hash == e->issuer_hash && !order[j]->cert.self_signed
+                && strcmp(order[j]->cert.issuer, e->cert.issuer) == 0)
+            {
+                r.certs++;
+                r.count += order[j]->seen;
+            }
+        }
+
+        ob_begin(ob);
+        if (ob->format == OUTPUT_TEXT)
+            issuer_print(ob, &r);
+        else
+            record_object(ob, &issuer_schema, &r);
+        ob_end(ob);
+    }
+
+    for (int i = 0; i < n; i++)
+        order[i]->seen = 0;
+    c->next = (sec / c->interval + 1) * c->interval;
+}
+
+// End of the capture: prints what the last interval got so far
+void x509_flush(x509_cache *c)
+{
+    if (c->interval && c->last)
+        x509_report(c, c->next > c->last ? c->next : c->last);
+}
@@ -0,0 +1,195 @@
+/*
+ * DNS decoder benchmark: parse_dns_packet() then every name of every
+ * record walked with dns_name_next(), as printing would.
+ *
+ *   gcc -O2 -Iinclude -I../libnetpcap/include test/dns_bench.c src/parsers/dns_parser.c -o dns_bench
+ *   ./dns_bench [rounds]
+ *
+ * The messages are built here: a plain query, a compressed answer with a
+ * CNAME chain, A, AAAA, MX, TXT and an EDNS0 OPT carrying a cookie, an
+ * NXDOMAIN with its SOA, and a message whose pointer loops, which must be
+ * found malformed.
+ */
+#include "dns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+    unsigned char data[DNS_MAX_PACKET_SIZE];
+    size_t len;
+} message;
+
+static void put(message *m, const void *p, size_t len)
+{
+    memcpy(m->data + m->len, p, len);
+    m->len += len;
+}
+
+static void put16(message *m, uint16_t v)
+{
+    unsigned char b[2] = { v >> 8, v & 0xff };
+
+    put(m, b, 2);
+}
+
+static void put32(message *m, uint32_t v)
+{
+    put16(m, v >> 16);
+    put16(m, v & 0xffff);
+}
+
+static void header(message *m, uint16_t flags, uint16_t qd, uint16_t an, uint16_t ns, uint16_t ar)
+{
+    m->len = 0;
+    put16(m, 0x1234);
+    put16(m, flags);
+    put16(m, qd);
+    put16(m, an);
+    put16(m, ns);
+    put16(m, ar);
+}
+
+// Record head up to RDLENGTH, `name` already in wire format
+static void record(message *m, const char *name, size_t name_len, uint16_t type, uint16_t rdlength)
+{
+    put(m, name, name_len);
+    put16(m, type);
+    put16(m, 1);
+    put32(m, 300);
+    put16(m, rdlength);
+}
+
+#define NAME(s) s, sizeof(s) - 1
+
+static int build(message *msgs)
+{
+    static const unsigned char v6[16] = { 0x20, 0x01, 0x0d, 0xb8, [15] = 1 };
+    static const unsigned char v4[4] = { 93, 184, 216, 34 };
+    static const unsigned char cookie[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    message *m;
+
+    // www.example.com A?
+    m = &msgs[0];
+    header(m, 0x0100, 1, 0, 0, 0);
+    put(m, NAME("\3www\7example\3com\0"));
+    put16(m, DNS_TYPE_A);
+    put16(m, 1);
+
+    // The answer: www -> web -> cdn.example.com, then its addresses.
+    // example.com is at 16, www.example.com at 12.
+    m = &msgs[1];
+    header(m, 0x8180, 1, 7, 0, 1);
+    put(m, NAME("\3www\7example\3com\0"));
+    put16(m, DNS_TYPE_A);
+    put16(m, 1);
+    record(m, NAME("\xc0\x0c"), DNS_TYPE_CNAME, 6);
+    put(m, NAME("\3web\xc0\x10"));                     // at 45
+    record(m, NAME("\xc0\x2d"), DNS_TYPE_CNAME, 6);
+    put(m, NAME("\3cdn\xc0\x10"));                     // at 63
+    record(m, NAME("\xc0\x3f"), DNS_TYPE_A, 4);
+    put(m, v4, 4);
+    record(m, NAME("\xc0\x3f"), DNS_TYPE_AAAA, 16);
+    put(m, v6, 16);
+    record(m, NAME("\xc0\x10"), DNS_TYPE_MX, 7);
+    put16(m, 10);
+    put(m, NAME("\2mx\xc0\x10"));
+    record(m, NAME("\xc0\x10"), DNS_TYPE_TXT, 18);
+    put(m, NAME("\5hello\13v=spf1 -all"));
+    record(m, NAME("\xc0\x10"), DNS_TYPE_NS, 6);
+    put(m, NAME("\3ns1\xc0\x10"));
+    put(m, NAME("\0"));
+    put16(m, DNS_TYPE_OPT);
+    put16(m, 1232);
+    put32(m, 0x8000);
+    put16(m, 12);
+    put16(m, 10);
+    put16(m, 8);
+    put(m, cookie, 8);
+
+    // nope.example.com: NXDOMAIN and the zone's SOA, example.com at 17
+    m = &msgs[2];
+    header(m, 0x8183, 1, 0, 1, 0);
+    put(m, NAME("\4nope\7example\3com\0"));
+    put16(m, DNS_TYPE_A);
+    put16(m, 1);
+    record(m, NAME("\xc0\x11"), DNS_TYPE_SOA, 39);
+    put(m, NAME("\3ns1\xc0\x11\12hostmaster\xc0\x11"));
+    for (int i = 1; i <= 5; i++)
+        put32(m, i);
+
+    // An answer whose owner name points at itself
+    m = &msgs[3];
+    header(m, 0x8180, 1, 1, 0, 0);
+    put(m, NAME("\1a\1b\0"));
+    put16(m, DNS_TYPE_A);
+    put16(m, 1);
+    record(m, NAME("\xc0\x15"), DNS_TYPE_A, 4);
+    put(m, v4, 4);
+    return 4;
+}
+
+// Walks every name the way printing does, returns the bytes seen
+static size_t walk(const dns_packet *p)
+{
+    size_t bytes = 0;
+
+    for (uint16_t i = 0; i < p->nrr; i++) {
+        dns_name_iter it;
+        span label;
+
+        dns_name_iter_init(&it, p->msg, p->total_len, p->rr[i].name);
+        while (dns_name_next(&it, &label) == 1)
+            bytes += label.len;
+        if (p->rr[i].type == DNS_TYPE_CNAME || p->rr[i].type == DNS_TYPE_NS) {
+            dns_name_iter_init(&it, p->msg, p->total_len, p->rr[i].rdata);
+            while (dns_name_next(&it, &label) == 1)
+                bytes += label.len;
+        }
+    }
+    return bytes;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const int expect_malformed[] = { 0, 0, 0, 1 };
+    static const uint16_t expect_rr[] = { 1, 9, 2, 1 };
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000000;
+    message msgs[4];
+    int count = build(msgs);
+    volatile size_t sink = 0;
+    dns_packet p;
+    double t0, t1;
+
+    for (int i = 0; i < count; i++) {
+        if (parse_dns_packet(msgs[i].data, msgs[i].len, &p) != 0
+            || p.malformed != expect_malformed[i] || p.nrr != expect_rr[i]) {
+            fprintf(stderr, "message %d: malformed %d, %u records\n", i, p.malformed, p.nrr);
+            return 1;
+        }
+    }
+    if (parse_dns_packet(msgs[1].data, msgs[1].len, &p) != 0 || !p.edns || p.udp_size != 1232 || !p.dnssec_ok) {
+        fprintf(stderr, "EDNS0 not decoded\n");
+        return 1;
+    }
+
+    t0 = now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            parse_dns_packet(msgs[i].data, msgs[i].len, &p);
+            sink += walk(&p);
+        }
+    }
+    t1 = now();
+    printf("%d messages, %d rounds: %.1f ns/msg, %.2f M messages/s\n", count, rounds,
+           (t1 - t0) * 1e9 / ((double)rounds * count), (double)rounds * count / (t1 - t0) / 1e6);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Certificate parser test: x509_parse() on certificates built here, whose
+ * common names and DNS names hold bytes that aren't printable ASCII.
+ *
+ *   gcc -O2 -Iinclude -I../libnetpcap/include test/x509_test.c src/parsers/x509_parser.c -o x509_test
+ *   ./x509_test
+ *
+ * A NUL inside a name ("www.bank.com\0.evil.com", the null prefix attack)
+ * must not cut it short, and control bytes must not reach the terminal:
+ * both come out as \xNN, a backslash too so that the escape can't be
+ * forged. Exits 1 if any name doesn't come out as expected.
+ */
+#include "x509.h"
+#include <stdio.h>
+#include <string.h>
+
+#define UTF8_STRING     0x0c
+#define BMP_STRING      0x1e
+
+typedef struct {
+    unsigned char data[2048];
+    size_t len;
+} der;
+
+typedef struct {
+    const char *what;
+    unsigned char tag;          // Of the common name
+    const char *cn;
+    size_t cn_len;
+    const char *san;            // dNSName, NULL for none
+    size_t san_len;
+    const char *want_cn;
+    const char *want_san;
+}               cert_case;
+
+static const cert_case cases[] = {
+    { "plain name", UTF8_STRING, "example.com", 11, "example.com", 11,
+      "example.com", "example.com" },
+    { "NUL in the name", UTF8_STRING, "www.bank.com\0.evil.com", 22, "www.bank.com\0.evil.com", 22,
+      "www.bank.com\\x00.evil.com", "www.bank.com\\x00.evil.com" },
+    { "escape sequence", UTF8_STRING, "\x1b[2Jred", 7, "a\x07.example", 10,
+      "\\x1b[2Jred", "a\\x07.example" },
+    { "backslash", UTF8_STRING, "a\\x00b", 6, NULL, 0,
+      "a\\x5cx00b", "" },
+    { "non-ASCII byte", UTF8_STRING, "caf\xc3\xa9", 5, NULL, 0,
+      "caf\\xc3\\xa9", "" },
+    { "BMPString NUL", BMP_STRING, "\0a\0\0\0b", 6, NULL, 0,
+      "a\\x00b", "" },
+};
+
+static void put(der *d, const void *p, size_t len)
+{
+    memcpy(d->data + d->len, p, len);
+    d->len += len;
+}
+
+// Appends a TLV of `tag` holding `len` bytes of `p`
+static void tlv(der *d, unsigned char tag, const void *p, size_t len)
+{
+    unsigned char head[4] = { tag };
+    size_t n = 2;
+
+    if (len < 0x80)
+    {
+        head[1] = (unsigned char)len;
+    }
+    else if (len < 0x100)
+    {
+        head[1] = 0x81;
+        head[2] = (unsigned char)len;
+        n = 3;
+    }
+    else
+    {
+        head[1] = 0x82;
+        head[2] = (unsigned char)(len >> 8);
+        head[3] = (unsigned char)len;
+        n = 4;
+    }
+    put(d, head, n);
+    put(d, p, len);
+}
+
+static void wrap(der *outer, unsigned char tag, const der *inner)
+{
+    tlv(outer, tag, inner->data, inner->len);
+}
+
+// Name with one RDN: CN=cn
+static void name(der *d, unsigned char tag, const char *cn, size_t len)
+{
+    static const unsigned char oid_cn[] = { 0x55, 0x04, 0x03 };
+    der atv = {0}, rdn = {0}, seq = {0};
+
+    tlv(&atv, 0x06, oid_cn, sizeof(oid_cn));
+    tlv(&atv, tag, cn, len);
+    wrap(&rdn, 0x30, &atv);
+    wrap(&seq, 0x31, &rdn);
+    wrap(d, 0x30, &seq);
+}
+
+static void certificate(der *cert, const cert_case *c)
+{
+    static const unsigned char version[] = { 0x02, 0x01, 0x02 };
+    static const unsigned char serial[] = { 0x01 };
+    static const unsigned char sha256_rsa[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b };
+    static const unsigned char oid_ec[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01 };
+    static const unsigned char oid_p256[] = { 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+    static const unsigned char oid_san[] = { 0x55, 0x1d, 0x11 };
+    unsigned char key[66] = { 0x00, 0x04 };
+    der tbs = {0}, alg = {0}, validity = {0}, spki = {0}, keyalg = {0};
+    der names = {0}, san = {0}, octets = {0}, ext = {0}, exts = {0}, tagged = {0}, body = {0};
+
+    cert->len = 0;
+    tlv(&tbs, 0xa0, version, sizeof(version));
+    tlv(&tbs, 0x02, serial, sizeof(serial));
+    tlv(&alg, 0x06, sha256_rsa, sizeof(sha256_rsa));
+    wrap(&tbs, 0x30, &alg);
+    name(&tbs, UTF8_STRING, "Test CA", 7);
+    tlv(&validity, 0x17, "250101000000Z", 13);
+    tlv(&validity, 0x17, "350101000000Z", 13);
+    wrap(&tbs, 0x30, &validity);
+    name(&tbs, c->tag, c->cn, c->cn_len);
+    tlv(&keyalg, 0x06, oid_ec, sizeof(oid_ec));
+    tlv(&keyalg, 0x06, oid_p256, sizeof(oid_p256));
+    wrap(&spki, 0x30, &keyalg);
+    tlv(&spki, 0x03, key, sizeof(key));
+    wrap(&tbs, 0x30, &spki);
+    if (c->san)
+    {
+        tlv(&names, 0x82, c->san, c->san_len);
+        wrap(&san, 0x30, &names);
+        tlv(&ext, 0x06, oid_san, sizeof(oid_san));
+        wrap(&octets, 0x04, &san);
+        put(&ext, octets.data, octets.len);
+        wrap(&exts, 0x30, &ext);
+        wrap(&tagged, 0x30, &exts);
+        wrap(&tbs, 0xa3, &tagged);
+    }
+
+    wrap(&body, 0x30, &tbs);
+    wrap(&body, 0x30, &alg);
+    tlv(&body, 0x03, "\0", 1);
+    wrap(cert, 0x30, &body);
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const cert_case *c = &cases[i];
+        char subject[X509_NAME_MAX];
+        x509_cert out;
+        der cert;
+
+        certificate(&cert, c);
+        if (x509_parse(cert.data, cert.len, &out) == -1)
+        {
+            fprintf(stderr, "%s: not parsed\n", c->what);
+            failed = 1;
+            continue;
+        }
+        snprintf(subject, sizeof(subject), "CN=%s", c->want_cn);
+        if (strcmp(out.cn, c->want_cn) != 0 || strcmp(out.subject, subject) != 0
+            || strcmp(out.san, c->want_san) != 0 || strcmp(out.key, "ec-p256") != 0)
+        {
+            fprintf(stderr, "%s: cn \"%s\" subject \"%s\" san \"%s\" key %s\n",
+                    c->what, out.cn, out.subject, out.san, out.key);
+            failed = 1;
+        }
+    }
+    if (!failed)
+        printf("%zu certificates passed\n", sizeof(cases) / sizeof(cases[0]));
+    return failed;
+}
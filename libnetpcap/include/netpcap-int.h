@@ -0,0 +1,123 @@
+#ifndef _NETPCAP_INT_H_
+#define _NETPCAP_INT_H_
+
+#include "netpcap.h"
+#include <stddef.h>
+
+// syscall
+// https://chromium.googlesource.com/chromiumos/docs/+/master/constants/syscalls.md
+#define NET_bpf 321
+
+/***********************************|
+|              STRUCTS              |
+|__________________________________*/
+
+// One AF_XDP ring (/src/xdp.c).
+// The producer and consumer indexes live in memory shared with the kernel,
+// the cached copies avoid touching that cache line on every packet.
+struct xdp_uring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;                    // uint64_t frame addresses or struct xdp_desc
+    uint32_t mask;
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    void *map;
+    size_t map_len;
+};
+
+// Interface of a pcapng section (/src/savefile.c)
+struct netpcap_iface {
+    int linktype;
+    uint64_t ts_units;              // Timestamp units per second
+    int64_t ts_offset;              // Seconds added to every timestamp
+};
+
+// Filter compiler instruction (/src/gencode.c, /src/optimize.c).
+// Like struct bpf_insn, except that jumps hold absolute instruction indexes
+// (jt for BPF_JA too) so the optimizer can retarget them freely.
+struct bpf_ir {
+    uint16_t code;
+    uint32_t k;
+    int jt;
+    int jf;
+    int dead;                       // Removed by the optimizer
+};
+
+// Capture handle (netpcap_t).
+// Each backend fills in the *_op callbacks when the handle is activated,
+// the public netpcap_* functions only dispatch through them.
+struct netpcap_handle {
+    int fd;                         // Capture socket
+    int ifindex;                    // Bound interface (0 = all interfaces)
+    int snaplen;                    // Max bytes reported per packet
+    int linktype;                   // DLT_* of the captured frames
+    int timeout_ms;                 // Max time a dispatch call waits for packets
+    volatile int break_loop;        // Set by netpcap_breakloop()
+    int vlan_meta;                  // Kernel filters see the outer VLAN tag in skb metadata
+    netpcap_filter *filter;         // Userspace filter, for backends without a kernel one
+
+    int (*dispatch_op)(struct netpcap_handle *, int, pcap_handler, unsigned char *);
+    int (*stats_op)(struct netpcap_handle *, struct netpcap_stat *);
+    int (*setfilter_op)(struct netpcap_handle *, struct bpf_program *);
+    void (*cleanup_op)(struct netpcap_handle *);
+
+    // TPACKET_V3 RX ring (/src/ring.c)
+    unsigned char *map;             // mmap'd ring, or savefile
+    size_t map_len;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int cur_block;         // Block being walked
+    unsigned int pkts_left;         // Packets of cur_block not yet delivered
+    unsigned char *next_pkt;        // Next tpacket3_hdr in cur_block
+    unsigned int consumed;          // Walked blocks not yet handed back to the kernel
+    int lo_ifindex;                 // Loopback interface, its outgoing copies are skipped
+    unsigned int skipped;           // Frames skipped since the last stats read
+
+    // AF_XDP socket (/src/xdp.c)
+    unsigned char *umem;            // Packet buffers shared with the kernel
+    size_t umem_len;
+    unsigned int frame_size;
+    unsigned int frame_count;
+    struct xdp_uring fill;          // Free frames given to the kernel
+    struct xdp_uring comp;          // TX completions (unused, required by bind)
+    struct xdp_uring rx;            // Received packets
+    uint64_t *pending;              // Frames of the last burst, refilled on the next call
+    unsigned int npending;
+    int prog_fd;                    // XDP redirect program
+    int map_fd;                     // XSKMAP: RX queue -> socket
+    int link_fd;                    // Program attachment, detached on close
+
+    // Savefile (/src/savefile.c)
+    size_t file_off;                // Next record in `map`
+    int file_eof;                   // Every record has been read
+    int file_swapped;               // Written with the other byte order
+    int file_nsec;                  // Classic pcap with nanosecond timestamps
+    struct netpcap_iface *ifaces;   // pcapng: interfaces of the current section
+    unsigned int iface_count;
+
+    struct netpcap_stat stats;      // Cumulative counters
+    char errbuf[NETPCAP_ERRBUF_SIZE];
+};
+
+/***********************************|
+|            PROTOTYPES             |
+|__________________________________*/
+
+// /src/bpf_filter.c
+int filter_install(netpcap_t *p, const struct bpf_program *fp);
+
+// /src/netpcap.c
+netpcap_t *netpcap_alloc(const char *device, int snaplen, char *errbuf);
+
+// /src/optimize.c
+void bpf_optimize(struct bpf_ir *ir, int n);
+
+// /src/ring.c
+int ring_activate(netpcap_t *p, int promisc, const netpcap_ring_opts *opts);
+
+// /src/xdp.c
+int xdp_activate(netpcap_t *p, const netpcap_xdp_opts *opts);
+
+#endif // _NETPCAP_INT_H_
@@ -42,8 +42,13 @@ typedef struct _ifaddrs {
 // Forward declarations
 struct netpcap_handle;              // Opaque handle for capturing (similar to pcap_t)
 typedef struct netpcap_handle netpcap_t;
+struct netpcap_filter;              // Validated BPF program ready to run in userspace
+typedef struct netpcap_filter netpcap_filter;
 
 // BPF-related types (reimplement if needed)
+// When libpcap's <pcap.h> is included first, its definitions are reused:
+// they have the same layout as the ones below.
+#ifndef lib_pcap_bpf_h
 typedef struct bpf_program {
     unsigned int bf_len;            // Number of instructions in the BPF program
     struct bpf_insn *bf_insns;      // Pointer to BPF instruction array
@@ -56,12 +61,11 @@ typedef struct bpf_insn {
     uint32_t k;                     // Generic operand (e.g., constant, offset)
 } bpf_insn;
 
-typedef void (*pcap_handler)(
-    unsigned char *user,            // User-defined pointer passed to callback
-    const struct pcap_pkthdr *h,    // Pointer to packet metadata (timestamp, length)
-    const unsigned char *bytes      // Pointer to raw packet data
-);
+#define DLT_NULL        0           // BSD loopback encapsulation
+#define DLT_EN10MB      1           // Ethernet (10Mb, 100Mb, 1000Mb, and up)
+#endif
 
+#ifndef lib_pcap_pcap_h
 // Packet header (metadata for a captured packet)
 struct pcap_pkthdr {
     struct timeval ts;              // Timestamp when packet was captured
@@ -69,6 +73,61 @@ struct pcap_pkthdr {
     uint32_t len;                   // Original length of the packet on the wire
 };
 
+typedef void (*pcap_handler)(
+    unsigned char *user,            // User-defined pointer passed to callback
+    const struct pcap_pkthdr *h,    // Pointer to packet metadata (timestamp, length)
+    const unsigned char *bytes      // Pointer to raw packet data
+);
+#endif
+
+#define NETPCAP_ERRBUF_SIZE     256
+#define NETPCAP_ERROR           -1  // Generic error, see netpcap_geterr()
+#define NETPCAP_ERROR_BREAK     -2  // Loop terminated by netpcap_breakloop()
+
+// Capture statistics
+struct netpcap_stat {
+    unsigned int ps_recv;           // Packets received by the socket, drops excluded
+    unsigned int ps_drop;           // Packets dropped because the ring was full
+    unsigned int ps_ifdrop;         // Packets dropped by the interface (unsupported, always 0)
+};
+
+// TPACKET_V3 RX ring geometry.
+// The kernel fills one block at a time and hands it to userspace when it is
+// full or when `frame_timeout_ms` expires, whichever comes first.
+typedef struct _netpcap_ring_opts {
+    unsigned int block_size;        // Bytes per block, a multiple of the page size
+    unsigned int block_count;       // Number of blocks in the ring
+    unsigned int frame_timeout_ms;  // Block retire timeout in milliseconds
+} netpcap_ring_opts;
+
+// PACKET_FANOUT modes: how packets are spread across the sockets of a group
+#define NETPCAP_FANOUT_HASH     0   // By flow hash: a flow always lands on the same socket
+#define NETPCAP_FANOUT_LB       1   // Round-robin
+#define NETPCAP_FANOUT_CPU      2   // By receiving CPU
+
+#define NETPCAP_RING_BLOCK_SIZE     (1U << 20)
+#define NETPCAP_RING_BLOCK_COUNT    32
+#define NETPCAP_RING_TIMEOUT_MS     100
+
+// AF_XDP socket geometry.
+// The UMEM is split in `frame_count` frames of `frame_size` bytes, each one
+// holding a single packet. The fill and RX rings have `frame_count` slots.
+typedef struct _netpcap_xdp_opts {
+    unsigned int frame_size;        // Power of two, from 2048 to the page size
+    unsigned int frame_count;       // Power of two
+    unsigned int queue_id;          // NIC RX queue the socket is bound to
+    int mode;                       // NETPCAP_XDP_SKB or NETPCAP_XDP_DRV
+    int timeout_ms;                 // Max time a dispatch call waits for packets
+} netpcap_xdp_opts;
+
+// Where the XDP program runs
+#define NETPCAP_XDP_SKB         0   // Generic mode: any interface (veth, lo...), packets copied
+#define NETPCAP_XDP_DRV         1   // Native mode: driver support needed, zero-copy when available
+
+#define NETPCAP_XDP_FRAME_SIZE      4096
+#define NETPCAP_XDP_FRAME_COUNT     4096
+#define NETPCAP_XDP_TIMEOUT_MS      100
+
 
 
 /***********************************|
@@ -85,17 +144,50 @@ netpcap_t *netpcap_open_live(const char *device, int snaplen, int promisc,
 int netpcap_datalink(netpcap_t *p);                                                // Get data link type (e.g., Ethernet)
 void netpcap_close(netpcap_t *p);                                                  // Close the capture handle
 
-int netpcap_compile(netpcap_t *p, struct bpf_program *fp, const char *str,
-                    int optimize, uint32_t netmask);                               // Compile a BPF filter string
-
 int netpcap_setfilter(netpcap_t *p, struct bpf_program *fp);                       // Apply compiled filter to capture
-void netpcap_freecode(struct bpf_program *fp);                                     // Free memory used by compiled BPF code
 
 int netpcap_lookupnet(const char *device, uint32_t *net,
                       uint32_t *mask, char *errbuf);                               // Get network address and netmask for device
 
+// Packets handed to the callback point straight into the capture ring.
+// They stay valid until the next call to netpcap_loop/netpcap_dispatch
+// on the same handle, so a caller may keep a whole burst and process it
+// after netpcap_dispatch() returns.
 int netpcap_loop(netpcap_t *p, int cnt, pcap_handler callback,
                  unsigned char *user);                                             // Capture packets in a loop and call callback
+int netpcap_dispatch(netpcap_t *p, int cnt, pcap_handler callback,
+                     unsigned char *user);                                         // Process at most cnt ready packets
+void netpcap_breakloop(netpcap_t *p);                                              // Make loop/dispatch return (signal safe)
+int netpcap_stats(netpcap_t *p, struct netpcap_stat *ps);                          // Cumulative receive/drop counters
+int netpcap_fileno(netpcap_t *p);                                                  // Underlying socket descriptor
+char *netpcap_geterr(netpcap_t *p);                                                // Last error on the handle
+
+// /src/bpf_filter.c
+// Savefile and AF_XDP handles run the program given to netpcap_setfilter()
+// with these before the callback sees the packet.
+netpcap_filter *netpcap_filter_prepare(const struct bpf_program *fp, char *errbuf);  // Validate and pre-decode a program
+uint32_t netpcap_filter_run(const netpcap_filter *f, const unsigned char *pkt,
+                            uint32_t wirelen, uint32_t caplen);                    // Bytes to keep, 0 if rejected
+void netpcap_filter_free(netpcap_filter *f);
+
+// /src/gencode.c
+int netpcap_compile(netpcap_t *p, struct bpf_program *fp, const char *str,
+                    int optimize, uint32_t netmask);                               // Compile a BPF filter string
+void netpcap_freecode(struct bpf_program *fp);                                     // Free memory used by compiled BPF code
+void netpcap_bpf_dump(const struct bpf_program *fp);                               // Print a program like `tcpdump -d`
+
+// /src/ring.c
+netpcap_t *netpcap_open_ring(const char *device, int snaplen, int promisc,
+                             const netpcap_ring_opts *opts, char *errbuf);         // Open a TPACKET_V3 capture with explicit ring geometry
+int netpcap_set_fanout(netpcap_t *p, uint16_t group_id, int mode);                 // Join a PACKET_FANOUT group
+
+// /src/savefile.c
+netpcap_t *netpcap_open_offline(const char *fname, char *errbuf);                  // Read a pcap or pcapng file
+
+// /src/xdp.c
+netpcap_t *netpcap_open_xdp(const char *device, int snaplen,
+                            const netpcap_xdp_opts *opts, char *errbuf);           // Open an AF_XDP capture on one RX queue
+
                                       // Free list allocated by getifaddrs
 int getifaddrs(ifaddrs **ifap);
 void freeifaddrs(ifaddrs *ifa);
@@ -0,0 +1,364 @@
+#include "netpcap-int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/filter.h>
+
+/*
+ * Userspace classic BPF.
+ *
+ * Savefiles and AF_XDP sockets have no kernel filter, so the program is run
+ * here on every record. netpcap_filter_prepare() validates it once and turns
+ * it into a pre-decoded form the interpreter can run without looking at
+ * opcode bits again:
+ *
+ *  - each instruction gets a dense opcode, dispatched with computed gotos
+ *    (one indirect jump per instruction, no switch bounds check);
+ *  - jump offsets become absolute indexes;
+ *  - a packet load followed by "jeq #k" becomes a single instruction, the
+ *    most frequent pair in compiled filters. The jeq is kept for the jumps
+ *    that land on it directly.
+ *
+ * Semantics are those of the kernel and of libpcap's bpf_filter(): a load
+ * outside the captured bytes or a division by zero rejects the packet.
+ * Ancillary (SKF_AD_*) loads only exist in the kernel and reject as well.
+ */
+
+enum {
+    OP_RET_K, OP_RET_A,
+    OP_LD_W_ABS, OP_LD_H_ABS, OP_LD_B_ABS,
+    OP_LD_W_IND, OP_LD_H_IND, OP_LD_B_IND,
+    OP_LD_LEN, OP_LD_IMM, OP_LD_MEM,
+    OP_LDX_IMM, OP_LDX_MEM, OP_LDX_LEN, OP_LDX_MSH,
+    OP_ST, OP_STX,
+    OP_ADD_K, OP_SUB_K, OP_MUL_K, OP_DIV_K, OP_MOD_K, OP_AND_K, OP_OR_K, OP_XOR_K, OP_LSH_K, OP_RSH_K,
+    OP_ADD_X, OP_SUB_X, OP_MUL_X, OP_DIV_X, OP_MOD_X, OP_AND_X, OP_OR_X, OP_XOR_X, OP_LSH_X, OP_RSH_X,
+    OP_NEG,
+    OP_JA,
+    OP_JEQ_K, OP_JGT_K, OP_JGE_K, OP_JSET_K,
+    OP_JEQ_X, OP_JGT_X, OP_JGE_X, OP_JSET_X,
+    OP_TAX, OP_TXA,
+    // Load, then jeq #k2
+    OP_LD_W_ABS_JEQ, OP_LD_H_ABS_JEQ, OP_LD_B_ABS_JEQ, OP_LD_H_IND_JEQ,
+    OP_COUNT
+};
+
+// Pre-decoded instruction
+struct filter_op {
+    uint32_t op;
+    uint32_t k;
+    uint32_t k2;                    // Fused jeq constant
+    uint32_t jt;                    // Absolute indexes
+    uint32_t jf;
+};
+
+struct netpcap_filter {
+    unsigned int len;
+    int uses_mem;                   // Scratch memory must start zeroed
+    struct filter_op ops[];
+};
+
+static int decode_op(const struct bpf_insn *in)
+{
+    int src_x = BPF_SRC(in->code) == BPF_X;
+
+    switch (BPF_CLASS(in->code)) {
+    case BPF_RET:
+        if (BPF_RVAL(in->code) == BPF_K)
+            return OP_RET_K;
+        return BPF_RVAL(in->code) == BPF_A ? OP_RET_A : -1;
+
+    case BPF_LD:
+        switch (BPF_MODE(in->code)) {
+        case BPF_ABS:
+        case BPF_IND: {
+            int base = BPF_MODE(in->code) == BPF_ABS ? OP_LD_W_ABS : OP_LD_W_IND;
+            switch (BPF_SIZE(in->code)) {
+            case BPF_W: return base;
+            case BPF_H: return base + 1;
+            case BPF_B: return base + 2;
+            }
+            return -1;
+        }
+        case BPF_LEN: return OP_LD_LEN;
+        case BPF_IMM: return OP_LD_IMM;
+        case BPF_MEM: return in->k < BPF_MEMWORDS ? OP_LD_MEM : -1;
+        }
+        return -1;
+
+    case BPF_LDX:
+        switch (BPF_MODE(in->code)) {
+        case BPF_IMM: return OP_LDX_IMM;
+        case BPF_MEM: return in->k < BPF_MEMWORDS ? OP_LDX_MEM : -1;
+        case BPF_LEN: return OP_LDX_LEN;
+        case BPF_MSH: return BPF_SIZE(in->code) == BPF_B ? OP_LDX_MSH : -1;
+        }
+        return -1;
+
+    case BPF_ST:
+        return in->k < BPF_MEMWORDS ? OP_ST : -1;
+    case BPF_STX:
+        return in->k < BPF_MEMWORDS ? OP_STX : -1;
+
+    case BPF_ALU:
+        if (!src_x && (BPF_OP(in->code) == BPF_DIV || BPF_OP(in->code) == BPF_MOD) && in->k == 0)
+            return -1;
+        switch (BPF_OP(in->code)) {
+        case BPF_ADD: return src_x ? OP_ADD_X : OP_ADD_K;
+        case BPF_SUB: return src_x ? OP_SUB_X : OP_SUB_K;
+        case BPF_MUL: return src_x ? OP_MUL_X : OP_MUL_K;
+        case BPF_DIV: return src_x ? OP_DIV_X : OP_DIV_K;
+        case BPF_MOD: return src_x ? OP_MOD_X : OP_MOD_K;
+        case BPF_AND: return src_x ? OP_AND_X : OP_AND_K;
+        case BPF_OR:  return src_x ? OP_OR_X : OP_OR_K;
+        case BPF_XOR: return src_x ? OP_XOR_X : OP_XOR_K;
+        case BPF_LSH: return src_x ? OP_LSH_X : OP_LSH_K;
+        case BPF_RSH: return src_x ? OP_RSH_X : OP_RSH_K;
+        case BPF_NEG: return OP_NEG;
+        }
+        return -1;
+
+    case BPF_JMP:
+        switch (BPF_OP(in->code)) {
+        case BPF_JA:   return OP_JA;
+        case BPF_JEQ:  return src_x ? OP_JEQ_X : OP_JEQ_K;
+        case BPF_JGT:  return src_x ? OP_JGT_X : OP_JGT_K;
+        case BPF_JGE:  return src_x ? OP_JGE_X : OP_JGE_K;
+        case BPF_JSET: return src_x ? OP_JSET_X : OP_JSET_K;
+        }
+        return -1;
+
+    case BPF_MISC:
+        if (BPF_MISCOP(in->code) == BPF_TAX)
+            return OP_TAX;
+        return BPF_MISCOP(in->code) == BPF_TXA ? OP_TXA : -1;
+    }
+    return -1;
+}
+
+static int fused_op(int op)
+{
+    switch (op) {
+    case OP_LD_W_ABS: return OP_LD_W_ABS_JEQ;
+    case OP_LD_H_ABS: return OP_LD_H_ABS_JEQ;
+    case OP_LD_B_ABS: return OP_LD_B_ABS_JEQ;
+    case OP_LD_H_IND: return OP_LD_H_IND_JEQ;
+    }
+    return -1;
+}
+
+/*
+ * Validate `fp` and build its pre-decoded form. Like the kernel, only
+ * programs whose every path ends on a ret are accepted: jumps go forward
+ * and stay inside the program, and the last instruction is a ret.
+ */
+netpcap_filter *netpcap_filter_prepare(const struct bpf_program *fp, char *errbuf)
+{
+    unsigned int len = fp->bf_len;
+    netpcap_filter *f;
+
+    if (len == 0 || len > BPF_MAXINSNS || !fp->bf_insns) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "Invalid BPF program length %u", len);
+        return NULL;
+    }
+    if (BPF_CLASS(fp->bf_insns[len - 1].code) != BPF_RET) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "BPF program doesn't end with a ret");
+        return NULL;
+    }
+
+    f = malloc(sizeof(*f) + len * sizeof(struct filter_op));
+    if (!f) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "Out of memory");
+        return NULL;
+    }
+    f->len = len;
+    f->uses_mem = 0;
+
+    for (unsigned int i = 0; i < len; i++) {
+        const struct bpf_insn *in = &fp->bf_insns[i];
+        struct filter_op *op = &f->ops[i];
+        int code = decode_op(in);
+
+        if (code == -1) {
+            snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "Invalid BPF instruction %u (code 0x%04x)", i, in->code);
+            free(f);
+            return NULL;
+        }
+
+        op->op = code;
+        op->k = in->k;
+        op->k2 = 0;
+        op->jt = op->jf = 0;
+
+        if (BPF_CLASS(in->code) == BPF_JMP
+            && (code == OP_JA ? (uint64_t)i + 1 + in->k >= len
+                              : i + 1 + in->jt >= len || i + 1 + in->jf >= len)) {
+            snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "BPF jump out of range at instruction %u", i);
+            free(f);
+            return NULL;
+        }
+        if (code == OP_JA) {
+            op->jt = i + 1 + in->k;
+        } else if (BPF_CLASS(in->code) == BPF_JMP) {
+            op->jt = i + 1 + in->jt;
+            op->jf = i + 1 + in->jf;
+        }
+        if (code == OP_LD_MEM || code == OP_LDX_MEM)
+            f->uses_mem = 1;
+    }
+
+    // Fuse load + jeq. The load stays valid on its own if it is not fused.
+    for (unsigned int i = 0; i + 1 < len; i++) {
+        struct filter_op *op = &f->ops[i];
+        const struct filter_op *next = &f->ops[i + 1];
+        int fused = fused_op(op->op);
+
+        if (fused == -1 || next->op != OP_JEQ_K)
+            continue;
+        op->op = fused;
+        op->k2 = next->k;
+        op->jt = next->jt;
+        op->jf = next->jf;
+    }
+    return f;
+}
+
+void netpcap_filter_free(netpcap_filter *f)
+{
+    free(f);
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint32_t get16(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+/*
+ * Run `f` on a packet. Returns the number of bytes to keep, 0 when the
+ * packet is rejected.
+ */
+uint32_t netpcap_filter_run(const netpcap_filter *f, const unsigned char *pkt,
+                            uint32_t wirelen, uint32_t caplen)
+{
+    static const void *const dispatch[OP_COUNT] = {
+        [OP_RET_K] = &&ret_k,           [OP_RET_A] = &&ret_a,
+        [OP_LD_W_ABS] = &&ld_w_abs,     [OP_LD_H_ABS] = &&ld_h_abs,     [OP_LD_B_ABS] = &&ld_b_abs,
+        [OP_LD_W_IND] = &&ld_w_ind,     [OP_LD_H_IND] = &&ld_h_ind,     [OP_LD_B_IND] = &&ld_b_ind,
+        [OP_LD_LEN] = &&ld_len,         [OP_LD_IMM] = &&ld_imm,         [OP_LD_MEM] = &&ld_mem,
+        [OP_LDX_IMM] = &&ldx_imm,       [OP_LDX_MEM] = &&ldx_mem,
+        [OP_LDX_LEN] = &&ldx_len,       [OP_LDX_MSH] = &&ldx_msh,
+        [OP_ST] = &&st,                 [OP_STX] = &&stx,
+        [OP_ADD_K] = &&add_k,   [OP_SUB_K] = &&sub_k,   [OP_MUL_K] = &&mul_k,   [OP_DIV_K] = &&div_k,
+        [OP_MOD_K] = &&mod_k,   [OP_AND_K] = &&and_k,   [OP_OR_K] = &&or_k,     [OP_XOR_K] = &&xor_k,
+        [OP_LSH_K] = &&lsh_k,   [OP_RSH_K] = &&rsh_k,
+        [OP_ADD_X] = &&add_x,   [OP_SUB_X] = &&sub_x,   [OP_MUL_X] = &&mul_x,   [OP_DIV_X] = &&div_x,
+        [OP_MOD_X] = &&mod_x,   [OP_AND_X] = &&and_x,   [OP_OR_X] = &&or_x,     [OP_XOR_X] = &&xor_x,
+        [OP_LSH_X] = &&lsh_x,   [OP_RSH_X] = &&rsh_x,
+        [OP_NEG] = &&neg,
+        [OP_JA] = &&ja,
+        [OP_JEQ_K] = &&jeq_k,   [OP_JGT_K] = &&jgt_k,   [OP_JGE_K] = &&jge_k,   [OP_JSET_K] = &&jset_k,
+        [OP_JEQ_X] = &&jeq_x,   [OP_JGT_X] = &&jgt_x,   [OP_JGE_X] = &&jge_x,   [OP_JSET_X] = &&jset_x,
+        [OP_TAX] = &&tax,       [OP_TXA] = &&txa,
+        [OP_LD_W_ABS_JEQ] = &&ld_w_abs_jeq,     [OP_LD_H_ABS_JEQ] = &&ld_h_abs_jeq,
+        [OP_LD_B_ABS_JEQ] = &&ld_b_abs_jeq,     [OP_LD_H_IND_JEQ] = &&ld_h_ind_jeq,
+    };
+    const struct filter_op *ops = f->ops;
+    const struct filter_op *op = ops;
+    uint32_t A = 0, X = 0;
+    uint32_t mem[BPF_MEMWORDS];
+    uint64_t off;
+
+#define NEXT()      goto *dispatch[(++op)->op]
+#define GOTO(i)     do { op = ops + (i); goto *dispatch[op->op]; } while (0)
+#define BRANCH(c)   GOTO((c) ? op->jt : op->jf)
+// X + k wraps around like in bpf_filter(), the bound check itself can't
+#define CHECK(o, n) do { if ((o) + (n) > caplen) return 0; } while (0)
+
+    if (f->uses_mem)
+        memset(mem, 0, sizeof(mem));
+    goto *dispatch[op->op];
+
+ret_k:      return op->k;
+ret_a:      return A;
+
+ld_w_abs:   off = op->k; CHECK(off, 4); A = get32(pkt + off); NEXT();
+ld_h_abs:   off = op->k; CHECK(off, 2); A = get16(pkt + off); NEXT();
+ld_b_abs:   off = op->k; CHECK(off, 1); A = pkt[off]; NEXT();
+ld_w_ind:   off = (uint32_t)(X + op->k); CHECK(off, 4); A = get32(pkt + off); NEXT();
+ld_h_ind:   off = (uint32_t)(X + op->k); CHECK(off, 2); A = get16(pkt + off); NEXT();
+ld_b_ind:   off = (uint32_t)(X + op->k); CHECK(off, 1); A = pkt[off]; NEXT();
+ld_len:     A = wirelen; NEXT();
+ld_imm:     A = op->k; NEXT();
+ld_mem:     A = mem[op->k]; NEXT();
+
+ldx_imm:    X = op->k; NEXT();
+ldx_mem:    X = mem[op->k]; NEXT();
+ldx_len:    X = wirelen; NEXT();
+ldx_msh:    off = op->k; CHECK(off, 1); X = (pkt[off] & 0xf) << 2; NEXT();
+
+st:         mem[op->k] = A; NEXT();
+stx:        mem[op->k] = X; NEXT();
+
+add_k:      A += op->k; NEXT();
+sub_k:      A -= op->k; NEXT();
+mul_k:      A *= op->k; NEXT();
+div_k:      A /= op->k; NEXT();
+mod_k:      A %= op->k; NEXT();
+and_k:      A &= op->k; NEXT();
+or_k:       A |= op->k; NEXT();
+xor_k:      A ^= op->k; NEXT();
+lsh_k:      A = op->k < 32 ? A << op->k : 0; NEXT();
+rsh_k:      A = op->k < 32 ? A >> op->k : 0; NEXT();
+add_x:      A += X; NEXT();
+sub_x:      A -= X; NEXT();
+mul_x:      A *= X; NEXT();
+div_x:      if (X == 0) return 0; A /= X; NEXT();
+mod_x:      if (X == 0) return 0; A %= X; NEXT();
+and_x:      A &= X; NEXT();
+or_x:       A |= X; NEXT();
+xor_x:      A ^= X; NEXT();
+lsh_x:      A = X < 32 ? A << X : 0; NEXT();
+rsh_x:      A = X < 32 ? A >> X : 0; NEXT();
+neg:        A = -A; NEXT();
+
+ja:         GOTO(op->jt);
+jeq_k:      BRANCH(A == op->k);
+jgt_k:      BRANCH(A > op->k);
+jge_k:      BRANCH(A >= op->k);
+jset_k:     BRANCH(A & op->k);
+jeq_x:      BRANCH(A == X);
+jgt_x:      BRANCH(A > X);
+jge_x:      BRANCH(A >= X);
+jset_x:     BRANCH(A & X);
+
+tax:        X = A; NEXT();
+txa:        A = X; NEXT();
+
+ld_w_abs_jeq:   off = op->k; CHECK(off, 4); A = get32(pkt + off); BRANCH(A == op->k2);
+ld_h_abs_jeq:   off = op->k; CHECK(off, 2); A = get16(pkt + off); BRANCH(A == op->k2);
+ld_b_abs_jeq:   off = op->k; CHECK(off, 1); A = pkt[off]; BRANCH(A == op->k2);
+ld_h_ind_jeq:   off = (uint32_t)(X + op->k); CHECK(off, 2); A = get16(pkt + off); BRANCH(A == op->k2);
+
+#undef NEXT
+#undef GOTO
+#undef BRANCH
+#undef CHECK
+}
+
+// setfilter_op of the backends without a kernel filter
+int filter_install(netpcap_t *p, const struct bpf_program *fp)
+{
+    netpcap_filter *f = netpcap_filter_prepare(fp, p->errbuf);
+
+    if (!f)
+        return -1;
+    netpcap_filter_free(p->filter);
+    p->filter = f;
+    return 0;
+}
@@ -0,0 +1,797 @@
+#include "netpcap-int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+/*
+ * Filter expression compiler.
+ *
+ * Turns the tcpdump-style expressions Netshark uses into classic BPF:
+ *
+ *   expr      := term { ("or" | "||") term }
+ *   term      := factor { ("and" | "&&") factor }
+ *   factor    := ("not" | "!") factor | "(" expr ")" | primitive
+ *   primitive := "vlan" [id]
+ *              | proto
+ *              | [proto] [src | dst] (host | net | port | portrange | proto) id
+ *              | id                    (previous qualifiers: "port 53 or 5353")
+ *   proto     := ip | ip6 | arp | tcp | udp | icmp
+ *
+ * Code is emitted left to right with the usual short-circuit scheme: each
+ * sub-expression leaves two lists of unresolved jumps, taken when it is true
+ * and when it is false, patched once the code that follows is known. Jump
+ * targets stay absolute instruction indexes until the program is laid out,
+ * so optimize.c can rewrite them freely.
+ *
+ * "vlan" shifts the offsets of everything to its right by the tag length.
+ * On a live AF_PACKET socket the kernel has already moved the outer tag to
+ * the skb metadata when the filter runs, so the first "vlan" is tested with
+ * the SKF_AD_VLAN_TAG* ancillary loads there and does not shift anything.
+ *
+ * see: https://www.tcpdump.org/manpages/pcap-filter.7.html
+ *      https://www.kernel.org/doc/html/latest/networking/filter.html
+ */
+
+#define ETHERTYPE_IP    0x0800
+#define ETHERTYPE_ARP   0x0806
+#define ETHERTYPE_VLAN  0x8100
+#define ETHERTYPE_QINQ  0x88a8
+#define ETHERTYPE_IPV6  0x86dd
+#define ETHER_HDRLEN    14
+#define VLAN_HDRLEN     4
+#define IPV6_HDRLEN     40
+#define NOMASK          0xffffffff
+
+enum { T_EOF, T_ID, T_LPAREN, T_RPAREN, T_AND, T_OR, T_NOT };
+
+// Qualifiers of a primitive
+enum { Q_DEFAULT, Q_IP, Q_IP6, Q_ARP, Q_TCP, Q_UDP, Q_ICMP };       // proto
+enum { Q_ANY, Q_SRC, Q_DST };                                       // dir
+enum { Q_NONE, Q_HOST, Q_NET, Q_PORT, Q_PORTRANGE, Q_PROTO };       // type
+
+static const char *proto_names[] = { "", "ip", "ip6", "arp", "tcp", "udp", "icmp", NULL };
+static const char *dir_names[] = { "", "src", "dst", NULL };
+static const char *type_names[] = { "", "host", "net", "port", "portrange", "proto", NULL };
+
+struct qual {
+    int proto;
+    int dir;
+    int type;
+};
+
+// Code of a sub-expression. `t` and `f` are the jumps leaving it when it is
+// true and when it is false, chained through their own jt/jf fields: a
+// link is the instruction index times two, plus one for jt; -1 ends it.
+struct block {
+    int start;                      // First instruction
+    int t;
+    int f;
+};
+
+struct compiler {
+    netpcap_t *p;
+    const char *in;                 // Next character of the expression
+    int tok;
+    char text[64];                  // Text of a T_ID token
+
+    struct bpf_ir *ir;
+    int n;
+    int cap;
+
+    unsigned int nl;                // Network header offset, grows with "vlan"
+    int vlan_meta;                  // Next "vlan" reads the tag from skb metadata
+    struct qual last;               // Qualifiers reused by a bare id
+    jmp_buf err;
+};
+
+static void cc_error(struct compiler *c, const char *fmt, ...) __attribute__((noreturn, format(printf, 2, 3)));
+
+static void cc_error(struct compiler *c, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(c->p->errbuf, sizeof(c->p->errbuf), fmt, ap);
+    va_end(ap);
+    longjmp(c->err, 1);
+}
+
+/*** Lexer ***/
+
+static int is_idchar(int ch)
+{
+    return isalnum(ch) || ch == '.' || ch == '-' || ch == '_' || ch == ':' || ch == '/';
+}
+
+static void next(struct compiler *c)
+{
+    const char *s = c->in;
+    size_t len = 0;
+
+    while (isspace((unsigned char)*s))
+        s++;
+
+    c->text[0] = '\0';
+    if (*s == '\0') {
+        c->tok = T_EOF;
+    } else if (*s == '(' || *s == ')' || *s == '!') {
+        c->tok = *s == '(' ? T_LPAREN : *s == ')' ? T_RPAREN : T_NOT;
+        s++;
+    } else if ((s[0] == '&' && s[1] == '&') || (s[0] == '|' && s[1] == '|')) {
+        c->tok = s[0] == '&' ? T_AND : T_OR;
+        s += 2;
+    } else if (is_idchar((unsigned char)*s)) {
+        while (is_idchar((unsigned char)s[len]))
+            len++;
+        if (len >= sizeof(c->text))
+            cc_error(c, "'%.*s...' is too long", 16, s);
+        memcpy(c->text, s, len);
+        c->text[len] = '\0';
+        s += len;
+
+        if (strcmp(c->text, "and") == 0)
+            c->tok = T_AND;
+        else if (strcmp(c->text, "or") == 0)
+            c->tok = T_OR;
+        else if (strcmp(c->text, "not") == 0)
+            c->tok = T_NOT;
+        else
+            c->tok = T_ID;
+    } else {
+        cc_error(c, "Unexpected character '%c'", *s);
+    }
+    c->in = s;
+}
+
+static int keyword(const char **names, const char *text)
+{
+    for (int i = 1; names[i]; i++)
+        if (strcmp(names[i], text) == 0)
+            return i;
+    return -1;
+}
+
+static uint32_t parse_num(struct compiler *c, const char *text, uint32_t max)
+{
+    char *end;
+    unsigned long v;
+
+    if (!isdigit((unsigned char)text[0]))
+        cc_error(c, "'%s' is not a number", text);
+    v = strtoul(text, &end, 10);
+    if (*end != '\0' || v > max)
+        cc_error(c, "Invalid value '%s'", text);
+    return (uint32_t)v;
+}
+
+static uint32_t parse_addr(struct compiler *c, const char *text)
+{
+    struct in_addr a;
+
+    if (inet_pton(AF_INET, text, &a) != 1)
+        cc_error(c, "'%s' is not an IPv4 address", text);
+    return ntohl(a.s_addr);
+}
+
+static uint32_t parse_port(struct compiler *c, const char *text, int proto)
+{
+    struct servent *se;
+
+    if (isdigit((unsigned char)text[0]))
+        return parse_num(c, text, 65535);
+
+    se = getservbyname(text, proto == Q_TCP ? "tcp" : proto == Q_UDP ? "udp" : NULL);
+    if (!se)
+        cc_error(c, "Unknown port '%s'", text);
+    return ntohs((uint16_t)se->s_port);
+}
+
+/*** Code generation ***/
+
+static int emit(struct compiler *c, uint16_t code, uint32_t k)
+{
+    if (c->n == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 64;
+        struct bpf_ir *ir = realloc(c->ir, cap * sizeof(*ir));
+        if (!ir)
+            cc_error(c, "Out of memory");
+        c->ir = ir;
+        c->cap = cap;
+    }
+    c->ir[c->n] = (struct bpf_ir){ .code = code, .k = k, .jt = -1, .jf = -1 };
+    return c->n++;
+}
+
+static int *link_slot(struct compiler *c, int link)
+{
+    return (link & 1) ? &c->ir[link >> 1].jt : &c->ir[link >> 1].jf;
+}
+
+// Point every jump of `list` at `target`
+static void patch(struct compiler *c, int list, int target)
+{
+    while (list != -1) {
+        int *slot = link_slot(c, list);
+        list = *slot;
+        *slot = target;
+    }
+}
+
+static int merge(struct compiler *c, int a, int b)
+{
+    int link = a;
+
+    if (a == -1)
+        return b;
+    for (;;) {
+        int *slot = link_slot(c, link);
+        if (*slot == -1) {
+            *slot = b;
+            return a;
+        }
+        link = *slot;
+    }
+}
+
+// `b` must have been emitted right after `a`
+static struct block gen_and(struct compiler *c, struct block a, struct block b)
+{
+    patch(c, a.t, b.start);
+    return (struct block){ a.start, b.t, merge(c, a.f, b.f) };
+}
+
+static struct block gen_or(struct compiler *c, struct block a, struct block b)
+{
+    patch(c, a.f, b.start);
+    return (struct block){ a.start, merge(c, a.t, b.t), b.f };
+}
+
+static struct block gen_not(struct block a)
+{
+    return (struct block){ a.start, a.f, a.t };
+}
+
+// A = packet[off] (& mask); test A against k
+static struct block gen_cmp(struct compiler *c, uint16_t size_mode, uint32_t off,
+                            uint32_t mask, uint16_t op, uint32_t k)
+{
+    int start = emit(c, BPF_LD | size_mode, off);
+    int j;
+
+    if (mask != NOMASK)
+        emit(c, BPF_ALU | BPF_AND | BPF_K, mask);
+    j = emit(c, BPF_JMP | op | BPF_K, k);
+    return (struct block){ start, j * 2 + 1, j * 2 };
+}
+
+static struct block gen_linktype(struct compiler *c, uint16_t type)
+{
+    return gen_cmp(c, BPF_H | BPF_ABS, c->nl - 2, NOMASK, BPF_JEQ, type);
+}
+
+static struct block gen_ipproto(struct compiler *c, int v6, uint32_t proto)
+{
+    struct block b = gen_linktype(c, v6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP);
+    struct block b2 = gen_cmp(c, BPF_B | BPF_ABS, c->nl + (v6 ? 6 : 9), NOMASK, BPF_JEQ, proto);
+
+    return gen_and(c, b, b2);
+}
+
+static struct block gen_proto(struct compiler *c, int proto)
+{
+    struct block b, b2;
+
+    switch (proto) {
+    case Q_IP:
+        return gen_linktype(c, ETHERTYPE_IP);
+    case Q_IP6:
+        return gen_linktype(c, ETHERTYPE_IPV6);
+    case Q_ARP:
+        return gen_linktype(c, ETHERTYPE_ARP);
+    case Q_ICMP:
+        return gen_ipproto(c, 0, IPPROTO_ICMP);
+    default:
+        b = gen_ipproto(c, 0, proto == Q_TCP ? IPPROTO_TCP : IPPROTO_UDP);
+        b2 = gen_ipproto(c, 1, proto == Q_TCP ? IPPROTO_TCP : IPPROTO_UDP);
+        return gen_or(c, b, b2);
+    }
+}
+
+// IPv4 source/destination address (ARP sender/target address) under `mask`
+static struct block gen_addr(struct compiler *c, int arp, int dir, uint32_t addr, uint32_t mask)
+{
+    uint32_t src = c->nl + (arp ? 14 : 12);
+    uint32_t dst = c->nl + (arp ? 24 : 16);
+    struct block b = gen_linktype(c, arp ? ETHERTYPE_ARP : ETHERTYPE_IP);
+    struct block b2, b3;
+
+    if (dir == Q_SRC || dir == Q_DST) {
+        b2 = gen_cmp(c, BPF_W | BPF_ABS, dir == Q_SRC ? src : dst, mask, BPF_JEQ, addr);
+    } else {
+        b2 = gen_cmp(c, BPF_W | BPF_ABS, src, mask, BPF_JEQ, addr);
+        b3 = gen_cmp(c, BPF_W | BPF_ABS, dst, mask, BPF_JEQ, addr);
+        b2 = gen_or(c, b2, b3);
+    }
+    return gen_and(c, b, b2);
+}
+
+static struct block gen_host(struct compiler *c, struct qual q, uint32_t addr, uint32_t mask)
+{
+    struct block b, b2;
+
+    switch (q.proto) {
+    case Q_IP:
+        return gen_addr(c, 0, q.dir, addr, mask);
+    case Q_ARP:
+        return gen_addr(c, 1, q.dir, addr, mask);
+    case Q_DEFAULT:
+        b = gen_addr(c, 0, q.dir, addr, mask);
+        b2 = gen_addr(c, 1, q.dir, addr, mask);
+        return gen_or(c, b, b2);
+    }
+    cc_error(c, "'%s' applied to %s", proto_names[q.proto], type_names[q.type]);
+}
+
+// Port (range) at `off`, X holding the IP header length for BPF_IND
+static struct block gen_portcmp(struct compiler *c, uint16_t mode, uint32_t off,
+                                uint32_t lo, uint32_t hi)
+{
+    struct block b, b2;
+
+    if (lo == hi)
+        return gen_cmp(c, BPF_H | mode, off, NOMASK, BPF_JEQ, lo);
+    b = gen_cmp(c, BPF_H | mode, off, NOMASK, BPF_JGE, lo);
+    b2 = gen_cmp(c, BPF_H | mode, off, NOMASK, BPF_JGT, hi);
+    return gen_and(c, b, gen_not(b2));
+}
+
+static struct block gen_ports(struct compiler *c, int v6, int dir, uint32_t lo, uint32_t hi)
+{
+    uint16_t mode = v6 ? BPF_ABS : BPF_IND;
+    uint32_t off = v6 ? c->nl + IPV6_HDRLEN : c->nl;
+    int start = c->n;
+    struct block b, b2;
+
+    if (!v6)
+        emit(c, BPF_LDX | BPF_B | BPF_MSH, c->nl);
+
+    if (dir == Q_SRC || dir == Q_DST) {
+        b = gen_portcmp(c, mode, dir == Q_SRC ? off : off + 2, lo, hi);
+    } else {
+        b = gen_portcmp(c, mode, off, lo, hi);
+        b2 = gen_portcmp(c, mode, off + 2, lo, hi);
+        b = gen_or(c, b, b2);
+    }
+    b.start = start;
+    return b;
+}
+
+// TCP and/or UDP over IPv4 or IPv6 (no extension headers)
+static struct block gen_l4(struct compiler *c, int v6, int proto)
+{
+    uint32_t off = c->nl + (v6 ? 6 : 9);
+    struct block b, b2, b3;
+
+    if (proto != Q_DEFAULT)
+        return gen_ipproto(c, v6, proto == Q_TCP ? IPPROTO_TCP : IPPROTO_UDP);
+    b = gen_linktype(c, v6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP);
+    b2 = gen_cmp(c, BPF_B | BPF_ABS, off, NOMASK, BPF_JEQ, IPPROTO_TCP);
+    b3 = gen_cmp(c, BPF_B | BPF_ABS, off, NOMASK, BPF_JEQ, IPPROTO_UDP);
+    return gen_and(c, b, gen_or(c, b2, b3));
+}
+
+static struct block gen_port(struct compiler *c, struct qual q, uint32_t lo, uint32_t hi)
+{
+    struct block v4, v6, b;
+
+    if (q.proto != Q_DEFAULT && q.proto != Q_TCP && q.proto != Q_UDP)
+        cc_error(c, "'%s' applied to %s", proto_names[q.proto], type_names[q.type]);
+
+    // Non-first IPv4 fragments carry no L4 header
+    v4 = gen_l4(c, 0, q.proto);
+    b = gen_cmp(c, BPF_H | BPF_ABS, c->nl + 6, NOMASK, BPF_JSET, 0x1fff);
+    v4 = gen_and(c, v4, gen_not(b));
+    b = gen_ports(c, 0, q.dir, lo, hi);
+    v4 = gen_and(c, v4, b);
+
+    v6 = gen_l4(c, 1, q.proto);
+    b = gen_ports(c, 1, q.dir, lo, hi);
+    v6 = gen_and(c, v6, b);
+
+    return gen_or(c, v4, v6);
+}
+
+static struct block gen_vlan(struct compiler *c, int id)
+{
+    struct block b, b2;
+
+    if (c->vlan_meta) {
+        c->vlan_meta = 0;
+        b = gen_cmp(c, BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT, NOMASK, BPF_JEQ, 1);
+        if (id < 0)
+            return b;
+        b2 = gen_cmp(c, BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG, 0x0fff, BPF_JEQ, id);
+        return gen_and(c, b, b2);
+    }
+
+    b = gen_linktype(c, ETHERTYPE_VLAN);
+    b2 = gen_linktype(c, ETHERTYPE_QINQ);
+    b = gen_or(c, b, b2);
+    if (id >= 0) {
+        b2 = gen_cmp(c, BPF_H | BPF_ABS, c->nl, 0x0fff, BPF_JEQ, id);
+        b = gen_and(c, b, b2);
+    }
+    c->nl += VLAN_HDRLEN;
+    return b;
+}
+
+/*** Parser ***/
+
+// Consumes the value token(s) of a qualified primitive
+static struct block gen_qualified(struct compiler *c, struct qual q)
+{
+    char value[sizeof(c->text)];
+    uint32_t addr, mask, lo, hi;
+    char *sep;
+    struct block b, b2;
+    int kw;
+
+    if (c->tok != T_ID)
+        cc_error(c, "Missing value after '%s'", type_names[q.type]);
+    memcpy(value, c->text, sizeof(value));
+    next(c);
+
+    switch (q.type) {
+    case Q_HOST:
+        return gen_host(c, q, parse_addr(c, value), NOMASK);
+
+    case Q_NET:
+        mask = NOMASK;
+        if ((sep = strchr(value, '/'))) {
+            *sep = '\0';
+            lo = parse_num(c, sep + 1, 32);
+            mask = lo ? NOMASK << (32 - lo) : 0;
+        } else if (c->tok == T_ID && strcmp(c->text, "mask") == 0) {
+            next(c);
+            if (c->tok != T_ID)
+                cc_error(c, "Missing netmask");
+            mask = parse_addr(c, c->text);
+            next(c);
+        }
+        addr = parse_addr(c, value);
+        if (addr & ~mask)
+            cc_error(c, "Non-network bits set in '%s'", value);
+        return gen_host(c, q, addr, mask);
+
+    case Q_PORT:
+        lo = parse_port(c, value, q.proto);
+        return gen_port(c, q, lo, lo);
+
+    case Q_PORTRANGE:
+        if (!(sep = strchr(value, '-')))
+            cc_error(c, "'%s' is not a port range", value);
+        *sep = '\0';
+        lo = parse_port(c, value, q.proto);
+        hi = parse_port(c, sep + 1, q.proto);
+        if (lo > hi)
+            cc_error(c, "Empty port range '%s-%s'", value, sep + 1);
+        return gen_port(c, q, lo, hi);
+
+    default:    // Q_PROTO
+        if ((kw = keyword(proto_names, value)) >= Q_TCP)
+            lo = kw == Q_TCP ? IPPROTO_TCP : kw == Q_UDP ? IPPROTO_UDP : IPPROTO_ICMP;
+        else
+            lo = parse_num(c, value, 255);
+        if (q.proto == Q_IP || q.proto == Q_IP6)
+            return gen_ipproto(c, q.proto == Q_IP6, lo);
+        if (q.proto != Q_DEFAULT)
+            cc_error(c, "'%s' applied to proto", proto_names[q.proto]);
+        b = gen_ipproto(c, 0, lo);
+        b2 = gen_ipproto(c, 1, lo);
+        return gen_or(c, b, b2);
+    }
+}
+
+static struct block parse_primitive(struct compiler *c)
+{
+    struct qual q = { Q_DEFAULT, Q_ANY, Q_NONE };
+    int kw;
+
+    if (c->tok != T_ID)
+        cc_error(c, "Syntax error near '%s'", c->tok == T_EOF ? "end of filter" : c->text);
+
+    if (strcmp(c->text, "vlan") == 0) {
+        int id = -1;
+
+        next(c);
+        if (c->tok == T_ID && isdigit((unsigned char)c->text[0])) {
+            id = (int)parse_num(c, c->text, 4095);
+            next(c);
+        }
+        return gen_vlan(c, id);
+    }
+
+    if ((kw = keyword(proto_names, c->text)) != -1) {
+        q.proto = kw;
+        next(c);
+    }
+    if (c->tok == T_ID && (kw = keyword(dir_names, c->text)) != -1) {
+        q.dir = kw;
+        next(c);
+    }
+    if (c->tok == T_ID && (kw = keyword(type_names, c->text)) != -1) {
+        q.type = kw;
+        next(c);
+    }
+
+    if (q.type == Q_NONE) {
+        if (q.dir != Q_ANY)
+            q.type = Q_HOST;                // "src 10.0.0.1"
+        else if (q.proto != Q_DEFAULT)
+            return gen_proto(c, q.proto);   // "tcp"
+        else if (c->last.type != Q_NONE)
+            q = c->last;                    // "port 53 or 5353"
+        else
+            q.type = Q_HOST;                // "10.0.0.1"
+    }
+
+    c->last = q;
+    return gen_qualified(c, q);
+}
+
+static struct block parse_expr(struct compiler *c);
+
+static struct block parse_factor(struct compiler *c)
+{
+    struct block b;
+
+    if (c->tok == T_NOT) {
+        next(c);
+        return gen_not(parse_factor(c));
+    }
+    if (c->tok == T_LPAREN) {
+        next(c);
+        b = parse_expr(c);
+        if (c->tok != T_RPAREN)
+            cc_error(c, "Missing ')'");
+        next(c);
+        return b;
+    }
+    return parse_primitive(c);
+}
+
+static struct block parse_term(struct compiler *c)
+{
+    struct block b = parse_factor(c);
+
+    while (c->tok == T_AND) {
+        next(c);
+        struct block b2 = parse_factor(c);
+        b = gen_and(c, b, b2);
+    }
+    return b;
+}
+
+static struct block parse_expr(struct compiler *c)
+{
+    struct block b = parse_term(c);
+
+    while (c->tok == T_OR) {
+        next(c);
+        struct block b2 = parse_term(c);
+        b = gen_or(c, b, b2);
+    }
+    return b;
+}
+
+/*** Layout ***/
+
+// Drop the instructions the optimizer removed and turn jump targets into
+// offsets. A jump to a removed instruction lands on the next live one.
+static int assemble(struct compiler *c, struct bpf_program *fp)
+{
+    int *pos = malloc((c->n + 1) * sizeof(int));
+    struct bpf_insn *insns;
+    int len = 0;
+
+    if (!pos)
+        cc_error(c, "Out of memory");
+    for (int i = 0; i < c->n; i++) {
+        pos[i] = len;
+        if (!c->ir[i].dead)
+            len++;
+    }
+    pos[c->n] = len;
+
+    insns = calloc(len, sizeof(*insns));
+    if (!insns) {
+        free(pos);
+        cc_error(c, "Out of memory");
+    }
+
+    for (int i = 0; i < c->n; i++) {
+        struct bpf_ir *in = &c->ir[i];
+        struct bpf_insn *out = &insns[pos[i]];
+
+        if (in->dead)
+            continue;
+        out->code = in->code;
+        out->k = in->k;
+        if (BPF_CLASS(in->code) != BPF_JMP)
+            continue;
+
+        if (BPF_OP(in->code) == BPF_JA) {
+            out->k = pos[in->jt] - pos[i] - 1;
+        } else if (pos[in->jt] - pos[i] - 1 > 255 || pos[in->jf] - pos[i] - 1 > 255) {
+            free(pos);
+            free(insns);
+            cc_error(c, "Filter too long: branch offset out of range");
+        } else {
+            out->jt = pos[in->jt] - pos[i] - 1;
+            out->jf = pos[in->jf] - pos[i] - 1;
+        }
+    }
+
+    free(pos);
+    fp->bf_len = len;
+    fp->bf_insns = insns;
+    return 0;
+}
+
+/*
+ * Same contract as pcap_compile(). An empty expression accepts everything.
+ * `netmask` is only needed by "ip broadcast", which is not supported.
+ */
+int netpcap_compile(netpcap_t *p, struct bpf_program *fp, const char *str,
+                    int optimize, uint32_t netmask)
+{
+    struct compiler c;
+    struct block b;
+    uint32_t snaplen = p->snaplen > 0 ? (uint32_t)p->snaplen : 262144;
+
+    (void)netmask;
+    fp->bf_len = 0;
+    fp->bf_insns = NULL;
+
+    if (p->linktype != DLT_EN10MB) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Filters need Ethernet frames, link type is %d", p->linktype);
+        return -1;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = p;
+    c.in = str ? str : "";
+    c.nl = ETHER_HDRLEN;
+    c.vlan_meta = p->vlan_meta;
+
+    if (setjmp(c.err)) {
+        free(c.ir);
+        return -1;
+    }
+
+    next(&c);
+    if (c.tok == T_EOF) {
+        emit(&c, BPF_RET | BPF_K, snaplen);
+    } else {
+        b = parse_expr(&c);
+        if (c.tok != T_EOF)
+            cc_error(&c, "Syntax error near '%s'", c.tok == T_RPAREN ? ")" : c.text);
+        patch(&c, b.t, emit(&c, BPF_RET | BPF_K, snaplen));
+        patch(&c, b.f, emit(&c, BPF_RET | BPF_K, 0));
+    }
+
+    if (optimize)
+        bpf_optimize(c.ir, c.n);
+    assemble(&c, fp);
+    free(c.ir);
+    return 0;
+}
+
+void netpcap_freecode(struct bpf_program *fp)
+{
+    free(fp->bf_insns);
+    fp->bf_insns = NULL;
+    fp->bf_len = 0;
+}
+
+/*** Listing ***/
+
+static const char *alu_names[16] = {
+    "add", "sub", "mul", "div", "or", "and", "lsh", "rsh", "neg", "mod", "xor",
+};
+
+static const char *jmp_names[16] = { "ja", "jeq", "jgt", "jge", "jset" };
+
+static void dump_load(char *buf, size_t len, const struct bpf_insn *in)
+{
+    const char *op = BPF_SIZE(in->code) == BPF_H ? "ldh" : BPF_SIZE(in->code) == BPF_B ? "ldb" : "ld";
+
+    switch (BPF_MODE(in->code)) {
+    case BPF_ABS:
+        if (in->k == (uint32_t)(SKF_AD_OFF + SKF_AD_VLAN_TAG))
+            snprintf(buf, len, "%-8s vlan_tci", op);
+        else if (in->k == (uint32_t)(SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT))
+            snprintf(buf, len, "%-8s vlan_avail", op);
+        else
+            snprintf(buf, len, "%-8s [%u]", op, in->k);
+        break;
+    case BPF_IND:
+        snprintf(buf, len, "%-8s [x + %u]", op, in->k);
+        break;
+    case BPF_IMM:
+        snprintf(buf, len, "%-8s #0x%x", op, in->k);
+        break;
+    case BPF_LEN:
+        snprintf(buf, len, "%-8s #pktlen", op);
+        break;
+    default:
+        snprintf(buf, len, "%-8s M[%u]", op, in->k);
+        break;
+    }
+}
+
+// Print a program the way `tcpdump -d` does
+void netpcap_bpf_dump(const struct bpf_program *fp)
+{
+    char buf[64];
+
+    for (unsigned int i = 0; i < fp->bf_len; i++) {
+        const struct bpf_insn *in = &fp->bf_insns[i];
+        const char *name;
+
+        switch (BPF_CLASS(in->code)) {
+        case BPF_LD:
+            dump_load(buf, sizeof(buf), in);
+            break;
+        case BPF_LDX:
+            if (BPF_MODE(in->code) == BPF_MSH)
+                snprintf(buf, sizeof(buf), "%-8s 4*([%u]&0xf)", "ldxb", in->k);
+            else if (BPF_MODE(in->code) == BPF_IMM)
+                snprintf(buf, sizeof(buf), "%-8s #0x%x", "ldx", in->k);
+            else if (BPF_MODE(in->code) == BPF_LEN)
+                snprintf(buf, sizeof(buf), "%-8s #pktlen", "ldx");
+            else
+                snprintf(buf, sizeof(buf), "%-8s M[%u]", "ldx", in->k);
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            snprintf(buf, sizeof(buf), "%-8s M[%u]", BPF_CLASS(in->code) == BPF_ST ? "st" : "stx", in->k);
+            break;
+        case BPF_ALU:
+            name = alu_names[BPF_OP(in->code) >> 4] ? alu_names[BPF_OP(in->code) >> 4] : "alu?";
+            if (BPF_OP(in->code) == BPF_NEG)
+                snprintf(buf, sizeof(buf), "%s", name);
+            else if (BPF_SRC(in->code) == BPF_X)
+                snprintf(buf, sizeof(buf), "%-8s x", name);
+            else
+                snprintf(buf, sizeof(buf), "%-8s #0x%x", name, in->k);
+            break;
+        case BPF_JMP:
+            name = jmp_names[BPF_OP(in->code) >> 4] ? jmp_names[BPF_OP(in->code) >> 4] : "j?";
+            if (BPF_OP(in->code) == BPF_JA)
+                snprintf(buf, sizeof(buf), "%-8s %u", name, i + 1 + in->k);
+            else if (BPF_SRC(in->code) == BPF_X)
+                snprintf(buf, sizeof(buf), "%-8s x%*sjt %u\tjf %u", name, 8, "", i + 1 + in->jt, i + 1 + in->jf);
+            else
+                snprintf(buf, sizeof(buf), "%-8s #0x%-8x jt %u\tjf %u", name, in->k, i + 1 + in->jt, i + 1 + in->jf);
+            break;
+        case BPF_RET:
+            if (BPF_RVAL(in->code) == BPF_A)
+                snprintf(buf, sizeof(buf), "%-8s a", "ret");
+            else
+                snprintf(buf, sizeof(buf), "%-8s #%u", "ret", in->k);
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "%s", BPF_MISCOP(in->code) == BPF_TAX ? "tax" : "txa");
+            break;
+        }
+        printf("(%03u) %s\n", i, buf);
+    }
+}
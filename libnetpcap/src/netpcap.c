@@ -1,39 +1,225 @@
-#include "netpcap.h"
+#include "netpcap-int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 /*
- * It uses the getifaddrs() system call to get information about network interfaces. This syscall:
- * - Returns a linked list of ifaddrs structures
- * - Contains information about all network interfaces
- * - Includes IP addresses, netmasks, and interface flags
- *
- * It also reads the /proc/net/dev file to get additional interface statistics and information.
- *
- * For more detailed information, it may:
- * - Use ioctl() with SIOCGIFCONF to get interface configurations
- * - Use ioctl() with SIOCGIFFLAGS to get interface flags
- * - Read /sys/class/net/ directory for interface details
-*/
+ * Interfaces from getifaddrs(), which lists every interface once per
+ * address, and once more with its link (AF_PACKET) on Linux: each becomes
+ * one netpcap_if, in the order first seen, with its IPv4 and IPv6
+ * addresses. The "any" pseudo-device comes last, as with libpcap.
+ * Descriptions are only known for "any".
+ */
+static netpcap_if *dev_find(netpcap_if **alldevs, const char *name, unsigned int flags) {
+    netpcap_if **pos = alldevs;
+
+    for (; *pos; pos = &(*pos)->next)
+        if (strcmp((*pos)->name, name) == 0)
+            return *pos;
+    *pos = calloc(1, sizeof(netpcap_if));
+    if (!*pos)
+        return NULL;
+    (*pos)->name = strdup(name);
+    if (!(*pos)->name) {
+        free(*pos);
+        *pos = NULL;
+        return NULL;
+    }
+    (*pos)->flags = (int)flags;
+    return *pos;
+}
+
+// Copy of an IPv4 or IPv6 socket address, NULL when absent or of another family
+static struct sockaddr *sockaddr_dup(const struct sockaddr *sa, int *failed) {
+    size_t len;
+    struct sockaddr *copy;
+
+    if (!sa)
+        return NULL;
+    if (sa->sa_family == AF_INET)
+        len = sizeof(struct sockaddr_in);
+    else if (sa->sa_family == AF_INET6)
+        len = sizeof(struct sockaddr_in6);
+    else
+        return NULL;
+    copy = malloc(len);
+    if (!copy) {
+        *failed = 1;
+        return NULL;
+    }
+    memcpy(copy, sa, len);
+    return copy;
+}
+
+static int dev_add_addr(netpcap_if *dev, const ifaddrs *ifa) {
+    netpcap_addr *a, **pos;
+    int failed = 0;
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return -1;
+    a->addr = sockaddr_dup(ifa->ifa_addr, &failed);
+    a->netmask = sockaddr_dup(ifa->ifa_netmask, &failed);
+    if (ifa->ifa_flags & IFF_BROADCAST)
+        a->broadaddr = sockaddr_dup(ifa->ifu_broadaddr, &failed);
+    for (pos = &dev->addresses; *pos; pos = &(*pos)->next)
+        ;
+    *pos = a;
+    return failed ? -1 : 0;
+}
+
 int netpcap_findalldevs(netpcap_if **alldevs, char *errbuf) {
-    struct ifaddrs *h_ifa;
+    ifaddrs *h_ifa, *ifa;
+    netpcap_if *dev;
+    int failed = 0;
 
+    *alldevs = NULL;
     if (getifaddrs(&h_ifa) == -1) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "getifaddrs: %s", strerror(errno));
         return -1;
     }
 
-    
-    
+    for (ifa = h_ifa; ifa && !failed; ifa = ifa->ifa_next) {
+        int family = ifa->ifa_addr ? ifa->ifa_addr->sa_family : AF_UNSPEC;
 
+        dev = dev_find(alldevs, ifa->ifa_name, ifa->ifa_flags);
+        failed = !dev || ((family == AF_INET || family == AF_INET6) && dev_add_addr(dev, ifa) == -1);
+    }
+    freeifaddrs(h_ifa);
+
+    if (!failed) {
+        dev = dev_find(alldevs, "any", IFF_UP | IFF_RUNNING);
+        failed = !dev || (!dev->description
+                          && !(dev->description = strdup("Pseudo-device that captures on all interfaces")));
+    }
+    if (failed) {
+        netpcap_freealldevs(*alldevs);
+        *alldevs = NULL;
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "Out of memory");
+        return -1;
+    }
     return 0;
 }
 
 void netpcap_freealldevs(netpcap_if *alldevs) {
-    
+    while (alldevs) {
+        netpcap_if *next = alldevs->next;
+        netpcap_addr *a = alldevs->addresses;
+
+        while (a) {
+            netpcap_addr *anext = a->next;
+
+            free(a->addr);
+            free(a->netmask);
+            free(a->broadaddr);
+            free(a);
+            a = anext;
+        }
+        free(alldevs->name);
+        free(alldevs->description);
+        free(alldevs);
+        alldevs = next;
+    }
 }
 
+/*
+ * Allocate a handle bound to `device` ("any" or NULL captures on all interfaces).
+ * The backend opens the socket and fills in the *_op callbacks.
+ */
+netpcap_t *netpcap_alloc(const char *device, int snaplen, char *errbuf) {
+    netpcap_t *p = calloc(1, sizeof(*p));
+    if (!p) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "Out of memory");
+        return NULL;
+    }
 
-int main(){
-    netpcap_if **alldevs;
-    char *errbuff;
+    p->fd = -1;
+    p->snaplen = (snaplen <= 0 || snaplen > 262144) ? 262144 : snaplen;
 
-    netpcap_findalldevs(alldevs, errbuff);
-}
\ No newline at end of file
+    if (device && strcmp(device, "any") != 0) {
+        p->ifindex = if_nametoindex(device);
+        if (p->ifindex == 0) {
+            snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "%s: No such device", device);
+            free(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+/*
+ * Same contract as pcap_open_live(): `to_ms` is used as the ring block retire
+ * timeout, so a block is never held by the kernel longer than that.
+ * Use netpcap_open_ring() to choose the ring geometry.
+ */
+netpcap_t *netpcap_open_live(const char *device, int snaplen, int promisc,
+                             int to_ms, char *errbuf) {
+    netpcap_ring_opts opts = {
+        .block_size = NETPCAP_RING_BLOCK_SIZE,
+        .block_count = NETPCAP_RING_BLOCK_COUNT,
+        .frame_timeout_ms = to_ms > 0 ? (unsigned int)to_ms : NETPCAP_RING_TIMEOUT_MS,
+    };
+
+    return netpcap_open_ring(device, snaplen, promisc, &opts, errbuf);
+}
+
+int netpcap_datalink(netpcap_t *p) {
+    return p->linktype;
+}
+
+void netpcap_close(netpcap_t *p) {
+    if (!p)
+        return;
+    if (p->cleanup_op)
+        p->cleanup_op(p);
+    if (p->fd != -1)
+        close(p->fd);
+    netpcap_filter_free(p->filter);
+    free(p);
+}
+
+int netpcap_dispatch(netpcap_t *p, int cnt, pcap_handler callback, unsigned char *user) {
+    return p->dispatch_op(p, cnt, callback, user);
+}
+
+int netpcap_loop(netpcap_t *p, int cnt, pcap_handler callback, unsigned char *user) {
+    int total = 0;
+
+    for (;;) {
+        int n = p->dispatch_op(p, cnt > 0 ? cnt - total : -1, callback, user);
+        if (n < 0)
+            return n;
+        // A savefile is done, a live capture only timed out
+        if (n == 0 && p->file_eof)
+            return 0;
+        total += n;
+        if (cnt > 0 && total >= cnt)
+            return 0;
+    }
+}
+
+void netpcap_breakloop(netpcap_t *p) {
+    p->break_loop = 1;
+}
+
+int netpcap_stats(netpcap_t *p, struct netpcap_stat *ps) {
+    return p->stats_op(p, ps);
+}
+
+int netpcap_fileno(netpcap_t *p) {
+    return p->fd;
+}
+
+char *netpcap_geterr(netpcap_t *p) {
+    return p->errbuf;
+}
+
+int netpcap_setfilter(netpcap_t *p, struct bpf_program *fp) {
+    return p->setfilter_op(p, fp);
+}
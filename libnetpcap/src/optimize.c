@@ -0,0 +1,461 @@
+#include "netpcap-int.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <linux/filter.h>
+
+/*
+ * Optimizer for the code generated by gencode.c.
+ *
+ * The generator is naive on purpose: "tcp port 53 or udp port 53" loads the
+ * ethertype and the IP protocol again for every alternative and tests them
+ * again on paths where their value is already settled. Programs have no
+ * loops (every jump goes forward) and loads only read the packet, which
+ * never changes, so a single pass in instruction order finds out:
+ *
+ *  - which load produced the value A and X hold at each instruction;
+ *  - which test outcomes ("ldh [12] == 0x800") hold on every path reaching
+ *    each instruction.
+ *
+ * With that, and which registers each instruction still needs:
+ *
+ *  - jump threading: a branch landing on a test whose outcome is already
+ *    known goes straight to the right successor. Unconditional jumps and
+ *    loads on the way are walked through, as long as the final target does
+ *    not use the register a skipped load would have set;
+ *  - redundant loads: a load of the value a register already holds on every
+ *    path reaching it is removed;
+ *  - dead code: unreachable instructions, conditional jumps whose branches
+ *    agree and jumps to the next instruction are removed.
+ *
+ * The passes run until nothing changes.
+ */
+
+#define MAX_FACTS   16
+#define LIVE_A      1
+#define LIVE_X      2
+
+// What a register holds: the load that produced it
+struct reg {
+    int known;
+    uint16_t code;
+    uint32_t k;
+    uint16_t xcode;                 // X as it was for an indexed load
+    uint32_t xk;
+};
+
+// Outcome of a test: `op` #k on the value `v` was `taken` (or not)
+struct fact {
+    struct reg v;
+    uint16_t op;
+    uint32_t k;
+    int taken;
+};
+
+struct state {
+    int reached;
+    struct reg a;
+    struct reg x;
+    int nfacts;
+    struct fact facts[MAX_FACTS];
+};
+
+static int reg_eq(const struct reg *r1, const struct reg *r2)
+{
+    return r1->known && r2->known
+        && r1->code == r2->code && r1->k == r2->k
+        && r1->xcode == r2->xcode && r1->xk == r2->xk;
+}
+
+static int fact_eq(const struct fact *f1, const struct fact *f2)
+{
+    return reg_eq(&f1->v, &f2->v) && f1->op == f2->op && f1->k == f2->k && f1->taken == f2->taken;
+}
+
+// Registers after `in` runs
+static void step(const struct bpf_ir *in, struct state *s)
+{
+    switch (BPF_CLASS(in->code)) {
+    case BPF_LD:
+        if (BPF_MODE(in->code) == BPF_MEM || (BPF_MODE(in->code) == BPF_IND && !s->x.known))
+            s->a = (struct reg){ 0 };
+        else if (BPF_MODE(in->code) == BPF_IND)
+            s->a = (struct reg){ 1, in->code, in->k, s->x.code, s->x.k };
+        else
+            s->a = (struct reg){ 1, in->code, in->k, 0, 0 };
+        break;
+    case BPF_LDX:
+        if (BPF_MODE(in->code) == BPF_MEM)
+            s->x = (struct reg){ 0 };
+        else
+            s->x = (struct reg){ 1, in->code, in->k, 0, 0 };
+        break;
+    case BPF_ALU:
+        s->a = (struct reg){ 0 };
+        break;
+    case BPF_MISC:
+        if (BPF_MISCOP(in->code) == BPF_TAX)
+            s->x = (struct reg){ 0 };
+        else
+            s->a = (struct reg){ 0 };
+        break;
+    }
+}
+
+static int is_load(const struct bpf_ir *in)
+{
+    return BPF_CLASS(in->code) == BPF_LD || BPF_CLASS(in->code) == BPF_LDX;
+}
+
+// A load whose result the register already holds
+static int is_redundant(const struct bpf_ir *in, const struct state *s)
+{
+    struct state after;
+
+    if (!is_load(in))
+        return 0;
+    after.a = s->a;
+    after.x = s->x;
+    step(in, &after);
+    if (BPF_CLASS(in->code) == BPF_LD)
+        return reg_eq(&s->a, &after.a);
+    return reg_eq(&s->x, &after.x);
+}
+
+static int is_test(const struct bpf_ir *in)
+{
+    return BPF_CLASS(in->code) == BPF_JMP && BPF_OP(in->code) != BPF_JA && BPF_SRC(in->code) == BPF_K;
+}
+
+static void add_fact(struct state *s, const struct bpf_ir *test, int taken)
+{
+    struct fact f = { s->a, BPF_OP(test->code), test->k, taken };
+
+    if (!s->a.known)
+        return;
+    for (int i = 0; i < s->nfacts; i++)
+        if (fact_eq(&s->facts[i], &f))
+            return;
+    // Full: forget the oldest
+    if (s->nfacts == MAX_FACTS) {
+        memmove(s->facts, s->facts + 1, (MAX_FACTS - 1) * sizeof(f));
+        s->nfacts--;
+    }
+    s->facts[s->nfacts++] = f;
+}
+
+// What holds on entry of an instruction reached from `src` as well
+static void meet(struct state *dst, const struct state *src)
+{
+    int kept = 0;
+
+    if (!dst->reached) {
+        *dst = *src;
+        dst->reached = 1;
+        return;
+    }
+    if (!reg_eq(&dst->a, &src->a))
+        dst->a.known = 0;
+    if (!reg_eq(&dst->x, &src->x))
+        dst->x.known = 0;
+
+    for (int i = 0; i < dst->nfacts; i++) {
+        for (int j = 0; j < src->nfacts; j++) {
+            if (fact_eq(&dst->facts[i], &src->facts[j])) {
+                dst->facts[kept++] = dst->facts[i];
+                break;
+            }
+        }
+    }
+    dst->nfacts = kept;
+}
+
+// State on entry of every instruction. Removed instructions do nothing.
+static void flow(const struct bpf_ir *ir, int n, struct state *in)
+{
+    struct state out;
+
+    memset(in, 0, n * sizeof(*in));
+    in[0].reached = 1;
+
+    for (int i = 0; i < n; i++) {
+        if (!in[i].reached)
+            continue;
+        out = in[i];
+        if (ir[i].dead) {
+            if (i + 1 < n)
+                meet(&in[i + 1], &out);
+            continue;
+        }
+
+        step(&ir[i], &out);
+        if (BPF_CLASS(ir[i].code) == BPF_RET)
+            continue;
+        if (BPF_CLASS(ir[i].code) != BPF_JMP) {
+            if (i + 1 < n)
+                meet(&in[i + 1], &out);
+        } else if (BPF_OP(ir[i].code) == BPF_JA) {
+            meet(&in[ir[i].jt], &out);
+        } else if (!is_test(&ir[i])) {
+            meet(&in[ir[i].jt], &out);
+            meet(&in[ir[i].jf], &out);
+        } else {
+            struct state taken = out;
+
+            add_fact(&taken, &ir[i], 1);
+            meet(&in[ir[i].jt], &taken);
+            add_fact(&out, &ir[i], 0);
+            meet(&in[ir[i].jf], &out);
+        }
+    }
+}
+
+// Registers each instruction may read before writing them
+static void liveness(const struct bpf_ir *ir, int n, int *live)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        const struct bpf_ir *in = &ir[i];
+        int next = i + 1 < n ? live[i + 1] : 0;
+        int use = 0, def = 0, out;
+
+        if (in->dead) {
+            live[i] = next;
+            continue;
+        }
+
+        switch (BPF_CLASS(in->code)) {
+        case BPF_LD:
+            use = BPF_MODE(in->code) == BPF_IND ? LIVE_X : 0;
+            def = LIVE_A;
+            out = next;
+            break;
+        case BPF_LDX:
+            def = LIVE_X;
+            out = next;
+            break;
+        case BPF_ST:
+            use = LIVE_A;
+            out = next;
+            break;
+        case BPF_STX:
+            use = LIVE_X;
+            out = next;
+            break;
+        case BPF_ALU:
+            use = LIVE_A | (BPF_SRC(in->code) == BPF_X ? LIVE_X : 0);
+            def = LIVE_A;
+            out = next;
+            break;
+        case BPF_JMP:
+            if (BPF_OP(in->code) == BPF_JA) {
+                out = live[in->jt];
+            } else {
+                use = LIVE_A | (BPF_SRC(in->code) == BPF_X ? LIVE_X : 0);
+                out = live[in->jt] | live[in->jf];
+            }
+            break;
+        case BPF_RET:
+            use = BPF_RVAL(in->code) == BPF_A ? LIVE_A : 0;
+            out = 0;
+            break;
+        default:
+            use = BPF_MISCOP(in->code) == BPF_TAX ? LIVE_A : LIVE_X;
+            def = BPF_MISCOP(in->code) == BPF_TAX ? LIVE_X : LIVE_A;
+            out = next;
+            break;
+        }
+        live[i] = use | (out & ~def);
+    }
+}
+
+/*
+ * Outcome of test `t` on a value known to satisfy `f`:
+ * 1 true, 0 false, -1 unknown.
+ */
+static int decide(const struct fact *f, const struct bpf_ir *t)
+{
+    uint32_t a = f->k, b = t->k;
+    int op = BPF_OP(t->code);
+
+    if (f->op == op && a == b)
+        return f->taken;
+
+    switch (f->op) {
+    case BPF_JEQ:
+        if (f->taken) {
+            // A == a
+            if (op == BPF_JEQ)
+                return 0;
+            if (op == BPF_JGT)
+                return a > b;
+            if (op == BPF_JGE)
+                return a >= b;
+            return (a & b) != 0;
+        }
+        break;
+    case BPF_JSET:
+        // Bits of b all within a: A & a == 0 means A & b == 0 as well
+        if (!f->taken && op == BPF_JSET && (b & ~a) == 0)
+            return 0;
+        break;
+    case BPF_JGT:
+        if (f->taken) {
+            // A > a
+            if ((op == BPF_JGT && b <= a) || (op == BPF_JGE && b <= a + 1 && a != UINT32_MAX))
+                return 1;
+            if (op == BPF_JEQ && b <= a)
+                return 0;
+        } else {
+            // A <= a
+            if ((op == BPF_JGT && b >= a) || ((op == BPF_JGE || op == BPF_JEQ) && b > a))
+                return 0;
+        }
+        break;
+    case BPF_JGE:
+        if (f->taken) {
+            // A >= a
+            if ((op == BPF_JGE && b <= a) || (op == BPF_JGT && b < a))
+                return 1;
+            if (op == BPF_JEQ && b < a)
+                return 0;
+        } else {
+            // A < a
+            if (((op == BPF_JGE || op == BPF_JEQ) && b >= a) || (op == BPF_JGT && b + 1 >= a))
+                return 0;
+        }
+        break;
+    }
+    return -1;
+}
+
+static int decide_state(const struct state *s, const struct bpf_ir *t)
+{
+    int d;
+
+    if (!is_test(t) || !s->a.known)
+        return -1;
+    for (int i = 0; i < s->nfacts; i++)
+        if (reg_eq(&s->facts[i].v, &s->a) && (d = decide(&s->facts[i], t)) != -1)
+            return d;
+    return -1;
+}
+
+/*
+ * Where a jump to `target`, with state `s` along the way, really needs to
+ * go. The walk stops at the first instruction it cannot see through and
+ * settles on the furthest point that does not read a register the skipped
+ * loads would have set.
+ */
+static int thread(const struct bpf_ir *ir, int n, const int *live, struct state s, int target)
+{
+    int t = target, best = target;
+    int clobbered = 0;
+    int d;
+
+    for (int guard = 0; t < n && guard < n; guard++) {
+        const struct bpf_ir *in = &ir[t];
+
+        if (in->dead || is_redundant(in, &s)) {
+            t++;
+        } else if (is_load(in)) {
+            clobbered |= BPF_CLASS(in->code) == BPF_LD ? LIVE_A : LIVE_X;
+            step(in, &s);
+            t++;
+        } else if (BPF_CLASS(in->code) == BPF_JMP && BPF_OP(in->code) == BPF_JA) {
+            t = in->jt;
+        } else if ((d = decide_state(&s, in)) != -1) {
+            t = d ? in->jt : in->jf;
+        } else {
+            break;
+        }
+
+        if (t < n && !(live[t] & clobbered))
+            best = t;
+    }
+    return best;
+}
+
+static int next_live(const struct bpf_ir *ir, int n, int i)
+{
+    while (i < n && ir[i].dead)
+        i++;
+    return i;
+}
+
+void bpf_optimize(struct bpf_ir *ir, int n)
+{
+    struct state *in = malloc(n * sizeof(*in));
+    int *live = malloc(n * sizeof(*live));
+    int changed;
+
+    // The program is correct as it is, only slower
+    if (!in || !live) {
+        free(in);
+        free(live);
+        return;
+    }
+
+    do {
+        changed = 0;
+        flow(ir, n, in);
+        liveness(ir, n, live);
+
+        for (int i = 0; i < n; i++) {
+            struct bpf_ir *insn = &ir[i];
+            int d;
+
+            if (insn->dead)
+                continue;
+            if (!in[i].reached || is_redundant(insn, &in[i])) {
+                insn->dead = 1;
+                changed = 1;
+                continue;
+            }
+            if (BPF_CLASS(insn->code) != BPF_JMP)
+                continue;
+
+            if ((d = decide_state(&in[i], insn)) != -1) {
+                // Settled on every path reaching it
+                insn->code = BPF_JMP | BPF_JA;
+                insn->jt = d ? insn->jt : insn->jf;
+                changed = 1;
+            }
+
+            if (BPF_OP(insn->code) == BPF_JA) {
+                int t = thread(ir, n, live, in[i], insn->jt);
+                if (t != insn->jt) {
+                    insn->jt = t;
+                    changed = 1;
+                }
+            } else {
+                struct state taken = in[i], not_taken = in[i];
+                int t, f;
+
+                if (is_test(insn)) {
+                    add_fact(&taken, insn, 1);
+                    add_fact(&not_taken, insn, 0);
+                }
+                t = thread(ir, n, live, taken, insn->jt);
+                f = thread(ir, n, live, not_taken, insn->jf);
+                if (t != insn->jt || f != insn->jf) {
+                    insn->jt = t;
+                    insn->jf = f;
+                    changed = 1;
+                }
+                if (next_live(ir, n, insn->jt) == next_live(ir, n, insn->jf)) {
+                    insn->code = BPF_JMP | BPF_JA;
+                    changed = 1;
+                }
+            }
+
+            if (BPF_OP(insn->code) == BPF_JA
+                && next_live(ir, n, insn->jt) == next_live(ir, n, i + 1)) {
+                insn->dead = 1;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    free(live);
+    free(in);
+}
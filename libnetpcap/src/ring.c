@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include "netpcap-int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+/*
+ * AF_PACKET capture backed by a TPACKET_V3 memory-mapped block ring.
+ *
+ * The kernel writes packets straight into a ring shared with userspace,
+ * one block at a time. A block is handed to us (TP_STATUS_USER) when it is
+ * full or when the retire timeout expires, we walk its packets in place and
+ * give it back by writing TP_STATUS_KERNEL into its header.
+ *
+ * Packets are passed to the callback as pointers into the ring: nothing is
+ * copied. To let callers keep a burst of packets across the callback, a
+ * walked block is only handed back at the start of the next dispatch call.
+ *
+ * see: https://docs.kernel.org/networking/packet_mmap.html
+ */
+
+#define VLAN_TAG_LEN 4
+
+static struct tpacket_block_desc *ring_block(netpcap_t *p, unsigned int idx)
+{
+    return (struct tpacket_block_desc *)(p->map + (size_t)idx * p->block_size);
+}
+
+// Give every block walked by the previous call back to the kernel
+static void ring_release(netpcap_t *p)
+{
+    unsigned int idx = (p->cur_block + p->block_count - p->consumed) % p->block_count;
+
+    while (p->consumed > 0) {
+        struct tpacket_block_desc *bd = ring_block(p, idx);
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        idx = (idx + 1) % p->block_count;
+        p->consumed--;
+    }
+}
+
+static int ring_block_ready(netpcap_t *p)
+{
+    struct tpacket_block_desc *bd = ring_block(p, p->cur_block);
+    return (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) != 0;
+}
+
+// Wait until the current block is retired, the timeout expires or a signal arrives
+static int ring_wait(netpcap_t *p)
+{
+    struct pollfd pfd;
+
+    pfd.fd = p->fd;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    int rc = poll(&pfd, 1, p->timeout_ms > 0 ? p->timeout_ms : -1);
+    if (rc < 0) {
+        if (errno == EINTR)
+            return 0;
+        snprintf(p->errbuf, sizeof(p->errbuf), "poll: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pfd.revents & POLLERR) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == ENETDOWN) {
+            snprintf(p->errbuf, sizeof(p->errbuf), "The interface went down");
+            return -1;
+        }
+        if (err != 0) {
+            snprintf(p->errbuf, sizeof(p->errbuf), "Capture socket error: %s", strerror(err));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Re-insert the 802.1Q tag the kernel stripped into the frame (in place)
+static unsigned char *ring_restore_vlan(struct tpacket3_hdr *ppd, unsigned char *frame,
+                                        struct pcap_pkthdr *h)
+{
+    if (!(ppd->tp_status & TP_STATUS_VLAN_VALID) && ppd->hv1.tp_vlan_tci == 0)
+        return frame;
+    if (h->caplen < 2 * 6)
+        return frame;
+
+    uint16_t tpid = (ppd->tp_status & TP_STATUS_VLAN_TPID_VALID) ?
+                    ppd->hv1.tp_vlan_tpid : ETH_P_8021Q;
+    uint16_t tag[2] = { htons(tpid), htons((uint16_t)ppd->hv1.tp_vlan_tci) };
+
+    // PACKET_RESERVE guarantees VLAN_TAG_LEN bytes of headroom before tp_mac
+    memmove(frame - VLAN_TAG_LEN, frame, 2 * 6);
+    frame -= VLAN_TAG_LEN;
+    memcpy(frame + 2 * 6, tag, sizeof(tag));
+
+    h->caplen += VLAN_TAG_LEN;
+    h->len += VLAN_TAG_LEN;
+    return frame;
+}
+
+static int ring_dispatch(netpcap_t *p, int cnt, pcap_handler callback, unsigned char *user)
+{
+    int n = 0;
+
+    ring_release(p);
+
+    if (p->pkts_left == 0 && !ring_block_ready(p)) {
+        if (ring_wait(p) == -1)
+            return NETPCAP_ERROR;
+    }
+
+    while (cnt <= 0 || n < cnt) {
+        if (p->break_loop) {
+            p->break_loop = 0;
+            return n > 0 ? n : NETPCAP_ERROR_BREAK;
+        }
+
+        if (p->pkts_left == 0) {
+            // cnt <= 0 means "one block", like one buffer for pcap_dispatch
+            if (cnt <= 0 && n > 0)
+                break;
+            if (!ring_block_ready(p))
+                break;
+
+            struct tpacket_block_desc *bd = ring_block(p, p->cur_block);
+            p->pkts_left = bd->hdr.bh1.num_pkts;
+            p->next_pkt = (unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+
+            if (p->pkts_left == 0) {
+                p->consumed++;
+                p->cur_block = (p->cur_block + 1) % p->block_count;
+                continue;
+            }
+        }
+
+        struct tpacket3_hdr *ppd = (struct tpacket3_hdr *)p->next_pkt;
+        struct sockaddr_ll *sll = (struct sockaddr_ll *)((char *)ppd + TPACKET_ALIGN(sizeof(*ppd)));
+        struct pcap_pkthdr h;
+        unsigned char *frame = (unsigned char *)ppd + ppd->tp_mac;
+
+        h.ts.tv_sec = ppd->tp_sec;
+        h.ts.tv_usec = ppd->tp_nsec / 1000;
+        h.caplen = ppd->tp_snaplen;
+        h.len = ppd->tp_len;
+
+        frame = ring_restore_vlan(ppd, frame, &h);
+        if (h.caplen > (uint32_t)p->snaplen)
+            h.caplen = p->snaplen;
+
+        if (--p->pkts_left == 0) {
+            p->consumed++;
+            p->cur_block = (p->cur_block + 1) % p->block_count;
+        } else {
+            p->next_pkt += ppd->tp_next_offset;
+        }
+
+        // What is sent on loopback comes back as received: keep one copy
+        if (sll->sll_pkttype == PACKET_OUTGOING && sll->sll_ifindex == p->lo_ifindex) {
+            p->skipped++;
+            continue;
+        }
+
+        callback(user, &h, frame);
+        n++;
+    }
+
+    return n;
+}
+
+static int ring_stats(netpcap_t *p, struct netpcap_stat *ps)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    // The kernel resets its counters on every read: accumulate them
+    if (getsockopt(p->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "PACKET_STATISTICS: %s", strerror(errno));
+        return -1;
+    }
+    // tp_packets counts the drops and the loopback copies skipped too:
+    // ps_recv, as with libpcap, doesn't
+    unsigned int left = st.tp_drops < st.tp_packets ? st.tp_packets - st.tp_drops : 0;
+    unsigned int skipped = p->skipped < left ? p->skipped : left;
+
+    p->stats.ps_recv += left - skipped;
+    p->stats.ps_drop += st.tp_drops;
+    p->skipped -= skipped;
+
+    *ps = p->stats;
+    return 0;
+}
+
+/*
+ * Attach a classic BPF program to the capture socket (SO_ATTACH_FILTER).
+ * struct bpf_insn has the same layout as the kernel's struct sock_filter.
+ */
+static int ring_setfilter(netpcap_t *p, struct bpf_program *fp)
+{
+    struct sock_fprog prog;
+
+    prog.len = fp->bf_len;
+    prog.filter = (struct sock_filter *)fp->bf_insns;
+
+    if (setsockopt(p->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "SO_ATTACH_FILTER: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void ring_cleanup(netpcap_t *p)
+{
+    if (p->map && p->map != MAP_FAILED)
+        munmap(p->map, p->map_len);
+    p->map = NULL;
+}
+
+static int ring_linktype(netpcap_t *p, const char *device)
+{
+    struct ifreq ifr;
+
+    if (p->ifindex == 0)
+        return DLT_EN10MB;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, device, sizeof(ifr.ifr_name) - 1);
+    if (ioctl(p->fd, SIOCGIFHWADDR, &ifr) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "SIOCGIFHWADDR: %s", strerror(errno));
+        return -1;
+    }
+
+    switch (ifr.ifr_hwaddr.sa_family) {
+        case ARPHRD_ETHER:
+        case ARPHRD_LOOPBACK:
+            return DLT_EN10MB;
+        default:
+            snprintf(p->errbuf, sizeof(p->errbuf),
+                     "Unsupported link type %u on %s", ifr.ifr_hwaddr.sa_family, device);
+            return -1;
+    }
+}
+
+static int ring_check_opts(netpcap_t *p, const netpcap_ring_opts *opts)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (opts->block_size == 0 || opts->block_size % page != 0) {
+        snprintf(p->errbuf, sizeof(p->errbuf),
+                 "Ring block size %u is not a multiple of the page size (%ld)", opts->block_size, page);
+        return -1;
+    }
+    if (opts->block_count == 0) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Ring needs at least one block");
+        return -1;
+    }
+    if ((size_t)opts->block_size * opts->block_count > (size_t)1 << 32) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Ring larger than 4 GiB");
+        return -1;
+    }
+    return 0;
+}
+
+int ring_activate(netpcap_t *p, int promisc, const netpcap_ring_opts *opts)
+{
+    int version = TPACKET_V3;
+    int reserve = VLAN_TAG_LEN;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+
+    if (ring_check_opts(p, opts) == -1)
+        return -1;
+
+    p->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (p->fd == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "socket(AF_PACKET): %s", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "TPACKET_V3 not supported: %s", strerror(errno));
+        return -1;
+    }
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "PACKET_RESERVE: %s", strerror(errno));
+        return -1;
+    }
+
+    // V3 packs variable-size frames into blocks: tp_frame_size is only
+    // used by the kernel to validate the geometry
+    unsigned int frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + reserve + p->snaplen);
+    if (frame_size > opts->block_size)
+        frame_size = opts->block_size;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = opts->block_size;
+    req.tp_block_nr = opts->block_count;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = (opts->block_size / frame_size) * opts->block_count;
+    req.tp_retire_blk_tov = opts->frame_timeout_ms;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "PACKET_RX_RING: %s", strerror(errno));
+        return -1;
+    }
+
+    p->block_size = opts->block_size;
+    p->block_count = opts->block_count;
+    p->map_len = (size_t)opts->block_size * opts->block_count;
+    p->map = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, p->fd, 0);
+    if (p->map == MAP_FAILED) {
+        // MAP_LOCKED fails under RLIMIT_MEMLOCK, the ring still works without it
+        p->map = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+        if (p->map == MAP_FAILED) {
+            p->map = NULL;
+            snprintf(p->errbuf, sizeof(p->errbuf), "mmap ring: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = p->ifindex;
+    if (bind(p->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "bind: %s", strerror(errno));
+        return -1;
+    }
+
+    if (promisc && p->ifindex != 0) {
+        struct packet_mreq mr;
+        memset(&mr, 0, sizeof(mr));
+        mr.mr_ifindex = p->ifindex;
+        mr.mr_type = PACKET_MR_PROMISC;
+        if (setsockopt(p->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) == -1) {
+            snprintf(p->errbuf, sizeof(p->errbuf), "PACKET_MR_PROMISC: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (p->timeout_ms <= 0)
+        p->timeout_ms = opts->frame_timeout_ms;
+
+    // Packets sent on lo are seen twice, going out and coming in
+    p->lo_ifindex = (int)if_nametoindex("lo");
+
+    // The kernel strips the outer tag before socket filters run
+    p->vlan_meta = 1;
+
+    p->dispatch_op = ring_dispatch;
+    p->stats_op = ring_stats;
+    p->setfilter_op = ring_setfilter;
+    p->cleanup_op = ring_cleanup;
+    return 0;
+}
+
+/*
+ * Join the PACKET_FANOUT group `group_id`: the kernel then spreads the
+ * interface's packets over every socket of the group. With
+ * NETPCAP_FANOUT_HASH the choice is made on the flow hash, and IP
+ * fragments are reassembled first so they hash like the rest of their flow.
+ */
+int netpcap_set_fanout(netpcap_t *p, uint16_t group_id, int mode)
+{
+    int type;
+
+    switch (mode) {
+        case NETPCAP_FANOUT_HASH:
+            type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+            break;
+        case NETPCAP_FANOUT_LB:
+            type = PACKET_FANOUT_LB;
+            break;
+        case NETPCAP_FANOUT_CPU:
+            type = PACKET_FANOUT_CPU;
+            break;
+        default:
+            snprintf(p->errbuf, sizeof(p->errbuf), "Unknown fanout mode %d", mode);
+            return -1;
+    }
+
+    int arg = group_id | (type << 16);
+    if (setsockopt(p->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "PACKET_FANOUT: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+netpcap_t *netpcap_open_ring(const char *device, int snaplen, int promisc,
+                             const netpcap_ring_opts *opts, char *errbuf)
+{
+    netpcap_ring_opts defaults = {
+        .block_size = NETPCAP_RING_BLOCK_SIZE,
+        .block_count = NETPCAP_RING_BLOCK_COUNT,
+        .frame_timeout_ms = NETPCAP_RING_TIMEOUT_MS,
+    };
+
+    netpcap_t *p = netpcap_alloc(device, snaplen, errbuf);
+    if (!p)
+        return NULL;
+
+    if (ring_activate(p, promisc, opts ? opts : &defaults) == -1
+        || (p->linktype = ring_linktype(p, device)) == -1) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "%.*s: %.*s", IFNAMSIZ, device ? device : "any",
+                 NETPCAP_ERRBUF_SIZE - IFNAMSIZ - 3, p->errbuf);
+        netpcap_close(p);
+        return NULL;
+    }
+    return p;
+}
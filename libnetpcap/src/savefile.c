@@ -0,0 +1,463 @@
+#include "netpcap-int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Offline capture from a classic pcap or a pcapng file.
+ *
+ * The whole file is mapped read-only and its records are walked in place:
+ * the callback gets pointers into the mapping, which stay valid until the
+ * handle is closed. Both byte orders are accepted, as well as microsecond
+ * and nanosecond classic pcap files.
+ *
+ * see: https://www.ietf.org/archive/id/draft-ietf-opsawg-pcap-04.html
+ *      https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-02.html
+ */
+
+#define PCAP_MAGIC_USEC         0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_FILE_HDRLEN        24
+#define PCAP_REC_HDRLEN         16
+
+#define PCAPNG_SHB              0x0A0D0D0A  // Section Header Block
+#define PCAPNG_IDB              0x00000001  // Interface Description Block
+#define PCAPNG_OPB              0x00000002  // Packet Block (obsolete)
+#define PCAPNG_SPB              0x00000003  // Simple Packet Block
+#define PCAPNG_EPB              0x00000006  // Enhanced Packet Block
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_TSRESOL      9
+#define PCAPNG_OPT_TSOFFSET     14
+
+#define LINKTYPE_MASK           0x03FFFFFF  // Upper bits of the link type carry FCS info
+
+#define SF_EOF                  -2
+
+static uint16_t sf_u16(netpcap_t *p, const unsigned char *b)
+{
+    uint16_t v;
+    memcpy(&v, b, sizeof(v));
+    return p->file_swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t sf_u32(netpcap_t *p, const unsigned char *b)
+{
+    uint32_t v;
+    memcpy(&v, b, sizeof(v));
+    return p->file_swapped ? __builtin_bswap32(v) : v;
+}
+
+// Timestamp in `units` per second (plus a whole-second offset) to a timeval
+static void sf_set_ts(struct pcap_pkthdr *h, uint64_t ts, uint64_t units, int64_t offset)
+{
+    uint64_t frac = ts % units;
+
+    h->ts.tv_sec = (time_t)(ts / units + offset);
+    h->ts.tv_usec = (suseconds_t)((unsigned __int128)frac * 1000000 / units);
+}
+
+static int sf_truncated(netpcap_t *p)
+{
+    snprintf(p->errbuf, sizeof(p->errbuf), "Truncated capture file at offset %zu", p->file_off);
+    return -1;
+}
+
+/*** Classic pcap ***/
+
+static int sf_pcap_dispatch(netpcap_t *p, int cnt, pcap_handler callback, unsigned char *user)
+{
+    const unsigned char *file = p->map;
+    int n = 0;
+
+    while (cnt <= 0 || n < cnt) {
+        if (p->break_loop) {
+            p->break_loop = 0;
+            return n > 0 ? n : NETPCAP_ERROR_BREAK;
+        }
+        if (p->file_off == p->map_len) {
+            p->file_eof = 1;
+            break;
+        }
+        if (p->map_len - p->file_off < PCAP_REC_HDRLEN)
+            return sf_truncated(p);
+
+        const unsigned char *rec = file + p->file_off;
+        uint32_t incl = sf_u32(p, rec + 8);
+        struct pcap_pkthdr h;
+
+        if (incl > p->map_len - p->file_off - PCAP_REC_HDRLEN)
+            return sf_truncated(p);
+
+        h.ts.tv_sec = sf_u32(p, rec);
+        h.ts.tv_usec = p->file_nsec ? sf_u32(p, rec + 4) / 1000 : sf_u32(p, rec + 4);
+        h.caplen = incl > (uint32_t)p->snaplen ? (uint32_t)p->snaplen : incl;
+        h.len = sf_u32(p, rec + 12);
+
+        p->file_off += PCAP_REC_HDRLEN + incl;
+        p->stats.ps_recv++;
+
+        if (p->filter && !netpcap_filter_run(p->filter, rec + PCAP_REC_HDRLEN, h.len, h.caplen))
+            continue;
+        callback(user, &h, rec + PCAP_REC_HDRLEN);
+        n++;
+    }
+    return n;
+}
+
+static int sf_pcap_open(netpcap_t *p)
+{
+    const unsigned char *file = p->map;
+    uint32_t magic;
+
+    if (p->map_len < PCAP_FILE_HDRLEN) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "File too short for a pcap header");
+        return -1;
+    }
+
+    memcpy(&magic, file, sizeof(magic));
+    if (magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+        p->file_swapped = 1;
+        magic = __builtin_bswap32(magic);
+    }
+    p->file_nsec = magic == PCAP_MAGIC_NSEC;
+
+    if (sf_u16(p, file + 4) != 2) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Unsupported pcap version %u.%u",
+                 sf_u16(p, file + 4), sf_u16(p, file + 6));
+        return -1;
+    }
+
+    p->linktype = sf_u32(p, file + 20) & LINKTYPE_MASK;
+    p->file_off = PCAP_FILE_HDRLEN;
+    p->dispatch_op = sf_pcap_dispatch;
+    return 0;
+}
+
+/*** pcapng ***/
+
+static int sf_pcapng_add_iface(netpcap_t *p, const unsigned char *body, uint32_t body_len)
+{
+    struct netpcap_iface *ifc;
+
+    if (body_len < 8) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Interface Description Block too short");
+        return -1;
+    }
+
+    ifc = realloc(p->ifaces, (p->iface_count + 1) * sizeof(*ifc));
+    if (!ifc) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Out of memory");
+        return -1;
+    }
+    p->ifaces = ifc;
+    ifc = &p->ifaces[p->iface_count++];
+    ifc->linktype = sf_u16(p, body);
+    ifc->ts_units = 1000000;
+    ifc->ts_offset = 0;
+
+    // Options: code, length, value padded to 32 bits
+    for (uint32_t off = 8; off + 4 <= body_len;) {
+        uint16_t code = sf_u16(p, body + off);
+        uint16_t len = sf_u16(p, body + off + 2);
+
+        if (code == PCAPNG_OPT_END || off + 4 + len > body_len)
+            break;
+
+        const unsigned char *val = body + off + 4;
+        if (code == PCAPNG_OPT_TSRESOL && len >= 1) {
+            unsigned int exp = val[0] & 0x7f;
+            uint64_t units = 1;
+
+            // High bit set: power of two, otherwise power of ten
+            if (val[0] & 0x80)
+                units = exp < 64 ? (uint64_t)1 << exp : 0;
+            else
+                for (unsigned int i = 0; i < exp && units != 0; i++)
+                    units = units > UINT64_MAX / 10 ? 0 : units * 10;
+            if (units == 0) {
+                snprintf(p->errbuf, sizeof(p->errbuf), "Unsupported timestamp resolution 0x%02x", val[0]);
+                return -1;
+            }
+            ifc->ts_units = units;
+        } else if (code == PCAPNG_OPT_TSOFFSET && len >= 8) {
+            uint64_t v;
+            memcpy(&v, val, sizeof(v));
+            ifc->ts_offset = (int64_t)(p->file_swapped ? __builtin_bswap64(v) : v);
+        }
+        off += 4 + ((len + 3) & ~3U);
+    }
+    return 0;
+}
+
+static int sf_pcapng_section(netpcap_t *p, const unsigned char *blk, size_t avail)
+{
+    uint32_t magic;
+
+    if (avail < 28) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Section Header Block too short");
+        return -1;
+    }
+
+    memcpy(&magic, blk + 8, sizeof(magic));
+    if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+        p->file_swapped = 0;
+    else if (magic == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+        p->file_swapped = 1;
+    else {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Bad pcapng byte-order magic");
+        return -1;
+    }
+
+    if (sf_u16(p, blk + 12) != 1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Unsupported pcapng version %u.%u",
+                 sf_u16(p, blk + 12), sf_u16(p, blk + 14));
+        return -1;
+    }
+
+    // Interface ids are local to a section
+    p->iface_count = 0;
+    return 0;
+}
+
+/*
+ * Consume the block at file_off.
+ * Returns 1 when it holds a packet (`h` and `data` are set), 0 for any
+ * other block, SF_EOF at the end of the file and -1 on error.
+ */
+static int sf_pcapng_block(netpcap_t *p, struct pcap_pkthdr *h, const unsigned char **data)
+{
+    const unsigned char *blk = (const unsigned char *)p->map + p->file_off;
+    size_t avail = p->map_len - p->file_off;
+    uint32_t type, total;
+
+    if (avail == 0)
+        return SF_EOF;
+    if (avail < 12)
+        return sf_truncated(p);
+
+    memcpy(&type, blk, sizeof(type));
+    if (type == PCAPNG_SHB && sf_pcapng_section(p, blk, avail) == -1)
+        return -1;
+    type = sf_u32(p, blk);
+    total = sf_u32(p, blk + 4);
+
+    if (total < 12 || total % 4 != 0) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Bad pcapng block length %u at offset %zu", total, p->file_off);
+        return -1;
+    }
+    if (total > avail || sf_u32(p, blk + total - 4) != total)
+        return sf_truncated(p);
+
+    const unsigned char *body = blk + 8;
+    uint32_t body_len = total - 12;
+    uint32_t iface = 0, caplen, hdr_len;
+    uint64_t ts = 0;
+
+    p->file_off += total;
+
+    switch (type) {
+        case PCAPNG_IDB:
+            return sf_pcapng_add_iface(p, body, body_len) == -1 ? -1 : 0;
+        case PCAPNG_EPB:
+            if (body_len < 20)
+                return sf_truncated(p);
+            iface = sf_u32(p, body);
+            ts = (uint64_t)sf_u32(p, body + 4) << 32 | sf_u32(p, body + 8);
+            caplen = sf_u32(p, body + 12);
+            h->len = sf_u32(p, body + 16);
+            hdr_len = 20;
+            break;
+        case PCAPNG_OPB:
+            if (body_len < 20)
+                return sf_truncated(p);
+            iface = sf_u16(p, body);
+            ts = (uint64_t)sf_u32(p, body + 4) << 32 | sf_u32(p, body + 8);
+            caplen = sf_u32(p, body + 12);
+            h->len = sf_u32(p, body + 16);
+            hdr_len = 20;
+            break;
+        case PCAPNG_SPB:
+            // No timestamp, and the captured length is implied by the block length
+            if (body_len < 4)
+                return sf_truncated(p);
+            h->len = sf_u32(p, body);
+            caplen = h->len < body_len - 4 ? h->len : body_len - 4;
+            hdr_len = 4;
+            break;
+        default:
+            return 0;
+    }
+
+    if (caplen > body_len - hdr_len)
+        return sf_truncated(p);
+    if (iface >= p->iface_count) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Packet for unknown interface %u", iface);
+        return -1;
+    }
+    // One link type per handle: packets from other kinds of interfaces are skipped
+    if (p->ifaces[iface].linktype != p->linktype)
+        return 0;
+
+    if (type == PCAPNG_SPB) {
+        h->ts.tv_sec = 0;
+        h->ts.tv_usec = 0;
+    } else {
+        sf_set_ts(h, ts, p->ifaces[iface].ts_units, p->ifaces[iface].ts_offset);
+    }
+    h->caplen = caplen > (uint32_t)p->snaplen ? (uint32_t)p->snaplen : caplen;
+    *data = body + hdr_len;
+    return 1;
+}
+
+static int sf_pcapng_dispatch(netpcap_t *p, int cnt, pcap_handler callback, unsigned char *user)
+{
+    int n = 0;
+
+    while (cnt <= 0 || n < cnt) {
+        struct pcap_pkthdr h;
+        const unsigned char *data;
+
+        if (p->break_loop) {
+            p->break_loop = 0;
+            return n > 0 ? n : NETPCAP_ERROR_BREAK;
+        }
+
+        int rc = sf_pcapng_block(p, &h, &data);
+        if (rc == SF_EOF) {
+            p->file_eof = 1;
+            break;
+        }
+        if (rc == -1)
+            return NETPCAP_ERROR;
+        if (rc == 0)
+            continue;
+
+        p->stats.ps_recv++;
+        if (p->filter && !netpcap_filter_run(p->filter, data, h.len, h.caplen))
+            continue;
+        callback(user, &h, data);
+        n++;
+    }
+    return n;
+}
+
+static int sf_pcapng_open(netpcap_t *p)
+{
+    // The link type is the one of the first interface: read the blocks
+    // that come before it
+    while (p->iface_count == 0) {
+        struct pcap_pkthdr h;
+        const unsigned char *data;
+
+        int rc = sf_pcapng_block(p, &h, &data);
+        if (rc == -1)
+            return -1;
+        if (rc == SF_EOF)
+            break;
+        if (rc == 1) {
+            snprintf(p->errbuf, sizeof(p->errbuf), "Packet before any Interface Description Block");
+            return -1;
+        }
+    }
+
+    if (p->iface_count == 0) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "No Interface Description Block");
+        return -1;
+    }
+    p->linktype = p->ifaces[0].linktype;
+    p->dispatch_op = sf_pcapng_dispatch;
+    return 0;
+}
+
+/*** Handle ***/
+
+static int sf_stats(netpcap_t *p, struct netpcap_stat *ps)
+{
+    *ps = p->stats;
+    return 0;
+}
+
+static int sf_setfilter(netpcap_t *p, struct bpf_program *fp)
+{
+    return filter_install(p, fp);
+}
+
+static void sf_cleanup(netpcap_t *p)
+{
+    if (p->map)
+        munmap(p->map, p->map_len);
+    p->map = NULL;
+    free(p->ifaces);
+    p->ifaces = NULL;
+}
+
+static int sf_activate(netpcap_t *p, const char *fname)
+{
+    struct stat st;
+    uint32_t magic;
+
+    p->cleanup_op = sf_cleanup;
+    p->stats_op = sf_stats;
+    p->setfilter_op = sf_setfilter;
+
+    p->fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (p->fd == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "%s", strerror(errno));
+        return -1;
+    }
+    if (fstat(p->fd, &st) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "fstat: %s", strerror(errno));
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(magic)) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Not a capture file");
+        return -1;
+    }
+
+    p->map_len = st.st_size;
+    p->map = mmap(NULL, p->map_len, PROT_READ, MAP_PRIVATE, p->fd, 0);
+    if (p->map == MAP_FAILED) {
+        p->map = NULL;
+        snprintf(p->errbuf, sizeof(p->errbuf), "mmap: %s", strerror(errno));
+        return -1;
+    }
+    // Records are read once, front to back: let the kernel read ahead
+    madvise(p->map, p->map_len, MADV_SEQUENTIAL);
+
+    memcpy(&magic, p->map, sizeof(magic));
+    switch (magic) {
+        case PCAP_MAGIC_USEC:
+        case PCAP_MAGIC_NSEC:
+        case __builtin_bswap32(PCAP_MAGIC_USEC):
+        case __builtin_bswap32(PCAP_MAGIC_NSEC):
+            return sf_pcap_open(p);
+        case PCAPNG_SHB:
+            return sf_pcapng_open(p);
+        default:
+            snprintf(p->errbuf, sizeof(p->errbuf), "Unknown file format (magic 0x%08x)", magic);
+            return -1;
+    }
+}
+
+netpcap_t *netpcap_open_offline(const char *fname, char *errbuf)
+{
+    netpcap_t *p = netpcap_alloc(NULL, 0, errbuf);
+    if (!p)
+        return NULL;
+
+    if (sf_activate(p, fname) == -1) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "%.*s: %.*s", NETPCAP_ERRBUF_SIZE / 2, fname,
+                 NETPCAP_ERRBUF_SIZE / 2 - 3, p->errbuf);
+        netpcap_close(p);
+        return NULL;
+    }
+    return p;
+}
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include "netpcap-int.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+// <linux/bpf.h> has its own (eBPF) struct bpf_insn, which would clash
+// with the classic BPF one from netpcap.h
+#define bpf_insn ebpf_insn
+#include <linux/bpf.h>
+#undef bpf_insn
+
+/*
+ * AF_XDP capture.
+ *
+ * A small XDP program redirects every packet of one RX queue to an AF_XDP
+ * socket, before the kernel allocates an skb for it. Packets land in the
+ * UMEM, a buffer registered by userspace and split in fixed-size frames:
+ *
+ *   fill ring   userspace -> kernel   frames the kernel may write into
+ *   RX ring     kernel -> userspace   frames holding a received packet
+ *
+ * A frame goes back to the fill ring once the packet has been handled. As
+ * with the TPACKET_V3 ring, the frames of a burst are only given back at
+ * the start of the next dispatch call, so a caller can keep the burst.
+ *
+ * The program is loaded and attached through raw bpf() syscalls, with a
+ * bpf_link so it is detached when the handle is closed (or the process
+ * dies). Packets redirected to the socket are no longer seen by the
+ * network stack: AF_XDP is meant for mirror ports and taps, not for a
+ * host's own traffic.
+ *
+ * see: https://docs.kernel.org/networking/af_xdp.html
+ */
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(NET_bpf, cmd, attr, sizeof(*attr));
+}
+
+// XSKMAP with one slot per RX queue up to `queue_id`
+static int xdp_create_map(netpcap_t *p, unsigned int queue_id)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queue_id + 1;
+    strncpy(attr.map_name, "netpcap_xsks", sizeof(attr.map_name) - 1);
+
+    p->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (p->map_fd == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "bpf(BPF_MAP_CREATE): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int xdp_register_socket(netpcap_t *p, unsigned int queue_id)
+{
+    union bpf_attr attr;
+    uint32_t key = queue_id;
+    uint32_t value = p->fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = p->map_fd;
+    attr.key = (uint64_t)(unsigned long)&key;
+    attr.value = (uint64_t)(unsigned long)&value;
+
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "bpf(BPF_MAP_UPDATE_ELEM): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  r2 = ctx->rx_queue_index
+ *  r1 = xskmap
+ *  r3 = XDP_PASS                   action when no socket is bound to the queue
+ *  return bpf_redirect_map(r1, r2, r3)
+ */
+static int xdp_load_program(netpcap_t *p)
+{
+    struct ebpf_insn prog[6];
+    union bpf_attr attr;
+    char license[] = "GPL";
+
+    memset(prog, 0, sizeof(prog));
+    prog[0].code = BPF_LDX | BPF_MEM | BPF_W;
+    prog[0].dst_reg = BPF_REG_2;
+    prog[0].src_reg = BPF_REG_1;
+    prog[0].off = offsetof(struct xdp_md, rx_queue_index);
+
+    // 64-bit immediate load, spread over two instructions
+    prog[1].code = BPF_LD | BPF_DW | BPF_IMM;
+    prog[1].dst_reg = BPF_REG_1;
+    prog[1].src_reg = BPF_PSEUDO_MAP_FD;
+    prog[1].imm = p->map_fd;
+
+    prog[3].code = BPF_ALU64 | BPF_MOV | BPF_K;
+    prog[3].dst_reg = BPF_REG_3;
+    prog[3].imm = XDP_PASS;
+
+    prog[4].code = BPF_JMP | BPF_CALL;
+    prog[4].imm = BPF_FUNC_redirect_map;
+
+    prog[5].code = BPF_JMP | BPF_EXIT;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(unsigned long)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(unsigned long)license;
+    strncpy(attr.prog_name, "netpcap_xsk", sizeof(attr.prog_name) - 1);
+
+    p->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (p->prog_fd == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "bpf(BPF_PROG_LOAD): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int xdp_attach_program(netpcap_t *p, int mode)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = p->prog_fd;
+    attr.link_create.target_ifindex = p->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = mode == NETPCAP_XDP_DRV ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+
+    p->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (p->link_fd == -1) {
+        if (errno == EBUSY || errno == EEXIST)
+            snprintf(p->errbuf, sizeof(p->errbuf), "An XDP program is already attached to the interface");
+        else
+            snprintf(p->errbuf, sizeof(p->errbuf), "bpf(BPF_LINK_CREATE): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int xdp_map_ring(netpcap_t *p, struct xdp_uring *r, const struct xdp_ring_offset *off,
+                        size_t desc_size, off_t pgoff, const char *name)
+{
+    r->map_len = off->desc + (size_t)p->frame_count * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, p->fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        snprintf(p->errbuf, sizeof(p->errbuf), "mmap %s ring: %s", name, strerror(errno));
+        return -1;
+    }
+
+    r->producer = (uint32_t *)((unsigned char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((unsigned char *)r->map + off->consumer);
+    r->flags = (uint32_t *)((unsigned char *)r->map + off->flags);
+    r->descs = (unsigned char *)r->map + off->desc;
+    r->mask = p->frame_count - 1;
+    r->cached_prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+    r->cached_cons = __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+static int xdp_setup_rings(netpcap_t *p)
+{
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    unsigned int size = p->frame_count;
+
+    if (setsockopt(p->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1
+        || setsockopt(p->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1
+        || setsockopt(p->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "AF_XDP ring setup: %s", strerror(errno));
+        return -1;
+    }
+
+    if (getsockopt(p->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "XDP_MMAP_OFFSETS: %s", strerror(errno));
+        return -1;
+    }
+
+    if (xdp_map_ring(p, &p->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, "fill") == -1
+        || xdp_map_ring(p, &p->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, "completion") == -1
+        || xdp_map_ring(p, &p->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, "RX") == -1)
+        return -1;
+    return 0;
+}
+
+// Hand the frames of the previous burst back to the kernel
+static void xdp_refill(netpcap_t *p)
+{
+    struct xdp_uring *fq = &p->fill;
+    uint64_t *addrs = fq->descs;
+
+    if (p->npending == 0)
+        return;
+
+    // Every frame is either in the fill ring, in the RX ring or pending:
+    // the fill ring, as large as the UMEM, always has room for them
+    for (unsigned int i = 0; i < p->npending; i++)
+        addrs[fq->cached_prod++ & fq->mask] = p->pending[i];
+    __atomic_store_n(fq->producer, fq->cached_prod, __ATOMIC_RELEASE);
+    p->npending = 0;
+
+    if (__atomic_load_n(fq->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+        recvfrom(p->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+static uint32_t xdp_rx_ready(netpcap_t *p)
+{
+    struct xdp_uring *rx = &p->rx;
+
+    if (rx->cached_prod == rx->cached_cons)
+        rx->cached_prod = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE);
+    return rx->cached_prod - rx->cached_cons;
+}
+
+static int xdp_wait(netpcap_t *p)
+{
+    struct pollfd pfd;
+
+    pfd.fd = p->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, p->timeout_ms > 0 ? p->timeout_ms : -1) < 0 && errno != EINTR) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "poll: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int xdp_dispatch(netpcap_t *p, int cnt, pcap_handler callback, unsigned char *user)
+{
+    struct xdp_uring *rx = &p->rx;
+    const struct xdp_desc *descs = rx->descs;
+    struct pcap_pkthdr h;
+    struct timespec now;
+    uint32_t ready;
+    int n = 0;
+
+    xdp_refill(p);
+
+    ready = xdp_rx_ready(p);
+    if (ready == 0) {
+        if (xdp_wait(p) == -1)
+            return NETPCAP_ERROR;
+        ready = xdp_rx_ready(p);
+    }
+    if (cnt > 0 && ready > (uint32_t)cnt)
+        ready = cnt;
+
+    // AF_XDP descriptors carry no timestamp: one per burst
+    clock_gettime(CLOCK_REALTIME, &now);
+    h.ts.tv_sec = now.tv_sec;
+    h.ts.tv_usec = now.tv_nsec / 1000;
+
+    for (uint32_t i = 0; i < ready; i++) {
+        if (p->break_loop)
+            break;
+
+        const struct xdp_desc *d = &descs[rx->cached_cons++ & rx->mask];
+
+        h.len = d->len;
+        h.caplen = d->len > (uint32_t)p->snaplen ? (uint32_t)p->snaplen : d->len;
+        p->pending[p->npending++] = d->addr & ~(uint64_t)(p->frame_size - 1);
+        p->stats.ps_recv++;
+
+        if (p->filter && !netpcap_filter_run(p->filter, p->umem + d->addr, h.len, h.caplen))
+            continue;
+        callback(user, &h, p->umem + d->addr);
+        n++;
+    }
+
+    // The RX slots can be reused right away, only the frames are kept
+    __atomic_store_n(rx->consumer, rx->cached_cons, __ATOMIC_RELEASE);
+
+    if (p->break_loop) {
+        p->break_loop = 0;
+        return n > 0 ? n : NETPCAP_ERROR_BREAK;
+    }
+    return n;
+}
+
+static int xdp_stats(netpcap_t *p, struct netpcap_stat *ps)
+{
+    struct xdp_statistics st;
+    socklen_t len = sizeof(st);
+
+    memset(&st, 0, sizeof(st));
+    if (getsockopt(p->fd, SOL_XDP, XDP_STATISTICS, &st, &len) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "XDP_STATISTICS: %s", strerror(errno));
+        return -1;
+    }
+
+    // Unlike PACKET_STATISTICS, these counters are never reset
+    p->stats.ps_drop = st.rx_dropped + st.rx_ring_full;
+    p->stats.ps_ifdrop = st.rx_fill_ring_empty_descs;
+
+    *ps = p->stats;
+    return 0;
+}
+
+// AF_XDP sockets don't run socket filters: the program runs on each frame
+static int xdp_setfilter(netpcap_t *p, struct bpf_program *fp)
+{
+    return filter_install(p, fp);
+}
+
+static void xdp_unmap_ring(struct xdp_uring *r)
+{
+    if (r->map)
+        munmap(r->map, r->map_len);
+    r->map = NULL;
+}
+
+static void xdp_cleanup(netpcap_t *p)
+{
+    // Detach the program first so the queue goes back to the stack
+    if (p->link_fd != -1)
+        close(p->link_fd);
+    if (p->prog_fd != -1)
+        close(p->prog_fd);
+    if (p->map_fd != -1)
+        close(p->map_fd);
+    p->link_fd = p->prog_fd = p->map_fd = -1;
+
+    xdp_unmap_ring(&p->rx);
+    xdp_unmap_ring(&p->comp);
+    xdp_unmap_ring(&p->fill);
+    if (p->umem)
+        munmap(p->umem, p->umem_len);
+    p->umem = NULL;
+    free(p->pending);
+    p->pending = NULL;
+}
+
+static int is_pow2(unsigned int x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+static int xdp_check_opts(netpcap_t *p, const netpcap_xdp_opts *opts)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (!is_pow2(opts->frame_size) || opts->frame_size < 2048 || opts->frame_size > page) {
+        snprintf(p->errbuf, sizeof(p->errbuf),
+                 "XDP frame size %u must be a power of two between 2048 and %ld", opts->frame_size, page);
+        return -1;
+    }
+    if (!is_pow2(opts->frame_count)) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "XDP frame count %u is not a power of two", opts->frame_count);
+        return -1;
+    }
+    if (opts->mode != NETPCAP_XDP_SKB && opts->mode != NETPCAP_XDP_DRV) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Unknown XDP mode %d", opts->mode);
+        return -1;
+    }
+    if (p->ifindex == 0) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "AF_XDP needs an interface, not \"any\"");
+        return -1;
+    }
+    return 0;
+}
+
+static int xdp_bind(netpcap_t *p, const netpcap_xdp_opts *opts)
+{
+    struct sockaddr_xdp sxdp;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = p->ifindex;
+    sxdp.sxdp_queue_id = opts->queue_id;
+
+    // Zero-copy needs driver support, fall back to copy mode without it
+    if (opts->mode == NETPCAP_XDP_DRV) {
+        sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+        if (bind(p->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+            return 0;
+    }
+
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(p->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "bind queue %u: %s", opts->queue_id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int xdp_activate(netpcap_t *p, const netpcap_xdp_opts *opts)
+{
+    struct xdp_umem_reg reg;
+
+    p->prog_fd = p->map_fd = p->link_fd = -1;
+    p->cleanup_op = xdp_cleanup;
+
+    if (xdp_check_opts(p, opts) == -1)
+        return -1;
+
+    p->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (p->fd == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "socket(AF_XDP): %s", strerror(errno));
+        return -1;
+    }
+
+    p->frame_size = opts->frame_size;
+    p->frame_count = opts->frame_count;
+    p->umem_len = (size_t)opts->frame_size * opts->frame_count;
+    p->umem = mmap(NULL, p->umem_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p->umem == MAP_FAILED) {
+        p->umem = NULL;
+        snprintf(p->errbuf, sizeof(p->errbuf), "mmap UMEM: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(unsigned long)p->umem;
+    reg.len = p->umem_len;
+    reg.chunk_size = opts->frame_size;
+    if (setsockopt(p->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "XDP_UMEM_REG: %s", strerror(errno));
+        return -1;
+    }
+
+    p->pending = malloc(sizeof(uint64_t) * opts->frame_count);
+    if (!p->pending) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "Out of memory");
+        return -1;
+    }
+
+    if (xdp_setup_rings(p) == -1)
+        return -1;
+
+    // The whole UMEM starts in the fill ring
+    for (unsigned int i = 0; i < opts->frame_count; i++)
+        p->pending[i] = (uint64_t)i * opts->frame_size;
+    p->npending = opts->frame_count;
+    xdp_refill(p);
+
+    if (xdp_bind(p, opts) == -1
+        || xdp_create_map(p, opts->queue_id) == -1
+        || xdp_register_socket(p, opts->queue_id) == -1
+        || xdp_load_program(p) == -1
+        || xdp_attach_program(p, opts->mode) == -1)
+        return -1;
+
+    p->linktype = DLT_EN10MB;
+    p->timeout_ms = opts->timeout_ms;
+    p->dispatch_op = xdp_dispatch;
+    p->stats_op = xdp_stats;
+    p->setfilter_op = xdp_setfilter;
+    return 0;
+}
+
+netpcap_t *netpcap_open_xdp(const char *device, int snaplen,
+                            const netpcap_xdp_opts *opts, char *errbuf)
+{
+    netpcap_xdp_opts defaults = {
+        .frame_size = NETPCAP_XDP_FRAME_SIZE,
+        .frame_count = NETPCAP_XDP_FRAME_COUNT,
+        .queue_id = 0,
+        .mode = NETPCAP_XDP_SKB,
+        .timeout_ms = NETPCAP_XDP_TIMEOUT_MS,
+    };
+
+    netpcap_t *p = netpcap_alloc(device, snaplen, errbuf);
+    if (!p)
+        return NULL;
+
+    if (xdp_activate(p, opts ? opts : &defaults) == -1) {
+        snprintf(errbuf, NETPCAP_ERRBUF_SIZE, "%.*s: %.*s", IFNAMSIZ, device ? device : "any",
+                 NETPCAP_ERRBUF_SIZE - IFNAMSIZ - 3, p->errbuf);
+        netpcap_close(p);
+        return NULL;
+    }
+    return p;
+}
@@ -0,0 +1,116 @@
+/*
+ * Userspace filter benchmark: netpcap_filter_run() against libpcap's
+ * pcap_offline_filter() on the packets of a capture file.
+ *
+ *   make bench       (only where libpcap is installed)
+ *   ./build/filter_bench <file> "<filter>" [rounds]
+ *
+ * The file is read once into memory, then both filters run over every
+ * packet `rounds` times. Both must accept the same packets. The ratio of
+ * their times depends on the filter and the machine: measure it, no
+ * figure is assumed.
+ */
+#include <pcap.h>
+#include "netpcap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+    struct pcap_pkthdr hdr;
+    const unsigned char *data;
+} packet;
+
+typedef struct {
+    packet *pkts;
+    size_t count;
+    size_t size;
+} packet_list;
+
+static void collect(unsigned char *user, const struct pcap_pkthdr *h, const unsigned char *bytes)
+{
+    packet_list *l = (packet_list *)user;
+
+    if (l->count == l->size) {
+        l->size = l->size ? l->size * 2 : 4096;
+        l->pkts = realloc(l->pkts, l->size * sizeof(packet));
+        if (!l->pkts) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    l->pkts[l->count].hdr = *h;
+    l->pkts[l->count].data = bytes;     // Points into the mapped file
+    l->count++;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, unsigned long long runs, unsigned long long accepted)
+{
+    printf("%-22s %8.2f ns/pkt %10.2f Mpkt/s  accepted %llu\n",
+           name, secs * 1e9 / runs, runs / secs / 1e6, accepted);
+}
+
+int main(int argc, char **argv)
+{
+    char errbuf[NETPCAP_ERRBUF_SIZE];
+    struct bpf_program fp;
+    packet_list list = {0};
+    int rounds = argc > 3 ? atoi(argv[3]) : 20;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <file> <filter> [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    netpcap_t *p = netpcap_open_offline(argv[1], errbuf);
+    if (!p) {
+        fprintf(stderr, "%s: %s\n", argv[1], errbuf);
+        return 1;
+    }
+    if (netpcap_compile(p, &fp, argv[2], 1, 0) == -1) {
+        fprintf(stderr, "%s: %s\n", argv[2], netpcap_geterr(p));
+        return 1;
+    }
+    netpcap_filter *f = netpcap_filter_prepare(&fp, errbuf);
+    if (!f) {
+        fprintf(stderr, "%s\n", errbuf);
+        return 1;
+    }
+    if (netpcap_loop(p, -1, collect, (unsigned char *)&list) < 0 || list.count == 0) {
+        fprintf(stderr, "%s: no packets\n", argv[1]);
+        return 1;
+    }
+
+    printf("%zu packets, %d rounds, %u instructions\n", list.count, rounds, fp.bf_len);
+
+    unsigned long long runs = (unsigned long long)list.count * rounds;
+    unsigned long long ours = 0, theirs = 0;
+    double t0 = now_sec();
+    for (int r = 0; r < rounds; r++)
+        for (size_t i = 0; i < list.count; i++)
+            ours += netpcap_filter_run(f, list.pkts[i].data, list.pkts[i].hdr.len,
+                                       list.pkts[i].hdr.caplen) != 0;
+    double t1 = now_sec();
+    for (int r = 0; r < rounds; r++)
+        for (size_t i = 0; i < list.count; i++)
+            theirs += pcap_offline_filter(&fp, &list.pkts[i].hdr, list.pkts[i].data) != 0;
+    double t2 = now_sec();
+
+    report("netpcap_filter_run", t1 - t0, runs, ours / rounds);
+    report("pcap_offline_filter", t2 - t1, runs, theirs / rounds);
+    printf("speedup x%.2f\n", (t2 - t1) / (t1 - t0));
+
+    netpcap_filter_free(f);
+    netpcap_freecode(&fp);
+    netpcap_close(p);
+    free(list.pkts);
+    return ours == theirs ? 0 : 2;
+}
@@ -0,0 +1,260 @@
+/*
+ * Filter compiler test: each filter is compiled with netpcap_compile(),
+ * optimized and not, then run with netpcap_filter_run() on frames built
+ * here: IPv4 UDP, ICMP and TCP, IPv6 UDP and TCP, and an IPv4 UDP
+ * datagram behind an 802.1Q tag.
+ *
+ *   make test
+ *
+ * Exits 1 if any filter accepts or rejects the wrong frames.
+ */
+#include "netpcap-int.h"
+#include <stdio.h>
+#include <string.h>
+
+enum { UDP4, ICMP4, UDP6, TCP4, TCP6, MDNS4, VLAN_UDP4, FRAMES };
+
+typedef struct {
+    unsigned char data[128];
+    uint32_t len;
+} frame;
+
+typedef struct {
+    const char *filter;
+    int accept[FRAMES];
+} filter_case;
+
+/*
+ * UDP4       10.0.0.1:49152 > 10.0.0.2:53
+ * ICMP4      10.0.0.1 > 10.0.0.2, echo request
+ * UDP6       [fd00::1]:49152 > [fd00::2]:53
+ * TCP4       10.0.1.5:40000 > 192.168.1.1:443
+ * TCP6       [fd00::1]:40000 > [fd00::2]:443
+ * MDNS4      192.168.1.7:5353 > 224.0.0.251:5353
+ * VLAN_UDP4  UDP4 tagged with VLAN 100
+ */
+static const filter_case cases[] = {
+    { "",                                   { 1, 1, 1, 1, 1, 1, 1 } },
+    { "udp",                                { 1, 0, 1, 0, 0, 1, 0 } },
+    { "tcp",                                { 0, 0, 0, 1, 1, 0, 0 } },
+    { "icmp",                               { 0, 1, 0, 0, 0, 0, 0 } },
+    { "ip",                                 { 1, 1, 0, 1, 0, 1, 0 } },
+    { "ip6",                                { 0, 0, 1, 0, 1, 0, 0 } },
+    { "ip proto 17",                        { 1, 0, 0, 0, 0, 1, 0 } },
+    { "ip proto 1",                         { 0, 1, 0, 0, 0, 0, 0 } },
+    { "ip proto udp",                       { 1, 0, 0, 0, 0, 1, 0 } },
+    { "ip6 proto 17",                       { 0, 0, 1, 0, 0, 0, 0 } },
+    { "proto 17",                           { 1, 0, 1, 0, 0, 1, 0 } },
+    { "not ip proto 17",                    { 0, 1, 1, 1, 1, 0, 1 } },
+    { "host 10.0.0.2",                      { 1, 1, 0, 0, 0, 0, 0 } },
+    { "src host 10.0.0.1",                  { 1, 1, 0, 0, 0, 0, 0 } },
+    { "dst host 10.0.0.1",                  { 0, 0, 0, 0, 0, 0, 0 } },
+    { "10.0.1.5",                           { 0, 0, 0, 1, 0, 0, 0 } },
+
+    // net
+    { "net 10.0.0.0/24",                    { 1, 1, 0, 0, 0, 0, 0 } },
+    { "net 10.0.0.0/16",                    { 1, 1, 0, 1, 0, 0, 0 } },
+    { "net 10.0.0.0 mask 255.255.0.0",      { 1, 1, 0, 1, 0, 0, 0 } },
+    { "src net 192.168.1.0/24",             { 0, 0, 0, 0, 0, 1, 0 } },
+    { "dst net 192.168.0.0/16",             { 0, 0, 0, 1, 0, 0, 0 } },
+    { "net 0.0.0.0/0",                      { 1, 1, 0, 1, 0, 1, 0 } },
+
+    // Ports, IPv4 and IPv6
+    { "udp port 53",                        { 1, 0, 1, 0, 0, 0, 0 } },
+    { "port 443",                           { 0, 0, 0, 1, 1, 0, 0 } },
+    { "dst port 53",                        { 1, 0, 1, 0, 0, 0, 0 } },
+    { "src port 53",                        { 0, 0, 0, 0, 0, 0, 0 } },
+    { "src port 40000",                     { 0, 0, 0, 1, 1, 0, 0 } },
+    { "tcp port 53",                        { 0, 0, 0, 0, 0, 0, 0 } },
+    { "ip6 and port 53",                    { 0, 0, 1, 0, 0, 0, 0 } },
+    { "ip6 and tcp port 443",               { 0, 0, 0, 0, 1, 0, 0 } },
+    { "ip and dst port 443",                { 0, 0, 0, 1, 0, 0, 0 } },
+    { "portrange 50-60",                    { 1, 0, 1, 0, 0, 0, 0 } },
+    { "tcp portrange 400-500",              { 0, 0, 0, 1, 1, 0, 0 } },
+    { "udp portrange 5000-6000",            { 0, 0, 0, 0, 0, 1, 0 } },
+    { "src portrange 49000-50000",          { 1, 0, 1, 0, 0, 0, 0 } },
+
+    // A value alone takes the qualifiers of the previous one
+    { "port 53 or 5353",                    { 1, 0, 1, 0, 0, 1, 0 } },
+    { "udp port 53 or 5353",                { 1, 0, 1, 0, 0, 1, 0 } },
+    { "port 53 or 443",                     { 1, 0, 1, 1, 1, 0, 0 } },
+    { "host 10.0.0.2 or 10.0.1.5",          { 1, 1, 0, 1, 0, 0, 0 } },
+
+    // "and" binds tighter than "or", "not" tighter than both
+    { "udp or icmp and host 10.0.0.2",      { 1, 1, 1, 0, 0, 1, 0 } },
+    { "(udp or icmp) and host 10.0.0.2",    { 1, 1, 0, 0, 0, 0, 0 } },
+    { "icmp and host 10.0.0.2 or ip6",      { 0, 1, 1, 0, 1, 0, 0 } },
+    { "icmp and (host 10.0.0.2 or ip6)",    { 0, 1, 0, 0, 0, 0, 0 } },
+    { "not udp and not icmp",               { 0, 0, 0, 1, 1, 0, 1 } },
+    { "not (udp or tcp)",                   { 0, 1, 0, 0, 0, 0, 1 } },
+    { "not not udp",                        { 1, 0, 1, 0, 0, 1, 0 } },
+    { "! tcp && ip || port 443",            { 1, 1, 0, 1, 1, 1, 0 } },
+    { "((udp) and (port 53 or port 5353))", { 1, 0, 1, 0, 0, 1, 0 } },
+
+    // vlan, then the offsets after the tag
+    { "vlan",                               { 0, 0, 0, 0, 0, 0, 1 } },
+    { "vlan 100",                           { 0, 0, 0, 0, 0, 0, 1 } },
+    { "vlan 200",                           { 0, 0, 0, 0, 0, 0, 0 } },
+    { "not vlan",                           { 1, 1, 1, 1, 1, 1, 0 } },
+    { "vlan and udp port 53",               { 0, 0, 0, 0, 0, 0, 1 } },
+    { "vlan 100 and host 10.0.0.2",         { 0, 0, 0, 0, 0, 0, 1 } },
+    { "vlan and net 10.0.0.0/24",           { 0, 0, 0, 0, 0, 0, 1 } },
+    { "vlan and ip6",                       { 0, 0, 0, 0, 0, 0, 0 } },
+    { "vlan and tcp",                       { 0, 0, 0, 0, 0, 0, 0 } },
+    { "udp or vlan",                        { 1, 0, 1, 0, 0, 1, 1 } },
+};
+
+static void put(frame *f, const void *p, uint32_t len)
+{
+    memcpy(f->data + f->len, p, len);
+    f->len += len;
+}
+
+static void ether(frame *f, uint16_t type)
+{
+    static const unsigned char macs[12] = { 2, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 2 };
+    unsigned char t[2] = { type >> 8, type & 0xff };
+
+    put(f, macs, sizeof(macs));
+    put(f, t, sizeof(t));
+}
+
+// 802.1Q tag, after an ether() of type 0x8100
+static void vlan(frame *f, uint16_t id, uint16_t type)
+{
+    unsigned char tag[4] = { id >> 8, id & 0xff, type >> 8, type & 0xff };
+
+    put(f, tag, sizeof(tag));
+}
+
+static void ipv4(frame *f, uint8_t proto, uint32_t src, uint32_t dst, uint16_t payload)
+{
+    uint16_t len = 20 + payload;
+    unsigned char h[20] = {
+        0x45, 0, len >> 8, len & 0xff, 0, 1, 0x40, 0, 64, proto, 0, 0,
+        src >> 24, src >> 16, src >> 8, src, dst >> 24, dst >> 16, dst >> 8, dst,
+    };
+
+    put(f, h, sizeof(h));
+}
+
+static void ipv6(frame *f, uint8_t next, uint16_t payload)
+{
+    unsigned char h[40] = { 0x60, 0, 0, 0, payload >> 8, payload & 0xff, next, 64 };
+
+    h[23] = 1;                  // fd00::1 to fd00::2
+    h[8] = h[24] = 0xfd;
+    h[39] = 2;
+    put(f, h, sizeof(h));
+}
+
+static void udp(frame *f, uint16_t sport, uint16_t dport)
+{
+    unsigned char h[8] = { sport >> 8, sport & 0xff, dport >> 8, dport & 0xff, 0, 12, 0, 0 };
+    static const unsigned char query[4] = { 0x12, 0x34, 0x01, 0x00 };
+
+    put(f, h, sizeof(h));
+    put(f, query, sizeof(query));
+}
+
+// A SYN
+static void tcp(frame *f, uint16_t sport, uint16_t dport)
+{
+    unsigned char h[20] = {
+        sport >> 8, sport & 0xff, dport >> 8, dport & 0xff, 0, 0, 0, 1, 0, 0, 0, 0,
+        0x50, 0x02, 0xff, 0xff,
+    };
+
+    put(f, h, sizeof(h));
+}
+
+static void icmp(frame *f)
+{
+    static const unsigned char echo[8] = { 8, 0, 0, 0, 0, 1, 0, 1 };
+
+    put(f, echo, sizeof(echo));
+}
+
+// Runs `t` on every frame, 1 when one of them goes the wrong way
+static int run_case(netpcap_t *p, const filter_case *t, const frame *frames, int optimize)
+{
+    static const char *names[FRAMES] = {
+        "IPv4 UDP", "IPv4 ICMP", "IPv6 UDP", "IPv4 TCP", "IPv6 TCP", "IPv4 mDNS", "VLAN IPv4 UDP",
+    };
+    char errbuf[NETPCAP_ERRBUF_SIZE];
+    struct bpf_program fp;
+    netpcap_filter *f;
+    int failed = 0;
+
+    if (netpcap_compile(p, &fp, t->filter, optimize, 0) == -1) {
+        fprintf(stderr, "\"%s\": %s\n", t->filter, netpcap_geterr(p));
+        return 1;
+    }
+    if (!(f = netpcap_filter_prepare(&fp, errbuf))) {
+        fprintf(stderr, "\"%s\": %s\n", t->filter, errbuf);
+        netpcap_freecode(&fp);
+        return 1;
+    }
+    for (int k = 0; k < FRAMES; k++) {
+        int accepted = netpcap_filter_run(f, frames[k].data, frames[k].len, frames[k].len) != 0;
+
+        if (accepted != t->accept[k]) {
+            fprintf(stderr, "\"%s\"%s: %s %s, expected %s\n", t->filter,
+                    optimize ? "" : " unoptimized", names[k],
+                    accepted ? "accepted" : "rejected", t->accept[k] ? "accepted" : "rejected");
+            failed = 1;
+        }
+    }
+    if (failed)
+        netpcap_bpf_dump(&fp);
+    netpcap_filter_free(f);
+    netpcap_freecode(&fp);
+    return failed;
+}
+
+int main(void)
+{
+    char errbuf[NETPCAP_ERRBUF_SIZE];
+    frame frames[FRAMES] = {0};
+    int failed = 0;
+
+    ether(&frames[UDP4], 0x0800);
+    ipv4(&frames[UDP4], 17, 0x0a000001, 0x0a000002, 12);
+    udp(&frames[UDP4], 49152, 53);
+    ether(&frames[ICMP4], 0x0800);
+    ipv4(&frames[ICMP4], 1, 0x0a000001, 0x0a000002, 8);
+    icmp(&frames[ICMP4]);
+    ether(&frames[UDP6], 0x86dd);
+    ipv6(&frames[UDP6], 17, 12);
+    udp(&frames[UDP6], 49152, 53);
+    ether(&frames[TCP4], 0x0800);
+    ipv4(&frames[TCP4], 6, 0x0a000105, 0xc0a80101, 20);
+    tcp(&frames[TCP4], 40000, 443);
+    ether(&frames[TCP6], 0x86dd);
+    ipv6(&frames[TCP6], 6, 20);
+    tcp(&frames[TCP6], 40000, 443);
+    ether(&frames[MDNS4], 0x0800);
+    ipv4(&frames[MDNS4], 17, 0xc0a80107, 0xe00000fb, 12);
+    udp(&frames[MDNS4], 5353, 5353);
+    ether(&frames[VLAN_UDP4], 0x8100);
+    vlan(&frames[VLAN_UDP4], 100, 0x0800);
+    ipv4(&frames[VLAN_UDP4], 17, 0x0a000001, 0x0a000002, 12);
+    udp(&frames[VLAN_UDP4], 49152, 53);
+
+    netpcap_t *p = netpcap_alloc(NULL, 0, errbuf);
+    if (!p) {
+        fprintf(stderr, "%s\n", errbuf);
+        return 1;
+    }
+    p->linktype = DLT_EN10MB;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        for (int optimize = 0; optimize <= 1; optimize++)
+            failed |= run_case(p, &cases[i], frames, optimize);
+    }
+
+    netpcap_close(p);
+    if (!failed)
+        printf("%zu filters passed, optimized and not\n", sizeof(cases) / sizeof(cases[0]));
+    return failed;
+}